@@ -0,0 +1,89 @@
+/*
+ * 量測輸出端跟不上時, 各種上限處理方式的生產者成本與丟棄數量.
+ * 4 個執行緒同時輸出, 輸出端每 1ms 才 Process 一次. maxrss 為到目前為止行程的最大常駐記憶體.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp backpressure.cpp -lpthread -lz
+ */
+#include <stdio.h>
+#include <string.h>
+#if !defined(_MSC_VER)
+    #include <sys/resource.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int THREADS  = 4;
+static const int MESSAGES = 1000000;
+
+static long GetMaxRss()
+{
+#if !defined(_MSC_VER)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
+static void Run(const char* name, uint64_t bytes, E_BACKPRESSURE policy)
+{
+    BufferOutput output = CreateNullOutput(ELL_DEBUG);
+    SBudget budget;
+    budget.bytes  = bytes;
+    budget.policy = policy;
+    budget.level  = ELL_WARNING;
+    output->SetBudget(budget);
+
+    char msg[128];
+    memset(msg, 'x', sizeof(msg) - 1);
+    msg[sizeof(msg) - 1] = '\n';
+
+    std::atomic< bool > stop(false);
+    std::thread consumer([&]()
+    {
+        while (stop.load() == false)
+        {
+            output->Process();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    std::vector< std::thread > producers;
+    for (int i = 0; i < THREADS; ++i)
+    {
+        producers.push_back(std::thread([&, i]()
+        {
+            for (int j = 0; j < MESSAGES; ++j)
+                output->Output((j % 100 == 0) ? ELL_ERROR : ELL_INFO, msg, sizeof(msg));
+        }));
+    }
+    for (size_t i = 0; i < producers.size(); ++i)
+        producers[i].join();
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+
+    stop.store(true);
+    consumer.join();
+    output->Process();
+    printf("%-12s %12.1f %12llu %12ld\n", name, elapsed.count() / ((double)THREADS * MESSAGES),
+           (unsigned long long)output->GetDropped(), GetMaxRss());
+}
+
+int main()
+{
+    printf("%-12s %12s %12s %12s\n", "policy", "ns/message", "dropped", "maxrss KB");
+    Run( "block",  1024 * 1024, EB_BLOCK       );
+    Run( "newest", 1024 * 1024, EB_DROP_NEWEST );
+    Run( "oldest", 1024 * 1024, EB_DROP_OLDEST );
+    Run( "level",  1024 * 1024, EB_DROP_LEVEL  );
+    Run( "none",   0,           EB_BLOCK       );
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * 比較文字檔案輸出與二進位檔案輸出. 呼叫端使用 LogDeferred, 前綴為日期, 時間(奈秒), 執行緒與等級.
+ * produce 為呼叫端每筆的成本, process 為 Process 每筆的成本, bytes 為每筆寫入檔案的大小.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp binary.cpp -lpthread -lz
+ */
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <string>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+static const int BATCH    = 4096;
+
+static void Run(const char* sink, const BufferOutput& output, const std::string& path)
+{
+    Manager mgr = Create(ELL_INFO);
+    mgr->EnableOption(EO_DATE);
+    mgr->EnableOption(EO_TIME);
+    mgr->EnableOption(EO_NANOSECOND);
+    mgr->EnableOption(EO_THREAD);
+    mgr->EnableOption(EO_LEVEL);
+    mgr->Append( "file", output );
+
+    std::chrono::duration< double, std::nano > produce(0);
+    std::chrono::duration< double, std::nano > process(0);
+    for (int i = 0; i < MESSAGES; i += BATCH)
+    {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        for (int j = 0; j < BATCH; ++j)
+            LogDeferred(ELL_INFO, "request %d from %s took %u us, status %d\n", i + j, "client-17", (unsigned)(j * 7), 200);
+        std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+        mgr->Process();
+        produce += middle - begin;
+        process += std::chrono::steady_clock::now() - middle;
+    }
+    mgr.reset();
+
+    struct stat st;
+    double      bytes = (stat(path.c_str(), &st) == 0) ? (double)st.st_size / MESSAGES : 0;
+    printf("%-8s %12.1f %12.1f %12.1f\n", sink, produce.count() / MESSAGES, process.count() / MESSAGES, bytes);
+    remove(path.c_str());
+}
+
+int main(int argc, const char** argv)
+{
+    std::string directory = (argc > 1) ? argv[1] : "./bench-logs";
+    printf("%-8s %12s %12s %12s\n", "sink", "produce ns", "process ns", "bytes");
+    Run( "text",   CreateFileOutput(ELL_INFO, "text", directory),         directory + "/text.log"    );
+    Run( "binary", CreateBinaryFileOutput(ELL_INFO, "binary", directory), directory + "/binary.klog" );
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * 比較立即格式化(LogOutput)與延遲格式化(LogDeferred)在呼叫端的成本.
+ * 量測期間不輸出, 結束後才呼叫 Process(), 避免背景執行緒佔用同一個 CPU.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp capture.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+
+template< typename F >
+static double Run(F function)
+{
+    Manager mgr = Create(ELL_INFO);
+    mgr->Append( "null", CreateNullOutput(ELL_INFO) );
+    mgr->EnableOption(EO_DATE);
+    mgr->EnableOption(EO_TIME);
+    mgr->EnableOption(EO_THREAD);
+    mgr->EnableOption(EO_LEVEL);
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < MESSAGES; ++i)
+        function(i);
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+
+    mgr->Process();
+    mgr.reset();
+    return elapsed.count() / MESSAGES;
+}
+
+int main(int argc, const char** argv)
+{
+    std::string user("tester");
+    printf("%-12s %12s\n", "api", "ns/message");
+    printf("%-12s %12.1f\n", "LogOutput", Run([&](int i)
+    {
+        LogOutput(ELL_INFO, "request %d from %s took %f ms\n", i, user, 1.5);
+    }));
+    printf("%-12s %12.1f\n", "LogDeferred", Run([&](int i)
+    {
+        LogDeferred(ELL_INFO, "request %d from %s took %f ms\n", i, user, 1.5);
+    }));
+    return 0;
+}
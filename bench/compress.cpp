@@ -0,0 +1,62 @@
+/*
+ * 量測換檔後背景壓縮舊檔的速度及 CPU 成本. 壓縮好的舊檔會留在目錄中.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp compress.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <string>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 2000000;
+
+static void Run(int level, const std::string& directory)
+{
+    SFileOptions options;
+    options.size  = 1024 * 1024 * 16;
+    options.codec = CreateGzipCodec(level);
+    options.rate  = 0;
+    if (options.codec == nullptr)
+        return;
+
+    SCompressStats before = GetCompressStats();
+    {
+        Manager mgr = Create(ELL_INFO);
+        mgr->EnableOption(EO_DATE);
+        mgr->EnableOption(EO_TIME);
+        mgr->EnableOption(EO_LEVEL);
+        mgr->Append( "file", CreateFileOutput(ELL_INFO, "compress", directory, options) );
+        for (int i = 0; i < MESSAGES; ++i)
+        {
+            mgr->Printf(ELL_INFO, "benchmark message %d from module %s\n", i, "compress");
+            if ((i % 10000) == 0)
+                mgr->Process();
+        }
+    }
+    SCompressStats after = GetCompressStats();
+    double input   = (double)(after.input   - before.input);
+    double output  = (double)(after.output  - before.output);
+    double elapsed = (double)(after.elapsed - before.elapsed);
+    double cpu     = (double)(after.cpu     - before.cpu);
+    printf("%8d %8llu %10.1f %10.1f %12.1f %12.1f\n",
+           level,
+           (unsigned long long)(after.files - before.files),
+           input / 1e6,
+           input / output,
+           input / 1e6 / (elapsed / 1e9),
+           cpu / 1e6 / (input / 1e6));
+    remove( (directory + "/compress.log").c_str() );
+}
+
+int main(int argc, const char** argv)
+{
+    std::string directory = (argc > 1) ? argv[1] : "./bench-logs";
+    printf("%8s %8s %10s %10s %12s %12s\n", "level", "files", "MB in", "ratio", "MB/s", "cpu ms/MB");
+    Run(1, directory);
+    Run(6, directory);
+    Run(9, directory);
+    return 0;
+}
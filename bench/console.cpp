@@ -0,0 +1,145 @@
+/*
+ * 量測 console 輸出導向管線時的吞吐量, 模擬容器把 stderr 接到收集日誌的管線.
+ * stderr 換成管線, 另一個執行緒負責讀取並計算收到的位元組數.
+ * sink ns/msg 為背景執行緒輸出每一筆訊息的時間, 取自 GetStats.
+ * writes 為整個情境的 write 類系統呼叫次數, 取自 /proc/self/io, 只有 Linux 有.
+ * 同時確認訊息中的 % 原樣輸出, 不會被當成格式.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp console.cpp -lpthread -lz
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_MSC_VER)
+    #include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+
+#if !defined(_MSC_VER)
+static const char         MARK[] = "progress 100% %d%%";
+static std::atomic< bool > Found(false);
+
+/* 讀取管線直到寫入端關閉, 傳回收到的位元組數 */
+static uint64_t onRead(int handle)
+{
+    static char buffer[1024 * 64 + sizeof(MARK)];
+    uint64_t    total = 0;
+    size_t      keep  = 0;
+    while (true)
+    {
+        ssize_t size = read(handle, buffer + keep, sizeof(buffer) - sizeof(MARK));
+        if (size <= 0)
+            break;
+        total += (uint64_t)size;
+        size_t length = keep + (size_t)size;
+        buffer[length] = 0;
+        if (strstr(buffer, MARK) != nullptr)
+            Found = true;
+        /* 保留尾端, 標記可能跨兩次讀取 */
+        keep = (length < sizeof(MARK) - 1) ? length : sizeof(MARK) - 1;
+        memmove(buffer, buffer + length - keep, keep);
+    }
+    return total;
+}
+
+/* 到目前為止的 write 類系統呼叫次數, 無法取得時傳回 0 */
+static uint64_t GetWrites()
+{
+    uint64_t writes = 0;
+    FILE*    file   = fopen("/proc/self/io", "r");
+    if (file != nullptr)
+    {
+        char line[128];
+        while (fgets(line, sizeof(line), file) != nullptr)
+        {
+            if (strncmp(line, "syscw:", 6) == 0)
+                writes = strtoull(line + 6, nullptr, 10);
+        }
+        fclose(file);
+    }
+    return writes;
+}
+
+static void onProduce(int count)
+{
+    for (int i = 0; i < count; ++i)
+        CManager::GetInstance()->Printf(ELL_INFO, "Hello logger: msg number %d\n", i);
+}
+
+/* 傳回每秒訊息數量, bytes 為讀取端收到的位元組數, sink 為輸出端每筆的奈秒數 */
+static double Run(int threads, uint64_t& bytes, double& sink, uint64_t& writes)
+{
+    int pipes[2];
+    if (pipe(pipes) != 0)
+        return 0;
+    int saved = dup(2);
+    dup2(pipes[1], 2);
+    close(pipes[1]);
+
+    uint64_t    total = 0;
+    std::thread reader([&]() { total = onRead(pipes[0]); });
+
+    writes = GetWrites();
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    {
+        Manager mgr = Create(ELL_INFO);
+        mgr->Append( "console", CreateConsoleOutput(ELL_DEBUG) );
+        SAsyncOptions options;
+        options.interval = 1;
+        mgr->StartAsync(options);
+        mgr->Printf(ELL_INFO, "%s\n", MARK);
+
+        std::vector< std::thread > producers;
+        for (int i = 0; i < threads; ++i)
+            producers.push_back( std::thread(onProduce, MESSAGES / threads) );
+        for (size_t i = 0; i < producers.size(); ++i)
+            producers[i].join();
+        mgr->StopAsync();
+        mgr->Process();
+
+        SLogStats stats = mgr->GetStats();
+        sink = (double)stats.sinks[0].drain.sum / stats.sinks[0].messages;
+    }
+    double elapsed = std::chrono::duration< double >(std::chrono::steady_clock::now() - begin).count();
+    writes = GetWrites() - writes;
+
+    /* 還原 stderr, 讀取端收到 EOF 後結束 */
+    dup2(saved, 2);
+    close(saved);
+    reader.join();
+    close(pipes[0]);
+    bytes = total;
+    return MESSAGES / elapsed;
+}
+#endif
+
+int main()
+{
+#if defined(_MSC_VER)
+    printf("requires pipe and dup2\n");
+#else
+    printf("%-8s %12s %10s %10s %12s %8s\n", "threads", "messages/s", "ns/msg", "MB/s", "sink ns/msg", "writes");
+    static const int threads[] = { 1, 4 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i)
+    {
+        uint64_t bytes  = 0;
+        uint64_t writes = 0;
+        double   sink   = 0;
+        double   rate   = Run(threads[i], bytes, sink, writes);
+        printf("%-8d %12.0f %10.1f %10.1f %12.1f %8llu\n", threads[i], rate, 1e9 / rate, bytes * rate / MESSAGES / 1e6, sink, (unsigned long long)writes);
+    }
+    printf("%% verbatim: %s\n", (Found == true) ? "yes" : "no");
+#endif
+    return 0;
+}
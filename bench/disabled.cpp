@@ -0,0 +1,67 @@
+/*
+ * 量測等級關閉時, 每一次呼叫的成本.
+ * KKLOG_LEVEL 設為 6 (ELL_INFO), 所以 KKLOG_DEBUG 在編譯期就被移除.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp disabled.cpp -lpthread -lz
+ */
+#define KKLOG_LEVEL 6
+
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 10000000;
+
+template< typename F >
+static double Run(F function)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < MESSAGES; ++i)
+        function(i);
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / MESSAGES;
+}
+
+int main(int argc, const char** argv)
+{
+    Manager mgr = Create(ELL_WARNING);
+    mgr->Append( "null", CreateNullOutput(ELL_DEBUG) );
+
+    std::string user("tester");
+    printf("%-16s %12s\n", "api", "ns/call");
+    printf("%-16s %12.2f\n", "LogOutput", Run([&](int i)
+    {
+        LogOutput(ELL_INFO, "request %d from %s\n", i, user + "@example");
+    }));
+    printf("%-16s %12.2f\n", "GetLevel()", Run([&](int i)
+    {
+        if (CManager::GetInstance()->GetLevel() >= ELL_INFO)
+            LogOutput(ELL_INFO, "request %d from %s\n", i, user + "@example");
+    }));
+    printf("%-16s %12.2f\n", "KKLOG", Run([&](int i)
+    {
+        KKLOG(ELL_INFO, "request %d from %s\n", i, user + "@example");
+    }));
+    printf("%-16s %12.2f\n", "KKLOG_DEBUG", Run([&](int i)
+    {
+        KKLOG_DEBUG("request %d from %s\n", i, user + "@example");
+    }));
+
+    /* 分類沒有設定時與 CManager 同樣是 ELL_WARNING; 上層設定 ELL_ERROR 後同樣關閉 */
+    CCategory* pool = GetCategory("db.pool");
+    printf("%-16s %12.2f\n", "KKLOG_CATEGORY", Run([&](int i)
+    {
+        KKLOG_CATEGORY(pool, ELL_INFO, "request %d from %s\n", i, user + "@example");
+    }));
+    SetCategoryLevel("db", ELL_ERROR);
+    printf("%-16s %12.2f\n", "parent ERROR", Run([&](int i)
+    {
+        KKLOG_CATEGORY(pool, ELL_INFO, "request %d from %s\n", i, user + "@example");
+    }));
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * 量測掛上多個輸出時, 每一筆 Printf 的成本.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp fanout.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+
+static void onProduce(int count, const std::string& payload)
+{
+    for (int i = 0; i < count; ++i)
+        CManager::GetInstance()->Printf(ELL_INFO, "benchmark message %d%s\n", i, payload.c_str());
+}
+
+static double Run(int outputs, int threads, size_t size)
+{
+    std::string payload(size, 'x');
+    Manager mgr = Create(ELL_INFO);
+    for (int i = 0; i < outputs; ++i)
+        mgr->Append( "null" + std::to_string(i), CreateNullOutput(ELL_INFO) );
+
+    SAsyncOptions options;
+    options.interval = 1;
+    mgr->StartAsync(options);
+
+    std::vector< std::thread > producers;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; ++i)
+        producers.push_back( std::thread(onProduce, MESSAGES / threads, std::cref(payload)) );
+    for (size_t i = 0; i < producers.size(); ++i)
+        producers[i].join();
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+
+    mgr.reset();
+    return elapsed.count() / ((MESSAGES / threads) * threads);
+}
+
+int main(int argc, const char** argv)
+{
+    static const int    outputs[] = { 1, 3, 8 };
+    static const size_t sizes[]   = { 0, 1024 };
+    printf("%8s %8s %8s %12s\n", "payload", "outputs", "threads", "ns/message");
+    for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j)
+    {
+        for (size_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]); ++i)
+        {
+            printf("%8d %8d %8d %12.1f\n", (int)sizes[j], outputs[i], 1, Run(outputs[i], 1, sizes[j]));
+            printf("%8d %8d %8d %12.1f\n", (int)sizes[j], outputs[i], 8, Run(outputs[i], 8, sizes[j]));
+        }
+    }
+    return 0;
+}
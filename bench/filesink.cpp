@@ -0,0 +1,55 @@
+/*
+ * 量測檔案輸出在 Process 時, 每一筆訊息從佇列寫到檔案的成本.
+ * batch 為每次 Process 之間累積的訊息數量, worst 為單次 Process 最久的時間.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp filesink.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+
+static void Run(const char* sink, const BufferOutput& output, int batch)
+{
+    Manager mgr = Create(ELL_INFO);
+    mgr->Append( "file", output );
+
+    std::chrono::duration< double, std::nano > elapsed(0);
+    std::chrono::duration< double, std::micro > worst(0);
+    for (int i = 0; i < MESSAGES; i += batch)
+    {
+        for (int j = 0; j < batch; ++j)
+            mgr->Printf(ELL_INFO, "benchmark message %d\n", i + j);
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        mgr->Process();
+        std::chrono::steady_clock::duration once = std::chrono::steady_clock::now() - begin;
+        elapsed += once;
+        if (once > worst)
+            worst = once;
+    }
+    mgr.reset();
+    printf("%-12s %8d %12.1f %12.1f\n", sink, batch, elapsed.count() / MESSAGES, worst.count());
+}
+
+int main(int argc, const char** argv)
+{
+    std::string directory = (argc > 1) ? argv[1] : "./bench-logs";
+    static const int batches[] = { 10, 100, 10000 };
+    printf("%-12s %8s %12s %12s\n", "sink", "batch", "ns/message", "worst us");
+    for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i)
+    {
+        Run( "stdio",  CreateFileOutput(ELL_INFO, "stdio", directory),        batches[i] );
+        Run( "async",  CreateAsyncFileOutput(ELL_INFO, "async", directory),   batches[i] );
+        Run( "mapped", CreateMappedFileOutput(ELL_INFO, "mapped", directory), batches[i] );
+        remove( (directory + "/stdio.log").c_str() );
+        remove( (directory + "/async.log").c_str() );
+        remove( (directory + "/mapped.log").c_str() );
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * 量測 flight recorder 每一筆訊息的成本.
+ * CManager 設為 ELL_DEBUG, null 輸出設為 ELL_INFO, 所以 DEBUG 只進入 flight recorder.
+ * 每個情境輸出 1,000,000 筆 "Hello logger: msg number %d", 比較有無 flight recorder 的差異.
+ * dump 為寫出整個記錄區 (預設 4 MB) 到檔案的時間.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp flight.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+
+static double Run(int threads, E_LOG_LEVEL level)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    std::vector< std::thread > workers;
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.push_back( std::thread([=]()
+        {
+            for (int i = 0; i < MESSAGES / threads; ++i)
+                LogOutput(level, "Hello logger: msg number %d\n", i);
+        }) );
+    }
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / (MESSAGES / threads * threads);
+}
+
+int main(int argc, const char** argv)
+{
+    printf("%-10s %8s %8s %14s\n", "level", "threads", "recorder", "ns/msg");
+    static const int threads[] = { 1, 4 };
+    for (int recorder = 0; recorder < 2; ++recorder)
+    {
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t)
+        {
+            Manager mgr = Create(ELL_DEBUG);
+            mgr->Append( "null", CreateNullOutput(ELL_INFO) );
+            if (recorder == 1)
+                mgr->Append( "flight", CreateFlightRecorder(ELL_DEBUG) );
+            SAsyncOptions options;
+            options.interval = 1;
+            mgr->StartAsync(options);
+            printf("%-10s %8d %8s %14.1f\n", "DEBUG", threads[t], (recorder == 1) ? "yes" : "no", Run(threads[t], ELL_DEBUG));
+            printf("%-10s %8d %8s %14.1f\n", "INFO",  threads[t], (recorder == 1) ? "yes" : "no", Run(threads[t], ELL_INFO));
+        }
+    }
+
+    FlightRecorder flight = CreateFlightRecorder(ELL_DEBUG);
+    Manager        mgr    = Create(ELL_DEBUG);
+    mgr->Append( "flight", flight );
+    Run(1, ELL_DEBUG);
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    flight->Dump("flight-bench.log");
+    printf("dump %.2f ms\n", std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - begin).count());
+    remove("flight-bench.log");
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * 比較執行期掃描格式字串與 KKLOG_FORMAT 編譯期解析的成本.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp format.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+
+template< typename F >
+static double Measure(F function)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < MESSAGES; ++i)
+        function(i);
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+    CManager::GetInstance()->Process();
+    return elapsed.count() / MESSAGES;
+}
+
+template< typename F, typename... Targs >
+static void Compiled(std::string& output, const F& format, const Targs&... Fargs)
+{
+    SFormat_< F, 0 >::Apply(output, Fargs...);
+}
+
+int main(int argc, const char** argv)
+{
+    Manager mgr = Create(ELL_INFO);
+    mgr->Append( "null", CreateNullOutput(ELL_INFO) );
+
+    std::string output;
+    std::string name("tester");
+    printf("%-6s %-10s %12s %12s\n", "args", "path", "format ns", "LogOutput ns");
+
+    printf("%-6d %-10s %12.1f %12.1f\n", 0, "runtime",
+           Measure([&](int i) { output.clear(); FormatOutput_(output, "server started, 100%% ready\n"); }),
+           Measure([&](int i) { LogOutput(ELL_INFO, std::string("server started, 100%% ready\n")); }));
+    printf("%-6d %-10s %12.1f %12.1f\n", 0, "compiled",
+           Measure([&](int i) { output.clear(); Compiled(output, KKLOG_FORMAT("server started, 100%% ready\n")); }),
+           Measure([&](int i) { LogOutput(ELL_INFO, KKLOG_FORMAT("server started, 100%% ready\n")); }));
+
+    printf("%-6d %-10s %12.1f %12.1f\n", 3, "runtime",
+           Measure([&](int i) { output.clear(); FormatOutput_(output, "request %d from %s took %u ms\n", i, name, 15u); }),
+           Measure([&](int i) { LogOutput(ELL_INFO, "request %d from %s took %u ms\n", i, name, 15u); }));
+    printf("%-6d %-10s %12.1f %12.1f\n", 3, "compiled",
+           Measure([&](int i) { output.clear(); Compiled(output, KKLOG_FORMAT("request %d from %s took %u ms\n"), i, name, 15u); }),
+           Measure([&](int i) { LogOutput(ELL_INFO, KKLOG_FORMAT("request %d from %s took %u ms\n"), i, name, 15u); }));
+
+    printf("%-6d %-10s %12.1f %12.1f\n", 8, "runtime",
+           Measure([&](int i) { output.clear(); FormatOutput_(output, "%d %s %u %x %c %s %d %lld\n", i, name, 15u, 255, 'c', "text", -7, 1234567890123LL); }),
+           Measure([&](int i) { LogOutput(ELL_INFO, "%d %s %u %x %c %s %d %lld\n", i, name, 15u, 255, 'c', "text", -7, 1234567890123LL); }));
+    printf("%-6d %-10s %12.1f %12.1f\n", 8, "compiled",
+           Measure([&](int i) { output.clear(); Compiled(output, KKLOG_FORMAT("%d %s %u %x %c %s %d %lld\n"), i, name, 15u, 255, 'c', "text", -7, 1234567890123LL); }),
+           Measure([&](int i) { LogOutput(ELL_INFO, KKLOG_FORMAT("%d %s %u %x %c %s %d %lld\n"), i, name, 15u, 255, 'c', "text", -7, 1234567890123LL); }));
+
+    mgr.reset();
+    return 0;
+}
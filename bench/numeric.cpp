@@ -0,0 +1,99 @@
+/*
+ * 比較 ValueOutput_ 的數字轉換與原本每個參數都交給 snprintf 的成本.
+ * snprintf 欄位為舊的做法: 以 std::string 複製轉換, 再 snprintf 到 8 KB 的暫存區.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp numeric.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int VALUES = 4096;
+static const int ROUNDS = 256;
+
+template< typename T >
+static void SnprintfValue(std::string& output, const char*& fmt, const T& value)
+{
+    int count = GetFormatLength_(fmt);
+    if (count > 0)
+    {
+        char        buffer[1024 * 8];
+        std::string format(fmt, count + 1);
+        int         idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), value);
+        if (idx > 0)
+        {
+            buffer[idx] = 0;
+            output += buffer;
+        }
+        fmt += (count + 1);
+    }
+}
+
+template< typename T, typename F >
+static double Measure(const char* spec, const std::vector< T >& values, F function)
+{
+    std::string output;
+    output.reserve(64);
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        for (size_t i = 0; i < values.size(); ++i)
+        {
+            const char* fmt = spec;
+            output.clear();
+            function(output, fmt, values[i]);
+        }
+    }
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / ((double)ROUNDS * values.size());
+}
+
+template< typename T >
+static void Run(const char* type, const char* spec, const std::vector< T >& values)
+{
+    double before = Measure(spec, values, [](std::string& output, const char*& fmt, const T& value) { SnprintfValue(output, fmt, value); });
+    double after  = Measure(spec, values, [](std::string& output, const char*& fmt, const T& value) { ValueOutput_(output, fmt, value); });
+    printf("%-10s %-8s %12.1f %12.1f %8.1fx\n", type, spec, before, after, before / after);
+}
+
+int main()
+{
+    std::vector< int >          integers;
+    std::vector< unsigned >     naturals;
+    std::vector< long long >    longs;
+    std::vector< double >       reals;
+    std::vector< const void* >  pointers;
+    unsigned long long          seed = 88172645463325252ull;
+    for (int i = 0; i < VALUES; ++i)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        integers.push_back((int)(seed % 2000001) - 1000000);
+        naturals.push_back((unsigned)seed);
+        longs.push_back((long long)seed >> (i % 40));
+        reals.push_back((double)(long long)(seed % 20000001 - 10000000) / 1000.0);
+        pointers.push_back((const void*)(uintptr_t)(seed & 0x7fffffffffffull));
+    }
+
+    printf("%-10s %-8s %12s %12s %9s\n", "type", "spec", "snprintf ns", "fast ns", "speedup");
+    Run( "int",       "%d",    integers );
+    Run( "int",       "%8d",   integers );
+    Run( "unsigned",  "%u",    naturals );
+    Run( "unsigned",  "%x",    naturals );
+    Run( "unsigned",  "%08X",  naturals );
+    Run( "long long", "%lld",  longs    );
+    Run( "double",    "%f",    reals    );
+    Run( "double",    "%.3f",  reals    );
+    Run( "double",    "%e",    reals    );
+    Run( "double",    "%g",    reals    );
+    Run( "double",    "%10.2f", reals   );
+    Run( "pointer",   "%p",    pointers );
+    return 0;
+}
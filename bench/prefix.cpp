@@ -0,0 +1,43 @@
+/*
+ * 量測開啟日期/時間/執行緒/等級前綴時, 每一筆 Printf 的成本.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp prefix.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+
+static double Run(const E_OPTIONS* options, size_t count)
+{
+    Manager mgr = Create(ELL_INFO);
+    mgr->Append( "null", CreateNullOutput(ELL_INFO) );
+    for (size_t i = 0; i < count; ++i)
+        mgr->EnableOption(options[i]);
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < MESSAGES; ++i)
+        mgr->Printf(ELL_INFO, "message\n");
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+
+    mgr->Process();
+    mgr.reset();
+    return elapsed.count() / MESSAGES;
+}
+
+int main(int argc, const char** argv)
+{
+    static const E_OPTIONS all[] = { EO_DATE, EO_TIME, EO_THREAD, EO_LEVEL, EO_MICROSECOND };
+    printf("%-24s %12s\n", "prefix", "ns/message");
+    printf("%-24s %12.1f\n", "none",                 Run(all, 0));
+    printf("%-24s %12.1f\n", "date",                 Run(all, 1));
+    printf("%-24s %12.1f\n", "date time",            Run(all, 2));
+    printf("%-24s %12.1f\n", "date time thread level", Run(all, 4));
+    printf("%-24s %12.1f\n", "... microsecond",      Run(all, 5));
+    return 0;
+}
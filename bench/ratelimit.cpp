@@ -0,0 +1,83 @@
+/*
+ * 量測每個呼叫點限制次數時, 被略過的呼叫的成本.
+ * 每個情境呼叫 10,000,000 次, 幾乎全部被略過, 參數包含一個 std::string 暫存物件,
+ * 略過時不應該建立. emitted 為實際輸出的筆數.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp ratelimit.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 10000000;
+
+template< typename F >
+static double Run(int threads, F function)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    std::vector< std::thread > workers;
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.push_back( std::thread([&]()
+        {
+            for (int i = 0; i < MESSAGES / threads; ++i)
+                function(i);
+        }) );
+    }
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / (MESSAGES / threads * threads);
+}
+
+static uint64_t GetEmitted(const Manager& mgr)
+{
+    static uint64_t last = 0;
+    mgr->Process();
+    uint64_t messages = mgr->GetStats().sinks[0].messages;
+    uint64_t emitted  = messages - last;
+    last = messages;
+    return emitted;
+}
+
+int main(int argc, const char** argv)
+{
+    Manager mgr = Create(ELL_INFO);
+    mgr->Append( "null", CreateNullOutput(ELL_DEBUG) );
+
+    std::string user("tester");
+    printf("%-16s %8s %12s %10s\n", "api", "threads", "ns/call", "emitted");
+    static const int threads[] = { 1, 4 };
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t)
+    {
+        double ns = Run(threads[t], [&](int i)
+        {
+            KKLOG_EVERY_N(ELL_INFO, 100000, "request %d from %s\n", i, user + "@example");
+        });
+        printf("%-16s %8d %12.2f %10llu\n", "KKLOG_EVERY_N", threads[t], ns, (unsigned long long)GetEmitted(mgr));
+        ns = Run(threads[t], [&](int i)
+        {
+            KKLOG_FIRST_N(ELL_INFO, 10, "request %d from %s\n", i, user + "@example");
+        });
+        printf("%-16s %8d %12.2f %10llu\n", "KKLOG_FIRST_N", threads[t], ns, (unsigned long long)GetEmitted(mgr));
+        ns = Run(threads[t], [&](int i)
+        {
+            KKLOG_PER_SECOND(ELL_INFO, 10, "request %d from %s\n", i, user + "@example");
+        });
+        printf("%-16s %8d %12.2f %10llu\n", "KKLOG_PER_SECOND", threads[t], ns, (unsigned long long)GetEmitted(mgr));
+    }
+    /* 對照: 每一次都輸出 */
+    double ns = Run(1, [&](int i)
+    {
+        LogOutput(ELL_INFO, "request %d from %s\n", i, user + "@example");
+    });
+    printf("%-16s %8d %12.2f %10llu\n", "LogOutput", 1, ns, (unsigned long long)GetEmitted(mgr));
+    return 0;
+}
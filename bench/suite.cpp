@@ -0,0 +1,232 @@
+/*
+ * 綜合量測, 修改效能相關的程式前後各執行一次比較.
+ * 工作量與 spdlog 的 bench 相同: 每個情境輸出 "Hello logger: msg number %d",
+ * 預設 1,000,000 筆, 1 個與 10 個執行緒, 可以直接與 spdlog/glog 公布的數字對照.
+ *
+ *   messages/s  包含最後寫完所有訊息的時間
+ *   p50/p99/p999 單次呼叫的時間(奈秒), 另外一輪量測, 包含讀取時間本身的成本(見 clock 那一行)
+ *   peak MB     該情境的最高常駐記憶體. Linux 每個情境重新計算, 其他平台為整個程式到目前為止的最高值
+ *
+ * console 輸出寫到 stderr, 量測時導向 /dev/null:
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp suite.cpp -lpthread -lz
+ *     ./a.out [messages] [directory] 2>/dev/null
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_MSC_VER)
+    #include <sys/resource.h>
+#endif
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static int         Messages  = 1000000;
+static std::string Directory = "./bench-logs";
+
+static int64_t Now()
+{
+    return std::chrono::duration_cast< std::chrono::nanoseconds >(
+             std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+/* 重新計算最高常駐記憶體, 只有 Linux 可以 */
+static void ResetPeak()
+{
+#if defined(__linux__)
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (file != nullptr)
+    {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+static double GetPeak()
+{
+#if defined(__linux__)
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file != nullptr)
+    {
+        char line[256];
+        long kb = -1;
+        while (fgets(line, sizeof(line), file) != nullptr)
+        {
+            if (strncmp(line, "VmHWM:", 6) == 0)
+            {
+                kb = atol(line + 6);
+                break;
+            }
+        }
+        fclose(file);
+        if (kb >= 0)
+            return kb / 1024.0;
+    }
+#endif
+#if !defined(_MSC_VER)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+#else
+    return 0;
+#endif
+}
+
+static void Merge(SHistogram& output, const SHistogram& input)
+{
+    for (int i = 0; i < SHistogram::BUCKETS; ++i)
+        output.buckets[i] += input.buckets[i];
+    output.count += input.count;
+    output.sum   += input.sum;
+    if (input.max > output.max)
+        output.max = input.max;
+}
+
+static void Record(SHistogram& histogram, int64_t elapsed)
+{
+    uint64_t value = (elapsed > 0) ? (uint64_t)elapsed : 0;
+    ++histogram.buckets[SHistogram::GetBucket(value)];
+    ++histogram.count;
+    histogram.sum += value;
+    if (value > histogram.max)
+        histogram.max = value;
+}
+
+typedef std::function< Output () >                 Factory;
+typedef std::function< void (int thread, int i) > Call;
+
+/* 每個執行緒輸出 count 筆, 傳回花費的秒數. latency 不是 nullptr 時量測每一次呼叫 */
+static double Produce(int threads, int count, const Call& call, SHistogram* latency)
+{
+    std::vector< SHistogram >  histograms(threads);
+    std::vector< std::thread > producers;
+    int64_t begin = Now();
+    for (int t = 0; t < threads; ++t)
+    {
+        producers.push_back( std::thread([&, t]()
+        {
+            SHistogram& histogram = histograms[t];
+            for (int i = 0; i < count; ++i)
+            {
+                if (latency == nullptr)
+                {
+                    call(t, i);
+                    continue;
+                }
+                int64_t start = Now();
+                call(t, i);
+                Record(histogram, Now() - start);
+            }
+        }) );
+    }
+    for (size_t i = 0; i < producers.size(); ++i)
+        producers[i].join();
+    double elapsed = (Now() - begin) / 1e9;
+    if (latency != nullptr)
+    {
+        for (int t = 0; t < threads; ++t)
+            Merge(*latency, histograms[t]);
+    }
+    return elapsed;
+}
+
+static void Print(const char* name, int threads, double rate, const SHistogram& latency, double peak)
+{
+    printf("%-16s %7d %12.0f %10.1f %8llu %8llu %8llu %8.1f\n",
+           name,
+           threads,
+           rate,
+           1e9 / rate,
+           (unsigned long long)latency.GetPercentile(50),
+           (unsigned long long)latency.GetPercentile(99),
+           (unsigned long long)latency.GetPercentile(99.9),
+           peak);
+}
+
+/* 一個情境: 先量測吞吐量, 再用較少的訊息量測單次呼叫的時間 */
+static void Run(const char* name, int threads, const Factory& factory, const Call& call)
+{
+    int        count = Messages / threads;
+    SHistogram latency;
+    double     rate;
+    double     peak;
+    {
+        ResetPeak();
+        Manager mgr = Create(ELL_INFO);
+        mgr->Append( "sink", factory() );
+        SAsyncOptions options;
+        options.interval = 1;
+        mgr->StartAsync(options);
+        int64_t begin = Now();
+        Produce(threads, count, call, nullptr);
+        mgr.reset();
+        rate = (double)count * threads / ((Now() - begin) / 1e9);
+        peak = GetPeak();
+    }
+    {
+        Manager mgr = Create(ELL_INFO);
+        mgr->Append( "sink", factory() );
+        SAsyncOptions options;
+        options.interval = 1;
+        mgr->StartAsync(options);
+        Produce(threads, (count < 200000) ? count : 200000, call, &latency);
+        mgr.reset();
+    }
+    Print(name, threads, rate, latency, peak);
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc > 1)
+        Messages = atoi(argv[1]);
+    if (argc > 2)
+        Directory = argv[2];
+    if (Messages <= 0)
+        Messages = 1000000;
+
+    Call hello = [](int thread, int i)
+    {
+        LogOutput(ELL_INFO, "Hello logger: msg number %d\n", i);
+    };
+    Call debug = [](int thread, int i)
+    {
+        LogOutput(ELL_DEBUG, "Hello logger: msg number %d\n", i);
+    };
+    Factory null    = []() -> Output { return CreateNullOutput(ELL_DEBUG); };
+    Factory console = []() -> Output { return CreateConsoleOutput(ELL_DEBUG); };
+    Factory file    = []() -> Output { return CreateFileOutput(ELL_DEBUG, "suite", Directory); };
+    Factory async   = []() -> Output { return CreateAsyncFileOutput(ELL_DEBUG, "suite-async", Directory); };
+
+    /* 讀取時間本身的成本, 單次呼叫的時間都包含這一部分 */
+    SHistogram clock;
+    Produce(1, 200000, [](int thread, int i) { }, &clock);
+
+    printf("%d messages per scenario\n", Messages);
+    printf("%-16s %7s %12s %10s %8s %8s %8s %8s\n", "scenario", "threads", "messages/s", "ns/msg", "p50 ns", "p99 ns", "p999 ns", "peak MB");
+    printf("%-16s %7d %12s %10s %8llu %8llu %8llu %8s\n", "clock", 1, "-", "-",
+           (unsigned long long)clock.GetPercentile(50),
+           (unsigned long long)clock.GetPercentile(99),
+           (unsigned long long)clock.GetPercentile(99.9),
+           "-");
+    static const int threads[] = { 1, 10 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i)
+    {
+        Run( "null",        threads[i], null,    hello );
+        Run( "file",        threads[i], file,    hello );
+        Run( "async file",  threads[i], async,   hello );
+        Run( "console",     threads[i], console, hello );
+        Run( "disabled",    threads[i], null,    debug );
+        remove( (Directory + "/suite.log").c_str() );
+        remove( (Directory + "/suite-async.log").c_str() );
+    }
+    return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * 量測 syslog 網路輸出, 以本機的接收端代替收集端.
+ * 每種傳輸方式各送出 200,000 筆, 接收端計算收到的訊息數量.
+ * outage 情境先在沒有接收端時送出, 之後才開始接收, 確認暫存的訊息會在重新連線後送達.
+ * unix 的接收佇列只有 /proc/sys/net/unix/max_dgram_qlen 個封包 (預設 10), 輸出端不等待,
+ * 接收端跟不上時超過暫存上限的訊息會被丟掉, received 會少於送出的數量.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp syslog.cpp -lpthread -lz
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_MSC_VER)
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <poll.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 200000;
+
+#if !defined(_MSC_VER)
+static std::atomic< int > Received(0);
+static std::string        Sample;
+
+/* 等待 handle 可以讀取, 超過 timeout 毫秒傳回 false */
+static bool Wait(int handle, int timeout)
+{
+    pollfd wait;
+    wait.fd      = handle;
+    wait.events  = POLLIN;
+    wait.revents = 0;
+    return poll(&wait, 1, timeout) > 0;
+}
+
+/* 每個封包一筆訊息, 一段時間沒有收到就結束 */
+static void onDatagrams(int handle)
+{
+    char buffer[1024 * 16];
+    while (Wait(handle, 500) == true)
+    {
+        ssize_t size = recv(handle, buffer, sizeof(buffer), 0);
+        if (size <= 0)
+            break;
+        if (Received++ == 0)
+            Sample.assign(buffer, size);
+    }
+}
+
+/* "LEN MSG" 接在一起 */
+static void onStream(int listener)
+{
+    if (Wait(listener, 5000) == false)
+        return;
+    int handle = accept(listener, nullptr, nullptr);
+    if (handle < 0)
+        return;
+    std::string data;
+    char        buffer[1024 * 64];
+    while (Wait(handle, 500) == true)
+    {
+        ssize_t size = recv(handle, buffer, sizeof(buffer), 0);
+        if (size <= 0)
+            break;
+        data.append(buffer, size);
+        size_t offset = 0;
+        while (true)
+        {
+            size_t space = data.find(' ', offset);
+            if (space == std::string::npos)
+                break;
+            size_t length = strtoul(data.c_str() + offset, nullptr, 10);
+            if (space + 1 + length > data.size())
+                break;
+            if (Received++ == 0)
+                Sample = data.substr(space + 1, length);
+            offset = space + 1 + length;
+        }
+        data.erase(0, offset);
+    }
+    close(handle);
+}
+
+static int Bind(int family, int type, sockaddr* address, socklen_t length)
+{
+    int handle = socket(family, type, 0);
+    if (handle < 0)
+        return -1;
+    int one = 1;
+    setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    /* UDP 接收端跟不上時會丟封包, 加大接收緩衝區 */
+    int size = 1024 * 1024 * 8;
+    setsockopt(handle, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (bind(handle, address, length) != 0)
+    {
+        close(handle);
+        return -1;
+    }
+    if (type == SOCK_STREAM)
+        listen(handle, 1);
+    return handle;
+}
+
+static void onProduce(int count)
+{
+    for (int i = 0; i < count; ++i)
+        CManager::GetInstance()->Printf(ELL_INFO, "Hello logger: msg number %d\n", i);
+}
+
+/* 送出 count 筆, 傳回每秒訊息數量 */
+static double Produce(const SSyslogOptions& options, int count)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    Manager mgr = Create(ELL_INFO);
+    mgr->Append( "syslog", CreateSyslogOutput(ELL_DEBUG, options) );
+    SAsyncOptions async;
+    async.interval = 1;
+    mgr->StartAsync(async);
+    onProduce(count);
+    mgr.reset();
+    return count / std::chrono::duration< double >(std::chrono::steady_clock::now() - begin).count();
+}
+
+static void Print(const char* name, double rate)
+{
+    printf("%-10s %12.0f %10.1f %10d\n", name, rate, 1e9 / rate, Received.load());
+}
+
+static void Run(const char* name, E_SYSLOG_TRANSPORT transport)
+{
+    SSyslogOptions options;
+    options.transport = transport;
+    options.app       = "bench";
+    Received = 0;
+
+    int         handle;
+    std::thread receiver;
+    if (transport == EST_UNIX)
+    {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        snprintf(address.sun_path, sizeof(address.sun_path), "/tmp/easylog-bench-%d.sock", (int)getpid());
+        unlink(address.sun_path);
+        handle = Bind(AF_UNIX, SOCK_DGRAM, (sockaddr*)&address, sizeof(address));
+        options.address = address.sun_path;
+        receiver = std::thread(onDatagrams, handle);
+    }
+    else
+    {
+        sockaddr_in address;
+        socklen_t   length = sizeof(address);
+        memset(&address, 0, sizeof(address));
+        address.sin_family      = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        handle = Bind(AF_INET, (transport == EST_TCP) ? SOCK_STREAM : SOCK_DGRAM, (sockaddr*)&address, sizeof(address));
+        getsockname(handle, (sockaddr*)&address, &length);
+        options.address = "127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+        if (transport == EST_TCP)
+            receiver = std::thread(onStream, handle);
+        else
+            receiver = std::thread(onDatagrams, handle);
+    }
+    double rate = Produce(options, MESSAGES);
+    receiver.join();
+    close(handle);
+    if (transport == EST_UNIX)
+        unlink(options.address.c_str());
+    Print(name, rate);
+}
+
+/* 先在沒有接收端時送出, 之後才開始接收 */
+static void Outage()
+{
+    sockaddr_in address;
+    socklen_t   length = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int handle = Bind(AF_INET, SOCK_STREAM, (sockaddr*)&address, sizeof(address));
+    getsockname(handle, (sockaddr*)&address, &length);
+    close(handle);
+
+    SSyslogOptions options;
+    options.transport = EST_TCP;
+    options.address   = "127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+    options.retry     = 10;
+    Received = 0;
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    Manager mgr = Create(ELL_INFO);
+    mgr->Append( "syslog", CreateSyslogOutput(ELL_DEBUG, options) );
+    SAsyncOptions async;
+    async.interval = 1;
+    mgr->StartAsync(async);
+    onProduce(MESSAGES / 10);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    handle = Bind(AF_INET, SOCK_STREAM, (sockaddr*)&address, sizeof(address));
+    std::thread receiver(onStream, handle);
+    onProduce(MESSAGES / 10);
+    receiver.join();
+    mgr.reset();
+    close(handle);
+    double rate = MESSAGES / 5 / std::chrono::duration< double >(std::chrono::steady_clock::now() - begin).count();
+    Print("outage", rate);
+}
+#endif
+
+int main()
+{
+#if defined(_MSC_VER)
+    printf("requires POSIX sockets\n");
+#else
+    printf("%-10s %12s %10s %10s\n", "transport", "messages/s", "ns/msg", "received");
+    Run("udp",  EST_UDP);
+    Run("unix", EST_UNIX);
+    Run("tcp",  EST_TCP);
+    Outage();
+    printf("sample: %s\n", Sample.c_str());
+#endif
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * 量測多個執行緒同時輸出時, 每秒可寫入的訊息數量.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp throughput.cpp -lpthread -lz
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int MESSAGES = 1000000;
+
+static void onProduce(int count)
+{
+    for (int i = 0; i < count; ++i)
+        CManager::GetInstance()->Printf(ELL_INFO, "benchmark message %d\n", i);
+}
+
+static double Run(int threads)
+{
+    Manager mgr = Create(ELL_INFO);
+    mgr->Append( "null", CreateNullOutput(ELL_INFO) );
+
+    SAsyncOptions options;
+    options.interval = 1;
+    mgr->StartAsync(options);
+
+    std::vector< std::thread > producers;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; ++i)
+        producers.push_back( std::thread(onProduce, MESSAGES / threads) );
+    for (size_t i = 0; i < producers.size(); ++i)
+        producers[i].join();
+    std::chrono::duration< double > elapsed = std::chrono::steady_clock::now() - begin;
+
+    mgr.reset();
+    return ((MESSAGES / threads) * threads) / elapsed.count();
+}
+
+int main(int argc, const char** argv)
+{
+    printf("%8s %16s\n", "threads", "messages/sec");
+    for (int threads = 1; threads <= 64; threads *= 2)
+        printf("%8d %16.0f\n", threads, Run(threads));
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * 量測不同長度訊息的 LogOutput 成本, 以及輸出端實際收到的位元組數(檢查是否被截斷).
+ * string 為先格式化到 std::string 再交給 Printf 的做法, writer 為 LogOutput 直接寫入佇列保留的空間.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp writer.cpp -lpthread -lz
+ */
+#include <stdio.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+/* 只累計收到的位元組數 */
+class CCountOutput : public COutput
+{
+public :
+    uint64_t bytes;
+
+    CCountOutput() : bytes(0) { }
+
+    virtual void        Output  (E_LOG_LEVEL level, const char* msg, uint32_t size) { bytes += size; }
+    virtual void        Process () { }
+    virtual E_LOG_LEVEL GetLevel() const { return ELL_INFO; }
+    virtual void        SetLevel(E_LOG_LEVEL value) { }
+};
+
+template< typename F >
+static void Run(const char* path, size_t size, F function)
+{
+    int                             messages = (size >= 1024 * 16) ? 20000 : 500000;
+    std::string                     payload(size, 'x');
+    Manager                         mgr   = Create(ELL_INFO);
+    std::shared_ptr< CCountOutput > count = std::make_shared< CCountOutput >();
+    mgr->Append( "count", count );
+    mgr->Append( "null",  CreateNullOutput(ELL_INFO) );
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; ++i)
+    {
+        function(i, payload);
+        if ((i & 255) == 255)
+            mgr->Process();
+    }
+    mgr->Process();
+    std::chrono::duration< double, std::nano > elapsed = std::chrono::steady_clock::now() - begin;
+    printf("%-8s %8d %12.1f %12.1f\n", path, (int)size, elapsed.count() / messages, (double)count->bytes / messages);
+    mgr.reset();
+}
+
+int main()
+{
+    static const size_t sizes[] = { 64, 1024, 1024 * 64 };
+    printf("%-8s %8s %12s %12s\n", "path", "payload", "ns/message", "bytes");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        Run("string", sizes[i], [](int index, const std::string& payload)
+        {
+            std::string output;
+            FormatOutput_(output, "request %d payload %s\n", index, payload);
+            CManager::GetInstance()->Printf( ELL_INFO, "%s", output.c_str() );
+        });
+        Run("writer", sizes[i], [](int index, const std::string& payload)
+        {
+            LogOutput(ELL_INFO, "request %d payload %s\n", index, payload);
+        });
+    }
+    return 0;
+}
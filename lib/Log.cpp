@@ -4,16 +4,62 @@
 #endif
 
 #define OUTPUT_BUFFER   (1024 * 64) /* 在於可以加速 printf 及 OutputDebugString 輸出效能 */
+#define SLAB_SIZE       (1024 * 64) /* 每個執行緒佇列的 slab 大小 */
+#define SLAB_FREE_LIMIT 4           /* 每個執行緒佇列保留可重複使用的 slab 數量 */
+#define ASYNC_STRIDE    32          /* 每個執行緒累積多少筆訊息才回報給背景執行緒 */
+#define BUDGET_STRIDE   16          /* 每個執行緒累積多少筆訊息才計入輸出端的用量 */
+#define ARENA_CHUNK     (1024 * 256)/* 訊息共用區塊的大小 */
+#define ARENA_FREE_LIMIT 16         /* 保留可重複使用的共用區塊數量 */
+#define ASYNC_BLOCKS    8           /* 非同步檔案輸出同時在途的寫入區塊數量 */
+#define ASYNC_WRITERS   2           /* 沒有 io_uring 時負責寫入的執行緒數量 */
+#define COMPRESS_CHUNK  (1024 * 256)/* 壓縮舊檔時每次讀入的大小 */
+#define BINARY_VERSION  1           /* 二進位輸出的格式版本 */
+#define WRITER_RESERVE  512         /* 每筆訊息一開始保留的大小, 不夠時再擴大 */
+#define PRINTF_RESERVE  (1024 * 8)  /* Printf 一開始保留的大小. vsnprintf 超出暫存區時很慢, 先保留多一點 */
+#define METRICS_SAMPLE  64          /* 每幾筆訊息抽樣量測一次延遲, 訊息數量的統計不受影響 */
+#define CONSOLE_IOVECS  256         /* console 一次 writev 的最大片段數, 不超過 IOV_MAX */
+#define CONSOLE_COPY    512         /* console 小於此大小的訊息複製到暫存區, 其餘直接引用. 每個片段在核心中都有成本 */
+#define CONSOLE_TTY_BYTES  (1024 * 4)  /* 終端機累積多少位元組就寫出, 讓人看得到進度 */
+#define CONSOLE_PIPE_BYTES (1024 * 64) /* 管線或檔案累積多少位元組才寫出, 與管線緩衝區一樣大 */
+#define SYSLOG_DATAGRAM (1024 * 8)  /* syslog 封包的最大長度, 超過時截斷 */
+#define SYSLOG_BATCH    64          /* syslog 一次 sendmmsg 的封包數量 */
+#define FLIGHT_SLOT     1024        /* flight recorder 每一格的最大大小 */
+#define FLIGHT_DUMP     (1024 * 4)  /* flight recorder 寫出時的暫存區, 放在堆疊上, 訊號處理的堆疊可能很小 */
 //#if !defined(OUTPUT_BUFFER)
     #define USE_FILE_OUT
 //#endif
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define USE_IO_URING
+    #endif
+#endif
+/* 有 zlib 時提供 gzip 壓縮, 需要連結 -lz. 可以用 -DUSE_ZLIB=0 關閉 */
+#if !defined(USE_ZLIB)
+    #if !defined(_MSC_VER) && defined(__has_include)
+        #if __has_include(<zlib.h>)
+            #define USE_ZLIB 1
+        #endif
+    #endif
+#endif
+#if !defined(USE_ZLIB)
+    #define USE_ZLIB 0
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <signal.h>
 #include <ctime>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
 #include <thread>
+#include <vector>
 #include <unordered_map>
 
 #include <fcntl.h>
@@ -26,6 +72,26 @@
     #include <errno.h>
 #else
     #include <unistd.h>
+    #include <pthread.h>
+    #include <sys/mman.h>
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
+    #include <sys/uio.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <netinet/in.h>
+    #include <netdb.h>
+    #include <dirent.h>
+    #include <errno.h>
+    #include <poll.h>
+#endif
+
+#if defined(USE_IO_URING)
+    #include <linux/io_uring.h>
+#endif
+
+#if USE_ZLIB
+    #include <zlib.h>
 #endif
 
 #include "Log.h"
@@ -38,255 +104,2405 @@ namespace kkboylin
         {
             typedef std::unordered_map< std::string, log::Output > Outputs;
 
+            /* 延遲格式化的紀錄標頭, 後面接著參數 */
+            struct SCapture
+            {
+                const char* format;
+                Renderer    render;
+                Encoder     encode;
+                int64_t     time;   /* 自 epoch 起的奈秒數 */
+                uint64_t    thread;
+            };
+
+            enum E_ENTRY
+            {
+                EE_TEXT,        /* 已經格式化的文字, 不含前綴 */
+                EE_CAPTURE,     /* 延遲格式化時複製的參數 */
+                EE_FIELDS,      /* 訊息及欄位, 以 CFields 編碼 */
+            };
+
+            /* 交給結構化輸出 (二進位, JSON) 的紀錄標頭, 後面接著 kind 指定的內容 */
+            struct SEntry
+            {
+                int64_t     time;
+                uint64_t    thread;
+                const char* format;
+                Renderer    render;
+                Encoder     encode;
+                uint32_t    kind;
+                uint32_t    level;
+            };
+
             namespace buffer
             {
-                class COutput : public CBufferOutput
+                class COutput;
+            };
+
+            /* 已註冊輸出的唯讀快照. 輸出時只需走訪連續的陣列 */
+            struct SSnapshot
+            {
+                std::vector< log::Output >       outputs;   /* 全部的輸出, 用來呼叫 Process */
+                std::vector< log::COutput* >     directs;   /* 不是緩衝輸出, 直接呼叫 Output */
+                std::vector< buffer::COutput* > buffers;   /* 由共用佇列讀取文字 */
+                std::vector< buffer::COutput* > entries;   /* 結構化輸出, 接收 SEntry */
+            };
+
+            namespace metrics
+            {
+                /* 量測延遲用的單調時間(奈秒) */
+                static int64_t Now()
                 {
-                private:
-                    struct SBuffer
-                    {
-                        uint32_t size;
-                        char     buffer[1];
-                    };
-                    typedef std::deque< SBuffer* > Buffers;
+                    return std::chrono::duration_cast< std::chrono::nanoseconds >(
+                             std::chrono::steady_clock::now().time_since_epoch() ).count();
+                }
 
-                    std::mutex  _Lock;
-                    Buffers     _Buffers[2];
-                    int         _Index;
-                    E_LOG_LEVEL _Level;
-                    bool        _Immediately;
-                    std::mutex  _LockOutput;
+                /* 同時只能有一個寫入者, 讀取者可以隨時合併 */
+                class CHistogram
+                {
+                private :
+                    std::atomic< uint64_t > _Sum;
+                    std::atomic< uint64_t > _Max;
+                    std::atomic< uint64_t > _Buckets[SHistogram::BUCKETS];
 
-                protected:
-                    virtual ~COutput();
+                    CHistogram                 (const CHistogram& other) {               }
+                    const CHistogram& operator=(const CHistogram& other) { return *this; }
 
-                    virtual void OnBegin() { }
-                    virtual void OnEnd  () { }
-                    virtual void Output (const char* msg, uint32_t size) = 0;
+                    /* 只有一個寫入者, 不需要 read-modify-write */
+                    static void Add(std::atomic< uint64_t >& counter, uint64_t value)
+                    {
+                        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+                    }
 
-                public:
-                    COutput(E_LOG_LEVEL level);
+                public :
+                    CHistogram() : _Sum(0), _Max(0)
+                    {
+                        for (int i = 0; i < SHistogram::BUCKETS; ++i)
+                            _Buckets[i].store(0, std::memory_order_relaxed);
+                    }
 
-                    virtual void        Output        (E_LOG_LEVEL level, const char* msg, uint32_t size) final;
-                    virtual void        Process       () final;
-                    virtual E_LOG_LEVEL GetLevel      () const final            { return _Level;        }
-                    virtual bool        IsImmediately () const final            { return _Immediately;  }
-                    virtual void        SetLevel      (E_LOG_LEVEL value) final { _Level = value;       }
-                    virtual void        SetImmediately(bool value) final        { _Immediately = value; }
-                };
+                    void Record(int64_t elapsed)
+                    {
+                        uint64_t value = (elapsed > 0) ? (uint64_t)elapsed : 0;
+                        Add(_Buckets[SHistogram::GetBucket(value)], 1);
+                        Add(_Sum, value);
+                        if (value > _Max.load(std::memory_order_relaxed))
+                            _Max.store(value, std::memory_order_relaxed);
+                    }
 
-                COutput::~COutput()
-                {
-                    for (int i = 0; i < 2; ++i)
+                    /* 數量以各格合計, 讀取途中有新樣本時也不會跟各格對不上 */
+                    void Merge(SHistogram& output) const
                     {
-                        Buffers& buffers = _Buffers[i];
-                        Buffers::const_iterator it = buffers.begin();
-                        for (; it != buffers.end(); ++it)
-                            free( (*it) );
+                        for (int i = 0; i < SHistogram::BUCKETS; ++i)
+                        {
+                            uint64_t count = _Buckets[i].load(std::memory_order_relaxed);
+                            output.buckets[i] += count;
+                            output.count      += count;
+                        }
+                        output.sum += _Sum.load(std::memory_order_relaxed);
+                        uint64_t max = _Max.load(std::memory_order_relaxed);
+                        if (max > output.max)
+                            output.max = max;
                     }
-                }
+                };
 
-                COutput::COutput(E_LOG_LEVEL level)
+                /* 每個執行緒各自的量測 */
+                struct SThread
                 {
-                    _Level       = level;
-                    _Index       = 0;
-                    _Immediately = false;
-                }
+                    CHistogram enqueue;   /* 產生一筆訊息的時間 */
+                };
 
-                void COutput::Output(E_LOG_LEVEL level, const char* msg, uint32_t size)
+                /* 所有執行緒的量測. 與 rcu::CRegistry 相同, 只會被重複使用, 不會被刪除,
+                   所以執行緒結束後它的樣本仍然計入 */
+                class CRegistry
                 {
-                    assert(msg != nullptr);
-                    assert(size > 0);
-                    if (_Level >= level)
+                private :
+                    std::mutex              _Lock;
+                    std::vector< SThread* > _Threads;
+                    std::vector< SThread* > _Frees;
+
+                public :
+                    static CRegistry& GetInstance()
                     {
-                        if (_Immediately == false)
+                        static CRegistry* instance = new CRegistry();
+                        return *instance;
+                    }
+
+                    SThread* Attach()
+                    {
+                        SThread* thread = nullptr;
+                        _Lock.lock();
+                        if (_Frees.size() > 0)
                         {
-                            SBuffer* buffer = (SBuffer*)malloc(sizeof(SBuffer) + size);
-                            if (buffer != nullptr)
-                            {
-                                buffer->size = size;
-                                memcpy(buffer->buffer, msg, size);
-                                buffer->buffer[size] = 0;
-                                _Lock.lock();
-                                _Buffers[_Index].push_back(buffer);
-                                _Lock.unlock();
-                            }
+                            thread = _Frees.back();
+                            _Frees.pop_back();
                         }
                         else
                         {
-                            _LockOutput.lock();
-                            Output(msg, size);
-                            _LockOutput.unlock();
+                            thread = new SThread();
+                            _Threads.push_back(thread);
                         }
+                        _Lock.unlock();
+                        return thread;
                     }
-                }
 
-                void COutput::Process()
-                {
-                    Buffers& buffers = _Buffers[_Index];
-                    if (buffers.size() > 0)
+                    void Detach(SThread* thread)
                     {
                         _Lock.lock();
-                        if (++_Index > 1)
-                            _Index = 0;
+                            _Frees.push_back(thread);
                         _Lock.unlock();
-                        OnBegin();
-                        Buffers::const_iterator it = buffers.begin();
-#if defined(OUTPUT_BUFFER)
-                        char buffer[OUTPUT_BUFFER];
-                        int  index = 0;
-                        for (; it != buffers.end(); ++it)
+                    }
+
+                    void Merge(SHistogram& enqueue)
+                    {
+                        _Lock.lock();
+                        std::vector< SThread* >::const_iterator it = _Threads.begin();
+                        for (; it != _Threads.end(); ++it)
+                            (*it)->enqueue.Merge(enqueue);
+                        _Lock.unlock();
+                    }
+                };
+            };
+
+            namespace ring
+            {
+                /* 單一生產者/單一消費者佇列.
+                   由預先配置的 slab 串接而成, 生產者寫入時不需要任何鎖定. */
+                class CQueue
+                {
+                public :
+                    struct SRecord
+                    {
+                        uint32_t size;
+                        uint32_t level;
+                        char     buffer[1];
+                    };
+
+                    /* 生產者寫入但還沒計入輸出端用量的部分 */
+                    struct SUsage
+                    {
+                        uint64_t bytes;
+                        uint32_t entries;
+
+                        SUsage() : bytes(0), entries(0) { }
+                    };
+
+                private :
+                    struct SSlab;
+
+                public :
+                    /* 已發布資料的位置, 給多個讀取者共用同一段資料 */
+                    struct SCursor
+                    {
+                        SSlab*   slab;
+                        uint32_t offset;
+                    };
+
+                private :
+                    struct SSlab
+                    {
+                        std::atomic< SSlab* >   next;
+                        std::atomic< uint32_t > committed; /* 已發布給消費者的位元組數 */
+                        uint32_t                capacity;
+                        char                    data[1];
+                    };
+
+                    SSlab*                  _Head;      /* 消費者使用 */
+                    uint32_t                _Read;      /* 消費者使用 */
+                    SSlab*                  _Tail;      /* 生產者使用 */
+                    uint32_t                _Write;     /* 生產者使用 */
+                    uint32_t                _Reserved;
+                    std::atomic< SSlab* >   _Free;      /* 消費者回收, 生產者取用 */
+                    std::atomic< int >      _Frees;
+                    std::atomic< bool >     _Closed;
+                    SUsage                  _Usage;     /* 生產者使用, 執行緒結束後由消費者取走 */
+                    std::atomic< uint64_t > _Committed; /* 生產者累計發布的筆數 */
+                    std::atomic< uint64_t > _Consumed;  /* 消費者累計取出的筆數 */
+                    std::atomic< uint64_t > _Probe;     /* 抽樣量測停留時間的是第幾筆, 0 表示沒有 */
+                    std::atomic< int64_t >  _ProbeTime; /* 抽樣的那一筆發布的時間 */
+
+                    CQueue                 (const CQueue& other) {               }
+                    const CQueue& operator=(const CQueue& other) { return *this; }
+
+                    static uint32_t Align(uint32_t size) { return (size + 7) & ~7u; }
+
+                    static SSlab* Allocate(uint32_t capacity)
+                    {
+                        SSlab* slab = (SSlab*)malloc(sizeof(SSlab) + capacity);
+                        if (slab != nullptr)
                         {
-                            if (index > 0)
-                            {
-                                if ((index + (*it)->size) >= sizeof(buffer))
-                                {
-                                    buffer[index] = 0;
-                                    _LockOutput.lock();
-                                        Output(buffer, index);
-                                    _LockOutput.unlock();
-                                    index = 0;
-                                }
-                            }
+                            new (&slab->next) std::atomic< SSlab* >(nullptr);
+                            new (&slab->committed) std::atomic< uint32_t >(0);
+                            slab->capacity = capacity;
+                        }
+                        return slab;
+                    }
 
-                            if ((*it)->size >= sizeof(buffer))
-                            {
-                                _LockOutput.lock();
-                                    Output((*it)->buffer, (*it)->size);
-                                _LockOutput.unlock();
-                            }
-                            else
+                    SSlab* Acquire(uint32_t need);
+                    void   Recycle(SSlab* slab);
+
+                public :
+                    CQueue();
+
+                    ~CQueue();
+
+                    bool IsClosed() const { return _Closed.load(std::memory_order_acquire); }
+                    void Close   ()       { _Closed.store(true, std::memory_order_release); }
+
+                    SUsage& GetUsage() { return _Usage; }
+
+                    uint64_t GetCommitted() const { return _Committed.load(std::memory_order_relaxed); }
+                    uint64_t GetConsumed () const { return _Consumed.load(std::memory_order_relaxed);  }
+
+                    /* SRecord::level 的旗標: 延遲格式化的參數 (SCapture), 輸出前才轉成文字 */
+                    static const uint32_t CAPTURE = 0x100;
+
+                    /* 一筆訊息在 slab 中實際佔用的大小 */
+                    static uint32_t Footprint(uint32_t size) { return Align(sizeof(SRecord) + size); }
+
+                    /* 先保留空間再發布, 讓呼叫端可以直接寫入 slab. flags 與 level 一起放在 SRecord::level */
+                    char* Reserve(E_LOG_LEVEL level, uint32_t size, uint32_t flags = 0);
+                    SRecord* GetReserved() { return (SRecord*)&_Tail->data[_Write]; }   /* Reserve 之後還沒發布的紀錄 */
+                    char* Grow   (uint32_t used, uint32_t size);   /* 擴大 Reserve 的空間, 保留前 used 個位元組 */
+                    void  Commit ();
+                    void  Commit (uint32_t size);   /* 只發布 Reserve 的前 size 個位元組 */
+
+                    /* 以下只有消費者可以呼叫 */
+                    bool    IsEmpty  () const;
+                    SCursor GetEnd   () const;
+                    void    Advance  (const SCursor& end, SUsage& freed);
+                    bool    TakeProbe(int64_t& time);   /* 抽樣的那一筆已經取出時傳回 true 與它發布的時間 */
+
+                    /* 讀取到 end 為止但不取出 */
+                    template< typename F >
+                    void Peek(F& callback, const SCursor& end) const
+                    {
+                        const SSlab* slab = _Head;
+                        uint32_t     read = _Read;
+                        for (;;)
+                        {
+                            uint32_t limit = (slab == end.slab) ? end.offset : slab->committed.load(std::memory_order_acquire);
+                            while (read < limit)
                             {
-                                memcpy(&buffer[index], (*it)->buffer, (*it)->size);
-                                index += (*it)->size;
+                                const SRecord* record = (const SRecord*)&slab->data[read];
+                                callback(*record);
+                                read += Align(sizeof(SRecord) + record->size);
                             }
-                            free((*it));
+                            if (slab == end.slab)
+                                return;
+                            slab = slab->next.load(std::memory_order_acquire);
+                            read = 0;
                         }
-                        if (index > 0)
+                    }
+
+                    template< typename F >
+                    void Pop(F& callback)
+                    {
+                        auto all = [&](const SRecord& record) -> bool
                         {
-                            buffer[index] = 0;
-                            _LockOutput.lock();
-                                Output(buffer, index);
-                            _LockOutput.unlock();
-                        }
-#else
-                        for (; it != buffers.end(); ++it)
+                            callback(record);
+                            return true;
+                        };
+                        PopWhile(all);
+                    }
+
+                    /* callback 傳回 false 時停止, 該筆訊息留在佇列中. 全部取完時傳回 true */
+                    template< typename F >
+                    bool PopWhile(F& callback)
+                    {
+                        for (;;)
                         {
-                            _LockOutput.lock();
-                                Output((*it)->buffer, (*it)->size);
-                            _LockOutput.unlock();
+                            uint32_t committed = _Head->committed.load(std::memory_order_acquire);
+                            while (_Read < committed)
+                            {
+                                const SRecord* record = (const SRecord*)&_Head->data[_Read];
+                                if (callback(*record) == false)
+                                    return false;
+                                _Read += Align(sizeof(SRecord) + record->size);
+                                _Consumed.store(_Consumed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                            }
+                            SSlab* next = _Head->next.load(std::memory_order_acquire);
+                            if (next == nullptr)
+                                return true;
+                            /* 生產者在串接下一個 slab 前可能又寫入了資料 */
+                            if (_Head->committed.load(std::memory_order_acquire) != _Read)
+                                continue;
+                            SSlab* slab = _Head;
+                            _Head = next;
+                            _Read = 0;
+                            Recycle(slab);
                         }
-#endif
-                        buffers.clear();
-                        OnEnd();
                     }
-                }
-            };
+                };
 
-            namespace console
-            {
-                class COutput : public buffer::COutput
+                CQueue::CQueue()
+                    : _Free(nullptr)
+                    , _Frees(0)
+                    , _Closed(false)
+                    , _Committed(0)
+                    , _Consumed(0)
+                    , _Probe(0)
+                    , _ProbeTime(0)
                 {
-                protected :
-                    virtual void Output(const char* msg, uint32_t size) final;
+                    _Head  = Allocate(SLAB_SIZE);
+                    _Tail  = _Head;
+                    _Read     = 0;
+                    _Write    = 0;
+                    _Reserved = 0;
+                }
 
-                public :
-                    COutput(E_LOG_LEVEL level) :
-                        buffer::COutput(level)
+                CQueue::~CQueue()
+                {
+                    while (_Head != nullptr)
                     {
+                        SSlab* next = _Head->next.load(std::memory_order_relaxed);
+                        free(_Head);
+                        _Head = next;
                     }
-                };
+                    SSlab* slab = _Free.load(std::memory_order_relaxed);
+                    while (slab != nullptr)
+                    {
+                        SSlab* next = slab->next.load(std::memory_order_relaxed);
+                        free(slab);
+                        slab = next;
+                    }
+                }
 
-                void COutput::Output(const char* msg, uint32_t size)
+                CQueue::SSlab* CQueue::Acquire(uint32_t need)
                 {
-                    fprintf(stderr, msg);
+                    if (need <= SLAB_SIZE)
+                    {
+                        /* 只有生產者會取出, 所以不會有 ABA 的問題 */
+                        SSlab* slab = _Free.load(std::memory_order_acquire);
+                        while (slab != nullptr)
+                        {
+                            if (_Free.compare_exchange_weak(slab,
+                                                            slab->next.load(std::memory_order_relaxed),
+                                                            std::memory_order_acquire))
+                            {
+                                _Frees.fetch_sub(1, std::memory_order_relaxed);
+                                slab->next.store(nullptr, std::memory_order_relaxed);
+                                slab->committed.store(0, std::memory_order_relaxed);
+                                return slab;
+                            }
+                        }
+                        return Allocate(SLAB_SIZE);
+                    }
+                    return Allocate(need);
                 }
-            }
 
-            namespace debuger
-            {
-                class COutput : public buffer::COutput
+                void CQueue::Recycle(SSlab* slab)
                 {
-                protected:
-                    virtual void Output(const char* msg, uint32_t size) final;
-
-                public:
-                    COutput(E_LOG_LEVEL level) :
-                        buffer::COutput(level)
+                    if( (slab->capacity == SLAB_SIZE) &&
+                        (_Frees.load(std::memory_order_relaxed) < SLAB_FREE_LIMIT) )
+                    {
+                        SSlab* head = _Free.load(std::memory_order_relaxed);
+                        do
+                        {
+                            slab->next.store(head, std::memory_order_relaxed);
+                        } while (_Free.compare_exchange_weak(head, slab, std::memory_order_release) == false);
+                        _Frees.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    else
                     {
+                        free(slab);
                     }
-                };
+                }
 
-                void COutput::Output(const char* msg, uint32_t size)
+                char* CQueue::Reserve(E_LOG_LEVEL level, uint32_t size, uint32_t flags)
                 {
-#if defined(_MSC_VER)
-                    if (IsDebuggerPresent() == TRUE)
-                        OutputDebugString(msg);
-#endif
+                    uint32_t need = Align(sizeof(SRecord) + size);
+                    if (_Write + need > _Tail->capacity)
+                    {
+                        SSlab* slab = Acquire(need);
+                        if (slab == nullptr)
+                            return nullptr;
+                        _Tail->next.store(slab, std::memory_order_release);
+                        _Tail  = slab;
+                        _Write = 0;
+                    }
+                    SRecord* record = (SRecord*)&_Tail->data[_Write];
+                    record->size  = size;
+                    record->level = (uint32_t)level | flags;
+                    record->buffer[size] = 0;
+                    _Reserved = need;
+                    return record->buffer;
                 }
-            };
 
-            namespace file
-            {
-                static bool MkDir(const char* directory)
+                /* 目前的 slab 放得下時就地擴大, 否則連同已寫入的內容搬到新的 slab */
+                char* CQueue::Grow(uint32_t used, uint32_t size)
                 {
-                    if( (directory != nullptr) &&
-                        (*directory != 0) )
+                    SRecord* record = (SRecord*)&_Tail->data[_Write];
+                    uint32_t need   = Align(sizeof(SRecord) + size);
+                    if (_Write + need > _Tail->capacity)
                     {
-    #if defined(_MSC_VER)
-                        return ( ::CreateDirectory(directory, nullptr) == TRUE );
-    #else
-                        return (mkdir(directory, 0777) == 0);
-    #endif
+                        SSlab* slab = Acquire(need);
+                        if (slab == nullptr)
+                            return nullptr;
+                        memcpy(slab->data, record, sizeof(SRecord) + used);
+                        _Tail->next.store(slab, std::memory_order_release);
+                        _Tail  = slab;
+                        _Write = 0;
+                        record = (SRecord*)slab->data;
                     }
-                    return false;
-                };
+                    record->size = size;
+                    record->buffer[size] = 0;
+                    _Reserved = need;
+                    return record->buffer;
+                }
 
-                static bool IsDirectoryExists(const char* directory)
+                void CQueue::Commit()
                 {
-                    if( (directory != nullptr) &&
-                        (*directory != 0) )
+                    uint64_t serial = _Committed.load(std::memory_order_relaxed) + 1;
+                    _Committed.store(serial, std::memory_order_relaxed);
+                    _Write += _Reserved;
+                    _Tail->committed.store(_Write, std::memory_order_release);
+                    /* 上一筆抽樣已經被取出時才記錄新的一筆 */
+                    if( ((serial % METRICS_SAMPLE) == 0) &&
+                        (_Probe.load(std::memory_order_acquire) == 0) )
                     {
-    #if defined(_MSC_VER)
-                        DWORD Code = ::GetFileAttributesA(directory);
-                        if( (Code != INVALID_FILE_ATTRIBUTES) &&
-                            ((Code & FILE_ATTRIBUTE_DIRECTORY) != 0) )
-                            return true;
-    #else
-                        struct stat st;
-                        if( stat( (const char *)directory, &st ) != -1 )
-                            return (S_ISDIR(st.st_mode) != 0);
-    #endif
+                        _ProbeTime.store(metrics::Now(), std::memory_order_relaxed);
+                        _Probe.store(serial, std::memory_order_release);
                     }
-                    return	false;
                 }
 
-                static bool Rename(const char* oldfilename,
-                                   const char* newfilename)
+                void CQueue::Commit(uint32_t size)
                 {
-                    if ((oldfilename != NULL) &&
-                        (newfilename != NULL) &&
-                        (*oldfilename != 0) &&
-                        (*newfilename != 0))
-#if defined(_MSC_VER)
-                        return (::MoveFile(oldfilename, newfilename) == TRUE);
-#else
-                        return (rename(oldfilename, newfilename) == 0);
-#endif
-                    return false;
+                    SRecord* record = (SRecord*)&_Tail->data[_Write];
+                    record->size = size;
+                    _Reserved    = Footprint(size);
+                    Commit();
                 }
 
-                static bool MkDir(const char* directory, bool createParent)
-		        {
-			        if( (directory == nullptr) ||
-				        (*directory == 0) )
-				        return false;
-			        if( IsDirectoryExists(directory) == true )
-				        return true;
+                bool CQueue::IsEmpty() const
+                {
+                    return (_Head->next.load(std::memory_order_acquire) == nullptr) &&
+                           (_Head->committed.load(std::memory_order_acquire) == _Read);
+                }
 
-			        if(createParent == true)
-			        {
-				        /* 建立子目錄 */
+                /* 生產者串接下一個 slab 之後就不會再寫入前一個, 所以最後一個 slab 的位置就是結尾 */
+                CQueue::SCursor CQueue::GetEnd() const
+                {
+                    SSlab* slab = _Head;
+                    for (;;)
+                    {
+                        SSlab* next = slab->next.load(std::memory_order_acquire);
+                        if (next == nullptr)
+                            break;
+                        slab = next;
+                    }
+                    SCursor cursor;
+                    cursor.slab   = slab;
+                    cursor.offset = slab->committed.load(std::memory_order_acquire);
+                    return cursor;
+                }
+
+                /* 取出到 end 為止, 回收經過的 slab */
+                void CQueue::Advance(const SCursor& end, SUsage& freed)
+                {
+                    uint64_t consumed = _Consumed.load(std::memory_order_relaxed);
+                    for (;;)
+                    {
+                        uint32_t limit = (_Head == end.slab) ? end.offset : _Head->committed.load(std::memory_order_acquire);
+                        while (_Read < limit)
+                        {
+                            const SRecord* record = (const SRecord*)&_Head->data[_Read];
+                            uint32_t       size   = Align(sizeof(SRecord) + record->size);
+                            freed.bytes += size;
+                            ++freed.entries;
+                            ++consumed;
+                            _Read += size;
+                        }
+                        if (_Head == end.slab)
+                        {
+                            _Consumed.store(consumed, std::memory_order_relaxed);
+                            return;
+                        }
+                        SSlab* slab = _Head;
+                        _Head = slab->next.load(std::memory_order_acquire);
+                        _Read = 0;
+                        Recycle(slab);
+                    }
+                }
+
+                bool CQueue::TakeProbe(int64_t& time)
+                {
+                    uint64_t probe = _Probe.load(std::memory_order_acquire);
+                    if( (probe == 0) ||
+                        (probe > _Consumed.load(std::memory_order_relaxed)) )
+                        return false;
+                    time = _ProbeTime.load(std::memory_order_relaxed);
+                    _Probe.store(0, std::memory_order_release);
+                    return true;
+                }
+
+                /* 直接寫入佇列保留的空間. 格式化途中又輸出其他訊息,
+                   或是配置失敗時, 改寫到 _Spill, 結束時再複製到佇列 */
+                class CRecordWriter : public log::CWriter
+                {
+                private :
+                    CQueue*     _Queue;
+                    std::string _Spill;
+
+                    CRecordWriter                 (const CRecordWriter& other) {               }
+                    const CRecordWriter& operator=(const CRecordWriter& other) { return *this; }
+
+                    virtual void Grow(size_t capacity)
+                    {
+                        size_t next = (_Capacity * 2 > capacity) ? _Capacity * 2 : capacity;
+                        if (_Queue != nullptr)
+                        {
+                            char* data = (next < (size_t)std::numeric_limits< int32_t >::max()) ? _Queue->Grow((uint32_t)_Size, (uint32_t)next) : nullptr;
+                            if (data != nullptr)
+                            {
+                                _Data     = data;
+                                _Capacity = next;
+                                return;
+                            }
+                            Spill();
+                        }
+                        _Spill.resize(next + 1);
+                        _Data     = &_Spill[0];
+                        _Capacity = next;
+                    }
+
+                public :
+                    CRecordWriter* parent;  /* 外層還沒結束的訊息 */
+                    E_LOG_LEVEL    level;
+                    int64_t        time;
+                    int64_t        start;   /* 抽樣量測時開始的時間, 0 表示不量測 */
+                    uint32_t       prefix;  /* 前綴的長度 */
+
+                    CRecordWriter() : _Queue(nullptr), parent(nullptr), level(ELL_DEBUG), time(0), start(0), prefix(0) { }
+
+                    /* 在 queue 保留 capacity 個位元組, 失敗時寫入 _Spill */
+                    void Open(CQueue* queue, E_LOG_LEVEL value, uint32_t capacity)
+                    {
+                        level     = value;
+                        _Queue    = queue;
+                        _Size     = 0;
+                        _Capacity = 0;
+                        _Data     = (_Queue != nullptr) ? _Queue->Reserve(level, capacity) : nullptr;
+                        if (_Data != nullptr)
+                        {
+                            _Capacity = capacity;
+                        }
+                        else
+                        {
+                            _Queue = nullptr;
+                            Grow(capacity);
+                        }
+                    }
+
+                    /* 讓出佇列保留的空間, 之後都寫入 _Spill */
+                    void Spill()
+                    {
+                        if (_Queue == nullptr)
+                            return;
+                        _Spill.assign(_Data, _Size);
+                        _Spill.resize(_Capacity + 1);
+                        _Data  = &_Spill[0];
+                        _Queue = nullptr;
+                    }
+
+                    bool  IsSpilled() const { return _Queue == nullptr; }
+                    char* GetData  ()       { return _Data; }
+
+                    void Format(const char* fmt, va_list args)
+                    {
+                        if (_Capacity - _Size < PRINTF_RESERVE)
+                            Grow(_Size + PRINTF_RESERVE);
+                        va_list copy;
+                        va_copy(copy, args);
+                        int length = vsnprintf(&_Data[_Size], _Capacity - _Size + 1, fmt, copy);
+                        va_end(copy);
+                        if (length <= 0)
+                            return;
+                        if (_Size + length > _Capacity)
+                        {
+                            Grow(_Size + length);
+                            vsnprintf(&_Data[_Size], _Capacity - _Size + 1, fmt, args);
+                        }
+                        _Size += length;
+                    }
+                };
+            };
+
+            namespace arena
+            {
+                /* 訊息共用的區塊. 以遞增指標切割, 所有參考都釋放後整塊回收.
+                   refs 一開始是 BIAS, 生產者在換下一塊時才扣掉沒有發出去的部分,
+                   所以發出參考時不需要任何原子操作. */
+                struct SChunk
+                {
+                    std::atomic< int64_t > refs;
+                    uint32_t               capacity;
+                    char                   data[1];
+                };
+
+                static const int64_t BIAS = (int64_t)1 << 62;
+
+                class CPool
+                {
+                private :
+                    std::mutex              _Lock;
+                    std::vector< SChunk* >  _Frees;
+
+                public :
+                    /* 刻意不釋放, 執行緒結束後區塊可能還被輸出端參考 */
+                    static CPool& GetInstance()
+                    {
+                        static CPool* instance = new CPool();
+                        return *instance;
+                    }
+
+                    SChunk* Acquire(uint32_t need)
+                    {
+                        SChunk* chunk = nullptr;
+                        if (need <= ARENA_CHUNK)
+                        {
+                            _Lock.lock();
+                            if (_Frees.size() > 0)
+                            {
+                                chunk = _Frees.back();
+                                _Frees.pop_back();
+                            }
+                            _Lock.unlock();
+                            need = ARENA_CHUNK;
+                        }
+                        if (chunk == nullptr)
+                        {
+                            chunk = (SChunk*)malloc(sizeof(SChunk) + need);
+                            if (chunk == nullptr)
+                                return nullptr;
+                            new (&chunk->refs) std::atomic< int64_t >(0);
+                            chunk->capacity = need;
+                        }
+                        chunk->refs.store(BIAS, std::memory_order_relaxed);
+                        return chunk;
+                    }
+
+                    void Recycle(SChunk* chunk)
+                    {
+                        if (chunk->capacity == ARENA_CHUNK)
+                        {
+                            _Lock.lock();
+                            if (_Frees.size() < ARENA_FREE_LIMIT)
+                            {
+                                _Frees.push_back(chunk);
+                                chunk = nullptr;
+                            }
+                            _Lock.unlock();
+                        }
+                        free(chunk);
+                    }
+                };
+
+                static inline void Release(SChunk* chunk, int64_t count)
+                {
+                    if (chunk->refs.fetch_sub(count, std::memory_order_acq_rel) == count)
+                        CPool::GetInstance().Recycle(chunk);
+                }
+
+                /* 每個執行緒各自的切割位置, 只有擁有者使用 */
+                class CArena
+                {
+                private :
+                    SChunk*  _Chunk;
+                    uint32_t _Used;
+                    int64_t  _Handed;   /* 目前這一塊已經發出去的參考數量 */
+
+                    CArena                 (const CArena& other) {               }
+                    const CArena& operator=(const CArena& other) { return *this; }
+
+                    void Retire()
+                    {
+                        if (_Chunk != nullptr)
+                            Release(_Chunk, BIAS - _Handed);
+                        _Chunk = nullptr;
+                    }
+
+                public :
+                    CArena() : _Chunk(nullptr), _Used(0), _Handed(0) { }
+
+                    ~CArena() { Retire(); }
+
+                    /* 取得至少 size 個位元組的空間, Commit 之前都還可以被覆蓋 */
+                    char* Reserve(uint32_t size)
+                    {
+                        if( (_Chunk == nullptr) ||
+                            (_Used + size > _Chunk->capacity) )
+                        {
+                            Retire();
+                            _Chunk = CPool::GetInstance().Acquire(size);
+                            _Used   = 0;
+                            _Handed = 0;
+                            if (_Chunk == nullptr)
+                                return nullptr;
+                        }
+                        return &_Chunk->data[_Used];
+                    }
+
+                    SChunk* GetChunk() const { return _Chunk; }
+
+                    /* 確定使用 Reserve 的前 size 個位元組, 並且發出了 references 個參考 */
+                    void Commit(uint32_t size, int64_t references)
+                    {
+                        _Used   += (size + 7) & ~7u;
+                        _Handed += references;
+                    }
+                };
+
+                /* 消費者依序釋放參考, 連續落在同一塊的只做一次原子操作 */
+                class CReleaser
+                {
+                private :
+                    SChunk* _Chunk;
+                    int64_t _Count;
+
+                public :
+                    CReleaser() : _Chunk(nullptr), _Count(0) { }
+
+                    ~CReleaser() { Flush(); }
+
+                    SChunk* GetChunk() const { return _Chunk; }
+
+                    void Add(SChunk* chunk)
+                    {
+                        if (chunk != _Chunk)
+                        {
+                            Flush();
+                            _Chunk = chunk;
+                        }
+                        ++_Count;
+                    }
+
+                    void Flush()
+                    {
+                        if (_Chunk != nullptr)
+                            Release(_Chunk, _Count);
+                        _Chunk = nullptr;
+                        _Count = 0;
+                    }
+                };
+            };
+
+            namespace rcu
+            {
+                /* 讀取者. 序號為奇數時表示正在讀取共享資料 */
+                struct SReader
+                {
+                    std::atomic< uint64_t > sequence;
+
+                    SReader() : sequence(0) { }
+                };
+
+                typedef std::pair< SReader*, uint64_t > Sample;
+                typedef std::vector< Sample >           Samples;
+
+                /* 所有執行緒的讀取者.
+                   刻意不釋放, 避免與 thread_local 的解構順序衝突. 讀取者只會被重複使用, 不會被刪除. */
+                class CRegistry
+                {
+                private :
+                    std::mutex              _Lock;
+                    std::vector< SReader* > _Readers;
+                    std::vector< SReader* > _Frees;
+
+                public :
+                    static CRegistry& GetInstance()
+                    {
+                        static CRegistry* instance = new CRegistry();
+                        return *instance;
+                    }
+
+                    SReader* Attach()
+                    {
+                        SReader* reader = nullptr;
+                        _Lock.lock();
+                        if (_Frees.size() > 0)
+                        {
+                            reader = _Frees.back();
+                            _Frees.pop_back();
+                        }
+                        else
+                        {
+                            reader = new SReader();
+                            _Readers.push_back(reader);
+                        }
+                        _Lock.unlock();
+                        return reader;
+                    }
+
+                    void Detach(SReader* reader)
+                    {
+                        _Lock.lock();
+                            _Frees.push_back(reader);
+                        _Lock.unlock();
+                    }
+
+                    /* 記錄目前正在讀取的讀取者 */
+                    void Collect(Samples& samples)
+                    {
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+                        _Lock.lock();
+                        std::vector< SReader* >::const_iterator it = _Readers.begin();
+                        for (; it != _Readers.end(); ++it)
+                        {
+                            uint64_t sequence = (*it)->sequence.load(std::memory_order_acquire);
+                            if ((sequence & 1) != 0)
+                                samples.push_back( Sample(*it, sequence) );
+                        }
+                        _Lock.unlock();
+                    }
+                };
+
+                /* 讀取區段. 寫入者會等到所有區段結束後才釋放舊資料 */
+                class CReadLock
+                {
+                private :
+                    SReader& _Reader;
+                    uint64_t _Sequence;
+
+                public :
+                    CReadLock(SReader& reader) :
+                        _Reader(reader)
+                    {
+                        _Sequence = _Reader.sequence.load(std::memory_order_relaxed);
+                        if ((_Sequence & 1) == 0)
+                        {
+                            _Reader.sequence.store(_Sequence + 1, std::memory_order_relaxed);
+                            std::atomic_thread_fence(std::memory_order_seq_cst);
+                        }
+                    }
+
+                    ~CReadLock()
+                    {
+                        if ((_Sequence & 1) == 0)
+                            _Reader.sequence.store(_Sequence + 2, std::memory_order_release);
+                    }
+                };
+
+                /* 等待釋放的資料. 呼叫端必須自行鎖定 */
+                class CReclaimer
+                {
+                private :
+                    struct SRetired
+                    {
+                        void*   pointer;
+                        void  (*destroy)(void*);
+                        Samples samples;
+                    };
+                    typedef std::vector< SRetired > Retireds;
+
+                    Retireds _Retireds;
+
+                    template< typename T >
+                    static void Destroy(void* pointer) { delete (T*)pointer; }
+
+                public :
+                    ~CReclaimer()
+                    {
+                        Retireds::iterator it = _Retireds.begin();
+                        for (; it != _Retireds.end(); ++it)
+                            (*it).destroy((*it).pointer);
+                    }
+
+                    template< typename T >
+                    void Retire(T* pointer)
+                    {
+                        if (pointer != nullptr)
+                        {
+                            SRetired retired;
+                            retired.pointer = pointer;
+                            retired.destroy = &Destroy< T >;
+                            CRegistry::GetInstance().Collect(retired.samples);
+                            _Retireds.push_back(retired);
+                        }
+                    }
+
+                    void Reclaim()
+                    {
+                        Retireds::iterator it = _Retireds.begin();
+                        while (it != _Retireds.end())
+                        {
+                            bool     passed = true;
+                            Samples& samples = (*it).samples;
+                            Samples::const_iterator sample = samples.begin();
+                            for (; sample != samples.end(); ++sample)
+                            {
+                                if ((*sample).first->sequence.load(std::memory_order_acquire) == (*sample).second)
+                                {
+                                    passed = false;
+                                    break;
+                                }
+                            }
+                            if (passed == true)
+                            {
+                                (*it).destroy((*it).pointer);
+                                it = _Retireds.erase(it);
+                            }
+                            else
+                            {
+                                ++it;
+                            }
+                        }
+                    }
+                };
+            };
+
+            namespace timestamp
+            {
+                /* 自 epoch 起的奈秒數 */
+                static int64_t Now()
+                {
+                    return std::chrono::duration_cast< std::chrono::nanoseconds >(
+                             std::chrono::system_clock::now().time_since_epoch() ).count();
+                }
+
+                static inline char* Digits2(char* ptr, int value)
+                {
+                    ptr[0] = (char)('0' + value / 10);
+                    ptr[1] = (char)('0' + value % 10);
+                    return ptr + 2;
+                }
+
+                static inline char* Digits(char* ptr, uint32_t value, int count)
+                {
+                    for (int i = count - 1; i >= 0; --i)
+                    {
+                        ptr[i] = (char)('0' + value % 10);
+                        value /= 10;
+                    }
+                    return ptr + count;
+                }
+
+                /* 快取目前這一分鐘的日期與時間, 同一分鐘內只需要更新秒數與小數部分 */
+                struct SCache
+                {
+                    int64_t minute;     /* 這一分鐘開始的秒數 */
+                    char    date[11];   /* "YYYY-MM-DD " */
+                    char    time[6];    /* "HH:MM:" */
+
+                    SCache() : minute(INT64_MIN) { }
+
+                    void Update(int64_t seconds)
+                    {
+                        if( (seconds >= minute) &&
+                            (seconds < minute + 60) )
+                            return;
+
+                        std::time_t now = (std::time_t)seconds;
+                        std::tm     tm;
+#if defined(_MSC_VER)
+                        localtime_s(&tm, &now);
+#else
+                        localtime_r(&now, &tm);
+#endif
+                        minute = seconds - tm.tm_sec;
+
+                        char* ptr = Digits(date, (uint32_t)(tm.tm_year + 1900), 4);
+                        *ptr++ = '-';
+                        ptr = Digits2(ptr, tm.tm_mon + 1);
+                        *ptr++ = '-';
+                        ptr = Digits2(ptr, tm.tm_mday);
+                        *ptr = ' ';
+
+                        ptr = Digits2(time, tm.tm_hour);
+                        *ptr++ = ':';
+                        ptr = Digits2(ptr, tm.tm_min);
+                        *ptr = ':';
+                    }
+                };
+            };
+
+            namespace thread
+            {
+                typedef std::shared_ptr< ring::CQueue > Queue;
+
+                /* 每個執行緒各自持有的資料 */
+                struct SContext
+                {
+                    typedef std::pair< uint64_t, Queue > Slot;
+                    typedef std::vector< Slot >          Slots;
+
+                    Slots                queues;
+                    uint32_t             pending;   /* 尚未回報給背景執行緒的訊息數量 */
+                    rcu::SReader*        reader;
+                    metrics::SThread*    measures;  /* 延遲的樣本 */
+                    uint32_t             samples;   /* 產生過的訊息數量, 用來決定哪幾筆要量測 */
+                    int64_t              start;     /* Reserve 抽樣量測時開始的時間, 0 表示不量測 */
+                    uint64_t             id;
+                    timestamp::SCache    time;      /* 前綴時間的快取 */
+                    arena::CArena        arena;     /* 訊息內容, 由所有輸出端共用 */
+                    std::string          encoded;   /* LogFields 編碼的暫存 */
+                    std::string          text;      /* LogFields 轉成文字的暫存 */
+                    ring::CRecordWriter  writer;    /* LogOutput 與 Printf 格式化的目的地 */
+                    ring::CRecordWriter* active;    /* 正在格式化的訊息, 巢狀輸出時指向最內層 */
+
+                    SContext() : pending(0), reader(nullptr), measures(nullptr), samples(0), start(0), active(nullptr)
+                    {
+                        id = std::hash< std::thread::id >()( std::this_thread::get_id() );
+                    }
+
+                    ~SContext()
+                    {
+                        if (reader != nullptr)
+                            rcu::CRegistry::GetInstance().Detach(reader);
+                        if (measures != nullptr)
+                            metrics::CRegistry::GetInstance().Detach(measures);
+                    }
+
+                    rcu::SReader& GetReader()
+                    {
+                        if (reader == nullptr)
+                            reader = rcu::CRegistry::GetInstance().Attach();
+                        return *reader;
+                    }
+
+                    /* 每 METRICS_SAMPLE 筆量測一筆, 傳回開始的時間, 0 表示這一筆不量測 */
+                    int64_t Sample()
+                    {
+                        if ((++samples % METRICS_SAMPLE) != 0)
+                            return 0;
+                        return metrics::Now();
+                    }
+
+                    void Measure(int64_t begin)
+                    {
+                        if (begin == 0)
+                            return;
+                        if (measures == nullptr)
+                            measures = metrics::CRegistry::GetInstance().Attach();
+                        measures->enqueue.Record(metrics::Now() - begin);
+                    }
+                };
+
+                static SContext& GetContext()
+                {
+                    static thread_local SContext context;
+                    return context;
+                }
+
+                /* 每個執行緒各有一個佇列, 由擁有者負責取出 */
+                class CQueues
+                {
+                private :
+                    typedef std::vector< Queue > Queues;
+
+                    static std::atomic< uint64_t > _Serials;
+
+                    uint64_t             _Serial;
+                    mutable std::mutex   _Lock;
+                    Queues               _Queues;
+                    ring::CQueue::SUsage _Orphans;  /* 已結束的執行緒還沒計入的用量 */
+                    uint64_t             _Retired;  /* 已移除的佇列累計發布的筆數 */
+                    metrics::CHistogram  _Residency; /* 只有消費者寫入 */
+
+                    CQueues                 (const CQueues& other) {               }
+                    const CQueues& operator=(const CQueues& other) { return *this; }
+
+                    ring::CQueue* Attach(SContext& context);
+
+                    /* 消費者取出後呼叫, 抽樣的那一筆已經取出時記錄它的停留時間 */
+                    void Probe(ring::CQueue& queue)
+                    {
+                        int64_t time;
+                        if (queue.TakeProbe(time) == true)
+                            _Residency.Record(metrics::Now() - time);
+                    }
+
+                    /* 必須在 _Lock 內呼叫 */
+                    void Retire(ring::CQueue& queue)
+                    {
+                        ring::CQueue::SUsage& usage = queue.GetUsage();
+                        _Orphans.bytes   += usage.bytes;
+                        _Orphans.entries += usage.entries;
+                        _Retired         += queue.GetCommitted();
+                    }
+
+                public :
+                    CQueues() : _Serial(++_Serials), _Retired(0) { }
+
+                    ~CQueues()
+                    {
+                        Queues::iterator it = _Queues.begin();
+                        for (; it != _Queues.end(); ++it)
+                            (*it)->Close();
+                    }
+
+                    ring::CQueue* Get(SContext& context)
+                    {
+                        SContext::Slots::const_iterator it = context.queues.begin();
+                        for (; it != context.queues.end(); ++it)
+                        {
+                            if ((*it).first == _Serial)
+                                return (*it).second.get();
+                        }
+                        return Attach(context);
+                    }
+
+                    ring::CQueue* Get() { return Get(GetContext()); }
+
+                    /* 只能有一個消費者 */
+                    template< typename F >
+                    void Pop(F& callback);
+
+                    /* 依序取出, callback 傳回 false 時停止. 不處理已結束的執行緒 */
+                    template< typename F >
+                    void PopWhile(F& callback);
+
+                    /* 同一批資料依序給多個讀取者 */
+                    class CReader
+                    {
+                    public :
+                        typedef std::vector< const ring::CQueue::SRecord* > Records;
+
+                    private :
+                        const Queues&                               _Queues;
+                        const std::vector< ring::CQueue::SCursor >& _Ends;
+                        const Records*                              _Rendered;
+
+                    public :
+                        CReader(const Queues& queues, const std::vector< ring::CQueue::SCursor >& ends)
+                            : _Queues(queues)
+                            , _Ends(ends)
+                            , _Rendered(nullptr)
+                        {
+                        }
+
+                        /* 同樣的資料, 延遲格式化的紀錄依序換成 rendered, nullptr 表示略過 */
+                        CReader(const CReader& other, const Records& rendered)
+                            : _Queues(other._Queues)
+                            , _Ends(other._Ends)
+                            , _Rendered(&rendered)
+                        {
+                        }
+
+                        template< typename F >
+                        void Read(F& callback) const
+                        {
+                            if (_Rendered == nullptr)
+                            {
+                                for (size_t i = 0; i < _Queues.size(); ++i)
+                                    _Queues[i]->Peek(callback, _Ends[i]);
+                                return;
+                            }
+                            size_t next    = 0;
+                            auto   replace = [&](const ring::CQueue::SRecord& record)
+                            {
+                                if ((record.level & ring::CQueue::CAPTURE) == 0)
+                                {
+                                    callback(record);
+                                    return;
+                                }
+                                const ring::CQueue::SRecord* rendered = (next < _Rendered->size()) ? (*_Rendered)[next] : nullptr;
+                                ++next;
+                                if (rendered != nullptr)
+                                    callback(*rendered);
+                            };
+                            for (size_t i = 0; i < _Queues.size(); ++i)
+                                _Queues[i]->Peek(replace, _Ends[i]);
+                        }
+                    };
+
+                    /* 取得目前已發布的資料, 呼叫 pass(reader) 讓所有讀取者讀取後再一起取出.
+                       freed 累加取出的用量 */
+                    template< typename F >
+                    void Multicast(F& pass, ring::CQueue::SUsage& freed);
+
+                    /* 累計放入的數量與目前的深度. 可以在任何執行緒呼叫 */
+                    void Measure(SQueueStats& stats) const
+                    {
+                        _Lock.lock();
+                        stats.enqueued += _Retired;
+                        Queues::const_iterator it = _Queues.begin();
+                        for (; it != _Queues.end(); ++it)
+                        {
+                            /* 先讀取出的數量, 發布的數量只會更多 */
+                            uint64_t consumed  = (*it)->GetConsumed();
+                            uint64_t committed = (*it)->GetCommitted();
+                            stats.enqueued += committed;
+                            if (committed > consumed)
+                                stats.depth += committed - consumed;
+                        }
+                        _Lock.unlock();
+                        _Residency.Merge(stats.residency);
+                    }
+
+                    /* 取走已結束的執行緒來不及計入的用量 */
+                    ring::CQueue::SUsage TakeOrphans()
+                    {
+                        _Lock.lock();
+                            ring::CQueue::SUsage usage = _Orphans;
+                            _Orphans = ring::CQueue::SUsage();
+                        _Lock.unlock();
+                        return usage;
+                    }
+                };
+
+                std::atomic< uint64_t > CQueues::_Serials(0);
+
+                ring::CQueue* CQueues::Attach(SContext& context)
+                {
+                    /* 第一次在這個執行緒輸出, 順便清除已經關閉的佇列 */
+                    SContext::Slots& slots = context.queues;
+                    SContext::Slots::iterator it = slots.begin();
+                    while (it != slots.end())
+                    {
+                        if ((*it).second->IsClosed() == true)
+                            it = slots.erase(it);
+                        else
+                            ++it;
+                    }
+                    Queue queue = std::make_shared< ring::CQueue >();
+                    _Lock.lock();
+                        _Queues.push_back(queue);
+                    _Lock.unlock();
+                    slots.push_back( SContext::Slot(_Serial, queue) );
+                    return queue.get();
+                }
+
+                template< typename F >
+                void CQueues::Pop(F& callback)
+                {
+                    _Lock.lock();
+                        Queues queues = _Queues;
+                    _Lock.unlock();
+
+                    bool orphans = false;
+                    Queues::iterator it = queues.begin();
+                    for (; it != queues.end(); ++it)
+                    {
+                        (*it)->Pop(callback);
+                        Probe(**it);
+                        /* 執行緒已經結束 */
+                        if ((*it).use_count() == 2)
+                            orphans = true;
+                    }
+
+                    if (orphans == true)
+                    {
+                        queues.clear();
+                        _Lock.lock();
+                        for (it = _Queues.begin(); it != _Queues.end(); )
+                        {
+                            /* 只剩下本物件持有, 不會再有新的資料 */
+                            if ((*it).use_count() == 1)
+                            {
+                                std::atomic_thread_fence(std::memory_order_acquire);
+                                (*it)->Pop(callback);
+                                Retire(**it);
+                                it = _Queues.erase(it);
+                                continue;
+                            }
+                            ++it;
+                        }
+                        _Lock.unlock();
+                    }
+                }
+
+                template< typename F >
+                void CQueues::Multicast(F& pass, ring::CQueue::SUsage& freed)
+                {
+                    _Lock.lock();
+                        Queues queues = _Queues;
+                    _Lock.unlock();
+
+                    std::vector< ring::CQueue::SCursor > ends;
+                    ends.reserve(queues.size());
+                    Queues::const_iterator it = queues.begin();
+                    for (; it != queues.end(); ++it)
+                        ends.push_back( (*it)->GetEnd() );
+
+                    pass( CReader(queues, ends) );
+
+                    bool orphans = false;
+                    for (size_t i = 0; i < queues.size(); ++i)
+                    {
+                        queues[i]->Advance(ends[i], freed);
+                        Probe(*queues[i]);
+                        if (queues[i].use_count() == 2)
+                            orphans = true;
+                    }
+
+                    /* 執行緒已經結束, 而且資料都讀完了才移除. 沒讀完的下次再處理 */
+                    if (orphans == true)
+                    {
+                        queues.clear();
+                        _Lock.lock();
+                        Queues::iterator it = _Queues.begin();
+                        while (it != _Queues.end())
+                        {
+                            if ((*it).use_count() == 1)
+                            {
+                                std::atomic_thread_fence(std::memory_order_acquire);
+                                if ((*it)->IsEmpty() == true)
+                                {
+                                    Retire(**it);
+                                    it = _Queues.erase(it);
+                                    continue;
+                                }
+                            }
+                            ++it;
+                        }
+                        _Lock.unlock();
+                    }
+                }
+
+                template< typename F >
+                void CQueues::PopWhile(F& callback)
+                {
+                    _Lock.lock();
+                        Queues queues = _Queues;
+                    _Lock.unlock();
+
+                    Queues::iterator it = queues.begin();
+                    for (; it != queues.end(); ++it)
+                    {
+                        bool all = (*it)->PopWhile(callback);
+                        Probe(**it);
+                        if (all == false)
+                            break;
+                    }
+                }
+            };
+
+            namespace budget
+            {
+                /* 佇列的上限. 用量由生產者每 BUDGET_STRIDE 筆計入一次, 消費者取出後扣除 */
+                class CLimit
+                {
+                private :
+                    std::atomic< uint64_t > _LimitBytes;
+                    std::atomic< uint32_t > _LimitEntries;
+                    std::atomic< int >      _Policy;
+                    std::atomic< int >      _PolicyLevel;
+                    std::atomic< int64_t >  _Bytes;
+                    std::atomic< int64_t >  _Entries;
+                    std::atomic< uint64_t > _Dropped;
+                    std::atomic< uint64_t > _Unreported;    /* 還沒輸出提示的丟棄數量 */
+                    std::mutex              _Lock;
+                    std::condition_variable _Space;
+
+                public :
+                    CLimit()
+                        : _Bytes(0)
+                        , _Entries(0)
+                        , _Dropped(0)
+                        , _Unreported(0)
+                    {
+                        Set(SBudget());
+                    }
+
+                    SBudget Get() const
+                    {
+                        SBudget budget;
+                        budget.bytes   = _LimitBytes.load(std::memory_order_relaxed);
+                        budget.entries = _LimitEntries.load(std::memory_order_relaxed);
+                        budget.policy  = (E_BACKPRESSURE)_Policy.load(std::memory_order_relaxed);
+                        budget.level   = (E_LOG_LEVEL)_PolicyLevel.load(std::memory_order_relaxed);
+                        return budget;
+                    }
+
+                    void Set(const SBudget& value)
+                    {
+                        _LimitBytes.store(value.bytes, std::memory_order_relaxed);
+                        _LimitEntries.store(value.entries, std::memory_order_relaxed);
+                        _Policy.store(value.policy, std::memory_order_relaxed);
+                        _PolicyLevel.store(value.level, std::memory_order_relaxed);
+                        /* 放寬上限時叫醒等待中的生產者 */
+                        _Space.notify_all();
+                    }
+
+                    /* bytes, entries 為扣除 freed 之後的用量 */
+                    bool IsOver(int64_t freedBytes, int64_t freedEntries, uint32_t need) const
+                    {
+                        int64_t bytes   = _Bytes.load(std::memory_order_relaxed) - freedBytes;
+                        int64_t entries = _Entries.load(std::memory_order_relaxed) - freedEntries;
+                        /* 佇列是空的時候一定放得下一筆, 避免超過上限的訊息永遠等不到 */
+                        if (entries <= 0)
+                            return false;
+                        uint64_t limit = _LimitBytes.load(std::memory_order_relaxed);
+                        if( (limit != 0) &&
+                            ((uint64_t)bytes + need > limit) )
+                            return true;
+                        uint32_t count = _LimitEntries.load(std::memory_order_relaxed);
+                        return (count != 0) && ((uint64_t)entries >= count);
+                    }
+
+                    bool IsOver(const ring::CQueue::SUsage& usage, uint32_t need) const
+                    {
+                        return IsOver(-(int64_t)usage.bytes, -(int64_t)usage.entries, need);
+                    }
+
+                    void Account(ring::CQueue::SUsage& usage, uint32_t need)
+                    {
+                        usage.bytes += need;
+                        if (++usage.entries >= BUDGET_STRIDE)
+                            Publish(usage);
+                    }
+
+                    void Publish(ring::CQueue::SUsage& usage)
+                    {
+                        Adopt(usage);
+                        usage = ring::CQueue::SUsage();
+                    }
+
+                    /* 計入已結束的執行緒來不及計入的用量 */
+                    void Adopt(const ring::CQueue::SUsage& usage)
+                    {
+                        if (usage.entries > 0)
+                        {
+                            _Bytes.fetch_add((int64_t)usage.bytes, std::memory_order_relaxed);
+                            _Entries.fetch_add((int64_t)usage.entries, std::memory_order_relaxed);
+                        }
+                    }
+
+                    void Free(int64_t bytes, int64_t entries)
+                    {
+                        if (entries > 0)
+                        {
+                            _Bytes.fetch_sub(bytes, std::memory_order_relaxed);
+                            _Entries.fetch_sub(entries, std::memory_order_relaxed);
+                            _Space.notify_all();
+                        }
+                    }
+
+                    void Drop(uint64_t count)
+                    {
+                        _Dropped.fetch_add(count, std::memory_order_relaxed);
+                        _Unreported.fetch_add(count, std::memory_order_relaxed);
+                    }
+
+                    uint64_t GetDropped() const { return _Dropped.load(std::memory_order_relaxed); }
+
+                    uint64_t TakeUnreported()
+                    {
+                        if (_Unreported.load(std::memory_order_relaxed) == 0)
+                            return 0;
+                        return _Unreported.exchange(0, std::memory_order_relaxed);
+                    }
+
+                    /* 超過上限時依設定決定是否放入. 傳回 false 表示丟掉這筆訊息.
+                       lock 為消費者的鎖, 等待時若沒有人在輸出就由呼叫端 drain, 丟最舊的訊息時在鎖內呼叫 discard(need) */
+                    template< typename D, typename R >
+                    bool Admit(ring::CQueue::SUsage& usage, E_LOG_LEVEL level, uint32_t need, std::mutex& lock, D& drain, R& discard)
+                    {
+                        switch (_Policy.load(std::memory_order_relaxed))
+                        {
+                        case EB_DROP_NEWEST:
+                            Drop(1);
+                            return false;
+                        case EB_DROP_LEVEL:
+                            if (level > _PolicyLevel.load(std::memory_order_relaxed))
+                            {
+                                Drop(1);
+                                return false;
+                            }
+                            break;
+                        case EB_DROP_OLDEST:
+                            Publish(usage);
+                            lock.lock();
+                                discard(need);
+                            lock.unlock();
+                            return true;
+                        default:
+                            break;
+                        }
+
+                        Publish(usage);
+                        while (IsOver(usage, need) == true)
+                        {
+                            if (lock.try_lock() == true)
+                            {
+                                drain();
+                                lock.unlock();
+                                continue;
+                            }
+                            std::unique_lock< std::mutex > wait(_Lock);
+                            _Space.wait_for(wait, std::chrono::milliseconds(1));
+                        }
+                        return true;
+                    }
+                };
+            };
+
+            namespace fields
+            {
+                /* CFields 編碼後的一個值, 字串指向原本的內容 */
+                struct SValue
+                {
+                    int                type;    /* E_BINARY_TYPE */
+                    long long          integer;
+                    unsigned long long natural;
+                    double             real;
+                    const char*        text;
+                    uint32_t           length;
+                };
+
+                class CReader
+                {
+                private :
+                    const unsigned char* _Data;
+                    const unsigned char* _End;
+
+                    bool Varint(uint64_t& value)
+                    {
+                        value = 0;
+                        for (int shift = 0; shift < 64; shift += 7)
+                        {
+                            if (_Data >= _End)
+                                return false;
+                            unsigned char byte = *_Data++;
+                            value |= (uint64_t)(byte & 0x7f) << shift;
+                            if ((byte & 0x80) == 0)
+                                return true;
+                        }
+                        return false;
+                    }
+
+                public :
+                    CReader(const char* data, uint32_t size) : _Data((const unsigned char*)data), _End((const unsigned char*)data + size) { }
+
+                    bool IsEnd() const { return _Data >= _End; }
+
+                    bool Read(SValue& value)
+                    {
+                        uint64_t number = 0;
+                        if (_Data >= _End)
+                            return false;
+                        value.type = *_Data++;
+                        switch (value.type)
+                        {
+                        case EBT_SIGNED :
+                            if (Varint(number) == false)
+                                return false;
+                            value.integer = (long long)(number >> 1) ^ -(long long)(number & 1);
+                            return true;
+                        case EBT_UNSIGNED :
+                        case EBT_POINTER :
+                            if (Varint(number) == false)
+                                return false;
+                            value.natural = number;
+                            return true;
+                        case EBT_DOUBLE :
+                            if (_End - _Data < 8)
+                                return false;
+                            for (int i = 0; i < 8; ++i)
+                                number |= (uint64_t)_Data[i] << (i * 8);
+                            memcpy(&value.real, &number, sizeof(number));
+                            _Data += 8;
+                            return true;
+                        case EBT_BOOLEAN :
+                            if (_Data >= _End)
+                                return false;
+                            value.natural = *_Data++;
+                            return true;
+                        case EBT_STRING :
+                            if( (Varint(number) == false) ||
+                                ((uint64_t)(_End - _Data) < number) )
+                                return false;
+                            value.text   = (const char*)_Data;
+                            value.length = (uint32_t)number;
+                            _Data += number;
+                            return true;
+                        }
+                        return false;
+                    }
+                };
+
+                /* 能還原成相同數值的最短表示 */
+                static int DoubleOutput(char* buffer, size_t size, double value)
+                {
+                    return RoundTripOutput_(buffer, size, value);
+                }
+
+                /* 字串中有空白, '=' 或 '"' 時加上引號 */
+                static void QuoteOutput(std::string& output, const char* text, uint32_t length)
+                {
+                    bool quote = (length == 0);
+                    for (uint32_t i = 0; (i < length) && (quote == false); ++i)
+                        quote = ((unsigned char)text[i] <= ' ') || (text[i] == '=') || (text[i] == '"');
+                    if (quote == false)
+                    {
+                        output.append(text, length);
+                        return;
+                    }
+                    output += '"';
+                    for (uint32_t i = 0; i < length; ++i)
+                    {
+                        switch (text[i])
+                        {
+                        case '"'  : output += "\\\""; break;
+                        case '\\' : output += "\\\\"; break;
+                        case '\n' : output += "\\n";  break;
+                        case '\t' : output += "\\t";  break;
+                        default   : output += text[i]; break;
+                        }
+                    }
+                    output += '"';
+                }
+
+                static void ValueOutput(std::string& output, const SValue& value)
+                {
+                    char buffer[32];
+                    switch (value.type)
+                    {
+                    case EBT_SIGNED :
+                        output.append(buffer, snprintf(buffer, sizeof(buffer), "%lld", value.integer));
+                        break;
+                    case EBT_UNSIGNED :
+                        output.append(buffer, snprintf(buffer, sizeof(buffer), "%llu", value.natural));
+                        break;
+                    case EBT_POINTER :
+                        output.append(buffer, snprintf(buffer, sizeof(buffer), "0x%llx", value.natural));
+                        break;
+                    case EBT_DOUBLE :
+                        output.append(buffer, DoubleOutput(buffer, sizeof(buffer), value.real));
+                        break;
+                    case EBT_BOOLEAN :
+                        output += (value.natural != 0) ? "true" : "false";
+                        break;
+                    case EBT_STRING :
+                        QuoteOutput(output, value.text, value.length);
+                        break;
+                    }
+                }
+
+                /* 轉成文字: 訊息 key=value key=value */
+                static void Render(std::string& output, const char* data, uint32_t size)
+                {
+                    CReader reader(data, size);
+                    SValue  value;
+                    if (reader.Read(value) == false)
+                        return;
+                    output.append(value.text, value.length);
+                    SValue key;
+                    while( (reader.Read(key) == true) &&
+                           (reader.Read(value) == true) )
+                    {
+                        output += ' ';
+                        output.append(key.text, key.length);
+                        output += '=';
+                        ValueOutput(output, value);
+                    }
+                }
+            };
+
+            namespace buffer
+            {
+                /* 佇列中只放參考, 訊息內容在共用區塊中 */
+                struct SReference
+                {
+                    arena::SChunk* chunk;
+                    const char*    msg;
+                    uint32_t       size;
+                };
+
+                class COutput : public CBufferOutput
+                {
+                private:
+                    /* 一次輸出的暫存. 依 _Stage 合併到 OUTPUT_BUFFER 或直接交給輸出端 */
+                    class CBatch
+                    {
+                    public :
+                        struct SReport
+                        {
+                            SEntry entry;
+                            char   line[64];
+                        };
+
+                    private :
+                        COutput& _Owner;
+                        bool     _Begin;
+                        uint64_t _Messages;
+                        uint64_t _Bytes;
+                        SReport  _Report;   /* 輸出端可能到 Flush 才真正寫出, 丟棄通知要活到那時候 */
+#if defined(OUTPUT_BUFFER)
+                        char     _Buffer[OUTPUT_BUFFER];
+                        int      _Index;
+#endif
+
+                    public :
+                        CBatch(COutput& owner);
+
+                        SReport& GetReport() { return _Report; }
+
+                        void Write (E_LOG_LEVEL level, const char* msg, uint32_t size);
+                        void Flush ();  /* 請輸出端寫出已經交出去的訊息, 釋放訊息所在的區塊之前呼叫 */
+                        void Finish();
+                    };
+
+                    thread::CQueues _Queues;
+                    E_LOG_LEVEL     _Level;
+                    bool            _Immediately;
+                    bool            _Stage;         /* 是否先合併到 OUTPUT_BUFFER 再輸出 */
+                    bool            _Structured;    /* 訊息是 SEntry, 每一筆分別交給輸出端 */
+                    std::mutex      _LockProcess;
+                    std::mutex      _LockOutput;
+                    budget::CLimit  _Budget;
+
+                    metrics::CHistogram     _Drain;     /* 在 _LockProcess 內寫入 */
+                    int64_t                 _Consuming; /* Consume 花費的時間, 下一次 Process 時一起記錄 */
+                    std::atomic< uint64_t > _Messages;  /* 交給輸出端的訊息數量 */
+                    std::atomic< uint64_t > _Bytes;
+
+                    void Count(uint64_t messages, uint64_t bytes)
+                    {
+                        _Messages.fetch_add(messages, std::memory_order_relaxed);
+                        _Bytes.fetch_add(bytes, std::memory_order_relaxed);
+                    }
+
+                    void Report (CBatch& batch);
+                    void Discard(uint32_t need);
+                    void Drain  ();
+
+                protected:
+                    virtual ~COutput();
+
+                    virtual void OnBegin() { }
+                    virtual void OnEnd  () { }
+                    virtual void Output (const char* msg, uint32_t size) = 0;
+
+                    /* 不合併時每一筆訊息的輸出. 輸出端可以只記下位置, 到 OnFlush 才寫出,
+                       在 OnFlush 之前 msg 都有效. 兩者都在 _LockOutput 內呼叫 */
+                    virtual void Emit   (E_LOG_LEVEL level, const char* msg, uint32_t size) { Output(msg, size); }
+                    virtual void OnFlush() { }
+
+                    virtual uint64_t GetLost() const { return 0; }    /* 寫入失敗而遺失的位元組數 */
+
+                public:
+                    COutput(E_LOG_LEVEL level, bool stage = true, bool structured = false);
+
+                    virtual void        Output        (E_LOG_LEVEL level, const char* msg, uint32_t size) final;
+                    virtual void        Process       () final;
+                    virtual E_LOG_LEVEL GetLevel      () const final            { return _Level;        }
+                    virtual bool        IsImmediately () const final            { return _Immediately;  }
+                    virtual void        SetLevel      (E_LOG_LEVEL value) final { _Level = value;       }
+                    virtual void        SetImmediately(bool value) final        { _Immediately = value; }
+                    virtual SBudget     GetBudget     () const final            { return _Budget.Get(); }
+                    virtual void        SetBudget     (const SBudget& value) final { _Budget.Set(value); }
+                    virtual uint64_t    GetDropped    () const final            { return _Budget.GetDropped(); }
+                    virtual SSinkStats  GetStats      () const final;
+
+                    bool IsStructured() const { return _Structured; }
+
+                    /* 放入共用區塊中的訊息. 傳回 true 表示佇列持有一個參考 */
+                    bool Enqueue(E_LOG_LEVEL level, arena::SChunk* chunk, const char* msg, uint32_t size);
+
+                    /* 輸出 CManager 共用佇列中的訊息, 在這裡才依等級過濾. dropped 為共用佇列丟掉的數量 */
+                    void Consume(const thread::CQueues::CReader& reader, uint64_t dropped);
+
+                    /* 一筆訊息計入上限的大小 */
+                    static uint32_t Cost(uint32_t size) { return ring::CQueue::Footprint(sizeof(SReference)) + size; }
+                };
+
+                COutput::CBatch::CBatch(COutput& owner)
+                    : _Owner(owner)
+                    , _Begin(false)
+                    , _Messages(0)
+                    , _Bytes(0)
+#if defined(OUTPUT_BUFFER)
+                    , _Index(0)
+#endif
+                {
+                }
+
+                void COutput::CBatch::Write(E_LOG_LEVEL level, const char* msg, uint32_t size)
+                {
+                    if (_Begin == false)
+                    {
+                        _Begin = true;
+                        _Owner.OnBegin();
+                    }
+                    ++_Messages;
+                    _Bytes += size;
+#if defined(OUTPUT_BUFFER)
+                    if (_Owner._Stage == false)
+                    {
+                        /* 由輸出端直接從佇列複製, 不經過暫存區. 整批只鎖定一次 */
+                        if (_Index == 0)
+                        {
+                            _Owner._LockOutput.lock();
+                            _Index = -1;
+                        }
+                        _Owner.Emit(level, msg, size);
+                        return;
+                    }
+                    if (_Index > 0)
+                    {
+                        if ((_Index + size) >= sizeof(_Buffer))
+                        {
+                            _Buffer[_Index] = 0;
+                            _Owner._LockOutput.lock();
+                                _Owner.Output(_Buffer, _Index);
+                            _Owner._LockOutput.unlock();
+                            _Index = 0;
+                        }
+                    }
+
+                    if (size >= sizeof(_Buffer))
+                    {
+                        _Owner._LockOutput.lock();
+                            _Owner.Output(msg, size);
+                        _Owner._LockOutput.unlock();
+                    }
+                    else
+                    {
+                        memcpy(&_Buffer[_Index], msg, size);
+                        _Index += size;
+                    }
+#else
+                    _Owner._LockOutput.lock();
+                        _Owner.Emit(level, msg, size);
+                        _Owner.OnFlush();
+                    _Owner._LockOutput.unlock();
+#endif
+                }
+
+                void COutput::CBatch::Flush()
+                {
+#if defined(OUTPUT_BUFFER)
+                    if (_Index < 0)
+                        _Owner.OnFlush();
+#endif
+                }
+
+                void COutput::CBatch::Finish()
+                {
+                    if (_Messages > 0)
+                        _Owner.Count(_Messages, _Bytes);
+                    _Messages = 0;
+                    _Bytes    = 0;
+#if defined(OUTPUT_BUFFER)
+                    if (_Index < 0)
+                    {
+                        _Owner.OnFlush();
+                        _Owner._LockOutput.unlock();
+                    }
+                    if (_Index > 0)
+                    {
+                        _Buffer[_Index] = 0;
+                        _Owner._LockOutput.lock();
+                            _Owner.Output(_Buffer, _Index);
+                        _Owner._LockOutput.unlock();
+                    }
+                    _Index = 0;
+#endif
+                }
+
+                COutput::~COutput()
+                {
+                    /* 釋放還沒輸出的訊息的參考 */
+                    arena::CReleaser releaser;
+                    auto callback = [&](const ring::CQueue::SRecord& record)
+                    {
+                        releaser.Add( ((const SReference*)record.buffer)->chunk );
+                    };
+                    _Queues.Pop(callback);
+                }
+
+                COutput::COutput(E_LOG_LEVEL level, bool stage, bool structured)
+                    : _Consuming(0)
+                    , _Messages(0)
+                    , _Bytes(0)
+                {
+                    _Level       = level;
+                    _Immediately = false;
+                    _Stage       = (structured == false) && (stage == true);
+                    _Structured  = structured;
+                }
+
+                /* 從最舊的訊息開始丟, 直到放得下 need. 必須在 _LockProcess 內呼叫 */
+                void COutput::Discard(uint32_t need)
+                {
+                    int64_t           bytes   = 0;
+                    int64_t           entries = 0;
+                    arena::CReleaser  releaser;
+                    auto callback = [&](const ring::CQueue::SRecord& record) -> bool
+                    {
+                        if (_Budget.IsOver(bytes, entries, need) == false)
+                            return false;
+                        const SReference* reference = (const SReference*)record.buffer;
+                        bytes += Cost(reference->size);
+                        ++entries;
+                        releaser.Add(reference->chunk);
+                        return true;
+                    };
+                    _Queues.PopWhile(callback);
+                    releaser.Flush();
+                    _Budget.Free(bytes, entries);
+                    if (entries > 0)
+                        _Budget.Drop((uint64_t)entries);
+                }
+
+                void COutput::Output(E_LOG_LEVEL level, const char* msg, uint32_t size)
+                {
+                    assert(msg != nullptr);
+                    assert(size > 0);
+                    if (_Level >= level)
+                    {
+                        if (_Structured == true)
+                        {
+                            /* 直接送來的文字沒有時間與執行緒, 在這裡補上 */
+                            thread::SContext& context = thread::GetContext();
+                            uint32_t          total   = sizeof(SEntry) + size;
+                            char*             data    = context.arena.Reserve(total + 1);
+                            if (data == nullptr)
+                                return;
+                            SEntry entry = { timestamp::Now(), context.id, nullptr, nullptr, nullptr, EE_TEXT, (uint32_t)level };
+                            memcpy(data, &entry, sizeof(SEntry));
+                            memcpy(data + sizeof(SEntry), msg, size);
+                            data[total] = 0;
+                            if (Enqueue(level, context.arena.GetChunk(), data, total) == true)
+                                context.arena.Commit(total + 1, 1);
+                        }
+                        else
+                        if (_Immediately == false)
+                        {
+                            /* 不是經由 CManager 送來的訊息, 先放進這個執行緒的共用區塊 */
+                            arena::CArena& arena = thread::GetContext().arena;
+                            char*          data  = arena.Reserve(size + 1);
+                            if (data == nullptr)
+                                return;
+                            memcpy(data, msg, size);
+                            data[size] = 0;
+                            if (Enqueue(level, arena.GetChunk(), data, size) == true)
+                                arena.Commit(size + 1, 1);
+                        }
+                        else
+                        {
+                            _LockOutput.lock();
+                                Emit(level, msg, size);
+                                OnFlush();
+                            _LockOutput.unlock();
+                            Count(1, size);
+                        }
+                    }
+                }
+
+                bool COutput::Enqueue(E_LOG_LEVEL level, arena::SChunk* chunk, const char* msg, uint32_t size)
+                {
+                    if (_Level < level)
+                        return false;
+                    if (_Immediately == true)
+                    {
+                        _LockOutput.lock();
+                            Emit(level, msg, size);
+                            OnFlush();
+                        _LockOutput.unlock();
+                        Count(1, size);
+                        return false;
+                    }
+
+                    ring::CQueue*         queue = _Queues.Get();
+                    ring::CQueue::SUsage& usage = queue->GetUsage();
+                    uint32_t              need  = Cost(size);
+                    if (_Budget.IsOver(usage, need) == true)
+                    {
+                        auto drain   = [this]()              { Drain();       };
+                        auto discard = [this](uint32_t need) { Discard(need); };
+                        if (_Budget.Admit(usage, level, need, _LockProcess, drain, discard) == false)
+                            return false;
+                    }
+                    SReference* reference = (SReference*)queue->Reserve(level, sizeof(SReference));
+                    if (reference == nullptr)
+                        return false;
+                    reference->chunk = chunk;
+                    reference->msg   = msg;
+                    reference->size  = size;
+                    queue->Commit();
+                    _Budget.Account(usage, need);
+                    return true;
+                }
+
+                void COutput::Report(CBatch& batch)
+                {
+                    uint64_t dropped = _Budget.TakeUnreported();
+                    if (dropped > 0)
+                    {
+                        CBatch::SReport& report = batch.GetReport();
+                        int size = snprintf(report.line, sizeof(report.line), "%llu messages dropped\n", (unsigned long long)dropped);
+                        if (_Structured == true)
+                        {
+                            report.entry.time   = timestamp::Now();
+                            report.entry.thread = thread::GetContext().id;
+                            report.entry.format = nullptr;
+                            report.entry.render = nullptr;
+                            report.entry.encode = nullptr;
+                            report.entry.kind   = EE_TEXT;
+                            report.entry.level  = ELL_WARNING;
+                            batch.Write(ELL_WARNING, (const char*)&report, (uint32_t)(sizeof(SEntry) + size));
+                        }
+                        else
+                        {
+                            batch.Write(ELL_WARNING, report.line, (uint32_t)size);
+                        }
+                    }
+                }
+
+                void COutput::Consume(const thread::CQueues::CReader& reader, uint64_t dropped)
+                {
+                    /* Immediately 模式已經在 CManager::Printf 時直接輸出 */
+                    if (_Immediately == true)
+                        return;
+                    _LockProcess.lock();
+                    int64_t begin = metrics::Now();
+                    if (dropped > 0)
+                        _Budget.Drop(dropped);
+                    CBatch batch(*this);
+                    Report(batch);
+                    auto callback = [&](const ring::CQueue::SRecord& record)
+                    {
+                        if (_Level >= (E_LOG_LEVEL)record.level)
+                            batch.Write((E_LOG_LEVEL)record.level, record.buffer, record.size);
+                    };
+                    reader.Read(callback);
+                    batch.Finish();
+                    _Consuming += metrics::Now() - begin;
+                    _LockProcess.unlock();
+                }
+
+                void COutput::Process()
+                {
+                    _LockProcess.lock();
+                        int64_t begin = metrics::Now();
+                        Drain();
+                        _Drain.Record(metrics::Now() - begin + _Consuming);
+                        _Consuming = 0;
+                    _LockProcess.unlock();
+                }
+
+                SSinkStats COutput::GetStats() const
+                {
+                    SSinkStats stats;
+                    _Queues.Measure(stats.queue);
+                    stats.queue.dropped = _Budget.GetDropped();
+                    stats.messages      = _Messages.load(std::memory_order_relaxed);
+                    stats.bytes         = _Bytes.load(std::memory_order_relaxed);
+                    stats.lost          = GetLost();
+                    _Drain.Merge(stats.drain);
+                    return stats;
+                }
+
+                /* 必須在 _LockProcess 內呼叫 */
+                void COutput::Drain()
+                {
+                    CBatch           batch(*this);
+                    int64_t          bytes   = 0;
+                    int64_t          entries = 0;
+                    arena::CReleaser releaser;
+                    Report(batch);
+                    auto callback = [&](const ring::CQueue::SRecord& record)
+                    {
+                        const SReference& reference = *(const SReference*)record.buffer;
+                        bytes += Cost(reference.size);
+                        ++entries;
+                        if( (releaser.GetChunk() != nullptr) &&
+                            (releaser.GetChunk() != reference.chunk) )
+                        {
+                            /* 前一塊要釋放了, 還沒寫出的訊息可能還指向它 */
+                            batch.Flush();
+                        }
+                        batch.Write((E_LOG_LEVEL)record.level, reference.msg, reference.size);
+                        releaser.Add(reference.chunk);
+                    };
+                    _Queues.Pop(callback);
+                    batch.Finish();
+                    releaser.Flush();
+                    _Budget.Adopt(_Queues.TakeOrphans());
+                    _Budget.Free(bytes, entries);
+                    /* 沒有新訊息時也呼叫 OnEnd, 讓輸出端有機會送出還留著的資料.
+                       OnEnd 會動到輸出端的狀態, 要跟 Immediately 模式的輸出互斥 */
+                    _LockOutput.lock();
+                        OnEnd();
+                    _LockOutput.unlock();
+                }
+            };
+
+            namespace console
+            {
+#if defined(_MSC_VER)
+                struct iovec
+                {
+                    void*  iov_base;
+                    size_t iov_len;
+                };
+#endif
+
+                /* 依等級的 ANSI 顏色, nullptr 表示不加 */
+                static const char* const COLORS[ELL_COUNT] =
+                {
+                    "\033[1;31m",   /* ELL_EMERGENCY */
+                    "\033[1;31m",   /* ELL_ALERT */
+                    "\033[1;31m",   /* ELL_CRITICAL */
+                    "\033[31m",     /* ELL_ERROR */
+                    "\033[33m",     /* ELL_WARNING */
+                    "\033[36m",     /* ELL_NOTICE */
+                    nullptr,        /* ELL_INFO */
+                    "\033[2m",      /* ELL_DEBUG */
+                };
+                static const char RESET[] = "\033[0m";
+
+                static bool IsTerminal(int handle)
+                {
+#if defined(_MSC_VER)
+                    return _isatty(handle) != 0;
+#else
+                    return isatty(handle) != 0;
+#endif
+                }
+
+                /* 整批訊息收集成 iovec 後以一次 writev 寫出. 短訊息與顏色接在暫存區中,
+                   長訊息直接引用佇列中的內容. 不經過 stdio, 沒有 FILE 的鎖定, 也不受 stderr 沒有緩衝影響 */
+                class COutput : public buffer::COutput
+                {
+                private :
+                    int          _Handle;
+                    bool         _Color;
+                    uint32_t     _Limit;    /* 累積的位元組數達到此值就寫出 */
+                    struct iovec _Pieces[CONSOLE_IOVECS];
+                    int          _Count;
+                    uint32_t     _Bytes;
+                    char         _Buffer[CONSOLE_PIPE_BYTES];
+                    uint32_t     _Used;
+
+                    void Add  (const char* msg, uint32_t size);
+                    void Flush();
+
+                protected :
+                    virtual void Output (const char* msg, uint32_t size) final;
+                    virtual void Emit   (E_LOG_LEVEL level, const char* msg, uint32_t size) final;
+                    virtual void OnFlush() final { Flush(); }
+
+                public :
+                    COutput(E_LOG_LEVEL level, const SConsoleOptions& options);
+                };
+
+                COutput::COutput(E_LOG_LEVEL level, const SConsoleOptions& options)
+                    : buffer::COutput(level, false)
+                    , _Handle(options.handle)
+                    , _Count(0)
+                    , _Bytes(0)
+                    , _Used(0)
+                {
+                    bool terminal = IsTerminal(_Handle);
+                    if (options.color == ECC_AUTO)
+                    {
+                        const char* term = getenv("TERM");
+                        _Color = (terminal == true) &&
+                                 (getenv("NO_COLOR") == nullptr) &&
+                                 ( (term == nullptr) || (strcmp(term, "dumb") != 0) );
+                    }
+                    else
+                    {
+                        _Color = (options.color == ECC_ALWAYS);
+                    }
+                    if (options.batch > 0)
+                        _Limit = options.batch;
+                    else
+                        _Limit = (terminal == true) ? CONSOLE_TTY_BYTES : CONSOLE_PIPE_BYTES;
+                }
+
+                void COutput::Add(const char* msg, uint32_t size)
+                {
+                    if( (_Count == CONSOLE_IOVECS) ||
+                        ( (size < CONSOLE_COPY) && (_Used + size > sizeof(_Buffer)) ) )
+                        Flush();
+                    _Bytes += size;
+                    if (size < CONSOLE_COPY)
+                    {
+                        char* tail = &_Buffer[_Used];
+                        memcpy(tail, msg, size);
+                        _Used += size;
+                        /* 接在前一個片段後面時合併 */
+                        if( (_Count > 0) &&
+                            ((char*)_Pieces[_Count - 1].iov_base + _Pieces[_Count - 1].iov_len == tail) )
+                        {
+                            _Pieces[_Count - 1].iov_len += size;
+                            return;
+                        }
+                        msg = tail;
+                    }
+                    _Pieces[_Count].iov_base = (void*)msg;
+                    _Pieces[_Count].iov_len  = size;
+                    ++_Count;
+                }
+
+                void COutput::Flush()
+                {
+                    struct iovec* piece = _Pieces;
+                    int           count = _Count;
+                    while (count > 0)
+                    {
+#if defined(_MSC_VER)
+                        int64_t written = _write(_Handle, piece->iov_base, (unsigned int)piece->iov_len);
+#else
+                        int64_t written = writev(_Handle, piece, count);
+#endif
+                        if (written < 0)
+                        {
+#if !defined(_MSC_VER)
+                            if (errno == EINTR)
+                                continue;
+                            if( (errno == EAGAIN) ||
+                                (errno == EWOULDBLOCK) )
+                            {
+                                /* 非阻塞的管線滿了, 等讀取端消化 */
+                                struct pollfd wait;
+                                wait.fd      = _Handle;
+                                wait.events  = POLLOUT;
+                                wait.revents = 0;
+                                if( (poll(&wait, 1, -1) >= 0) ||
+                                    (errno == EINTR) )
+                                    continue;
+                            }
+#endif
+                            /* 輸出已經關閉或發生錯誤, 丟掉這一批 */
+                            break;
+                        }
+                        /* 只寫出一部分時從沒寫完的地方繼續 */
+                        while( (count > 0) &&
+                               ((uint64_t)written >= piece->iov_len) )
+                        {
+                            written -= piece->iov_len;
+                            ++piece;
+                            --count;
+                        }
+                        if (count > 0)
+                        {
+                            piece->iov_base = (char*)piece->iov_base + written;
+                            piece->iov_len -= (size_t)written;
+                        }
+                    }
+                    _Count = 0;
+                    _Bytes = 0;
+                    _Used  = 0;
+                }
+
+                void COutput::Output(const char* msg, uint32_t size)
+                {
+                    Add(msg, size);
+                    Flush();
+                }
+
+                void COutput::Emit(E_LOG_LEVEL level, const char* msg, uint32_t size)
+                {
+                    const char* color = ( (_Color == true) && (level < ELL_COUNT) ) ? COLORS[level] : nullptr;
+                    if (color != nullptr)
+                    {
+                        Add(color, (uint32_t)strlen(color));
+                        Add(msg, size);
+                        Add(RESET, sizeof(RESET) - 1);
+                    }
+                    else
+                    {
+                        Add(msg, size);
+                    }
+                    if (_Bytes >= _Limit)
+                        Flush();
+                }
+            }
+
+            namespace debuger
+            {
+                class COutput : public buffer::COutput
+                {
+                protected:
+                    virtual void Output(const char* msg, uint32_t size) final;
+
+                public:
+                    COutput(E_LOG_LEVEL level) :
+                        buffer::COutput(level)
+                    {
+                    }
+                };
+
+                void COutput::Output(const char* msg, uint32_t size)
+                {
+#if defined(_MSC_VER)
+                    if (IsDebuggerPresent() == TRUE)
+                        OutputDebugString(msg);
+#endif
+                }
+            };
+
+            namespace null
+            {
+                class COutput : public buffer::COutput
+                {
+                protected:
+                    virtual void Output(const char* msg, uint32_t size) final { }
+
+                public:
+                    COutput(E_LOG_LEVEL level) :
+                        buffer::COutput(level)
+                    {
+                    }
+                };
+            };
+
+            namespace file
+            {
+                static bool MkDir(const char* directory)
+                {
+                    if( (directory != nullptr) &&
+                        (*directory != 0) )
+                    {
+    #if defined(_MSC_VER)
+                        return ( ::CreateDirectory(directory, nullptr) == TRUE );
+    #else
+                        return (mkdir(directory, 0777) == 0);
+    #endif
+                    }
+                    return false;
+                };
+
+                static bool IsDirectoryExists(const char* directory)
+                {
+                    if( (directory != nullptr) &&
+                        (*directory != 0) )
+                    {
+    #if defined(_MSC_VER)
+                        DWORD Code = ::GetFileAttributesA(directory);
+                        if( (Code != INVALID_FILE_ATTRIBUTES) &&
+                            ((Code & FILE_ATTRIBUTE_DIRECTORY) != 0) )
+                            return true;
+    #else
+                        struct stat st;
+                        if( stat( (const char *)directory, &st ) != -1 )
+                            return (S_ISDIR(st.st_mode) != 0);
+    #endif
+                    }
+                    return	false;
+                }
+
+                static bool Rename(const char* oldfilename,
+                                   const char* newfilename)
+                {
+                    if ((oldfilename != NULL) &&
+                        (newfilename != NULL) &&
+                        (*oldfilename != 0) &&
+                        (*newfilename != 0))
+#if defined(_MSC_VER)
+                        return (::MoveFile(oldfilename, newfilename) == TRUE);
+#else
+                        return (rename(oldfilename, newfilename) == 0);
+#endif
+                    return false;
+                }
+
+                static bool MkDir(const char* directory, bool createParent)
+		        {
+			        if( (directory == nullptr) ||
+				        (*directory == 0) )
+				        return false;
+			        if( IsDirectoryExists(directory) == true )
+				        return true;
+
+			        if(createParent == true)
+			        {
+				        /* 建立子目錄 */
 				        const char*	p1 = strrchr(directory, '/' );
 				        const char*	p2 = strrchr(directory, '\\' );
 				        if( (p1 != nullptr) ||
@@ -296,344 +2512,3696 @@ namespace kkboylin
 					        if( p2 > p )
 						        p = p2;
 
-					        size_t len = (intptr_t)(p - directory);
-					        if(len > 0)
-					        {
-						        std::string	dir( directory, len );
-						        if( (dir != ".") &&
-							        (dir != "..") )
-						        {
-							        if(MkDir(dir.c_str(), true ) == false )
-								        return false;
-						        }
-					        }
-				        }
-			        }
-			        return MkDir(directory);
-		        }
+					        size_t len = (intptr_t)(p - directory);
+					        if(len > 0)
+					        {
+						        std::string	dir( directory, len );
+						        if( (dir != ".") &&
+							        (dir != "..") )
+						        {
+							        if(MkDir(dir.c_str(), true ) == false )
+								        return false;
+						        }
+					        }
+				        }
+			        }
+			        return MkDir(directory);
+		        }
+
+                /* 實際寫入檔案的裝置, 由 COutput 負責開檔/換檔 */
+                /* 換檔後舊裝置可能還在寫入, 由輸出端與所有裝置共用 */
+                typedef std::shared_ptr< std::atomic< uint64_t > > Counter;
+
+                class CDevice
+                {
+                public :
+                    virtual ~CDevice() { }
+
+                    virtual bool     Open   (const char* filename) = 0;
+                    virtual void     Close  () = 0;
+                    virtual void     Write  (const char* msg, uint32_t size) = 0;
+                    virtual void     Flush  () { }
+                    virtual uint64_t GetSize() const = 0;                   /* 目前檔案的大小 */
+                    virtual bool     IsStage() const { return true; }   /* 是否需要先合併到暫存區再寫入 */
+                    virtual void     SetLost(const Counter& lost) { }    /* 背景寫入失敗時累計遺失的位元組數 */
+                };
+
+                typedef std::unique_ptr< CDevice > Device;
+
+                /* 一般檔案輸出 */
+                class CStreamDevice : public CDevice
+                {
+                private :
+#if defined(USE_FILE_OUT)
+                    FILE*       _File;
+#else
+                    int         _File;
+#endif
+                    uint64_t    _Size;
+
+                public :
+                    CStreamDevice() :
+#if defined(USE_FILE_OUT)
+                        _File(nullptr),
+#else
+                        _File(-1),
+#endif
+                        _Size(0)
+                    {
+                    }
+
+                    virtual ~CStreamDevice() { Close(); }
+
+                    virtual bool     Open   (const char* filename);
+                    virtual void     Close  ();
+                    virtual void     Write  (const char* msg, uint32_t size);
+                    virtual void     Flush  ();
+                    virtual uint64_t GetSize() const { return _Size; }
+                };
+
+                bool CStreamDevice::Open(const char* filename)
+                {
+                    struct stat st;
+                    _Size = (stat(filename, &st) == 0) ? (uint64_t)st.st_size : 0;
+#if defined(USE_FILE_OUT)
+                    _File = fopen(filename, "a+b");
+                    return (_File != nullptr);
+#else
+    #if defined(O_BINARY)
+                    _File = open(filename, O_CREAT | O_RDWR | O_APPEND | O_BINARY, 0644);
+    #else
+                    _File = open(filename, O_CREAT | O_RDWR | O_APPEND, 0644);
+    #endif
+                    return (_File != -1);
+#endif
+                }
+
+                void CStreamDevice::Close()
+                {
+#if defined(USE_FILE_OUT)
+                    if (_File != nullptr)
+                    {
+                        fclose(_File);
+                        _File = nullptr;
+                    }
+#else
+                    if (_File != -1)
+                    {
+                        close(_File);
+                        _File = -1;
+                    }
+#endif
+                }
+
+                void CStreamDevice::Write(const char* msg, uint32_t size)
+                {
+#if defined(USE_FILE_OUT)
+                    fwrite(msg, 1, size, _File);
+#else
+                    write(_File, msg, size);
+#endif
+                    _Size += size;
+                }
+
+                void CStreamDevice::Flush()
+                {
+#if defined(USE_FILE_OUT)
+                    fflush(_File);
+#endif
+                }
+
+                /* 以位置讀寫檔案, 不依賴檔案指標. 供映射及非同步輸出使用 */
+#if defined(_MSC_VER)
+                typedef HANDLE Handle;
+                static const Handle INVALID_FILE = INVALID_HANDLE_VALUE;
+#else
+                typedef int    Handle;
+                static const Handle INVALID_FILE = -1;
+#endif
+
+                static Handle OpenFile(const char* filename)
+                {
+#if defined(_MSC_VER)
+                    return CreateFileA(filename,
+                                       GENERIC_READ | GENERIC_WRITE,
+                                       FILE_SHARE_READ,
+                                       nullptr,
+                                       OPEN_ALWAYS,
+                                       FILE_ATTRIBUTE_NORMAL,
+                                       nullptr);
+#else
+                    return open(filename, O_CREAT | O_RDWR, 0644);
+#endif
+                }
+
+                static void CloseFile(Handle file, uint64_t size)
+                {
+#if defined(_MSC_VER)
+                    LARGE_INTEGER position;
+                    position.QuadPart = (LONGLONG)size;
+                    if (SetFilePointerEx(file, position, nullptr, FILE_BEGIN) == TRUE)
+                        SetEndOfFile(file);
+                    CloseHandle(file);
+#else
+                    int result = ftruncate(file, (off_t)size);
+                    (void)result;
+                    close(file);
+#endif
+                }
+
+                static uint64_t FileSize(Handle file)
+                {
+#if defined(_MSC_VER)
+                    LARGE_INTEGER length;
+                    if (GetFileSizeEx(file, &length) == TRUE)
+                        return (uint64_t)length.QuadPart;
+#else
+                    struct stat st;
+                    if (fstat(file, &st) == 0)
+                        return (uint64_t)st.st_size;
+#endif
+                    return 0;
+                }
+
+                static int64_t ReadAt(Handle file, char* buffer, uint32_t size, uint64_t position)
+                {
+#if defined(_MSC_VER)
+                    OVERLAPPED overlapped;
+                    DWORD      length = 0;
+                    memset(&overlapped, 0, sizeof(overlapped));
+                    overlapped.Offset     = (DWORD)position;
+                    overlapped.OffsetHigh = (DWORD)(position >> 32);
+                    if (ReadFile(file, buffer, size, &length, &overlapped) == FALSE)
+                        return -1;
+                    return length;
+#else
+                    return pread(file, buffer, size, (off_t)position);
+#endif
+                }
+
+                static int64_t WriteAt(Handle file, const char* msg, uint32_t size, uint64_t position)
+                {
+#if defined(_MSC_VER)
+                    OVERLAPPED overlapped;
+                    DWORD      length = 0;
+                    memset(&overlapped, 0, sizeof(overlapped));
+                    overlapped.Offset     = (DWORD)position;
+                    overlapped.OffsetHigh = (DWORD)(position >> 32);
+                    if (WriteFile(file, msg, size, &length, &overlapped) == FALSE)
+                        return -1;
+                    return length;
+#else
+                    return pwrite(file, msg, size, (off_t)position);
+#endif
+                }
+
+                /* 上次沒有正常關檔時, 檔尾會留下預先配置的空白區段. 最多往回找 limit 個位元組 */
+                static uint64_t Trim(Handle file, uint64_t size, uint64_t limit)
+                {
+                    char     buffer[1024 * 4];
+                    uint64_t begin = (size > limit) ? (size - limit) : 0;
+                    while (size > begin)
+                    {
+                        uint64_t position = (size - begin > sizeof(buffer)) ? (size - sizeof(buffer)) : begin;
+                        int64_t  length   = ReadAt(file, buffer, (uint32_t)(size - position), position);
+                        if (length <= 0)
+                            break;
+                        for (int64_t i = length; i > 0; --i)
+                        {
+                            if (buffer[i - 1] != 0)
+                                return position + i;
+                        }
+                        size = position;
+                    }
+                    return size;
+                }
+
+                /*
+                 * 記憶體映射輸出. 預先配置一段固定大小的區段並映射到記憶體,
+                 * 寫入時直接複製到映射區, 區段寫滿才換下一段. 關檔時截掉未使用的部分.
+                 */
+                class CMappedDevice : public CDevice
+                {
+                private :
+                    Handle                  _File;
+#if defined(_MSC_VER)
+                    HANDLE                  _Mapping;
+#endif
+                    char*                   _Base;      /* 目前映射區段的起始位址 */
+                    uint64_t                _Offset;    /* 目前映射區段在檔案中的位置 */
+                    uint64_t                _Length;    /* 目前映射區段的大小 */
+                    uint64_t                _Segment;
+                    uint64_t                _Granularity;
+                    std::atomic< uint64_t > _Tail;      /* 檔案實際寫入的長度 */
+
+                    bool Map   (uint64_t position);
+                    void Unmap ();
+                    void Direct(const char* msg, uint32_t size);
+
+                public :
+                    CMappedDevice(uint64_t segment);
+                    virtual ~CMappedDevice() { Close(); }
+
+                    virtual bool     Open   (const char* filename);
+                    virtual void     Close  ();
+                    virtual void     Write  (const char* msg, uint32_t size);
+                    virtual uint64_t GetSize() const { return _Tail.load(std::memory_order_acquire); }
+                    virtual bool     IsStage() const { return false; }
+                };
+
+                CMappedDevice::CMappedDevice(uint64_t segment) :
+                    _File(INVALID_FILE),
+#if defined(_MSC_VER)
+                    _Mapping(nullptr),
+#endif
+                    _Base(nullptr),
+                    _Offset(0),
+                    _Length(0),
+                    _Tail(0)
+                {
+#if defined(_MSC_VER)
+                    SYSTEM_INFO info;
+                    GetSystemInfo(&info);
+                    _Granularity = info.dwAllocationGranularity;
+#else
+                    _Granularity = (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+                    /* 區段大小必須是映射單位的整數倍 */
+                    _Segment = ((segment + _Granularity - 1) / _Granularity) * _Granularity;
+                    if (_Segment == 0)
+                        _Segment = _Granularity;
+                }
+
+                bool CMappedDevice::Open(const char* filename)
+                {
+                    _File = OpenFile(filename);
+                    if (_File == INVALID_FILE)
+                        return false;
+                    _Tail.store(Trim(_File, FileSize(_File), _Segment), std::memory_order_release);
+                    Map(_Tail.load(std::memory_order_relaxed));
+                    return true;
+                }
+
+                bool CMappedDevice::Map(uint64_t position)
+                {
+                    uint64_t offset = position - (position % _Granularity);
+                    uint64_t length = _Segment;
+#if defined(_MSC_VER)
+                    /* CreateFileMapping 會自動把檔案延長到指定大小 */
+                    uint64_t end    = offset + length;
+                    _Mapping = CreateFileMappingA(_File, nullptr, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, nullptr);
+                    if (_Mapping == nullptr)
+                        return false;
+                    _Base = (char*)MapViewOfFile(_Mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, (SIZE_T)length);
+                    if (_Base == nullptr)
+                    {
+                        CloseHandle(_Mapping);
+                        _Mapping = nullptr;
+                        return false;
+                    }
+#else
+                    /* 先確實配置好磁碟空間, 避免寫入映射區時因磁碟已滿而收到 SIGBUS */
+                    if (posix_fallocate(_File, (off_t)offset, (off_t)length) != 0)
+                        return false;
+                    void* base = mmap(nullptr, (size_t)length, PROT_READ | PROT_WRITE, MAP_SHARED, _File, (off_t)offset);
+                    if (base == MAP_FAILED)
+                        return false;
+                    _Base = (char*)base;
+#endif
+                    _Offset = offset;
+                    _Length = length;
+                    return true;
+                }
+
+                void CMappedDevice::Unmap()
+                {
+                    if (_Base != nullptr)
+                    {
+#if defined(_MSC_VER)
+                        UnmapViewOfFile(_Base);
+                        CloseHandle(_Mapping);
+                        _Mapping = nullptr;
+#else
+                        munmap(_Base, (size_t)_Length);
+#endif
+                        _Base   = nullptr;
+                        _Offset = 0;
+                        _Length = 0;
+                    }
+                }
+
+                void CMappedDevice::Close()
+                {
+                    Unmap();
+                    if (_File != INVALID_FILE)
+                    {
+                        CloseFile(_File, _Tail.load(std::memory_order_relaxed));
+                        _File = INVALID_FILE;
+                    }
+                    _Tail.store(0, std::memory_order_release);
+                }
+
+                /* 無法映射時 (例如磁碟已滿) 直接寫到檔尾 */
+                void CMappedDevice::Direct(const char* msg, uint32_t size)
+                {
+                    uint64_t tail   = _Tail.load(std::memory_order_relaxed);
+                    int64_t  length = WriteAt(_File, msg, size, tail);
+                    if (length > 0)
+                        _Tail.store(tail + length, std::memory_order_release);
+                }
+
+                void CMappedDevice::Write(const char* msg, uint32_t size)
+                {
+                    while (size > 0)
+                    {
+                        uint64_t tail = _Tail.load(std::memory_order_relaxed);
+                        if( (_Base == nullptr) ||
+                            (tail >= _Offset + _Length) )
+                        {
+                            Unmap();
+                            if (Map(tail) == false)
+                            {
+                                Direct(msg, size);
+                                return;
+                            }
+                        }
+                        uint64_t available = _Offset + _Length - tail;
+                        uint32_t count     = (size < available) ? size : (uint32_t)available;
+                        memcpy(_Base + (tail - _Offset), msg, count);
+                        _Tail.store(tail + count, std::memory_order_release);
+                        msg  += count;
+                        size -= count;
+                    }
+                }
+
+                /* 非同步輸出的寫入區塊. 寫入完成前不能再使用 */
+                struct SBlock
+                {
+                    char*               data;
+                    uint32_t            size;       /* 已填入的資料量 */
+                    uint32_t            done;       /* 已寫入檔案的資料量 */
+                    uint32_t            index;
+                    uint64_t            offset;     /* 寫入檔案的位置 */
+                    Handle              file;
+                    std::atomic< bool > busy;
+#if defined(USE_IO_URING)
+                    struct iovec        vector;
+#endif
+                };
+
+                /* 送出寫入並回收完成的區塊 */
+                class CEngine
+                {
+                protected :
+                    Counter _Lost;
+
+                    /* 區塊寫完或寫入失敗時呼叫. 失敗時以同步寫入再試一次, 仍然失敗就計入遺失, 不會默默丟掉 */
+                    void Finish(SBlock& block)
+                    {
+                        while (block.done < block.size)
+                        {
+                            int64_t length = WriteAt(block.file, block.data + block.done, block.size - block.done, block.offset + block.done);
+                            if (length <= 0)
+                                break;
+                            block.done += (uint32_t)length;
+                        }
+                        if (block.done < block.size)
+                            _Lost->fetch_add(block.size - block.done, std::memory_order_relaxed);
+                        block.busy.store(false, std::memory_order_release);
+                    }
+
+                public :
+                    CEngine() : _Lost(std::make_shared< std::atomic< uint64_t > >(0)) { }
+                    virtual ~CEngine() { }
+
+                    void SetLost(const Counter& lost) { _Lost = lost; }    /* 送出第一個區塊之前呼叫 */
+
+                    virtual void Submit(SBlock& block) = 0;
+                    virtual void Reap  (bool wait) = 0;     /* wait 為 true 時至少等到一個區塊完成 */
+                };
+
+                typedef std::unique_ptr< CEngine > Engine;
+
+#if defined(USE_IO_URING)
+                /* 直接以系統呼叫操作 io_uring, 不需要 liburing */
+                class CUringEngine : public CEngine
+                {
+                private :
+                    int             _Ring;
+                    SBlock*         _Blocks;
+                    bool            _Fixed;     /* 是否已註冊寫入區塊 */
+                    void*           _SqMap;
+                    size_t          _SqSize;
+                    void*           _CqMap;
+                    size_t          _CqSize;
+                    io_uring_sqe*   _Sqes;
+                    size_t          _SqesSize;
+                    unsigned*       _SqTail;
+                    unsigned*       _SqMask;
+                    unsigned*       _SqArray;
+                    unsigned*       _CqHead;
+                    unsigned*       _CqTail;
+                    unsigned*       _CqMask;
+                    io_uring_cqe*   _Cqes;
+
+                    CUringEngine(SBlock* blocks) :
+                        _Ring(-1),
+                        _Blocks(blocks),
+                        _Fixed(false),
+                        _SqMap(MAP_FAILED),
+                        _SqSize(0),
+                        _CqMap(MAP_FAILED),
+                        _CqSize(0),
+                        _Sqes((io_uring_sqe*)MAP_FAILED),
+                        _SqesSize(0)
+                    {
+                    }
+
+                    bool Setup(uint32_t count, uint32_t size);
+                    int  Enter(unsigned submit, unsigned complete, unsigned flags);
+
+                public :
+                    virtual ~CUringEngine();
+
+                    static CEngine* Create(SBlock* blocks, uint32_t count, uint32_t size);
+
+                    virtual void Submit(SBlock& block);
+                    virtual void Reap  (bool wait);
+                };
+
+                CEngine* CUringEngine::Create(SBlock* blocks, uint32_t count, uint32_t size)
+                {
+                    CUringEngine* engine = new CUringEngine(blocks);
+                    if (engine->Setup(count, size) == false)
+                    {
+                        delete engine;
+                        return nullptr;
+                    }
+                    return engine;
+                }
+
+                bool CUringEngine::Setup(uint32_t count, uint32_t size)
+                {
+                    io_uring_params params;
+                    memset(&params, 0, sizeof(params));
+                    _Ring = (int)syscall(__NR_io_uring_setup, count, &params);
+                    if (_Ring < 0)
+                        return false;
+
+                    _SqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                    _CqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+                    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+                    {
+                        if (_CqSize > _SqSize)
+                            _SqSize = _CqSize;
+                    }
+                    _SqMap = mmap(nullptr, _SqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _Ring, IORING_OFF_SQ_RING);
+                    if (_SqMap == MAP_FAILED)
+                        return false;
+                    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0)
+                    {
+                        _CqMap = mmap(nullptr, _CqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _Ring, IORING_OFF_CQ_RING);
+                        if (_CqMap == MAP_FAILED)
+                            return false;
+                    }
+                    _SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+                    _Sqes     = (io_uring_sqe*)mmap(nullptr, _SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _Ring, IORING_OFF_SQES);
+                    if (_Sqes == MAP_FAILED)
+                        return false;
+
+                    char* sq = (char*)_SqMap;
+                    char* cq = (_CqMap != MAP_FAILED) ? (char*)_CqMap : sq;
+                    _SqTail  = (unsigned*)(sq + params.sq_off.tail);
+                    _SqMask  = (unsigned*)(sq + params.sq_off.ring_mask);
+                    _SqArray = (unsigned*)(sq + params.sq_off.array);
+                    _CqHead  = (unsigned*)(cq + params.cq_off.head);
+                    _CqTail  = (unsigned*)(cq + params.cq_off.tail);
+                    _CqMask  = (unsigned*)(cq + params.cq_off.ring_mask);
+                    _Cqes    = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+                    /* 註冊寫入區塊, 省去每次寫入時核心對應使用者記憶體的成本. 失敗 (例如 RLIMIT_MEMLOCK 不足) 時改用一般寫入 */
+                    std::vector< struct iovec > vectors(count);
+                    for (uint32_t i = 0; i < count; ++i)
+                    {
+                        vectors[i].iov_base = _Blocks[i].data;
+                        vectors[i].iov_len  = size;
+                    }
+                    _Fixed = (syscall(__NR_io_uring_register, _Ring, IORING_REGISTER_BUFFERS, &vectors[0], count) == 0);
+                    return true;
+                }
+
+                CUringEngine::~CUringEngine()
+                {
+                    if (_Sqes != MAP_FAILED)
+                        munmap(_Sqes, _SqesSize);
+                    if (_CqMap != MAP_FAILED)
+                        munmap(_CqMap, _CqSize);
+                    if (_SqMap != MAP_FAILED)
+                        munmap(_SqMap, _SqSize);
+                    if (_Ring >= 0)
+                        close(_Ring);
+                }
+
+                int CUringEngine::Enter(unsigned submit, unsigned complete, unsigned flags)
+                {
+                    int result;
+                    do
+                    {
+                        result = (int)syscall(__NR_io_uring_enter, _Ring, submit, complete, flags, nullptr, 0);
+                    } while( (result < 0) &&
+                             (errno == EINTR) );
+                    return result;
+                }
+
+                void CUringEngine::Submit(SBlock& block)
+                {
+                    /* 同時在途的區塊數量不超過佇列大小, 所以一定有空的 sqe */
+                    unsigned      tail  = *_SqTail;
+                    unsigned      index = tail & *_SqMask;
+                    io_uring_sqe* sqe   = &_Sqes[index];
+                    memset(sqe, 0, sizeof(*sqe));
+                    sqe->fd        = block.file;
+                    sqe->off       = block.offset + block.done;
+                    sqe->user_data = block.index;
+                    if (_Fixed == true)
+                    {
+                        sqe->opcode    = IORING_OP_WRITE_FIXED;
+                        sqe->addr      = (uint64_t)(uintptr_t)(block.data + block.done);
+                        sqe->len       = block.size - block.done;
+                        sqe->buf_index = (uint16_t)block.index;
+                    }
+                    else
+                    {
+                        block.vector.iov_base = block.data + block.done;
+                        block.vector.iov_len  = block.size - block.done;
+                        sqe->opcode = IORING_OP_WRITEV;
+                        sqe->addr   = (uint64_t)(uintptr_t)&block.vector;
+                        sqe->len    = 1;
+                    }
+                    _SqArray[index] = index;
+                    __atomic_store_n(_SqTail, tail + 1, __ATOMIC_RELEASE);
+                    if (Enter(1, 0, 0) < 0)
+                    {
+                        /* 送不進去就退回同步寫入 */
+                        __atomic_store_n(_SqTail, tail, __ATOMIC_RELEASE);
+                        Finish(block);
+                    }
+                }
+
+                void CUringEngine::Reap(bool wait)
+                {
+                    if (wait == true)
+                        Enter(0, 1, IORING_ENTER_GETEVENTS);
+                    unsigned head = *_CqHead;
+                    unsigned tail = __atomic_load_n(_CqTail, __ATOMIC_ACQUIRE);
+                    while (head != tail)
+                    {
+                        const io_uring_cqe& cqe   = _Cqes[head & *_CqMask];
+                        SBlock&             block = _Blocks[cqe.user_data];
+                        int                 res   = cqe.res;
+                        __atomic_store_n(_CqHead, ++head, __ATOMIC_RELEASE);
+                        if (res > 0)
+                        {
+                            block.done += (uint32_t)res;
+                            if (block.done < block.size)
+                            {
+                                /* 只寫了一部分, 把剩下的再送出去 */
+                                Submit(block);
+                                continue;
+                            }
+                        }
+                        /* 寫完, 或寫入失敗時以同步寫入再試一次 */
+                        Finish(block);
+                    }
+                }
+#endif
+
+                /* 沒有 io_uring 時, 交給背景執行緒以 pwrite 寫入 */
+                class CPoolEngine : public CEngine
+                {
+                private :
+                    std::mutex                 _Lock;
+                    std::condition_variable    _Signal;
+                    std::condition_variable    _Done;
+                    std::deque< SBlock* >      _Jobs;
+                    std::vector< std::thread > _Threads;
+                    uint64_t                   _Finished;
+                    uint64_t                   _Seen;
+                    bool                       _Stop;
+
+                    void OnWrite();
+
+                public :
+                    CPoolEngine(uint32_t threads);
+                    virtual ~CPoolEngine();
+
+                    virtual void Submit(SBlock& block);
+                    virtual void Reap  (bool wait);
+                };
+
+                CPoolEngine::CPoolEngine(uint32_t threads) :
+                    _Finished(0),
+                    _Seen(0),
+                    _Stop(false)
+                {
+                    for (uint32_t i = 0; i < threads; ++i)
+                        _Threads.push_back( std::thread(&CPoolEngine::OnWrite, this) );
+                }
+
+                CPoolEngine::~CPoolEngine()
+                {
+                    _Lock.lock();
+                    _Stop = true;
+                    _Lock.unlock();
+                    _Signal.notify_all();
+                    for (size_t i = 0; i < _Threads.size(); ++i)
+                        _Threads[i].join();
+                }
+
+                void CPoolEngine::OnWrite()
+                {
+                    std::unique_lock< std::mutex > lock(_Lock);
+                    for (;;)
+                    {
+                        _Signal.wait(lock, [this] { return (_Stop == true) || (_Jobs.empty() == false); });
+                        if (_Jobs.empty() == true)
+                            break;
+                        SBlock* block = _Jobs.front();
+                        _Jobs.pop_front();
+                        lock.unlock();
+
+                        while (block->done < block->size)
+                        {
+                            int64_t length = WriteAt(block->file, block->data + block->done, block->size - block->done, block->offset + block->done);
+                            if (length <= 0)
+                                break;
+                            block->done += (uint32_t)length;
+                        }
+                        /* 失敗時再試一次 */
+                        Finish(*block);
+
+                        lock.lock();
+                        ++_Finished;
+                        _Done.notify_all();
+                    }
+                }
+
+                void CPoolEngine::Submit(SBlock& block)
+                {
+                    _Lock.lock();
+                    _Jobs.push_back(&block);
+                    _Lock.unlock();
+                    _Signal.notify_one();
+                }
+
+                void CPoolEngine::Reap(bool wait)
+                {
+                    if (wait == true)
+                    {
+                        std::unique_lock< std::mutex > lock(_Lock);
+                        _Done.wait(lock, [this] { return (_Finished != _Seen); });
+                        _Seen = _Finished;
+                    }
+                }
+
+                /*
+                 * 非同步檔案輸出. 訊息先填入固定數量的寫入區塊, 區塊滿了或 Process 結束時送出,
+                 * 不等待寫入完成. 只有全部區塊都在寫入中才會等待. 自行記錄檔案位置, 不使用 O_APPEND.
+                 */
+                class CAsyncDevice : public CDevice
+                {
+                private :
+                    Handle                      _File;
+                    uint64_t                    _Offset;    /* 下一個區塊寫入檔案的位置 */
+                    std::unique_ptr< char[] >   _Storage;
+                    std::unique_ptr< SBlock[] > _Blocks;
+                    uint32_t                    _Count;
+                    uint32_t                    _Size;
+                    SBlock*                     _Current;
+                    Engine                      _Engine;
+
+                    SBlock* Acquire();
+                    void    Submit ();
+                    void    Drain  ();
+                    bool    IsBusy () const;
+
+                public :
+                    CAsyncDevice(uint32_t count, uint32_t size);
+                    virtual ~CAsyncDevice() { Close(); }
+
+                    virtual bool     Open   (const char* filename);
+                    virtual void     Close  ();
+                    virtual void     Write  (const char* msg, uint32_t size);
+                    virtual void     Flush  ();
+                    virtual uint64_t GetSize() const { return _Offset + ((_Current != nullptr) ? _Current->size : 0); }
+                    virtual bool     IsStage() const { return false; }
+                    virtual void     SetLost(const Counter& lost) { _Engine->SetLost(lost); }
+                };
+
+                CAsyncDevice::CAsyncDevice(uint32_t count, uint32_t size) :
+                    _File(INVALID_FILE),
+                    _Offset(0),
+                    _Storage(new char[(size_t)count * size]),
+                    _Blocks(new SBlock[count]),
+                    _Count(count),
+                    _Size(size),
+                    _Current(nullptr)
+                {
+                    for (uint32_t i = 0; i < count; ++i)
+                    {
+                        _Blocks[i].data   = &_Storage[(size_t)i * size];
+                        _Blocks[i].size   = 0;
+                        _Blocks[i].done   = 0;
+                        _Blocks[i].index  = i;
+                        _Blocks[i].offset = 0;
+                        _Blocks[i].file   = INVALID_FILE;
+                        _Blocks[i].busy.store(false, std::memory_order_relaxed);
+                    }
+#if defined(USE_IO_URING)
+                    _Engine.reset( CUringEngine::Create(_Blocks.get(), count, size) );
+#endif
+                    if (_Engine == nullptr)
+                        _Engine.reset( new CPoolEngine(ASYNC_WRITERS) );
+                }
+
+                bool CAsyncDevice::Open(const char* filename)
+                {
+                    _File = OpenFile(filename);
+                    if (_File == INVALID_FILE)
+                        return false;
+                    _Offset = FileSize(_File);
+                    return true;
+                }
+
+                SBlock* CAsyncDevice::Acquire()
+                {
+                    _Engine->Reap(false);
+                    for (;;)
+                    {
+                        for (uint32_t i = 0; i < _Count; ++i)
+                        {
+                            if (_Blocks[i].busy.load(std::memory_order_acquire) == false)
+                            {
+                                _Blocks[i].size = 0;
+                                _Blocks[i].done = 0;
+                                return &_Blocks[i];
+                            }
+                        }
+                        _Engine->Reap(true);
+                    }
+                }
+
+                void CAsyncDevice::Submit()
+                {
+                    if( (_Current != nullptr) &&
+                        (_Current->size > 0) )
+                    {
+                        _Current->file   = _File;
+                        _Current->offset = _Offset;
+                        _Current->busy.store(true, std::memory_order_relaxed);
+                        _Offset += _Current->size;
+                        _Engine->Submit(*_Current);
+                        _Current = nullptr;
+                    }
+                }
+
+                /* 等待所有區塊寫入完成 */
+                void CAsyncDevice::Drain()
+                {
+                    for (uint32_t i = 0; i < _Count; ++i)
+                    {
+                        while (_Blocks[i].busy.load(std::memory_order_acquire) == true)
+                            _Engine->Reap(true);
+                    }
+                }
+
+                void CAsyncDevice::Write(const char* msg, uint32_t size)
+                {
+                    while (size > 0)
+                    {
+                        if (_Current == nullptr)
+                            _Current = Acquire();
+                        uint32_t available = _Size - _Current->size;
+                        uint32_t count     = (size < available) ? size : available;
+                        memcpy(_Current->data + _Current->size, msg, count);
+                        _Current->size += count;
+                        msg  += count;
+                        size -= count;
+                        if (_Current->size == _Size)
+                            Submit();
+                    }
+                }
+
+                bool CAsyncDevice::IsBusy() const
+                {
+                    for (uint32_t i = 0; i < _Count; ++i)
+                    {
+                        if (_Blocks[i].busy.load(std::memory_order_acquire) == true)
+                            return true;
+                    }
+                    return false;
+                }
+
+                void CAsyncDevice::Flush()
+                {
+                    /* 還有區塊在寫入中就先不送出, 繼續累積在目前的區塊. 磁碟忙碌時會自然合併成較大的寫入 */
+                    _Engine->Reap(false);
+                    if (IsBusy() == false)
+                        Submit();
+                }
+
+                void CAsyncDevice::Close()
+                {
+                    if (_File != INVALID_FILE)
+                    {
+                        Submit();
+                        Drain();
+                        CloseFile(_File, _Offset);
+                        _File = INVALID_FILE;
+                    }
+                }
+
+                static Device CreateDevice(const SFileOptions& options)
+                {
+                    switch (options.device)
+                    {
+                    case EFD_MAPPED :
+                        return Device(new CMappedDevice(options.segment));
+                    case EFD_ASYNC :
+                        return Device(new CAsyncDevice(ASYNC_BLOCKS, OUTPUT_BUFFER));
+                    default :
+                        return Device(new CStreamDevice());
+                    }
+                }
+
+                /* 換檔下來的舊檔 */
+                struct SArchive
+                {
+                    std::string path;
+                    uint64_t    size;
+                    int64_t     time;   /* 最後修改時間 (奈秒). 同一秒內可能換好幾個檔, 秒數不夠分辨先後 */
+                };
+
+                /* 列出目錄中 name-* 開頭的舊檔 */
+                static void ListArchives(const std::string& directory, const std::string& name, std::vector< SArchive >& archives)
+                {
+                    std::string prefix = name + "-";
+#if defined(_MSC_VER)
+                    WIN32_FIND_DATAA data;
+                    HANDLE           find = FindFirstFileA( (directory + "/" + prefix + "*").c_str(), &data );
+                    if (find == INVALID_HANDLE_VALUE)
+                        return;
+                    do
+                    {
+                        if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+                            continue;
+                        const char* rest = data.cFileName + prefix.size();
+                        if( (*rest < '0') ||
+                            (*rest > '9') )
+                            continue;
+                        ULARGE_INTEGER time;
+                        time.LowPart  = data.ftLastWriteTime.dwLowDateTime;
+                        time.HighPart = data.ftLastWriteTime.dwHighDateTime;
+                        SArchive archive;
+                        archive.path = directory + "/" + data.cFileName;
+                        archive.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+                        archive.time = (int64_t)(time.QuadPart - 116444736000000000ULL) * 100;
+                        archives.push_back(archive);
+                    } while (FindNextFileA(find, &data) == TRUE);
+                    FindClose(find);
+#else
+                    DIR* dir = opendir(directory.c_str());
+                    if (dir == nullptr)
+                        return;
+                    while (struct dirent* entry = readdir(dir))
+                    {
+                        if (strncmp(entry->d_name, prefix.c_str(), prefix.size()) != 0)
+                            continue;
+                        const char* rest = entry->d_name + prefix.size();
+                        if( (*rest < '0') ||
+                            (*rest > '9') )
+                            continue;
+                        SArchive    archive;
+                        struct stat st;
+                        archive.path = directory + "/" + entry->d_name;
+                        if( (stat(archive.path.c_str(), &st) != 0) ||
+                            (S_ISREG(st.st_mode) == 0) )
+                            continue;
+                        archive.size = (uint64_t)st.st_size;
+#if defined(__linux__)
+                        archive.time = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+                        archive.time = (int64_t)st.st_mtime * 1000000000;
+#endif
+                        archives.push_back(archive);
+                    }
+                    closedir(dir);
+#endif
+                }
+
+                /* 依保留數量及總大小刪除最舊的檔案 */
+                static void Cleanup(const std::string& directory, const std::string& name, uint32_t keep, uint64_t total)
+                {
+                    if( (keep == 0) &&
+                        (total == 0) )
+                        return;
+                    std::vector< SArchive > archives;
+                    ListArchives(directory, name, archives);
+                    std::sort(archives.begin(), archives.end(), [](const SArchive& a, const SArchive& b)
+                    {
+                        if (a.time != b.time)
+                            return (a.time > b.time);
+                        return (a.path > b.path);
+                    });
+                    uint64_t size = 0;
+                    for (size_t i = 0; i < archives.size(); ++i)
+                    {
+                        size += archives[i].size;
+                        if( ((keep != 0) && (i >= keep)) ||
+                            ((total != 0) && (size > total)) )
+                            remove(archives[i].path.c_str());
+                    }
+                }
+
+                /* 壓縮的統計, 所有檔案輸出共用 */
+                struct SCompressCounters
+                {
+                    std::atomic< uint64_t > files;
+                    std::atomic< uint64_t > failures;
+                    std::atomic< uint64_t > input;
+                    std::atomic< uint64_t > output;
+                    std::atomic< uint64_t > elapsed;
+                    std::atomic< uint64_t > cpu;
+                };
+
+                static SCompressCounters& GetCompressCounters()
+                {
+                    static SCompressCounters counters = {};
+                    return counters;
+                }
+
+                /* 目前執行緒使用的 CPU 時間(奈秒) */
+                static uint64_t GetThreadTime()
+                {
+#if defined(_MSC_VER)
+                    FILETIME create, exit, kernel, user;
+                    if (GetThreadTimes(GetCurrentThread(), &create, &exit, &kernel, &user) == FALSE)
+                        return 0;
+                    ULARGE_INTEGER k, u;
+                    k.LowPart  = kernel.dwLowDateTime;
+                    k.HighPart = kernel.dwHighDateTime;
+                    u.LowPart  = user.dwLowDateTime;
+                    u.HighPart = user.dwHighDateTime;
+                    return (k.QuadPart + u.QuadPart) * 100;
+#else
+                    struct timespec ts;
+                    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+                        return 0;
+                    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+                }
+
+                /*
+                 * 壓縮舊檔. 先寫到暫存檔, 完成後才更名並刪除原檔, 中途失敗時保留原檔.
+                 * rate 限制每秒讀入的位元組數, 避免跟寫入端搶磁碟.
+                 */
+                static bool Compress(CCodec& codec, const std::string& source, uint64_t rate)
+                {
+                    std::string target = source + codec.GetExtension();
+                    std::string temp   = target + ".tmp";
+                    FILE*       input  = fopen(source.c_str(), "rb");
+                    if (input == nullptr)
+                        return false;
+                    FILE* output = fopen(temp.c_str(), "wb");
+                    if (output == nullptr)
+                    {
+                        fclose(input);
+                        return false;
+                    }
+
+                    SCompressCounters&                    counters = GetCompressCounters();
+                    std::unique_ptr< char[] >             buffer(new char[COMPRESS_CHUNK]);
+                    std::string                           compressed;
+                    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+                    std::chrono::steady_clock::duration   wait(0);
+                    uint64_t                              cpu    = GetThreadTime();
+                    uint64_t                              read   = 0;
+                    uint64_t                              write  = 0;
+                    bool                                  result = codec.Begin();
+                    while (result == true)
+                    {
+                        size_t length = fread(buffer.get(), 1, COMPRESS_CHUNK, input);
+                        compressed.clear();
+                        if (length > 0)
+                            result = codec.Compress(buffer.get(), length, compressed);
+                        if (length < COMPRESS_CHUNK)
+                        {
+                            if (ferror(input) != 0)
+                                result = false;
+                            if (result == true)
+                                result = codec.End(compressed);
+                        }
+                        if( (compressed.empty() == false) &&
+                            (fwrite(compressed.data(), 1, compressed.size(), output) != compressed.size()) )
+                            result = false;
+                        read  += length;
+                        write += compressed.size();
+                        if (length < COMPRESS_CHUNK)
+                            break;
+                        if (rate != 0)
+                        {
+                            std::chrono::nanoseconds expected( (int64_t)(read * 1000000000.0 / rate) );
+                            std::chrono::steady_clock::duration spent = std::chrono::steady_clock::now() - begin;
+                            if (expected > spent)
+                            {
+                                std::this_thread::sleep_for(expected - spent);
+                                wait += expected - spent;
+                            }
+                        }
+                    }
+                    fclose(input);
+                    if (fclose(output) != 0)
+                        result = false;
+
+                    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - begin - wait;
+                    counters.input  .fetch_add(read, std::memory_order_relaxed);
+                    counters.output .fetch_add(write, std::memory_order_relaxed);
+                    counters.elapsed.fetch_add((uint64_t)std::chrono::duration_cast< std::chrono::nanoseconds >(elapsed).count(), std::memory_order_relaxed);
+                    counters.cpu    .fetch_add(GetThreadTime() - cpu, std::memory_order_relaxed);
+                    if( (result == true) &&
+                        (Rename(temp.c_str(), target.c_str()) == true) )
+                    {
+                        remove(source.c_str());
+                        counters.files.fetch_add(1, std::memory_order_relaxed);
+                        return true;
+                    }
+                    remove(temp.c_str());
+                    counters.failures.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+
+                /*
+                 * 換檔後的善後工作 (關閉舊檔, 壓縮, 清除過期檔案) 交給背景執行緒, 不佔用寫入的時間.
+                 * 執行緒以最低的 CPU 及 I/O 優先權執行. 所有檔案輸出共用一個執行緒, 最後一個使用者釋放時才結束.
+                 */
+                class CHousekeeper
+                {
+                private :
+                    std::mutex                          _Lock;
+                    std::condition_variable             _Signal;
+                    std::deque< std::function< void() > > _Jobs;
+                    std::thread                         _Thread;
+                    bool                                _Stop;
+
+                    void OnWork();
+
+                public :
+                    CHousekeeper();
+                    ~CHousekeeper();
+
+                    static std::shared_ptr< CHousekeeper > GetInstance();
+
+                    void Post(const std::function< void() >& job);
+                };
+
+                typedef std::shared_ptr< CHousekeeper > Housekeeper;
+
+                CHousekeeper::CHousekeeper() :
+                    _Stop(false)
+                {
+                    _Thread = std::thread(&CHousekeeper::OnWork, this);
+                }
+
+                CHousekeeper::~CHousekeeper()
+                {
+                    _Lock.lock();
+                    _Stop = true;
+                    _Lock.unlock();
+                    _Signal.notify_one();
+                    _Thread.join();
+                }
+
+                Housekeeper CHousekeeper::GetInstance()
+                {
+                    static std::mutex                   lock;
+                    static std::weak_ptr< CHousekeeper > instance;
+                    lock.lock();
+                    Housekeeper result = instance.lock();
+                    if (result == nullptr)
+                    {
+                        result   = std::make_shared< CHousekeeper >();
+                        instance = result;
+                    }
+                    lock.unlock();
+                    return result;
+                }
+
+                void CHousekeeper::Post(const std::function< void() >& job)
+                {
+                    _Lock.lock();
+                    _Jobs.push_back(job);
+                    _Lock.unlock();
+                    _Signal.notify_one();
+                }
+
+                /* 結束前會把剩下的工作做完 */
+                void CHousekeeper::OnWork()
+                {
+#if defined(_MSC_VER)
+                    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+                    /* Linux 的 nice 值是以執行緒為單位. I/O 優先權設為 best-effort 最低一級 */
+                    int result = setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+                    result = (int)syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, (2 << 13) | 7 /* IOPRIO_CLASS_BE, 7 */);
+                    (void)result;
+#endif
+                    std::unique_lock< std::mutex > lock(_Lock);
+                    for (;;)
+                    {
+                        _Signal.wait(lock, [this] { return (_Stop == true) || (_Jobs.empty() == false); });
+                        if (_Jobs.empty() == true)
+                            break;
+                        std::function< void() > job = std::move(_Jobs.front());
+                        _Jobs.pop_front();
+                        lock.unlock();
+                        job();
+                        lock.lock();
+                    }
+                }
+
+                /* 換檔時由 CHousekeeper 準備的下一個裝置, ready 之後才交回寫入端 */
+                struct SRotation
+                {
+                    std::atomic< bool > claimed;    /* 已經有人開始執行 Run */
+                    std::atomic< bool > ready;
+                    Device              device;
+                    std::string         filename;
+                    std::string         directory;
+                    std::string         prefix;     /* 舊檔名稱, 不含序號及副檔名 */
+                    std::string         extension;
+                    std::string         codec;      /* 壓縮後的副檔名 */
+                    int                 sequence;   /* 開始嘗試的序號, 完成後是下一個可以使用的序號 */
+                    bool                opened;     /* device 是否已經開啟 */
+                    std::time_t         time;       /* 開啟的時間 */
+                    std::string         archive;    /* 舊檔更名後的名稱 */
+
+                    SRotation() : claimed(false), ready(false), sequence(0), opened(false), time(0) { }
+
+                    void Run();
+                };
+
+                /* 選擇舊檔名稱, 更名並開啟新檔. CHousekeeper 與寫入端只有先取得的一方會執行 */
+                void SRotation::Run()
+                {
+                    if (claimed.exchange(true, std::memory_order_acq_rel) == true)
+                        return;
+                    struct stat st;
+                    do
+                    {
+                        archive = prefix;
+                        if (sequence > 0)
+                            archive += "." + std::to_string(sequence);
+                        archive += extension;
+                        ++sequence;
+                    } while( (stat(archive.c_str(), &st) == 0) ||
+                             ((codec.empty() == false) && (stat((archive + codec).c_str(), &st) == 0)) );
+                    Rename( filename.c_str(), archive.c_str() );
+                    opened = (MkDir(directory.c_str(), true) == true) &&
+                             (device->Open(filename.c_str()) == true);
+                    time   = std::time(nullptr);
+                    ready.store(true, std::memory_order_release);
+                }
+
+                /*
+                 * 檔案輸出. 寫入時只比較已寫入的大小及下次換檔的時間.
+                 * 換檔時選擇舊檔名稱, 更名及開啟新檔都交給 CHousekeeper, 寫入端在新檔準備好之前繼續寫舊檔,
+                 * 換上新檔之後再由 CHousekeeper 關閉舊檔, 壓縮及清除過期檔案.
+                 * Windows 無法更名開啟中的檔案, 仍然在寫入端關閉舊檔後直接換檔.
+                 */
+                class COutput : public buffer::COutput
+                {
+                protected :
+                    std::string  _Name;
+                    std::string  _Directory;
+                    std::string  _FileName;
+                    std::string  _Extension;
+                    SFileOptions _Options;
+                    Device       _Device;
+                    bool         _Opened;
+                    uint64_t     _Written;      /* 目前檔案的大小 */
+                    uint64_t     _Limit;        /* 超過此大小就換檔 */
+                    std::time_t  _Deadline;     /* 到此時間就換檔 */
+                    std::time_t  _Retry;        /* 開檔失敗時, 到此時間才再試 */
+                    std::tm      _Begin;        /* 目前檔案開始的時間, 用來命名舊檔 */
+                    std::string  _Stamp;        /* 上一個舊檔的時間標記 */
+                    int          _Sequence;     /* 同一個時間標記內的序號 */
+                    Housekeeper  _Housekeeper;
+                    std::shared_ptr< SRotation > _Rotation; /* 換檔中, 還沒換上新裝置 */
+                    Counter      _Lost;         /* 寫入失敗而遺失的位元組數 */
+
+                    virtual void Output(const char* msg, uint32_t size);
+                    virtual uint64_t GetLost() const { return _Lost->load(std::memory_order_relaxed); }
+
+                    bool        Prepare ();
+                    void        Append  (const char* msg, uint32_t size);
+                    bool        Rotate  ();
+                    bool        Open    (std::time_t now);
+                    void        Start   (std::time_t now);
+                    void        Archive ();
+                    bool        Swap    ();
+                    std::time_t GetDeadline(const std::tm& begin) const;
+
+                    virtual void OnEnd ();
+                    virtual void OnOpen() { }  /* 開啟新檔之後, 可以寫入檔頭 */
+
+                    COutput(E_LOG_LEVEL level,
+                            const std::string& name,
+                            const std::string& directory,
+                            const SFileOptions& options,
+                            Device device,
+                            const char* extension = ".log",
+                            bool structured = false) :
+                        buffer::COutput(level, device->IsStage(), structured)
+                        , _Name(name)
+                        , _Directory(directory)
+                        , _Extension(extension)
+                        , _Options(options)
+                        , _Device(std::move(device))
+                        , _Opened(false)
+                        , _Written(0)
+                        , _Limit(0)
+                        , _Deadline(0)
+                        , _Retry(0)
+                        , _Sequence(0)
+                        , _Lost(std::make_shared< std::atomic< uint64_t > >(0))
+                    {
+                        _FileName = _Directory + "/" + _Name + _Extension;
+                        _Device->SetLost(_Lost);
+                    }
+
+                public :
+                    virtual ~COutput();
+
+                    COutput(E_LOG_LEVEL level,
+                            const std::string& name,
+                            const std::string& directory,
+                            const SFileOptions& options) :
+                        COutput(level, name, directory, options, CreateDevice(options))
+                    {
+                    }
+                };
+
+                COutput::~COutput()
+                {
+                    _Device->Close();
+                }
+
+                std::time_t COutput::GetDeadline(const std::tm& begin) const
+                {
+                    std::tm next = begin;
+                    next.tm_sec  = 0;
+                    next.tm_min  = 0;
+                    next.tm_isdst = -1;
+                    switch (_Options.rotation)
+                    {
+                    case ER_HOURLY :
+                        next.tm_hour += 1;
+                        break;
+                    case ER_DAILY :
+                        next.tm_hour  = 0;
+                        next.tm_mday += 1;
+                        break;
+                    default :
+                        return std::numeric_limits< std::time_t >::max();
+                    }
+                    return std::mktime(&next);
+                }
+
+                bool COutput::Open(std::time_t now)
+                {
+                    if (now < _Retry)
+                        return false;
+                    if( (MkDir(_Directory.c_str(), true) == false) ||
+                        (_Device->Open(_FileName.c_str()) == false) )
+                    {
+                        _Retry = now + 1;
+                        return false;
+                    }
+                    Start(now);
+                    return true;
+                }
+
+                /* 裝置已經開啟, 開始計算新檔的大小及換檔時間 */
+                void COutput::Start(std::time_t now)
+                {
+#if defined(_MSC_VER)
+                    localtime_s(&_Begin, &now);
+#else
+                    localtime_r(&now, &_Begin);
+#endif
+                    _Opened   = true;
+                    _Written  = _Device->GetSize();
+                    _Limit    = (_Options.size != 0) ? _Options.size : std::numeric_limits< uint64_t >::max();
+                    _Deadline = GetDeadline(_Begin);
+                    OnOpen();
+                }
+
+                /* 開始換檔. 舊檔更名及開啟新檔在 CHousekeeper 進行, 完成後由 Swap 換上 */
+                void COutput::Archive()
+                {
+                    const char* format = "%Y-%m-%d-%H%M%S";
+                    if (_Options.rotation == ER_DAILY)
+                        format = "%Y-%m-%d";
+                    else
+                    if (_Options.rotation == ER_HOURLY)
+                        format = "%Y-%m-%d-%H";
+                    char stamp[64];
+                    std::strftime(stamp, sizeof(stamp), format, &_Begin);
+
+                    /* 同一個週期內因大小換檔時, 加上序號 */
+                    if (_Stamp != stamp)
+                    {
+                        _Stamp    = stamp;
+                        _Sequence = 0;
+                    }
+                    std::shared_ptr< SRotation > rotation = std::make_shared< SRotation >();
+                    rotation->device    = CreateDevice(_Options);
+                    rotation->filename  = _FileName;
+                    rotation->directory = _Directory;
+                    rotation->prefix    = _Directory + "/" + _Name + "-" + _Stamp;
+                    rotation->extension = _Extension;
+                    rotation->codec     = (_Options.codec != nullptr) ? _Options.codec->GetExtension() : "";
+                    rotation->sequence  = _Sequence;
+                    rotation->device->SetLost(_Lost);
+                    _Rotation = rotation;
+#if defined(_MSC_VER)
+                    /* Windows 無法更名開啟中的檔案 */
+                    _Device->Close();
+                    rotation->Run();
+#else
+                    _Housekeeper->Post([rotation]() { rotation->Run(); });
+#endif
+                }
+
+                /* 換上準備好的裝置, 舊裝置交給背景關閉. 傳回 false 表示新檔開啟失敗 */
+                bool COutput::Swap()
+                {
+                    std::shared_ptr< SRotation > rotation = std::move(_Rotation);
+                    std::shared_ptr< CDevice >   device( _Device.release() );
+                    _Device   = std::move(rotation->device);
+                    _Sequence = rotation->sequence;
+                    _Opened   = false;
+
+                    std::string archive   = rotation->archive;
+                    std::string directory = _Directory;
+                    std::string name      = _Name;
+                    uint32_t    keep      = _Options.keep;
+                    uint64_t    total     = _Options.total;
+                    Codec       codec     = _Options.codec;
+                    uint64_t    rate      = _Options.rate;
+                    _Housekeeper->Post([device, archive, codec, rate, directory, name, keep, total]() mutable
+                    {
+                        device->Close();
+                        device.reset();
+                        if (codec != nullptr)
+                            Compress(*codec, archive, rate);
+                        Cleanup(directory, name, keep, total);
+                    });
+
+                    if (rotation->opened == false)
+                    {
+                        _Retry = rotation->time + 1;
+                        return false;
+                    }
+                    Start(rotation->time);
+                    return true;
+                }
+
+                bool COutput::Rotate()
+                {
+                    std::time_t now = std::time(nullptr);
+                    if (_Opened == true)
+                    {
+                        if (_Rotation == nullptr)
+                        {
+                            if( (_Written < _Limit) &&
+                                (now < _Deadline) )
+                                return true;
+                            if (_Housekeeper == nullptr)
+                                _Housekeeper = CHousekeeper::GetInstance();
+                            Archive();
+                        }
+                        if (_Rotation->ready.load(std::memory_order_acquire) == false)
+                        {
+                            /* 新檔還沒準備好, 繼續寫舊檔. 背景來不及時由寫入端接手, 舊檔最多超過上限一半或晚一秒 */
+                            if( (now <= _Deadline) &&
+                                ((_Written < _Limit) || (_Written - _Limit < _Limit / 2)) )
+                                return true;
+                            _Rotation->Run();
+                            while (_Rotation->ready.load(std::memory_order_acquire) == false)
+                                std::this_thread::yield();
+                        }
+                        if (Swap() == true)
+                            return true;
+                    }
+                    return Open(now);
+                }
+
+                void COutput::OnEnd()
+                {
+                    if (_Opened == true)
+                        _Device->Flush();
+                }
+
+                /* 需要時換檔, 傳回 false 表示目前沒有可以寫入的檔案 */
+                bool COutput::Prepare()
+                {
+                    if( (_Written >= _Limit) ||
+                        (std::time(nullptr) >= _Deadline) )
+                        return Rotate();
+                    return true;
+                }
+
+                void COutput::Append(const char* msg, uint32_t size)
+                {
+                    _Device->Write(msg, size);
+                    _Written += size;
+                }
+
+                void COutput::Output(const char* msg, uint32_t size)
+                {
+                    if (Prepare() == true)
+                        Append(msg, size);
+                }
+            };
+
+            namespace binary
+            {
+                /*
+                 * 二進位檔案輸出. 每個檔案以 EBR_HEADER 開始, 格式字串與執行緒第一次出現時才寫入對照表,
+                 * 之後的訊息只寫編號, 時間為與上一筆的奈秒差值. 格式說明見 tools/logdecode.cpp
+                 */
+                class COutput : public file::COutput
+                {
+                private :
+                    typedef std::unordered_map< const char*, uint32_t > Formats;
+                    typedef std::unordered_map< uint64_t, uint32_t >    Threads;
+
+                    Formats     _Formats;   /* 格式字串都是常數字串, 以位址查詢 */
+                    Threads     _Threads;
+                    int64_t     _Time;      /* 上一筆訊息的時間 */
+                    std::string _Record;
+                    std::string _Arguments;
+
+                protected :
+                    virtual void Output(const char* msg, uint32_t size) final;
+                    virtual void OnOpen() final;
+
+                public :
+                    COutput(E_LOG_LEVEL level,
+                            const std::string& name,
+                            const std::string& directory,
+                            const SFileOptions& options) :
+                        file::COutput(level, name, directory, options, file::CreateDevice(options), ".klog", true)
+                        , _Time(0)
+                    {
+                    }
+                };
+
+                void COutput::OnOpen()
+                {
+                    _Formats.clear();
+                    _Threads.clear();
+                    _Time = timestamp::Now();
+                    _Record.assign("KKLB", 4);
+                    _Record += (char)BINARY_VERSION;
+                    VarintOutput_(_Record, (uint64_t)_Time);
+                    Append(_Record.data(), (uint32_t)_Record.size());
+                }
+
+                void COutput::Output(const char* msg, uint32_t size)
+                {
+                    /* 換檔要在編碼之前, 新檔案的對照表是空的 */
+                    if (Prepare() == false)
+                        return;
+
+                    /* 共用區塊中的位置不一定對齊 */
+                    SEntry        header;
+                    const SEntry* entry  = &header;
+                    const char*   data   = msg + sizeof(SEntry);
+                    uint32_t      length = size - (uint32_t)sizeof(SEntry);
+                    uint32_t      format = 0;
+                    memcpy(&header, msg, sizeof(SEntry));
+                    _Record.clear();
+                    if (entry->kind == EE_CAPTURE)
+                    {
+                        Formats::const_iterator it = _Formats.find(entry->format);
+                        if (it == _Formats.end())
+                        {
+                            uint32_t count = (uint32_t)strlen(entry->format);
+                            format = (uint32_t)_Formats.size() + 1;
+                            _Formats[entry->format] = format;
+                            _Record += (char)EBR_FORMAT;
+                            VarintOutput_(_Record, format);
+                            VarintOutput_(_Record, count);
+                            _Record.append(entry->format, count);
+                        }
+                        else
+                        {
+                            format = (*it).second;
+                        }
+                        _Arguments.clear();
+                        entry->encode(_Arguments, data);
+                        data   = _Arguments.data();
+                        length = (uint32_t)_Arguments.size();
+                    }
+
+                    uint32_t          thread;
+                    Threads::iterator it = _Threads.find(entry->thread);
+                    if (it == _Threads.end())
+                    {
+                        thread = (uint32_t)_Threads.size();
+                        _Threads[entry->thread] = thread;
+                        _Record += (char)EBR_THREAD;
+                        VarintOutput_(_Record, thread);
+                        VarintOutput_(_Record, entry->thread);
+                    }
+                    else
+                    {
+                        thread = (*it).second;
+                    }
+
+                    /* 多個執行緒的訊息不一定依時間排列, 差值以 zigzag 儲存 */
+                    int64_t delta = entry->time - _Time;
+                    _Time = entry->time;
+                    _Record += (char)((entry->kind == EE_FIELDS) ? EBR_FIELDS : EBR_MESSAGE);
+                    _Record += (char)entry->level;
+                    VarintOutput_(_Record, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+                    VarintOutput_(_Record, thread);
+                    if (entry->kind != EE_FIELDS)
+                        VarintOutput_(_Record, format);
+                    VarintOutput_(_Record, length);
+                    _Record.append(data, length);
+                    Append(_Record.data(), (uint32_t)_Record.size());
+                }
+            };
+
+            namespace json
+            {
+                static const char* LevelNames[ELL_COUNT] = { "EMERGENCY", "ALERT", "CRITICAL", "ERROR", "WARNING", "NOTICE", "INFO", "DEBUG" };
+
+                /*
+                 * JSON lines 檔案輸出. 每筆訊息一行, 包含 time (UTC), level, thread, message,
+                 * LogFields 的欄位接在後面. 直接寫入 _Buffer, 滿了才交給檔案.
+                 */
+                class COutput : public file::COutput
+                {
+                private :
+                    char        _Buffer[OUTPUT_BUFFER];
+                    uint32_t    _Index;
+                    int64_t     _Second;    /* _Stamp 對應的秒數 */
+                    char        _Stamp[20]; /* "YYYY-MM-DDTHH:MM:SS" */
+                    std::string _Render;    /* 延遲格式化的訊息轉成文字 */
+
+                    void Flush ();
+                    void Put   (char value);
+                    void Put   (const char* data, uint32_t size);
+                    void Escape(const char* data, uint32_t size);
+                    void Time  (int64_t time);
+                    void Value (const fields::SValue& value);
+
+                protected :
+                    virtual void Output(const char* msg, uint32_t size) final;
+
+                public :
+                    COutput(E_LOG_LEVEL level,
+                            const std::string& name,
+                            const std::string& directory,
+                            const SFileOptions& options) :
+                        file::COutput(level, name, directory, options, file::CreateDevice(options), ".jsonl", true)
+                        , _Index(0)
+                        , _Second(INT64_MIN)
+                    {
+                    }
+                };
+
+                void COutput::Flush()
+                {
+                    if (_Index > 0)
+                        Append(_Buffer, _Index);
+                    _Index = 0;
+                }
+
+                void COutput::Put(char value)
+                {
+                    if (_Index >= sizeof(_Buffer))
+                        Flush();
+                    _Buffer[_Index++] = value;
+                }
+
+                void COutput::Put(const char* data, uint32_t size)
+                {
+                    while (size > 0)
+                    {
+                        if (_Index >= sizeof(_Buffer))
+                            Flush();
+                        uint32_t count = std::min< uint32_t >(size, (uint32_t)sizeof(_Buffer) - _Index);
+                        memcpy(&_Buffer[_Index], data, count);
+                        _Index += count;
+                        data   += count;
+                        size   -= count;
+                    }
+                }
+
+                void COutput::Escape(const char* data, uint32_t size)
+                {
+                    static const char digits[] = "0123456789abcdef";
+                    Put('"');
+                    const char* begin = data;
+                    const char* end   = data + size;
+                    for (; data != end; ++data)
+                    {
+                        unsigned char c = (unsigned char)*data;
+                        if( (c >= 0x20) &&
+                            (c != '"') &&
+                            (c != '\\') )
+                            continue;
+                        /* 不需要跳脫的部分整段複製 */
+                        Put(begin, (uint32_t)(data - begin));
+                        begin = data + 1;
+                        switch (c)
+                        {
+                        case '"'  : Put("\\\"", 2); break;
+                        case '\\' : Put("\\\\", 2); break;
+                        case '\n' : Put("\\n", 2);  break;
+                        case '\r' : Put("\\r", 2);  break;
+                        case '\t' : Put("\\t", 2);  break;
+                        default :
+                            {
+                                char code[6] = { '\\', 'u', '0', '0', digits[c >> 4], digits[c & 0xf] };
+                                Put(code, sizeof(code));
+                            }
+                            break;
+                        }
+                    }
+                    Put(begin, (uint32_t)(end - begin));
+                    Put('"');
+                }
+
+                void COutput::Time(int64_t time)
+                {
+                    int64_t seconds = time / 1000000000;
+                    if (seconds != _Second)
+                    {
+                        std::time_t now = (std::time_t)seconds;
+                        std::tm     tm;
+#if defined(_MSC_VER)
+                        gmtime_s(&tm, &now);
+#else
+                        gmtime_r(&now, &tm);
+#endif
+                        std::strftime(_Stamp, sizeof(_Stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+                        _Second = seconds;
+                    }
+                    char fraction[16];
+                    fraction[0] = '.';
+                    char* ptr = timestamp::Digits(&fraction[1], (uint32_t)(time % 1000000000), 9);
+                    *ptr++ = 'Z';
+                    *ptr++ = '"';
+                    Put('"');
+                    Put(_Stamp, sizeof(_Stamp) - 1);
+                    Put(fraction, (uint32_t)(ptr - fraction));
+                }
+
+                void COutput::Value(const fields::SValue& value)
+                {
+                    char buffer[32];
+                    switch (value.type)
+                    {
+                    case EBT_SIGNED :
+                        Put(buffer, (uint32_t)snprintf(buffer, sizeof(buffer), "%lld", value.integer));
+                        break;
+                    case EBT_UNSIGNED :
+                        Put(buffer, (uint32_t)snprintf(buffer, sizeof(buffer), "%llu", value.natural));
+                        break;
+                    case EBT_POINTER :
+                        Put(buffer, (uint32_t)snprintf(buffer, sizeof(buffer), "\"0x%llx\"", value.natural));
+                        break;
+                    case EBT_DOUBLE :
+                        /* JSON 沒有 NaN 及無限大 */
+                        if (value.real - value.real == 0)
+                            Put(buffer, (uint32_t)fields::DoubleOutput(buffer, sizeof(buffer), value.real));
+                        else
+                            Put("null", 4);
+                        break;
+                    case EBT_BOOLEAN :
+                        if (value.natural != 0)
+                            Put("true", 4);
+                        else
+                            Put("false", 5);
+                        break;
+                    case EBT_STRING :
+                        Escape(value.text, value.length);
+                        break;
+                    }
+                }
+
+                void COutput::Output(const char* msg, uint32_t size)
+                {
+                    if (Prepare() == false)
+                        return;
+
+                    SEntry        header;
+                    const SEntry* entry  = &header;
+                    const char*   data   = msg + sizeof(SEntry);
+                    uint32_t      length = size - (uint32_t)sizeof(SEntry);
+                    char          thread[32];
+                    memcpy(&header, msg, sizeof(SEntry));
+                    Put("{\"time\":", 8);
+                    Time(entry->time);
+                    Put(",\"level\":\"", 10);
+                    if (entry->level < ELL_COUNT)
+                        Put(LevelNames[entry->level], (uint32_t)strlen(LevelNames[entry->level]));
+                    Put(thread, (uint32_t)snprintf(thread, sizeof(thread), "\",\"thread\":\"0x%llx\"", (unsigned long long)entry->thread));
+                    Put(",\"message\":", 11);
+                    if (entry->kind == EE_FIELDS)
+                    {
+                        fields::CReader reader(data, length);
+                        fields::SValue  value;
+                        if (reader.Read(value) == true)
+                            Escape(value.text, value.length);
+                        else
+                            Put("\"\"", 2);
+                        fields::SValue key;
+                        while( (reader.Read(key) == true) &&
+                               (reader.Read(value) == true) )
+                        {
+                            Put(',');
+                            Escape(key.text, key.length);
+                            Put(':');
+                            Value(value);
+                        }
+                    }
+                    else
+                    {
+                        if (entry->kind == EE_CAPTURE)
+                        {
+                            _Render.clear();
+                            entry->render(_Render, entry->format, data);
+                            data   = _Render.data();
+                            length = (uint32_t)_Render.size();
+                        }
+                        /* 訊息結尾的換行不放進 JSON */
+                        if( (length > 0) &&
+                            (data[length - 1] == '\n') )
+                            --length;
+                        Escape(data, length);
+                    }
+                    Put("}\n", 2);
+                    Flush();
+                }
+            };
+
+#if !defined(_MSC_VER)
+            namespace network
+            {
+                enum E_STATE
+                {
+                    ES_CLOSED,
+                    ES_CONNECTING,  /* TCP 非阻塞連線中 */
+                    ES_CONNECTED,
+                };
+
+                /* 解析收集端的位址. 在建立輸出時呼叫, 之後重新連線不再查詢 DNS */
+                static bool Resolve(const SSyslogOptions& options, sockaddr_storage& address, socklen_t& length)
+                {
+                    memset(&address, 0, sizeof(address));
+                    if (options.transport == EST_UNIX)
+                    {
+                        sockaddr_un* local = (sockaddr_un*)&address;
+                        if( (options.address.empty() == true) ||
+                            (options.address.size() >= sizeof(local->sun_path)) )
+                            return false;
+                        local->sun_family = AF_UNIX;
+                        memcpy(local->sun_path, options.address.c_str(), options.address.size() + 1);
+                        length = (socklen_t)sizeof(sockaddr_un);
+                        return true;
+                    }
+
+                    /* host:port, IPv6 以 [] 包住 */
+                    size_t colon = options.address.rfind(':');
+                    if (colon == std::string::npos)
+                        return false;
+                    std::string host = options.address.substr(0, colon);
+                    std::string port = options.address.substr(colon + 1);
+                    if( (host.size() >= 2) &&
+                        (host[0] == '[') &&
+                        (host[host.size() - 1] == ']') )
+                        host = host.substr(1, host.size() - 2);
+
+                    addrinfo  hints;
+                    addrinfo* result = nullptr;
+                    memset(&hints, 0, sizeof(hints));
+                    hints.ai_family   = AF_UNSPEC;
+                    hints.ai_socktype = (options.transport == EST_TCP) ? SOCK_STREAM : SOCK_DGRAM;
+                    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+                        return false;
+                    bool found = (result != nullptr) && (result->ai_addrlen <= sizeof(address));
+                    if (found == true)
+                    {
+                        memcpy(&address, result->ai_addr, result->ai_addrlen);
+                        length = (socklen_t)result->ai_addrlen;
+                    }
+                    freeaddrinfo(result);
+                    return found;
+                }
+
+                /* 一次送出多個封包, 傳回送出的數量, 第一個就失敗時傳回 -1 */
+                static int SendBatch(int handle, struct iovec* pieces, unsigned count)
+                {
+#if defined(__linux__)
+                    mmsghdr messages[SYSLOG_BATCH];
+                    memset(messages, 0, sizeof(mmsghdr) * count);
+                    for (unsigned i = 0; i < count; ++i)
+                    {
+                        messages[i].msg_hdr.msg_iov    = &pieces[i];
+                        messages[i].msg_hdr.msg_iovlen = 1;
+                    }
+                    return sendmmsg(handle, messages, count, MSG_DONTWAIT);
+#else
+                    for (unsigned i = 0; i < count; ++i)
+                    {
+                        if (send(handle, pieces[i].iov_base, pieces[i].iov_len, MSG_DONTWAIT) < 0)
+                            return (i > 0) ? (int)i : -1;
+                    }
+                    return (int)count;
+#endif
+                }
+
+                /*
+                 * 以 RFC 5424 格式送到 syslog 收集端. 每次 Process 的訊息組合好之後一起送出,
+                 * UDP 及 Unix socket 以 sendmmsg 一次送出多個封包, TCP 以長度分隔後整段送出.
+                 * socket 都是非阻塞的, 收集端無法使用時訊息留在 _Pending, 超過上限就丟掉新的訊息,
+                 * 每隔 retry 毫秒重新連線一次, 不會卡住輸出的執行緒.
+                 */
+                class COutput : public buffer::COutput
+                {
+                private :
+                    SSyslogOptions          _Options;
+                    sockaddr_storage        _Address;
+                    socklen_t               _Length;
+                    int                     _Socket;
+                    E_STATE                 _State;
+                    int64_t                 _Retry;     /* 可以再次連線的時間 (metrics::Now) */
+                    std::string             _Header;    /* " HOSTNAME APP-NAME PROCID - " */
+                    std::string             _Line;      /* 正在組合的訊息 */
+                    std::string             _Render;    /* 延遲格式化的訊息轉成文字 */
+                    std::string             _Pending;   /* 還沒送完的訊息, 依序接在一起 */
+                    std::vector< uint32_t > _Sizes;     /* _Pending 中每筆訊息的大小 */
+                    size_t                  _First;     /* 第一筆還沒送完的訊息 */
+                    size_t                  _Start;     /* 第一筆還沒送完的訊息在 _Pending 中的位置 */
+                    size_t                  _Head;      /* _Pending 中已經送出的位元組數, TCP 可能停在訊息中間 */
+                    uint64_t                _Lost;      /* 暫存滿了丟掉的數量, 恢復後補一筆通知 */
+                    int64_t                 _Second;    /* _Stamp 對應的秒數 */
+                    char                    _Stamp[20]; /* "YYYY-MM-DDTHH:MM:SS" */
+
+                    void Time   (int64_t time);
+                    void Name   (const char* data, uint32_t length);
+                    void Escape (const char* data, uint32_t length);
+                    void Push   ();
+                    void Skip   (size_t count);
+                    void Connect();
+                    void Close  ();
+                    bool Stream ();
+                    bool Datagrams();
+                    void Send   ();
+
+                protected :
+                    virtual void Output (const char* msg, uint32_t size) final;
+                    virtual void OnFlush() final { Send(); }
+                    virtual void OnEnd  () final { Send(); }
+
+                public :
+                    COutput(E_LOG_LEVEL level, const SSyslogOptions& options, const sockaddr_storage& address, socklen_t length);
+                    virtual ~COutput();
+                };
+
+                COutput::COutput(E_LOG_LEVEL level, const SSyslogOptions& options, const sockaddr_storage& address, socklen_t length)
+                    : buffer::COutput(level, false, true)
+                    , _Options(options)
+                    , _Address(address)
+                    , _Length(length)
+                    , _Socket(-1)
+                    , _State(ES_CLOSED)
+                    , _Retry(0)
+                    , _First(0)
+                    , _Start(0)
+                    , _Head(0)
+                    , _Lost(0)
+                    , _Second(INT64_MIN)
+                {
+                    if (_Options.facility > 23)
+                        _Options.facility = 1;
+
+                    /* HOSTNAME 及 APP-NAME 只能是可見的 ASCII 字元 */
+                    char host[256];
+                    if (gethostname(host, sizeof(host)) != 0)
+                        host[0] = 0;
+                    host[sizeof(host) - 1] = 0;
+                    std::string app = _Options.app.substr(0, 48);
+                    for (size_t i = 0; host[i] != 0; ++i)
+                    {
+                        if( (host[i] <= ' ') ||
+                            (host[i] > '~') )
+                            host[i] = '_';
+                    }
+                    for (size_t i = 0; i < app.size(); ++i)
+                    {
+                        if( (app[i] <= ' ') ||
+                            (app[i] > '~') )
+                            app[i] = '_';
+                    }
+                    char pid[32];
+                    snprintf(pid, sizeof(pid), " %d - ", (int)getpid());
+                    _Header  = ' ';
+                    _Header += (host[0] != 0) ? host : "-";
+                    _Header += ' ';
+                    _Header += (app.empty() == false) ? app : "-";
+                    _Header += pid;
+                }
+
+                COutput::~COutput()
+                {
+                    /* 最後再送一次, 送不出去的就放棄 */
+                    Send();
+                    Close();
+                }
+
+                void COutput::Time(int64_t time)
+                {
+                    int64_t seconds = time / 1000000000;
+                    if (seconds != _Second)
+                    {
+                        std::time_t now = (std::time_t)seconds;
+                        std::tm     tm;
+                        gmtime_r(&now, &tm);
+                        std::strftime(_Stamp, sizeof(_Stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+                        _Second = seconds;
+                    }
+                    /* RFC 5424 的小數最多 6 位 */
+                    char fraction[16];
+                    fraction[0] = '.';
+                    char* ptr = timestamp::Digits(&fraction[1], (uint32_t)(time % 1000000000) / 1000, 6);
+                    *ptr++ = 'Z';
+                    _Line.append(_Stamp, sizeof(_Stamp) - 1);
+                    _Line.append(fraction, ptr - fraction);
+                }
+
+                /* SD 的 PARAM-NAME: 最多 32 個可見字元, 不能有 '=', ']', '"' */
+                void COutput::Name(const char* data, uint32_t length)
+                {
+                    if (length == 0)
+                        _Line += '_';
+                    if (length > 32)
+                        length = 32;
+                    for (uint32_t i = 0; i < length; ++i)
+                    {
+                        char c = data[i];
+                        if( (c <= ' ') ||
+                            (c > '~') ||
+                            (c == '=') ||
+                            (c == ']') ||
+                            (c == '"') )
+                            c = '_';
+                        _Line += c;
+                    }
+                }
+
+                /* SD 的 PARAM-VALUE 中 '"', '\' 及 ']' 要跳脫 */
+                void COutput::Escape(const char* data, uint32_t length)
+                {
+                    const char* begin = data;
+                    const char* end   = data + length;
+                    for (; data != end; ++data)
+                    {
+                        if( (*data != '"') &&
+                            (*data != '\\') &&
+                            (*data != ']') )
+                            continue;
+                        _Line.append(begin, data - begin);
+                        _Line += '\\';
+                        begin = data;
+                    }
+                    _Line.append(begin, end - begin);
+                }
+
+                /* 把 _Line 放進 _Pending, 超過上限時丟掉 */
+                void COutput::Push()
+                {
+                    char     prefix[16];
+                    uint32_t extra = 0;
+                    if (_Options.transport == EST_TCP)
+                        extra = (uint32_t)snprintf(prefix, sizeof(prefix), "%u ", (unsigned)_Line.size());
+                    else
+                    if (_Line.size() > SYSLOG_DATAGRAM)
+                        _Line.resize(SYSLOG_DATAGRAM);
+
+                    uint32_t size = extra + (uint32_t)_Line.size();
+                    if ((_Pending.size() - _Start) + size > _Options.spill)
+                    {
+                        ++_Lost;
+                        return;
+                    }
+                    _Pending.append(prefix, extra);
+                    _Pending.append(_Line);
+                    _Sizes.push_back(size);
+                }
+
+                /* 前 count 筆訊息已經送出 */
+                void COutput::Skip(size_t count)
+                {
+                    for (size_t i = 0; i < count; ++i)
+                        _Start += _Sizes[_First++];
+                    if (_Head < _Start)
+                        _Head = _Start;
+                }
+
+                void COutput::Connect()
+                {
+                    int64_t now = metrics::Now();
+                    if (now < _Retry)
+                        return;
+                    _Retry  = now + (int64_t)_Options.retry * 1000000;
+                    _Socket = socket(_Address.ss_family, (_Options.transport == EST_TCP) ? SOCK_STREAM : SOCK_DGRAM, 0);
+                    if (_Socket < 0)
+                        return;
+                    fcntl(_Socket, F_SETFD, FD_CLOEXEC);
+                    fcntl(_Socket, F_SETFL, fcntl(_Socket, F_GETFL) | O_NONBLOCK);
+#if defined(SO_NOSIGPIPE)
+                    int one = 1;
+                    setsockopt(_Socket, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+                    if (connect(_Socket, (const sockaddr*)&_Address, _Length) == 0)
+                        _State = ES_CONNECTED;
+                    else
+                    if (errno == EINPROGRESS)
+                        _State = ES_CONNECTING;
+                    else
+                        Close();
+                }
+
+                void COutput::Close()
+                {
+                    if (_Socket >= 0)
+                        close(_Socket);
+                    _Socket = -1;
+                    _State  = ES_CLOSED;
+                    /* TCP 送到一半的訊息不能在新的連線上接著送 */
+                    if (_Head > _Start)
+                    {
+                        Skip(1);
+                        ++_Lost;
+                    }
+                }
+
+                bool COutput::Stream()
+                {
+#if defined(MSG_NOSIGNAL)
+                    int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+#else
+                    int flags = MSG_DONTWAIT;
+#endif
+                    bool result = true;
+                    while (_Head < _Pending.size())
+                    {
+                        ssize_t sent = send(_Socket, &_Pending[_Head], _Pending.size() - _Head, flags);
+                        if (sent < 0)
+                        {
+                            if (errno == EINTR)
+                                continue;
+                            result = (errno == EAGAIN) || (errno == EWOULDBLOCK);
+                            break;
+                        }
+                        _Head += (size_t)sent;
+                    }
+                    while( (_First < _Sizes.size()) &&
+                           (_Start + _Sizes[_First] <= _Head) )
+                        _Start += _Sizes[_First++];
+                    return result;
+                }
+
+                bool COutput::Datagrams()
+                {
+                    while (_First < _Sizes.size())
+                    {
+                        struct iovec pieces[SYSLOG_BATCH];
+                        unsigned     count  = 0;
+                        size_t       offset = _Start;
+                        for (; (count < SYSLOG_BATCH) && (_First + count < _Sizes.size()); ++count)
+                        {
+                            pieces[count].iov_base = &_Pending[offset];
+                            pieces[count].iov_len  = _Sizes[_First + count];
+                            offset += _Sizes[_First + count];
+                        }
+                        int sent = SendBatch(_Socket, pieces, count);
+                        if (sent < 0)
+                        {
+                            if (errno == EINTR)
+                                continue;
+                            /* 封包太大, 只丟掉這一筆 */
+                            if (errno == EMSGSIZE)
+                            {
+                                Skip(1);
+                                ++_Lost;
+                                continue;
+                            }
+                            /* 緩衝區滿了, 下一次再送 */
+                            return (errno == EAGAIN) ||
+                                   (errno == EWOULDBLOCK) ||
+                                   (errno == ENOBUFS);
+                        }
+                        Skip((size_t)sent);
+                    }
+                    return true;
+                }
+
+                /* 必須在 _LockOutput 內呼叫 */
+                void COutput::Send()
+                {
+                    if (_First < _Sizes.size())
+                    {
+                        if (_State == ES_CLOSED)
+                            Connect();
+                        if (_State == ES_CONNECTING)
+                        {
+                            pollfd wait;
+                            wait.fd      = _Socket;
+                            wait.events  = POLLOUT;
+                            wait.revents = 0;
+                            if (poll(&wait, 1, 0) > 0)
+                            {
+                                int       error  = 0;
+                                socklen_t length = sizeof(error);
+                                if( (getsockopt(_Socket, SOL_SOCKET, SO_ERROR, &error, &length) == 0) &&
+                                    (error == 0) )
+                                    _State = ES_CONNECTED;
+                                else
+                                    Close();
+                            }
+                            else
+                            if (metrics::Now() >= _Retry)
+                            {
+                                /* 連線太久, 下一次重新開始 */
+                                Close();
+                            }
+                        }
+                        if (_State == ES_CONNECTED)
+                        {
+                            bool result = (_Options.transport == EST_TCP) ? Stream() : Datagrams();
+                            if (result == false)
+                                Close();
+                        }
+                    }
+
+                    if (_First == _Sizes.size())
+                    {
+                        _Pending.clear();
+                        _Sizes.clear();
+                        _First = 0;
+                        _Start = 0;
+                        _Head  = 0;
+                        if (_Lost > 0)
+                        {
+                            /* 恢復後補一筆通知, 下一次送出 */
+                            char text[96];
+                            int  length = snprintf(text, sizeof(text), "%llu messages lost while the collector was unavailable", (unsigned long long)_Lost);
+                            _Lost = 0;
+                            _Line = '<';
+                            _Line += std::to_string(_Options.facility * 8 + ELL_WARNING);
+                            _Line += ">1 ";
+                            Time(timestamp::Now());
+                            _Line += _Header;
+                            _Line += "- ";
+                            _Line.append(text, length);
+                            Push();
+                        }
+                    }
+                    else
+                    if (_Start > _Pending.size() / 2)
+                    {
+                        /* 已經送出的部分超過一半時才搬移 */
+                        _Pending.erase(0, _Start);
+                        _Sizes.erase(_Sizes.begin(), _Sizes.begin() + _First);
+                        _Head -= _Start;
+                        _First = 0;
+                        _Start = 0;
+                    }
+                }
+
+                void COutput::Output(const char* msg, uint32_t size)
+                {
+                    SEntry      entry;
+                    const char* data   = msg + sizeof(SEntry);
+                    uint32_t    length = size - (uint32_t)sizeof(SEntry);
+                    memcpy(&entry, msg, sizeof(SEntry));
+                    E_LOG_LEVEL level = (entry.level < (uint32_t)ELL_COUNT) ? (E_LOG_LEVEL)entry.level : ELL_DEBUG;
+
+                    /* <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID [SD] MSG */
+                    char thread[48];
+                    _Line = '<';
+                    _Line += std::to_string(_Options.facility * 8 + (uint32_t)level);
+                    _Line += ">1 ";
+                    Time(entry.time);
+                    _Line += _Header;
+                    _Line.append(thread, snprintf(thread, sizeof(thread), "[log@32473 thread=\"0x%llx\"", (unsigned long long)entry.thread));
+                    if (entry.kind == EE_FIELDS)
+                    {
+                        fields::CReader reader(data, length);
+                        fields::SValue  value;
+                        fields::SValue  key;
+                        data   = nullptr;
+                        length = 0;
+                        if (reader.Read(value) == true)
+                        {
+                            data   = value.text;
+                            length = value.length;
+                        }
+                        while( (reader.Read(key) == true) &&
+                               (reader.Read(value) == true) )
+                        {
+                            _Line += ' ';
+                            Name(key.text, key.length);
+                            _Line += "=\"";
+                            if (value.type == EBT_STRING)
+                            {
+                                Escape(value.text, value.length);
+                            }
+                            else
+                            {
+                                _Render.clear();
+                                fields::ValueOutput(_Render, value);
+                                _Line += _Render;
+                            }
+                            _Line += '"';
+                        }
+                    }
+                    else
+                    if (entry.kind == EE_CAPTURE)
+                    {
+                        _Render.clear();
+                        entry.render(_Render, entry.format, data);
+                        data   = _Render.data();
+                        length = (uint32_t)_Render.size();
+                    }
+                    _Line += ']';
+                    if( (length > 0) &&
+                        (data[length - 1] == '\n') )
+                        --length;
+                    if (length > 0)
+                    {
+                        _Line += ' ';
+                        _Line.append(data, length);
+                    }
+                    Push();
+                }
+            };
+#endif
+
+#if USE_ZLIB
+            namespace gzip
+            {
+                /* 產生 gzip 格式, 可以直接用 gzip/zcat 讀取 */
+                class CCodec : public log::CCodec
+                {
+                private :
+                    z_stream _Stream;
+                    int      _Level;
+                    bool     _Active;
+
+                    bool Deflate(const char* data, size_t size, int flush, std::string& output);
+
+                public :
+                    CCodec(int level) :
+                        _Level(level),
+                        _Active(false)
+                    {
+                    }
+
+                    virtual ~CCodec()
+                    {
+                        if (_Active == true)
+                            deflateEnd(&_Stream);
+                    }
+
+                    virtual const char* GetExtension() const { return ".gz"; }
+                    virtual bool        Begin       ();
+                    virtual bool        Compress    (const char* data, size_t size, std::string& output);
+                    virtual bool        End         (std::string& output);
+                };
+
+                bool CCodec::Begin()
+                {
+                    if (_Active == true)
+                        deflateEnd(&_Stream);
+                    memset(&_Stream, 0, sizeof(_Stream));
+                    /* windowBits 加 16 表示輸出 gzip 標頭 */
+                    _Active = (deflateInit2(&_Stream, _Level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+                    return _Active;
+                }
+
+                bool CCodec::Deflate(const char* data, size_t size, int flush, std::string& output)
+                {
+                    char chunk[1024 * 16];
+                    _Stream.next_in  = (Bytef*)data;
+                    _Stream.avail_in = (uInt)size;
+                    for (;;)
+                    {
+                        _Stream.next_out  = (Bytef*)chunk;
+                        _Stream.avail_out = sizeof(chunk);
+                        int result = deflate(&_Stream, flush);
+                        if (result == Z_STREAM_ERROR)
+                            return false;
+                        output.append(chunk, sizeof(chunk) - _Stream.avail_out);
+                        if (flush == Z_FINISH)
+                        {
+                            if (result == Z_STREAM_END)
+                                return true;
+                        }
+                        else
+                        if (_Stream.avail_out != 0)
+                            return true;
+                    }
+                }
+
+                bool CCodec::Compress(const char* data, size_t size, std::string& output)
+                {
+                    if (_Active == false)
+                        return false;
+                    return Deflate(data, size, Z_NO_FLUSH, output);
+                }
+
+                bool CCodec::End(std::string& output)
+                {
+                    if (_Active == false)
+                        return false;
+                    bool result = Deflate(nullptr, 0, Z_FINISH, output);
+                    deflateEnd(&_Stream);
+                    _Active = false;
+                    return result;
+                }
+            };
+#endif
+
+            namespace flight
+            {
+                /* 每一格的開頭, 訊息接在後面 */
+                struct SSlot
+                {
+                    std::atomic< uint64_t > sequence;   /* 序號 index 寫入中為 index * 2 + 1, 完成後為 index * 2 + 2 */
+                    uint32_t                size;
+                };
+
+                static const int Signals[] = { SIGSEGV,
+#if !defined(_MSC_VER)
+                                               SIGBUS,
+#endif
+                                               SIGFPE,
+                                               SIGILL,
+                                               SIGABRT };
+                static const int SIGNAL_COUNT = (int)(sizeof(Signals) / sizeof(Signals[0]));
+
+                /* 寫完為止, 只使用 async-signal-safe 的函式 */
+                static void WriteAll(int handle, const char* data, uint32_t size)
+                {
+                    while (size > 0)
+                    {
+#if defined(_MSC_VER)
+                        int written = _write(handle, data, size);
+#else
+                        ssize_t written = write(handle, data, size);
+                        if( (written < 0) &&
+                            (errno == EINTR) )
+                            continue;
+#endif
+                        if (written <= 0)
+                            return;
+                        data += written;
+                        size -= (uint32_t)written;
+                    }
+                }
+
+                /* snprintf 不是 async-signal-safe, 自行轉換 */
+                static uint32_t AppendNumber(char* buffer, uint64_t value)
+                {
+                    char     digits[20];
+                    uint32_t count = 0;
+                    do
+                    {
+                        digits[count++] = (char)('0' + value % 10);
+                        value /= 10;
+                    } while (value > 0);
+                    for (uint32_t i = 0; i < count; ++i)
+                        buffer[i] = digits[count - 1 - i];
+                    return count;
+                }
+
+                static uint32_t AppendText(char* buffer, const char* text)
+                {
+                    uint32_t size = (uint32_t)strlen(text);
+                    memcpy(buffer, text, size);
+                    return size;
+                }
+
+                /*
+                 * 多個執行緒以 _Head 取得序號後各自寫入一格, 不需要鎖定. 格數固定, 序號超過格數後覆蓋最舊的.
+                 * 讀取時前後比對序號, 寫入中或讀取途中被覆蓋的格子直接略過.
+                 * 繞了一整圈時上一圈的執行緒還在寫入同一格, 就放棄新的這一筆, 不會混在一起.
+                 */
+                class COutput : public CFlightRecorder
+                {
+                private :
+                    E_LOG_LEVEL             _Level;
+                    SFlightOptions          _Options;
+                    char*                   _Slots;
+                    uint32_t                _Stride;    /* 每一格的大小 */
+                    uint64_t                _Mask;      /* 格數 - 1 */
+                    std::atomic< uint64_t > _Head;      /* 下一筆的序號 */
+
+                    static std::mutex                _Lock;     /* 安裝及移除訊號處理 */
+                    static std::atomic< COutput* >   _Installed;
+#if !defined(_MSC_VER)
+                    static struct sigaction          _Previous[SIGNAL_COUNT];
+#else
+                    static void                    (*_Previous[SIGNAL_COUNT])(int);
+#endif
+
+                    void Install  ();
+                    void Uninstall();
+                    void Write    (int handle, int signal) const;
+
+                    static void OnSignal(int signal);
+
+                public :
+                    COutput(E_LOG_LEVEL level, const SFlightOptions& options);
+
+                    virtual ~COutput();
+
+                    virtual void        Output  (E_LOG_LEVEL level, const char* msg, uint32_t size) final;
+                    virtual void        Process () final                  {                }
+                    virtual E_LOG_LEVEL GetLevel() const final            { return _Level; }
+                    virtual void        SetLevel(E_LOG_LEVEL value) final { _Level = value; }
+                    virtual bool        Dump    (const std::string& path) const final;
+                };
+
+                std::mutex              COutput::_Lock;
+                std::atomic< COutput* > COutput::_Installed(nullptr);
+#if !defined(_MSC_VER)
+                struct sigaction        COutput::_Previous[SIGNAL_COUNT];
+#else
+                void                  (*COutput::_Previous[SIGNAL_COUNT])(int);
+#endif
+
+                COutput::COutput(E_LOG_LEVEL level, const SFlightOptions& options) :
+                    _Level(level),
+                    _Options(options),
+                    _Head(0)
+                {
+                    uint32_t slot = (options.slot < 64) ? 64 : (options.slot > FLIGHT_SLOT) ? FLIGHT_SLOT : options.slot;
+                    _Stride = (slot + 63) & ~63u;
+                    uint64_t count = 1;
+                    while (count * 2 * _Stride <= options.size)
+                        count *= 2;
+                    _Mask  = count - 1;
+                    _Slots = new char[count * _Stride];
+                    for (uint64_t i = 0; i < count; ++i)
+                        (new (&_Slots[i * _Stride]) SSlot())->sequence.store(0, std::memory_order_relaxed);
+                    if (options.signals == true)
+                        Install();
+                }
+
+                COutput::~COutput()
+                {
+                    Uninstall();
+                    delete [] _Slots;
+                }
+
+                /* 最後建立的取代之前的. 訊號處理只在第一次安裝 */
+                void COutput::Install()
+                {
+                    std::lock_guard< std::mutex > lock(_Lock);
+                    if (_Installed.exchange(this) != nullptr)
+                        return;
+                    for (int i = 0; i < SIGNAL_COUNT; ++i)
+                    {
+#if !defined(_MSC_VER)
+                        struct sigaction action;
+                        memset(&action, 0, sizeof(action));
+                        action.sa_handler = OnSignal;
+                        /* 程式有設定 sigaltstack 時, 堆疊溢位也能寫出 */
+                        action.sa_flags   = SA_ONSTACK;
+                        sigemptyset(&action.sa_mask);
+                        sigaction(Signals[i], &action, &_Previous[i]);
+#else
+                        _Previous[i] = signal(Signals[i], OnSignal);
+#endif
+                    }
+                }
+
+                void COutput::Uninstall()
+                {
+                    std::lock_guard< std::mutex > lock(_Lock);
+                    COutput* self = this;
+                    if (_Installed.compare_exchange_strong(self, nullptr) == false)
+                        return;
+                    for (int i = 0; i < SIGNAL_COUNT; ++i)
+                    {
+#if !defined(_MSC_VER)
+                        sigaction(Signals[i], &_Previous[i], nullptr);
+#else
+                        signal(Signals[i], _Previous[i]);
+#endif
+                    }
+                }
+
+                /* 寫出後還原原本的處理方式再送一次, 由原本的處理方式結束程式或產生 core dump */
+                void COutput::OnSignal(int signal)
+                {
+                    COutput* recorder = _Installed.exchange(nullptr);
+                    if (recorder != nullptr)
+                    {
+                        int handle = 2;
+                        if (recorder->_Options.path.empty() == false)
+                        {
+#if defined(_MSC_VER)
+                            handle = _open(recorder->_Options.path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+                            handle = open(recorder->_Options.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+                        }
+                        if (handle >= 0)
+                        {
+                            recorder->Write(handle, signal);
+                            if (handle != 2)
+                                close(handle);
+                        }
+                    }
+                    for (int i = 0; i < SIGNAL_COUNT; ++i)
+                    {
+                        if (Signals[i] != signal)
+                            continue;
+#if !defined(_MSC_VER)
+                        sigaction(signal, &_Previous[i], nullptr);
+#else
+                        ::signal(signal, _Previous[i]);
+#endif
+                    }
+                    raise(signal);
+                }
+
+                void COutput::Output(E_LOG_LEVEL level, const char* msg, uint32_t size)
+                {
+                    if (_Level < level)
+                        return;
+                    uint64_t index    = _Head.fetch_add(1, std::memory_order_relaxed);
+                    SSlot*   slot     = (SSlot*)&_Slots[(index & _Mask) * _Stride];
+                    uint32_t capacity = _Stride - (uint32_t)sizeof(SSlot);
+                    /* 取得上一圈寫入的結果, 同時標示寫入中 */
+                    if ((slot->sequence.exchange(index * 2 + 1, std::memory_order_acq_rel) & 1) != 0)
+                        return;
+                    if (size > capacity)
+                        size = capacity;
+                    slot->size = size;
+                    memcpy(reinterpret_cast< char* >(slot) + sizeof(SSlot), msg, size);
+                    slot->sequence.store(index * 2 + 2, std::memory_order_release);
+                }
+
+                /* 由舊到新寫出, 可以在訊號處理中呼叫: 不配置記憶體, 不鎖定 */
+                void COutput::Write(int handle, int signal) const
+                {
+                    char     buffer[FLIGHT_DUMP];
+                    uint32_t used  = 0;
+                    uint64_t head  = _Head.load(std::memory_order_acquire);
+                    uint64_t count = _Mask + 1;
+                    uint64_t index = (head > count) ? head - count : 0;
 
-                class COutput : public buffer::COutput
+                    used += AppendText(&buffer[used], "---- flight recorder: last ");
+                    used += AppendNumber(&buffer[used], head - index);
+                    used += AppendText(&buffer[used], " of ");
+                    used += AppendNumber(&buffer[used], head);
+                    used += AppendText(&buffer[used], " messages");
+                    if (signal != 0)
+                    {
+                        used += AppendText(&buffer[used], ", signal ");
+                        used += AppendNumber(&buffer[used], (uint64_t)signal);
+                    }
+                    used += AppendText(&buffer[used], " ----\n");
+
+                    for (; index < head; ++index)
+                    {
+                        const SSlot* slot     = (const SSlot*)&_Slots[(index & _Mask) * _Stride];
+                        uint64_t     sequence = index * 2 + 2;
+                        if (slot->sequence.load(std::memory_order_acquire) != sequence)
+                            continue;
+                        uint32_t size = slot->size;
+                        if (size > _Stride - (uint32_t)sizeof(SSlot))
+                            continue;
+                        if (used + size + 1 > sizeof(buffer))
+                        {
+                            WriteAll(handle, buffer, used);
+                            used = 0;
+                        }
+                        memcpy(&buffer[used], reinterpret_cast< const char* >(slot) + sizeof(SSlot), size);
+                        std::atomic_thread_fence(std::memory_order_acquire);
+                        /* 複製途中被覆蓋, 不採用 */
+                        if (slot->sequence.load(std::memory_order_relaxed) != sequence)
+                            continue;
+                        used += size;
+                        /* 截斷的訊息補上換行 */
+                        if( (size == 0) ||
+                            (buffer[used - 1] != '\n') )
+                            buffer[used++] = '\n';
+                    }
+                    WriteAll(handle, buffer, used);
+                }
+
+                bool COutput::Dump(const std::string& path) const
                 {
-                protected :
-                    std::string _Directory;
-                    std::string _Name;
-                    std::string _FileName;
-                    std::tm     _LastTm;
-                    std::time_t _Last;
-#if defined(USE_FILE_OUT)
-                    FILE*       _File;
+                    if (path.empty() == true)
+                    {
+                        Write(2, 0);
+                        return true;
+                    }
+#if defined(_MSC_VER)
+                    int handle = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
 #else
-                    int         _File;
+                    int handle = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
 #endif
-                    virtual void Output(const char* msg, uint32_t size) final;
+                    if (handle < 0)
+                        return false;
+                    Write(handle, 0);
+                    close(handle);
+                    return true;
+                }
+            };
+
+            namespace category
+            {
+                static const int INHERIT = std::numeric_limits< int >::min();  /* 沒有自行設定等級 */
+
+                class CNode : public CCategory
+                {
+                public :
+                    std::string name;
+                    CNode*      parent;
+                    int         level;  /* 自行設定的等級, INHERIT 表示使用上層的 */
+
+                    CNode(const std::string& value, CNode* owner) :
+                        name(value),
+                        parent(owner),
+                        level(INHERIT)
+                    {
+                        _Name = name.c_str();
+                    }
+
+                    void Store(int value) { _Level.store(value, std::memory_order_relaxed); }
+                };
 
-                    bool Reset(std::time_t now);
+                /* 所有分類. 只有取得及設定時鎖定, 輸出時只讀取 CCategory::_Level */
+                class CRegistry
+                {
+                private :
+                    std::mutex                                _Lock;
+                    std::unordered_map< std::string, CNode* > _Nodes;
+                    CNode*                                    _Root;
+                    int                                       _Threshold;   /* CManager 的等級, 沒有 CManager 時為 -1 */
+
+                    CRegistry() : _Root(new CNode("", nullptr)), _Threshold(-1)
+                    {
+                        _Nodes[""] = _Root;
+                    }
+
+                    /* 必須在 _Lock 內呼叫 */
+                    CNode* Find(const std::string& name)
+                    {
+                        std::unordered_map< std::string, CNode* >::iterator it = _Nodes.find(name);
+                        if (it != _Nodes.end())
+                            return (*it).second;
+                        size_t dot    = name.rfind('.');
+                        CNode* parent = (dot == std::string::npos) ? _Root : Find(name.substr(0, dot));
+                        CNode* node   = new CNode(name, parent);
+                        node->Store(Compute(node));
+                        _Nodes[name] = node;
+                        return node;
+                    }
+
+                    int Compute(const CNode* node) const
+                    {
+                        if (_Threshold < 0)
+                            return -1;
+                        for (; node != nullptr; node = node->parent)
+                        {
+                            if (node->level != INHERIT)
+                                return node->level;
+                        }
+                        return _Threshold;
+                    }
 
-                    virtual void OnBegin();
-                    virtual void OnEnd();
+                    /* 設定很少改變, 直接重新計算全部. 必須在 _Lock 內呼叫 */
+                    void Update()
+                    {
+                        std::unordered_map< std::string, CNode* >::iterator it = _Nodes.begin();
+                        for (; it != _Nodes.end(); ++it)
+                            (*it).second->Store(Compute((*it).second));
+                    }
 
                 public :
-                    virtual ~COutput();
+                    /* 刻意不釋放, 呼叫端可能保存分類直到程式結束 */
+                    static CRegistry& GetInstance()
+                    {
+                        static CRegistry* instance = new CRegistry();
+                        return *instance;
+                    }
 
-                    COutput(E_LOG_LEVEL level,
-                            const std::string& name,
-                            const std::string& directory) :
-                        buffer::COutput(level)
-                        , _Name(name)
-                        , _Directory(directory)
-                        , _Last(0)
-#if defined(USE_FILE_OUT)
-                        , _File(nullptr)
-#else
-                        , _File(-1)
-#endif
+                    CCategory* Get(const std::string& name)
+                    {
+                        std::lock_guard< std::mutex > lock(_Lock);
+                        return Find(name);
+                    }
+
+                    void SetLevel(const std::string& name, int level)
                     {
-                        _FileName = _Directory + "/" + _Name + ".log";
+                        std::lock_guard< std::mutex > lock(_Lock);
+                        Find(name)->level = level;
+                        Update();
+                    }
+
+                    void SetThreshold(int level)
+                    {
+                        std::lock_guard< std::mutex > lock(_Lock);
+                        _Threshold = level;
+                        Update();
                     }
                 };
+            };
 
-                COutput::~COutput()
+            class CManagerImp : public CManager
+            {
+                friend std::shared_ptr< CManager >;
+            protected :
+                std::mutex                _LockProcess;
+                Outputs                   _Outputs;
+                std::mutex                _LockOutput;
+                std::atomic< SSnapshot* > _Snapshot;
+                rcu::CReclaimer           _Retired;
+                E_LOG_LEVEL               _Level;
+                bool                      _Options[EO_COUNT];
+                thread::CQueues           _Records;     /* 格式化後的訊息及延遲格式化的參數, 所有緩衝輸出共用 */
+                budget::CLimit            _Budget;
+                std::string               _Render;      /* Deliver 時延遲格式化的訊息轉成的文字, 格式與佇列中的紀錄相同 */
+                std::vector< uint32_t >   _Offsets;     /* 每一筆延遲格式化的訊息在 _Render 的位置 */
+                thread::CQueues::CReader::Records _Rendered;
+
+                std::mutex              _LockAsync;
+                std::condition_variable _Signal;
+                std::thread             _Async;
+                SAsyncOptions           _AsyncOptions;
+                std::atomic< bool >     _Asynchronous;
+                bool                    _Stop;
+                std::atomic< uint32_t > _Pending;
+
+                metrics::CHistogram     _Drain;         /* 在 _LockProcess 內寫入 */
+                std::atomic< uint32_t > _StatsPeriod;   /* 輸出統計的間隔(毫秒), 0 表示不輸出 */
+                std::atomic< int64_t >  _StatsTime;     /* 上一次輸出統計的時間 */
+
+                void OnAsync();
+                void Report ();
+                void Notify (thread::SContext& context);
+                void Publish();
+                int  Prefix (char* buffer, E_LOG_LEVEL level, int64_t time, uint64_t thread, timestamp::SCache& cache) const;
+                void Render  (const SSnapshot* snapshot, thread::SContext& context, const thread::CQueues::CReader& reader);
+                void Deliver ();
+                void Discard (uint32_t need);
+                void Dispatch(const SSnapshot* snapshot, ring::CQueue& queue, E_LOG_LEVEL level, const char* msg, uint32_t size, bool admit);
+                void Post    (const SSnapshot* snapshot, thread::SContext& context, const SEntry& header, const char* data, uint32_t size);
+
+            public:
+                CManagerImp(E_LOG_LEVEL level);
+
+                virtual ~CManagerImp();
+
+                virtual void        Append         (const std::string& name, const log::Output& output);
+                virtual void        Remove         (const std::string& name);
+                virtual E_LOG_LEVEL GetLevel       () const;
+                virtual void        SetLevel       (E_LOG_LEVEL value);
+                virtual void        Printf         (E_LOG_LEVEL level, const char* fmt, ...);
+                virtual CWriter*    Begin          (E_LOG_LEVEL level, const CCategory* category);
+                virtual void        End            (CWriter* writer);
+                virtual void        Process        ();
+                virtual bool        EnableOption   (E_OPTIONS option);
+                virtual bool        DisableOption  (E_OPTIONS option);
+                virtual bool        IsEnabledOption(E_OPTIONS option) const;
+                virtual log::Output GetOutput      (const std::string& name);
+                virtual bool        StartAsync     (const SAsyncOptions& options);
+                virtual void        StopAsync      ();
+                virtual bool        IsAsync        () const;
+                virtual char*       Reserve        (E_LOG_LEVEL level, const char* format, Renderer render, Encoder encode, uint32_t size);
+                virtual void        Commit         ();
+                virtual SBudget     GetBudget      () const                 { return _Budget.Get();        }
+                virtual void        SetBudget      (const SBudget& value)   { _Budget.Set(value);          }
+                virtual uint64_t    GetDropped     () const                 { return _Budget.GetDropped(); }
+                virtual void        Fields         (E_LOG_LEVEL level, const char* msg, const SField* const* fields, uint32_t count);
+                virtual SLogStats   GetStats       ();
+                virtual void        SetStatsPeriod (uint32_t milliseconds);
+            };
+
+            void CManagerImp::Append(const std::string& name, const log::Output& output)
+            {
+                if(output)
                 {
-#if defined(USE_FILE_OUT)
-                    if (_File != nullptr)
-                        fclose(_File);
-#else
-                    if (_File != -1)
-                        close(_File);
-#endif
+                    _LockOutput.lock();
+                        _Outputs[name] = output;
+                        Publish();
+                    _LockOutput.unlock();
+                }
+            }
+
+            /* 呼叫端必須已經鎖定 _LockOutput */
+            void CManagerImp::Publish()
+            {
+                SSnapshot* snapshot = new SSnapshot();
+                snapshot->outputs.reserve(_Outputs.size());
+                Outputs::const_iterator it = _Outputs.begin();
+                for (; it != _Outputs.end(); ++it)
+                {
+                    snapshot->outputs.push_back((*it).second);
+                    buffer::COutput* output = dynamic_cast< buffer::COutput* >((*it).second.get());
+                    if (output == nullptr)
+                        snapshot->directs.push_back((*it).second.get());
+                    else
+                    if (output->IsStructured() == true)
+                        snapshot->entries.push_back(output);
+                    else
+                        snapshot->buffers.push_back(output);
+                }
+                _Retired.Retire( _Snapshot.exchange(snapshot) );
+                _Retired.Reclaim();
+            }
+
+            bool CManagerImp::EnableOption(E_OPTIONS option)
+            {
+                if( (option >= EO_TIME) &&
+                    (option < EO_COUNT) )
+                {
+                    _Options[option] = true;
+                    return true;
+                }
+                return false;
+            }
+
+            bool CManagerImp::DisableOption(E_OPTIONS option)
+            {
+                if( (option >= EO_TIME) &&
+                    (option < EO_COUNT) )
+                {
+                    _Options[option] = false;
+                    return true;
+                }
+                return false;
+            }
+
+            bool CManagerImp::IsEnabledOption(E_OPTIONS option) const
+            {
+                if( (option >= EO_TIME) &&
+                    (option < EO_COUNT) )
+                {
+                    return _Options[option];
+                }
+                return false;
+            }
+
+            log::Output CManagerImp::GetOutput(const std::string& name)
+            {
+                log::Output result;
+                _LockOutput.lock();
+                    Outputs::iterator it = _Outputs.find(name);
+                    if (it != _Outputs.end())
+                        result = (*it).second;
+                _LockOutput.unlock();
+                return result;
+            }
+
+            void CManagerImp::Remove(const std::string& name)
+            {
+                /* 先把共用佇列中的訊息交給要移除的輸出 */
+                Process();
+                _LockOutput.lock();
+                    if (_Outputs.erase(name) > 0)
+                        Publish();
+                _LockOutput.unlock();
+            }
+
+            E_LOG_LEVEL CManagerImp::GetLevel() const
+            {
+                return _Level;
+            }
+
+            void CManagerImp::SetLevel(E_LOG_LEVEL value)
+            {
+                _Level = value;
+                SetThreshold(value);
+            }
+
+            static const char* LevelNames[ELL_COUNT] = { "[EMERGENCY] ",
+                                                         "[ALERT    ] ",
+                                                         "[CRITICAL ] ",
+                                                         "[ERROR    ] ",
+                                                         "[WARNING  ] ",
+                                                         "[NOTICE   ] ",
+                                                         "[INFO     ] ",
+                                                         "[DEBUG    ] " };
+
+            #define PREFIX_SIZE 128     /* 前綴的最大長度 */
+
+            void CManagerImp::Printf(E_LOG_LEVEL level,
+                                     const char* fmt,
+                                     ...)
+            {
+                CWriter* writer = Begin(level, nullptr);
+                if (writer == nullptr)
+                    return;
+
+                va_list args;
+                va_start(args, fmt);
+                static_cast< ring::CRecordWriter* >(writer)->Format(fmt, args);
+                va_end(args);
+                End(writer);
+            }
+
+            /* 在共用佇列保留空間並寫入前綴, 格式化時直接寫在後面 */
+            CWriter* CManagerImp::Begin(E_LOG_LEVEL level, const CCategory* category)
+            {
+                if (category == nullptr)
+                {
+                    if (_Level < level)
+                        return nullptr;
+                }
+                else
+                if (category->IsEnabled(level) == false)
+                {
+                    return nullptr;
+                }
+
+                thread::SContext& context = thread::GetContext();
+                {
+                    rcu::CReadLock lock(context.GetReader());
+                    if (_Snapshot.load(std::memory_order_acquire)->outputs.size() == 0)
+                        return nullptr;
+                }
+
+                int64_t              begin  = context.Sample();
+                ring::CRecordWriter* writer = &context.writer;
+                if (context.active != nullptr)
+                {
+                    /* 格式化途中又輸出訊息. 外層讓出佇列保留的空間, 結束時再複製 */
+                    context.active->Spill();
+                    writer = new ring::CRecordWriter();
+                }
+                writer->parent = context.active;
+                context.active = writer;
+                writer->Open(_Records.Get(context), level, WRITER_RESERVE);
+                writer->start  = begin;
+                writer->time   = timestamp::Now();
+                writer->prefix = (uint32_t)Prefix(writer->GetData(), level, writer->time, context.id, context.time);
+                writer->resize(writer->prefix);
+                /* 分類放在訊息內容中, 結構化輸出也看得到 */
+                if( (category != nullptr) &&
+                    (*category->GetName() != 0) )
+                {
+                    *writer += '[';
+                    *writer += category->GetName();
+                    *writer += "] ";
+                }
+                return writer;
+            }
+
+            void CManagerImp::End(CWriter* output)
+            {
+                ring::CRecordWriter* writer  = static_cast< ring::CRecordWriter* >(output);
+                thread::SContext&    context = thread::GetContext();
+                context.active = writer->parent;
+                {
+                    rcu::CReadLock   lock(context.GetReader());
+                    const SSnapshot* snapshot = _Snapshot.load(std::memory_order_acquire);
+                    ring::CQueue*    queue    = _Records.Get(context);
+                    E_LOG_LEVEL      level    = writer->level;
+                    uint32_t         size     = (uint32_t)writer->size();
+                    char*            buffer   = writer->GetData();
+                    if (writer->IsSpilled() == true)
+                    {
+                        buffer = queue->Reserve(level, size);
+                        if (buffer != nullptr)
+                            memcpy(buffer, writer->GetData(), size);
+                    }
+                    if( (buffer != nullptr) &&
+                        (snapshot->outputs.size() > 0) )
+                    {
+                        buffer[size] = 0;
+                        /* 二進位輸出不需要前綴. 要在 Dispatch 之前, 之後 buffer 可能已經被取出 */
+                        if (snapshot->entries.size() > 0)
+                        {
+                            SEntry header = { writer->time, context.id, nullptr, nullptr, nullptr, EE_TEXT, (uint32_t)level };
+                            Post(snapshot, context, header, &buffer[writer->prefix], size - writer->prefix);
+                        }
+                        Dispatch(snapshot, *queue, level, buffer, size, true);
+                        if (_Asynchronous.load(std::memory_order_relaxed) == true)
+                            Notify(context);
+                    }
                 }
+                context.Measure(writer->start);
+                if (writer != &context.writer)
+                    delete writer;
+            }
+
+            /* msg 在 queue 保留的空間中. 緩衝輸出之後由共用佇列讀取, 其他輸出直接呼叫.
+               admit 為 false 時不檢查上限, 給持有 _LockProcess 的呼叫端使用 */
+            void CManagerImp::Dispatch(const SSnapshot* snapshot,
+                                       ring::CQueue&    queue,
+                                       E_LOG_LEVEL      level,
+                                       const char*      msg,
+                                       uint32_t         size,
+                                       bool             admit)
+            {
+                std::vector< log::COutput* >::const_iterator direct = snapshot->directs.begin();
+                for (; direct != snapshot->directs.end(); ++direct)
+                    (*direct)->Output(level, msg, size);
 
-                bool COutput::Reset(std::time_t now)
+                std::vector< buffer::COutput* >::const_iterator buffer = snapshot->buffers.begin();
+                bool                                            shared = false;
+                for (; buffer != snapshot->buffers.end(); ++buffer)
                 {
-                    std::tm val = *std::localtime(&now);
-                    if (_Last != 0)
+                    if ((*buffer)->IsImmediately() == false)
                     {
-                        if (val.tm_mday == _LastTm.tm_mday)
-                            return true;
+                        if ((*buffer)->GetLevel() >= level)
+                            shared = true;
+                    }
+                    else
+                    {
+                        (*buffer)->Output(level, msg, size);
                     }
-                    if (MkDir(_Directory.c_str(), true) == false)
+                }
+                /* 沒有人需要時保留的空間直接給下一筆使用 */
+                if (shared == false)
+                    return;
+
+                ring::CQueue::SUsage& usage = queue.GetUsage();
+                uint32_t              need  = ring::CQueue::Footprint(size);
+                if( (admit == true) &&
+                    (_Budget.IsOver(usage, need) == true) )
+                {
+                    auto drain   = [this]()              { Deliver();     };
+                    auto discard = [this](uint32_t need) { Discard(need); };
+                    if (_Budget.Admit(usage, level, need, _LockProcess, drain, discard) == false)
+                        return;
+                }
+                queue.Commit(size);
+                _Budget.Account(usage, need);
+            }
+
+            /* 在共用區塊建立一份 SEntry, 所有結構化輸出共用 */
+            void CManagerImp::Post(const SSnapshot*  snapshot,
+                                   thread::SContext& context,
+                                   const SEntry&     header,
+                                   const char*       data,
+                                   uint32_t          size)
+            {
+                E_LOG_LEVEL                                     level = (E_LOG_LEVEL)header.level;
+                std::vector< buffer::COutput* >::const_iterator it    = snapshot->entries.begin();
+                for (; it != snapshot->entries.end(); ++it)
+                {
+                    if ((*it)->GetLevel() >= level)
+                        break;
+                }
+                if (it == snapshot->entries.end())
+                    return;
+
+                uint32_t total = sizeof(SEntry) + size;
+                char*    blob  = context.arena.Reserve(total + 1);
+                if (blob == nullptr)
+                    return;
+                memcpy(blob, &header, sizeof(SEntry));
+                memcpy(blob + sizeof(SEntry), data, size);
+                blob[total] = 0;
+
+                int64_t references = 0;
+                for (; it != snapshot->entries.end(); ++it)
+                {
+                    if ((*it)->Enqueue(level, context.arena.GetChunk(), blob, total) == true)
+                        ++references;
+                }
+                if (references > 0)
+                    context.arena.Commit(total + 1, references);
+            }
+
+            void CManagerImp::Fields(E_LOG_LEVEL          level,
+                                     const char*          msg,
+                                     const SField* const* fields,
+                                     uint32_t             count)
+            {
+                if (_Level < level)
+                    return;
+
+                thread::SContext& context  = thread::GetContext();
+                rcu::CReadLock    lock(context.GetReader());
+                const SSnapshot*  snapshot = _Snapshot.load(std::memory_order_acquire);
+                if (snapshot->outputs.size() == 0)
+                    return;
+                int64_t           begin    = context.Sample();
+
+                /* 欄位只編碼一次. 結構化輸出保存編碼後的內容, 文字輸出再由它轉成文字 */
+                std::string& encoded = context.encoded;
+                CFields      writer(encoded);
+                encoded.clear();
+                if (msg == nullptr)
+                    msg = "";
+                EncodeOutput_(encoded, msg, (uint32_t)strlen(msg));
+                for (uint32_t i = 0; i < count; ++i)
+                    writer.Add(*fields[i]);
+
+                int64_t time = timestamp::Now();
+                if (snapshot->entries.size() > 0)
+                {
+                    SEntry header = { time, context.id, nullptr, nullptr, nullptr, EE_FIELDS, (uint32_t)level };
+                    Post(snapshot, context, header, encoded.data(), (uint32_t)encoded.size());
+                }
+                if( (snapshot->directs.size() > 0) ||
+                    (snapshot->buffers.size() > 0) )
+                {
+                    std::string& text = context.text;
+                    text.clear();
+                    fields::Render(text, encoded.data(), (uint32_t)encoded.size());
+                    text += '\n';
+
+                    ring::CQueue* queue  = _Records.Get(context);
+                    char*         buffer = queue->Reserve(level, PREFIX_SIZE + (uint32_t)text.size());
+                    if (buffer == nullptr)
+                        return;
+                    int index = Prefix(buffer, level, time, context.id, context.time);
+                    memcpy(&buffer[index], text.data(), text.size());
+                    index += (int)text.size();
+                    buffer[index] = 0;
+                    Dispatch(snapshot, *queue, level, buffer, index, true);
+                }
+                if (_Asynchronous.load(std::memory_order_relaxed) == true)
+                    Notify(context);
+                context.Measure(begin);
+            }
+
+            /* 從最舊的訊息開始丟, 直到放得下 need. 必須在 _LockProcess 內呼叫 */
+            void CManagerImp::Discard(uint32_t need)
+            {
+                int64_t bytes   = 0;
+                int64_t entries = 0;
+                auto callback = [&](const ring::CQueue::SRecord& record) -> bool
+                {
+                    if (_Budget.IsOver(bytes, entries, need) == false)
                         return false;
-#if defined(USE_FILE_OUT)
-                    if (_File != nullptr)
+                    bytes += ring::CQueue::Footprint(record.size);
+                    ++entries;
+                    return true;
+                };
+                _Records.PopWhile(callback);
+                _Budget.Free(bytes, entries);
+                if (entries > 0)
+                    _Budget.Drop((uint64_t)entries);
+            }
+
+            /* buffer 至少要有 PREFIX_SIZE 個位元組 */
+            int CManagerImp::Prefix(char*             buffer,
+                                    E_LOG_LEVEL       level,
+                                    int64_t           time,
+                                    uint64_t          thread,
+                                    timestamp::SCache& cache) const
+            {
+                char*   ptr     = buffer;
+                int64_t seconds = time / 1000000000;
+                if( (_Options[EO_DATE] == true) ||
+                    (_Options[EO_DAY] == true) ||
+                    (_Options[EO_TIME] == true) )
+                    cache.Update(seconds);
+                if (_Options[EO_DATE] == true)
+                {
+                    memcpy(ptr, cache.date, sizeof(cache.date));
+                    ptr += sizeof(cache.date);
+                }
+                else
+                if (_Options[EO_DAY] == true)
+                {
+                    memcpy(ptr, &cache.date[8], 3);
+                    ptr += 3;
+                }
+                if(_Options[EO_TIME] == true)
+                {
+                    memcpy(ptr, cache.time, sizeof(cache.time));
+                    ptr = timestamp::Digits2(ptr + sizeof(cache.time), (int)(seconds - cache.minute));
+                    uint32_t fraction = (uint32_t)(time % 1000000000);
+                    if (_Options[EO_NANOSECOND] == true)
                     {
-                        fclose(_File);
-#else
-                    if (_File != -1)
+                        *ptr++ = '.';
+                        ptr = timestamp::Digits(ptr, fraction, 9);
+                    }
+                    else
+                    if (_Options[EO_MICROSECOND] == true)
+                    {
+                        *ptr++ = '.';
+                        ptr = timestamp::Digits(ptr, fraction / 1000, 6);
+                    }
+                    else
+                    if (_Options[EO_MILLISECOND] == true)
                     {
-                        close(_File);
-#endif
-                        char tmp[32];
-                        char filename[1024 * 4];
-                        std::strftime(tmp, sizeof(tmp), "%Y-%m-%d", &_LastTm);
-                        sprintf(filename,
-                                "%s/%s-%s.log",
-                                _Directory.c_str(),
-                                _Name.c_str(),
-                                tmp );
-                        Rename( _FileName.c_str(), filename );
+                        *ptr++ = '.';
+                        ptr = timestamp::Digits(ptr, fraction / 1000000, 3);
                     }
-#if defined(USE_FILE_OUT)
-                    _File = fopen(_FileName.c_str(), "a+b");
-                    if (_File == nullptr)
-#else
-    #if defined(O_BINARY)
-                    _File = open(_FileName.c_str(), O_CREAT | O_RDWR | O_APPEND | O_RDWR | O_BINARY);
-    #else
-                    _File = open(_FileName.c_str(), O_CREAT | O_RDWR | O_APPEND | O_RDWR);
-    #endif
-                    if (_File == -1)
-#endif
-                        return false;
-                    _LastTm = val;
-                    _Last   = now;
-                    return true;
+                    *ptr++ = ' ';
                 }
-
-                void COutput::OnBegin()
+                if (_Options[EO_THREAD] == true)
                 {
+                    static const char digits[] = "0123456789abcdef";
+                    char  hex[16];
+                    char* end = &hex[sizeof(hex)];
+                    char* hp  = end;
+                    do
+                    {
+                        *--hp = digits[thread & 0xf];
+                        thread >>= 4;
+                    } while (thread != 0);
+                    *ptr++ = '0';
+                    *ptr++ = 'x';
+                    memcpy(ptr, hp, end - hp);
+                    ptr += (end - hp);
+                    *ptr++ = ' ';
                 }
-
-                void COutput::OnEnd()
+                if (_Options[EO_LEVEL] == true)
                 {
-#if defined(USE_FILE_OUT)
-                    fflush(_File);
-#endif
+                    if( (level >= 0) &&
+                        (level < ELL_COUNT) )
+                    {
+                        memcpy(ptr, LevelNames[level], 12);
+                        ptr += 12;
+                    }
                 }
+                return (int)(ptr - buffer);
+            }
 
-                void COutput::Output(const char* msg, uint32_t size)
+            /* 延遲格式化的參數與其他訊息放在同一個佇列, 保持同一個執行緒的先後順序 */
+            char* CManagerImp::Reserve(E_LOG_LEVEL level,
+                                       const char* format,
+                                       Renderer    render,
+                                       Encoder     encode,
+                                       uint32_t    size)
+            {
+                if (_Level < level)
+                    return nullptr;
+
+                thread::SContext& context = thread::GetContext();
+                /* 格式化途中又輸出訊息. 外層讓出佇列保留的空間 */
+                if (context.active != nullptr)
+                    context.active->Spill();
+                context.start = context.Sample();
+                char* data = _Records.Get(context)->Reserve(level, sizeof(SCapture) + size, ring::CQueue::CAPTURE);
+                if (data == nullptr)
+                    return nullptr;
+                SCapture* capture = (SCapture*)data;
+                capture->format = format;
+                capture->render = render;
+                capture->encode = encode;
+                capture->time   = timestamp::Now();
+                capture->thread = context.id;
+                return data + sizeof(SCapture);
+            }
+
+            void CManagerImp::Commit()
+            {
+                thread::SContext& context = thread::GetContext();
                 {
-                    if (_Last == 0)
+                    rcu::CReadLock         lock(context.GetReader());
+                    const SSnapshot*       snapshot = _Snapshot.load(std::memory_order_acquire);
+                    ring::CQueue*          queue    = _Records.Get(context);
+                    ring::CQueue::SRecord* record   = queue->GetReserved();
+                    const SCapture*        capture  = (const SCapture*)record->buffer;
+                    E_LOG_LEVEL            level    = (E_LOG_LEVEL)(record->level & ~ring::CQueue::CAPTURE);
+                    /* 結構化輸出直接保存參數, 需要時才轉成文字 */
+                    if (snapshot->entries.size() > 0)
                     {
-                        if( Reset( std::time(nullptr) ) == false )
-                            return;
+                        SEntry header = { capture->time, capture->thread, capture->format, capture->render, capture->encode, EE_CAPTURE, (uint32_t)level };
+                        Post(snapshot, context, header, record->buffer + sizeof(SCapture), record->size - (uint32_t)sizeof(SCapture));
                     }
-                    else
+                    /* 直接輸出 (例如 CFlightRecorder) 不能等到 Deliver, 當下就轉成文字 */
+                    std::vector< log::COutput* >::const_iterator direct = snapshot->directs.begin();
+                    for (; direct != snapshot->directs.end(); ++direct)
+                    {
+                        if ((*direct)->GetLevel() >= level)
+                            break;
+                    }
+                    if (direct != snapshot->directs.end())
+                    {
+                        std::string& text = context.text;
+                        char         prefix[PREFIX_SIZE];
+                        text.assign(prefix, Prefix(prefix, level, capture->time, capture->thread, context.time));
+                        capture->render(text, capture->format, record->buffer + sizeof(SCapture));
+                        for (; direct != snapshot->directs.end(); ++direct)
+                            (*direct)->Output(level, text.c_str(), (uint32_t)text.size());
+                    }
+                    /* 緩衝輸出在 Deliver 時才轉成文字. 沒有人需要時保留的空間直接給下一筆使用 */
+                    bool wanted = false;
+                    std::vector< buffer::COutput* >::const_iterator it = snapshot->buffers.begin();
+                    for (; (wanted == false) && (it != snapshot->buffers.end()); ++it)
+                    {
+                        if ((*it)->GetLevel() >= level)
+                            wanted = true;
+                    }
+                    if (wanted == true)
                     {
-                        std::time_t now = std::time(nullptr);
-                        if (_Last != now)
+                        ring::CQueue::SUsage& usage    = queue->GetUsage();
+                        uint32_t              need     = ring::CQueue::Footprint(record->size);
+                        bool                  admitted = true;
+                        if (_Budget.IsOver(usage, need) == true)
                         {
-                            if (Reset(now) == false)
-                                return;
+                            auto drain   = [this]()              { Deliver();     };
+                            auto discard = [this](uint32_t need) { Discard(need); };
+                            admitted = _Budget.Admit(usage, level, need, _LockProcess, drain, discard);
+                        }
+                        if (admitted == true)
+                        {
+                            queue->Commit();
+                            _Budget.Account(usage, need);
                         }
                     }
-#if defined(USE_FILE_OUT)
-                    fwrite(msg, 1, size, _File);
-#else
-                    write(_File, msg, size);
-#endif
                 }
-            };
+                if (_Asynchronous.load(std::memory_order_relaxed) == true)
+                    Notify(context);
+                context.Measure(context.start);
+            }
 
-            class CManagerImp : public CManager
+            /*
+             * 延遲格式化的紀錄依序轉成文字放在 _Render, 格式與佇列中的紀錄相同.
+             * 緩衝輸出讀取時在原來的位置讀到轉好的文字, 與同一個執行緒的其他訊息保持順序.
+             * 必須在 _LockProcess 內呼叫
+             */
+            void CManagerImp::Render(const SSnapshot* snapshot, thread::SContext& context, const thread::CQueues::CReader& reader)
             {
-                friend std::shared_ptr< CManager >;
-            protected :
-                std::mutex  _LockProcess;
-                Outputs     _Outputs;
-                std::mutex  _LockOutput;
-                E_LOG_LEVEL _Level;
-                bool        _Options[EO_COUNT];
+                static const uint32_t NONE = std::numeric_limits< uint32_t >::max();
 
-            public:
-                CManagerImp(E_LOG_LEVEL level);
+                _Render.clear();
+                _Offsets.clear();
+                auto callback = [&](const ring::CQueue::SRecord& record)
+                {
+                    if ((record.level & ring::CQueue::CAPTURE) == 0)
+                        return;
+                    _Offsets.push_back(NONE);
 
-                virtual ~CManagerImp();
+                    const SCapture* capture = (const SCapture*)record.buffer;
+                    E_LOG_LEVEL     level   = (E_LOG_LEVEL)(record.level & ~ring::CQueue::CAPTURE);
+                    bool            shared  = false;
+                    bool            immediate = false;
+                    std::vector< buffer::COutput* >::const_iterator buffer = snapshot->buffers.begin();
+                    for (; buffer != snapshot->buffers.end(); ++buffer)
+                    {
+                        if ((*buffer)->GetLevel() >= level)
+                        {
+                            if ((*buffer)->IsImmediately() == true)
+                                immediate = true;
+                            else
+                                shared = true;
+                        }
+                    }
+                    if( (shared == false) &&
+                        (immediate == false) )
+                        return;
 
-                virtual void        Append         (const std::string& name, const log::Output& output);
-                virtual void        Remove         (const std::string& name);
-                virtual E_LOG_LEVEL GetLevel       () const;
-                virtual void        SetLevel       (E_LOG_LEVEL value);
-                virtual void        Printf         (E_LOG_LEVEL level, const char* fmt, ...);
-                virtual void        Process        ();
-                virtual bool        EnableOption   (E_OPTIONS option);
-                virtual bool        DisableOption  (E_OPTIONS option);
-                virtual bool        IsEnabledOption(E_OPTIONS option) const;
-                virtual log::Output GetOutput      (const std::string& name);
-            };
+                    /* 標頭, 前綴, 內容, 結尾的 0, 對齊 8 個位元組 */
+                    size_t offset = _Render.size();
+                    char   prefix[PREFIX_SIZE];
+                    _Render.resize(offset + offsetof(ring::CQueue::SRecord, buffer));
+                    _Render.append(prefix, Prefix(prefix, level, capture->time, capture->thread, context.time));
+                    capture->render(_Render, capture->format, record.buffer + sizeof(SCapture));
+                    uint32_t size = (uint32_t)(_Render.size() - offset - offsetof(ring::CQueue::SRecord, buffer));
+                    _Render.resize(offset + ring::CQueue::Footprint(size), 0);
+                    ring::CQueue::SRecord* rendered = (ring::CQueue::SRecord*)&_Render[offset];
+                    rendered->size  = size;
+                    rendered->level = level;
+                    if (shared == true)
+                        _Offsets.back() = (uint32_t)offset;
 
-            void CManagerImp::Append(const std::string& name, const log::Output& output)
+                    if (immediate == true)
+                    {
+                        for (buffer = snapshot->buffers.begin(); buffer != snapshot->buffers.end(); ++buffer)
+                        {
+                            if ((*buffer)->IsImmediately() == true)
+                                (*buffer)->Output(level, rendered->buffer, size);
+                        }
+                    }
+                };
+                reader.Read(callback);
+
+                /* _Render 不再變動後才取得位置 */
+                _Rendered.clear();
+                for (size_t i = 0; i < _Offsets.size(); ++i)
+                    _Rendered.push_back( (_Offsets[i] == NONE) ? nullptr : (const ring::CQueue::SRecord*)&_Render[_Offsets[i]] );
+            }
+
+            void CManagerImp::Notify(thread::SContext& context)
             {
-                if(output)
+                uint32_t batch  = _AsyncOptions.batch;
+                uint32_t stride = (batch < ASYNC_STRIDE) ? batch : ASYNC_STRIDE;
+                if (++context.pending >= stride)
                 {
-                    _LockOutput.lock();
-                        _Outputs[name] = output;
-                    _LockOutput.unlock();
+                    uint32_t count   = context.pending;
+                    uint32_t pending = _Pending.fetch_add(count, std::memory_order_relaxed);
+                    context.pending = 0;
+                    if( (pending < batch) &&
+                        (pending + count >= batch) )
+                    {
+                        _LockAsync.lock();
+                            _Signal.notify_one();
+                        _LockAsync.unlock();
+                    }
                 }
             }
 
-            bool CManagerImp::EnableOption(E_OPTIONS option)
+            bool CManagerImp::StartAsync(const SAsyncOptions& options)
             {
-                if( (option >= EO_TIME) &&
-                    (option < EO_COUNT) )
+                if( (options.interval == 0) ||
+                    (options.batch == 0) )
+                    return false;
+                _LockAsync.lock();
+                if (_Async.joinable() == true)
                 {
-                    _Options[option] = true;
-                    return true;
+                    _LockAsync.unlock();
+                    return false;
                 }
-                return false;
+                _AsyncOptions = options;
+                _Stop         = false;
+                _Pending      = 0;
+                _Async        = std::thread(&CManagerImp::OnAsync, this);
+                _LockAsync.unlock();
+                _Asynchronous = true;
+                return true;
             }
 
-            bool CManagerImp::DisableOption(E_OPTIONS option)
+            void CManagerImp::StopAsync()
             {
-                if( (option >= EO_TIME) &&
-                    (option < EO_COUNT) )
+                _LockAsync.lock();
+                if (_Async.joinable() == false)
                 {
-                    _Options[option] = false;
-                    return true;
+                    _LockAsync.unlock();
+                    return;
                 }
-                return false;
+                _Stop = true;
+                _Signal.notify_one();
+                _LockAsync.unlock();
+                _Async.join();
+                _Asynchronous = false;
             }
 
-            bool CManagerImp::IsEnabledOption(E_OPTIONS option) const
+            bool CManagerImp::IsAsync() const
             {
-                if( (option >= EO_TIME) &&
-                    (option < EO_COUNT) )
-                {
-                    return _Options[option];
-                }
-                return false;
+                return _Asynchronous;
             }
 
-            log::Output CManagerImp::GetOutput(const std::string& name)
+            void CManagerImp::OnAsync()
             {
-                log::Output result;
-                if(_Outputs.size() > 0)
+                if (_AsyncOptions.cpu >= 0)
                 {
-                    _LockOutput.lock();
-                        Outputs::iterator it = _Outputs.find(name);
-                        if (it != _Outputs.end())
-                            result = (*it).second;
-                    _LockOutput.unlock();
+#if defined(_MSC_VER)
+                    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << _AsyncOptions.cpu);
+#elif defined(__linux__)
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    CPU_SET(_AsyncOptions.cpu, &set);
+                    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
                 }
-                return result;
+
+                std::chrono::milliseconds   interval(_AsyncOptions.interval);
+                std::unique_lock< std::mutex > lock(_LockAsync);
+                while (_Stop == false)
+                {
+                    _Signal.wait_for(lock, interval, [this]()
+                    {
+                        return (_Stop == true) ||
+                               (_Pending.load(std::memory_order_relaxed) >= _AsyncOptions.batch);
+                    });
+                    _Pending = 0;
+                    lock.unlock();
+                        Process();
+                    lock.lock();
+                }
+                lock.unlock();
+                /* 結束前輸出所有已在佇列中的訊息 */
+                Process();
             }
 
-            void CManagerImp::Remove(const std::string& name)
+            CManagerImp::CManagerImp(E_LOG_LEVEL level)
+                : _Snapshot(new SSnapshot())
+                , _Asynchronous(false)
+                , _Stop(false)
+                , _Pending(0)
+                , _StatsPeriod(0)
+                , _StatsTime(0)
             {
-                _LockOutput.lock();
-                    _Outputs.erase(name);
-                _LockOutput.unlock();
+                _Level = level;
+                SetThreshold(level);
+                for (int i = 0; i < EO_COUNT; ++i)
+                    _Options[i] = false;
             }
 
-            E_LOG_LEVEL CManagerImp::GetLevel() const
+            CManagerImp::~CManagerImp()
             {
-                return _Level;
+                StopAsync();
+                Process();
+                Process();
+                delete _Snapshot.load();
             }
 
-            void CManagerImp::SetLevel(E_LOG_LEVEL value)
+            /* 所有緩衝輸出依序讀取共用佇列後再一起取出. 必須在 _LockProcess 內呼叫 */
+            void CManagerImp::Deliver()
             {
-                _Level = value;
-            }
+                thread::SContext& context  = thread::GetContext();
+                rcu::CReadLock    lock(context.GetReader());
+                const SSnapshot*  snapshot = _Snapshot.load(std::memory_order_acquire);
+                uint64_t          dropped  = _Budget.TakeUnreported();
+                auto pass = [&](const thread::CQueues::CReader& reader)
+                {
+                    Render(snapshot, context, reader);
+                    thread::CQueues::CReader                        rendered(reader, _Rendered);
+                    std::vector< buffer::COutput* >::const_iterator it = snapshot->buffers.begin();
+                    for (; it != snapshot->buffers.end(); ++it)
+                        (*it)->Consume(rendered, dropped);
+                };
+                ring::CQueue::SUsage freed;
+                _Records.Multicast(pass, freed);
+                _Budget.Adopt(_Records.TakeOrphans());
+                _Budget.Free((int64_t)freed.bytes, (int64_t)freed.entries);
 
-            static const char* LevelNames[ELL_COUNT] = { "EMERGENCY",
-                                                         "ALERT    ",
-                                                         "CRITICAL ",
-                                                         "ERROR    ",
-                                                         "WARNING  ",
-                                                         "NOTICE   ",
-                                                         "INFO     ",
-                                                         "DEBUG    " };
+                std::vector< log::Output >::const_iterator it = snapshot->outputs.begin();
+                for (; it != snapshot->outputs.end(); ++it)
+                    (*it)->Process();
+            }
 
-            void CManagerImp::Printf(E_LOG_LEVEL level,
-                                     const char* fmt,
-                                     ...)
+            void CManagerImp::Process()
             {
-                if( (_Level >= level) &&
-                    (_Outputs.size() > 0) )
+                _LockProcess.lock();
+                    int64_t begin = metrics::Now();
+                    Deliver();
+                    int64_t end = metrics::Now();
+                    _Drain.Record(end - begin);
+                _LockProcess.unlock();
+
+                /* 順便釋放已經沒有人讀取的快照 */
+                if (_LockOutput.try_lock() == true)
                 {
-                    std::time_t now = std::time(nullptr);
-                    char buffer[1024 * 8];
-                    int  index = 0;
-                    if (_Options[EO_DATE] == true)
-                        index += strftime(&buffer[index], sizeof(buffer) - (index + 1), "%Y-%m-%d ", std::localtime(&now));
-                    else
-                    if (_Options[EO_DAY] == true)
-                        index += strftime(&buffer[index], sizeof(buffer) - (index + 1), "%d ", std::localtime(&now));
-                    if(_Options[EO_TIME] == true)
-                        index += strftime( &buffer[index], sizeof(buffer) - (index+1), "%H:%M:%S ", std::localtime(&now) );
-                    if (_Options[EO_THREAD] == true)
-                    {
-                        uint64_t id = std::hash<std::thread::id>()( std::this_thread::get_id() );
-                        index += sprintf(&buffer[index], "0x%llx ", id);
-                    }
-                    if (_Options[EO_LEVEL] == true)
-                    {
-                        if( (level >= 0) &&
-                            (level < ELL_COUNT) )
-                        {
-                            index += sprintf(&buffer[index], "[%s] ", LevelNames[level]);
-                        }
-                    }
+                    _Retired.Reclaim();
+                    _LockOutput.unlock();
+                }
 
-                    va_list args;
-                    va_start(args, fmt);
-                    index += vsnprintf( &buffer[index], sizeof(buffer) - (index+1), fmt, args);
-                    va_end(args);
-                    if (index > 0)
-                    {
-                        buffer[index] = 0;
-                        if(_Outputs.size() > 0)
-                        {
-                            _LockOutput.lock();
-                                Outputs outputs = _Outputs;
-                            _LockOutput.unlock();
-                            Outputs::const_iterator it = outputs.begin();
-                            for (; it != outputs.end(); ++it)
-                                (*it).second->Output(level, buffer, index);
-                        }
-                    }
+                /* 同時有多個執行緒呼叫時只有一個輸出統計 */
+                uint32_t period = _StatsPeriod.load(std::memory_order_relaxed);
+                if (period > 0)
+                {
+                    int64_t last = _StatsTime.load(std::memory_order_relaxed);
+                    if( (end - last >= (int64_t)period * 1000000) &&
+                        (_StatsTime.compare_exchange_strong(last, end, std::memory_order_relaxed) == true) )
+                        Report();
                 }
             }
 
-            CManagerImp::CManagerImp(E_LOG_LEVEL level)
+            SLogStats CManagerImp::GetStats()
             {
-                _Level = level;
-                for (int i = 0; i < EO_COUNT; ++i)
-                    _Options[i] = false;
+                SLogStats stats;
+                _Records.Measure(stats.queue);
+                stats.queue.dropped = _Budget.GetDropped();
+                metrics::CRegistry::GetInstance().Merge(stats.enqueue);
+                _Drain.Merge(stats.drain);
+                _LockOutput.lock();
+                    Outputs::const_iterator it = _Outputs.begin();
+                    for (; it != _Outputs.end(); ++it)
+                    {
+                        const CBufferOutput* output = dynamic_cast< const CBufferOutput* >((*it).second.get());
+                        if (output != nullptr)
+                        {
+                            stats.sinks.push_back(output->GetStats());
+                            stats.sinks.back().name = (*it).first;
+                        }
+                    }
+                _LockOutput.unlock();
+                return stats;
             }
 
-            CManagerImp::~CManagerImp()
+            void CManagerImp::SetStatsPeriod(uint32_t milliseconds)
             {
-                Process();
-                Process();
+                _StatsTime.store(metrics::Now(), std::memory_order_relaxed);
+                _StatsPeriod.store(milliseconds, std::memory_order_relaxed);
             }
 
-            void CManagerImp::Process()
+            /* 以一般訊息輸出統計, 下一次 Process 時才會寫出. 時間單位都是微秒 */
+            void CManagerImp::Report()
             {
-                if (_Outputs.size() > 0)
+                SLogStats stats = GetStats();
+                Printf(ELL_INFO,
+                       "log stats: enqueued %llu depth %llu dropped %llu"
+                       " enqueue p50/p99/max %.1f/%.1f/%.1f residency %.1f/%.1f/%.1f drain %.1f/%.1f/%.1f\n",
+                       (unsigned long long)stats.queue.enqueued,
+                       (unsigned long long)stats.queue.depth,
+                       (unsigned long long)stats.queue.dropped,
+                       stats.enqueue.GetPercentile(50) / 1000.0,
+                       stats.enqueue.GetPercentile(99) / 1000.0,
+                       stats.enqueue.max / 1000.0,
+                       stats.queue.residency.GetPercentile(50) / 1000.0,
+                       stats.queue.residency.GetPercentile(99) / 1000.0,
+                       stats.queue.residency.max / 1000.0,
+                       stats.drain.GetPercentile(50) / 1000.0,
+                       stats.drain.GetPercentile(99) / 1000.0,
+                       stats.drain.max / 1000.0);
+                std::vector< SSinkStats >::const_iterator it = stats.sinks.begin();
+                for (; it != stats.sinks.end(); ++it)
                 {
-                    _LockProcess.lock();
-                        _LockOutput.lock();
-                            Outputs outputs = _Outputs;
-                        _LockOutput.unlock();
-                        Outputs::const_iterator it = outputs.begin();
-                        for (; it != outputs.end(); ++it)
-                            (*it).second->Process();
-                    _LockProcess.unlock();
+                    Printf(ELL_INFO,
+                           "log stats: sink %s messages %llu bytes %llu depth %llu dropped %llu lost %llu drain p50/p99/max %.1f/%.1f/%.1f\n",
+                           (*it).name.c_str(),
+                           (unsigned long long)(*it).messages,
+                           (unsigned long long)(*it).bytes,
+                           (unsigned long long)(*it).queue.depth,
+                           (unsigned long long)(*it).queue.dropped,
+                           (unsigned long long)(*it).lost,
+                           (*it).drain.GetPercentile(50) / 1000.0,
+                           (*it).drain.GetPercentile(99) / 1000.0,
+                           (*it).drain.max / 1000.0);
                 }
             }
         };
 
-        CManager* CManager::_Instance = nullptr;
+        CManager*          CManager::_Instance = nullptr;
+        std::atomic< int > CManager::_Threshold(-1);
 
         CManager::CManager()
         {
@@ -643,9 +6211,31 @@ namespace kkboylin
 
         CManager::~CManager()
         {
+            SetThreshold((E_LOG_LEVEL)-1);
             _Instance = nullptr;
         }
 
+        void CManager::SetThreshold(E_LOG_LEVEL level)
+        {
+            _Threshold.store(level, std::memory_order_relaxed);
+            category::CRegistry::GetInstance().SetThreshold(level);
+        }
+
+        CCategory* GetCategory(const std::string& name)
+        {
+            return category::CRegistry::GetInstance().Get(name);
+        }
+
+        void SetCategoryLevel(const std::string& name, E_LOG_LEVEL level)
+        {
+            category::CRegistry::GetInstance().SetLevel(name, (level < 0) ? -1 : (int)level);
+        }
+
+        void ResetCategoryLevel(const std::string& name)
+        {
+            category::CRegistry::GetInstance().SetLevel(name, category::INHERIT);
+        }
+
         Manager Create(E_LOG_LEVEL level)
         {
             return std::make_shared< CManagerImp >(level);
@@ -653,7 +6243,12 @@ namespace kkboylin
 
         BufferOutput CreateConsoleOutput(E_LOG_LEVEL level)
         {
-            return std::make_shared< console::COutput >(level);
+            return std::make_shared< console::COutput >(level, SConsoleOptions());
+        }
+
+        BufferOutput CreateConsoleOutput(E_LOG_LEVEL level, const SConsoleOptions& options)
+        {
+            return std::make_shared< console::COutput >(level, options);
         }
 
         BufferOutput CreateDebugerOutput(E_LOG_LEVEL level)
@@ -661,9 +6256,191 @@ namespace kkboylin
             return std::make_shared< debuger::COutput >(level);
         }
 
+        BufferOutput CreateNullOutput(E_LOG_LEVEL level)
+        {
+            return std::make_shared< null::COutput >(level);
+        }
+
         BufferOutput CreateFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory)
         {
-            return std::make_shared< file::COutput >(level, name, directory);
+            return CreateFileOutput(level, name, directory, SFileOptions());
+        }
+
+        BufferOutput CreateFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory, const SFileOptions& options)
+        {
+            return std::make_shared< file::COutput >(level, name, directory, options);
+        }
+
+        BufferOutput CreateAsyncFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory)
+        {
+            SFileOptions options;
+            options.device = EFD_ASYNC;
+            return CreateFileOutput(level, name, directory, options);
+        }
+
+        BufferOutput CreateMappedFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory, uint64_t segment)
+        {
+            SFileOptions options;
+            options.device  = EFD_MAPPED;
+            options.segment = segment;
+            return CreateFileOutput(level, name, directory, options);
+        }
+
+        BufferOutput CreateBinaryFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory)
+        {
+            return CreateBinaryFileOutput(level, name, directory, SFileOptions());
+        }
+
+        BufferOutput CreateBinaryFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory, const SFileOptions& options)
+        {
+            return std::make_shared< binary::COutput >(level, name, directory, options);
+        }
+
+        BufferOutput CreateJsonFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory)
+        {
+            return CreateJsonFileOutput(level, name, directory, SFileOptions());
+        }
+
+        BufferOutput CreateJsonFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory, const SFileOptions& options)
+        {
+            return std::make_shared< json::COutput >(level, name, directory, options);
+        }
+
+        BufferOutput CreateSyslogOutput(E_LOG_LEVEL level, const SSyslogOptions& options)
+        {
+#if defined(_MSC_VER)
+            return nullptr;
+#else
+            sockaddr_storage address;
+            socklen_t        length = 0;
+            if (network::Resolve(options, address, length) == false)
+                return nullptr;
+            return std::make_shared< network::COutput >(level, options, address, length);
+#endif
+        }
+
+        FlightRecorder CreateFlightRecorder(E_LOG_LEVEL level, const SFlightOptions& options)
+        {
+            return std::make_shared< flight::COutput >(level, options);
+        }
+
+        void CFields::Add(const SField& field)
+        {
+            if (field.key == nullptr)
+                return;
+            if (field.type == EBT_OBJECT)
+            {
+                size_t size = _Prefix.size();
+                if (*field.key != 0)
+                {
+                    _Prefix += field.key;
+                    _Prefix += '.';
+                }
+                field.emit(*this, field.pointer);
+                _Prefix.resize(size);
+                return;
+            }
+
+            /* 名稱是前綴加上 key, key 是空字串時使用前綴本身 */
+            uint32_t prefix = (uint32_t)_Prefix.size();
+            uint32_t length = (uint32_t)strlen(field.key);
+            if( (length == 0) &&
+                (prefix > 0) )
+                --prefix;
+            _Output += (char)EBT_STRING;
+            VarintOutput_(_Output, prefix + length);
+            _Output.append(_Prefix.c_str(), prefix);
+            _Output.append(field.key, length);
+            switch (field.type)
+            {
+            case EBT_SIGNED :
+                EncodeOutput_(_Output, field.integer);
+                break;
+            case EBT_UNSIGNED :
+                EncodeOutput_(_Output, field.natural);
+                break;
+            case EBT_DOUBLE :
+                EncodeOutput_(_Output, field.real);
+                break;
+            case EBT_POINTER :
+                EncodeOutput_(_Output, field.pointer);
+                break;
+            case EBT_STRING :
+                EncodeOutput_(_Output, field.text, field.length);
+                break;
+            case EBT_BOOLEAN :
+                _Output += (char)EBT_BOOLEAN;
+                _Output += (char)((field.natural != 0) ? 1 : 0);
+                break;
+            }
+        }
+
+        Codec CreateGzipCodec(int level)
+        {
+#if USE_ZLIB
+            return std::make_shared< gzip::CCodec >(level);
+#else
+            return nullptr;
+#endif
+        }
+
+        SCompressStats GetCompressStats()
+        {
+            file::SCompressCounters& counters = file::GetCompressCounters();
+            SCompressStats           stats;
+            stats.files    = counters.files   .load(std::memory_order_relaxed);
+            stats.failures = counters.failures.load(std::memory_order_relaxed);
+            stats.input    = counters.input   .load(std::memory_order_relaxed);
+            stats.output   = counters.output  .load(std::memory_order_relaxed);
+            stats.elapsed  = counters.elapsed .load(std::memory_order_relaxed);
+            stats.cpu      = counters.cpu     .load(std::memory_order_relaxed);
+            return stats;
+        }
+
+        /* 16 以下每個值一格, 之後每個 2 的次方區間分成 8 格 */
+        uint32_t SHistogram::GetBucket(uint64_t value)
+        {
+            if (value < 16)
+                return (uint32_t)value;
+#if defined(_MSC_VER)
+            unsigned long exponent;
+            _BitScanReverse64(&exponent, value);
+#else
+            int exponent = 63 - __builtin_clzll(value);
+#endif
+            uint32_t bucket = (uint32_t)(exponent - 2) * 8 + (uint32_t)((value >> (exponent - 3)) & 7);
+            return (bucket < BUCKETS) ? bucket : BUCKETS - 1;
+        }
+
+        uint64_t SHistogram::GetUpper(uint32_t bucket)
+        {
+            if (bucket < 16)
+                return bucket;
+            uint32_t exponent = bucket / 8 + 2;
+            return ((uint64_t)(8 + bucket % 8 + 1) << (exponent - 3)) - 1;
+        }
+
+        uint64_t SHistogram::GetPercentile(double percent) const
+        {
+            if (count == 0)
+                return 0;
+            double   exact = (double)count * percent / 100.0;
+            uint64_t rank  = (uint64_t)exact;
+            if ((double)rank < exact)
+                ++rank;
+            if (rank == 0)
+                rank = 1;
+            uint64_t seen = 0;
+            for (uint32_t i = 0; i < BUCKETS - 1; ++i)
+            {
+                seen += buckets[i];
+                if (seen >= rank)
+                {
+                    uint64_t upper = GetUpper(i);
+                    return (upper < max) ? upper : max;
+                }
+            }
+            return max;
         }
     };
 };
@@ -2,12 +2,27 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <string>
 #include <memory>
 #include <mutex>
+#include <type_traits>
+#include <vector>
+
+/* 編譯期最低等級, 對應 E_LOG_LEVEL 的數值 (0 = ELL_EMERGENCY ... 7 = ELL_DEBUG).
+   例如 -DKKLOG_LEVEL=4 時 KKLOG_NOTICE/KKLOG_INFO/KKLOG_DEBUG 不會產生任何程式碼 */
+#if !defined(KKLOG_LEVEL)
+    #define KKLOG_LEVEL 7
+#endif
 
 namespace kkboylin
 {
@@ -52,15 +67,297 @@ namespace kkboylin
             EO_DAY,
             EO_THREAD,
             EO_LEVEL,
+            EO_MILLISECOND,     /**< \brief 時間顯示到毫秒. */
+            EO_MICROSECOND,     /**< \brief 時間顯示到微秒. */
+            EO_NANOSECOND,      /**< \brief 時間顯示到奈秒. */
 
             EO_COUNT
         };
 
+        struct SAsyncOptions
+        {
+            uint32_t interval;  /**< \brief 最長的輸出間隔(毫秒). */
+            uint32_t batch;     /**< \brief 累積的訊息數量達到此值時立即輸出. */
+            int      cpu;       /**< \brief 背景執行緒綁定的 CPU, -1 表示不綁定. */
+
+            SAsyncOptions() : interval(1000), batch(4096), cpu(-1) { }
+        };
+
+        enum E_FILE_DEVICE
+        {
+            EFD_STREAM,     /**< \brief 一般檔案輸出. */
+            EFD_MAPPED,     /**< \brief 記憶體映射輸出. */
+            EFD_ASYNC,      /**< \brief 非同步輸出 (io_uring 或背景執行緒). */
+        };
+
+        enum E_ROTATION
+        {
+            ER_NONE,        /**< \brief 不依時間換檔. */
+            ER_HOURLY,      /**< \brief 每小時換檔. */
+            ER_DAILY,       /**< \brief 每天換檔. */
+        };
+
+        /* 壓縮換檔下來的舊檔. 由背景執行緒依序呼叫 Begin, Compress..., End */
+        class CCodec
+        {
+        public :
+            virtual ~CCodec() { }
+
+            virtual const char* GetExtension() const = 0;  /* 壓縮檔的副檔名, 例如 ".gz" */
+            virtual bool        Begin       () = 0;
+            virtual bool        Compress    (const char* data, size_t size, std::string& output) = 0;
+            virtual bool        End         (std::string& output) = 0;
+        };
+        typedef std::shared_ptr< CCodec > Codec;
+
+        struct SCompressStats
+        {
+            uint64_t files;     /**< \brief 壓縮完成的檔案數量. */
+            uint64_t failures;  /**< \brief 壓縮失敗的檔案數量. */
+            uint64_t input;     /**< \brief 讀入的位元組數. */
+            uint64_t output;    /**< \brief 寫出的位元組數. */
+            uint64_t elapsed;   /**< \brief 壓縮花費的時間(奈秒), 不含限速等待. */
+            uint64_t cpu;       /**< \brief 壓縮使用的 CPU 時間(奈秒). */
+        };
+
+        /* 延遲分布(奈秒). 每個 2 的次方區間再均分成 8 格, 誤差不超過 12.5%.
+           超過 2^40 奈秒(約 18 分鐘)的都算在最後一格 */
+        struct SHistogram
+        {
+            enum { BUCKETS = 304 };
+
+            uint64_t count;             /**< \brief 樣本數量. */
+            uint64_t sum;               /**< \brief 樣本總和. */
+            uint64_t max;               /**< \brief 最大的樣本. */
+            uint64_t buckets[BUCKETS];  /**< \brief 各格的樣本數量, 以 GetBucket 換算. */
+
+            SHistogram() : count(0), sum(0), max(0) { memset(buckets, 0, sizeof(buckets)); }
+
+            uint64_t GetMean      () const { return (count > 0) ? sum / count : 0; }
+            uint64_t GetPercentile(double percent) const;  /* 至少 percent% 的樣本不超過傳回值 */
+
+            static uint32_t GetBucket(uint64_t value);
+            static uint64_t GetUpper (uint32_t bucket);    /* 該格的最大值 */
+        };
+
+        /* 一組每個執行緒各自一個的佇列 */
+        struct SQueueStats
+        {
+            uint64_t   enqueued;    /**< \brief 累計放入佇列的訊息數量. */
+            uint64_t   depth;       /**< \brief 目前還在佇列中的訊息數量. */
+            uint64_t   dropped;     /**< \brief 累計因為超過上限丟掉的訊息數量. */
+            SHistogram residency;   /**< \brief 訊息從放入到取出的時間, 抽樣量測. */
+
+            SQueueStats() : enqueued(0), depth(0), dropped(0) { }
+        };
+
+        struct SSinkStats
+        {
+            std::string name;       /**< \brief Append 時的名稱. */
+            SQueueStats queue;      /**< \brief 輸出端自己的佇列. 結構化訊息與直接呼叫 Output 的訊息才會放入. */
+            uint64_t    messages;   /**< \brief 交給輸出端的訊息數量. */
+            uint64_t    bytes;      /**< \brief 交給輸出端的位元組數. */
+            uint64_t    lost;       /**< \brief 寫入失敗而遺失的位元組數, 目前只有非同步檔案輸出會計算. */
+            SHistogram  drain;      /**< \brief 每次輸出佇列中訊息花費的時間. */
+
+            SSinkStats() : messages(0), bytes(0), lost(0) { }
+        };
+
+        struct SLogStats
+        {
+            SQueueStats               queue;    /**< \brief 所有緩衝輸出共用的佇列. */
+            SHistogram                enqueue;  /**< \brief 呼叫端產生一筆訊息的時間(含格式化), 抽樣量測. 自程式開始累計. */
+            SHistogram                drain;    /**< \brief 每次 Process 花費的時間. */
+            std::vector< SSinkStats > sinks;    /**< \brief 各個緩衝輸出. */
+        };
+
+        enum E_CONSOLE_COLOR
+        {
+            ECC_AUTO,       /**< \brief 輸出到終端機時才加上顏色, 設定 NO_COLOR 環境變數時不加. */
+            ECC_ALWAYS,     /**< \brief 一律加上顏色. */
+            ECC_NEVER,      /**< \brief 不加顏色. */
+        };
+
+        struct SConsoleOptions
+        {
+            int             handle; /**< \brief 輸出的檔案描述子, 預設為 stderr. */
+            E_CONSOLE_COLOR color;  /**< \brief 依等級加上 ANSI 顏色的方式. */
+            uint32_t        batch;  /**< \brief 累積多少位元組才寫出一次, 0 表示依是否為終端機自動決定. */
+
+            SConsoleOptions() : handle(2), color(ECC_AUTO), batch(0) { }
+        };
+
+        enum E_SYSLOG_TRANSPORT
+        {
+            EST_UDP,        /**< \brief UDP, 每筆訊息一個封包 (RFC 5426). */
+            EST_TCP,        /**< \brief TCP, 以長度作為分隔 (RFC 6587 octet counting). */
+            EST_UNIX,       /**< \brief Unix domain datagram socket, 例如 /dev/log. */
+        };
+
+        /* 以 RFC 5424 格式送到 syslog 收集端 */
+        struct SSyslogOptions
+        {
+            E_SYSLOG_TRANSPORT transport;   /**< \brief 傳輸方式. */
+            std::string        address;     /**< \brief "host:port" ("[::1]:514"), EST_UNIX 時為 socket 的路徑. */
+            std::string        app;         /**< \brief APP-NAME, 空字串表示不提供. */
+            uint32_t           facility;    /**< \brief syslog facility, 預設 1 (user). */
+            uint64_t           spill;       /**< \brief 收集端無法使用時最多暫存的位元組數, 超過時丟掉新的訊息. */
+            uint32_t           retry;       /**< \brief 斷線後重新連線的間隔(毫秒). */
+
+            SSyslogOptions() : transport(EST_UDP), address("127.0.0.1:514"), facility(1), spill(1024 * 1024 * 4), retry(1000) { }
+        };
+
+        /* 在記憶體中保留最近的訊息, 當機時寫到檔案 */
+        struct SFlightOptions
+        {
+            uint64_t    size;       /**< \brief 記錄區的大小(位元組), 格數取 2 的次方. */
+            uint32_t    slot;       /**< \brief 每一格的大小(64 ~ 1024 位元組), 較長的訊息會被截斷. */
+            std::string path;       /**< \brief 當機時寫出的檔案, 空字串表示寫到 stderr. */
+            bool        signals;    /**< \brief 攔截 SIGSEGV/SIGBUS/SIGFPE/SIGILL/SIGABRT, 寫出後交還原本的處理方式. */
+
+            SFlightOptions() : size(1024 * 1024 * 4), slot(256), signals(true) { }
+        };
+
+        struct SFileOptions
+        {
+            E_FILE_DEVICE device;   /**< \brief 寫入方式. */
+            E_ROTATION    rotation; /**< \brief 依時間換檔的週期. */
+            uint64_t      size;     /**< \brief 檔案超過此大小就換檔, 0 表示不限制. */
+            uint32_t      keep;     /**< \brief 最多保留的舊檔數量, 0 表示不限制. */
+            uint64_t      total;    /**< \brief 舊檔的總大小上限, 0 表示不限制. */
+            uint64_t      segment;  /**< \brief 記憶體映射輸出每次預先配置的大小. */
+            Codec         codec;    /**< \brief 壓縮舊檔的方式, nullptr 表示不壓縮. */
+            uint64_t      rate;     /**< \brief 壓縮時每秒最多讀入的位元組數, 0 表示不限制. */
+
+            SFileOptions() : device(EFD_STREAM), rotation(ER_DAILY), size(0), keep(0), total(0), segment(1024 * 1024 * 32), rate(1024 * 1024 * 32) { }
+        };
+
+        enum E_BACKPRESSURE
+        {
+            EB_BLOCK,       /**< \brief 等待輸出端消化, 必要時由呼叫端自行輸出. */
+            EB_DROP_NEWEST, /**< \brief 丟掉新的訊息. */
+            EB_DROP_OLDEST, /**< \brief 丟掉佇列中最舊的訊息. */
+            EB_DROP_LEVEL,  /**< \brief 丟掉比指定等級更不重要的新訊息, 其餘等待. */
+        };
+
+        /* 佇列中最多可以累積的訊息 */
+        struct SBudget
+        {
+            uint64_t       bytes;   /**< \brief 佇列最多佔用的位元組數, 0 表示不限制. */
+            uint32_t       entries; /**< \brief 佇列最多累積的訊息數量, 0 表示不限制. */
+            E_BACKPRESSURE policy;  /**< \brief 超過上限時的處理方式. */
+            E_LOG_LEVEL    level;   /**< \brief EB_DROP_LEVEL 時保留的最低等級. */
+
+            SBudget() : bytes(1024 * 1024 * 64), entries(0), policy(EB_BLOCK), level(ELL_WARNING) { }
+        };
+
+        /* 將延遲格式化的參數轉成文字 */
+        typedef void (*Renderer)(std::string& output, const char* format, const char* data);
+
+        /* 二進位輸出中每個參數開頭的型態 */
+        enum E_BINARY_TYPE
+        {
+            EBT_SIGNED   = 1,   /**< \brief 有號整數, zigzag 後以 varint 儲存. */
+            EBT_UNSIGNED = 2,   /**< \brief 無號整數, 以 varint 儲存. */
+            EBT_DOUBLE   = 3,   /**< \brief 浮點數, 8 個位元組的 IEEE 754 (little-endian). */
+            EBT_STRING   = 4,   /**< \brief 字串, varint 長度後接著內容. */
+            EBT_POINTER  = 5,   /**< \brief 指標, 以 varint 儲存. */
+            EBT_BOOLEAN  = 6,   /**< \brief 布林值, 1 個位元組. */
+            EBT_OBJECT   = 7,   /**< \brief 只用在 SField, 自訂型態編碼時會展開成多個欄位. */
+        };
+
+        /* 二進位輸出中每筆紀錄開頭的種類. 數字都以 varint 儲存 */
+        enum E_BINARY_RECORD
+        {
+            EBR_HEADER  = 'K',  /**< \brief 檔頭 "KKLB", 版本, 基準時間(奈秒). 之後的編號重新開始. */
+            EBR_FORMAT  = 'F',  /**< \brief 格式字串: 編號(從 1 開始), 長度, 內容. */
+            EBR_THREAD  = 'T',  /**< \brief 執行緒: 編號(從 0 開始), 執行緒識別碼. */
+            EBR_MESSAGE = 'M',  /**< \brief 訊息: 等級(1 個位元組), 時間差, 執行緒編號, 格式編號(0 表示文字), 長度, 參數或文字. */
+            EBR_FIELDS  = 'S',  /**< \brief 結構化訊息: 等級(1 個位元組), 時間差, 執行緒編號, 長度, 訊息與欄位. */
+        };
+
+        struct SField;
+        class  CFields;
+
+        /* 將延遲格式化的參數轉成二進位輸出的格式 */
+        typedef void (*Encoder)(std::string& output, const char* data);
+
+        /* 格式化的目的地. 直接寫入輸出佇列保留的空間, 放不下時由 Grow 擴大.
+           成員名稱與 std::string 相同, 讓格式化的樣板兩者都能使用 */
+        class CWriter
+        {
+        protected :
+            char*  _Data;
+            size_t _Size;
+            size_t _Capacity;   /* 不含結尾的 0 */
+
+            CWriter() : _Data(nullptr), _Size(0), _Capacity(0) { }
+
+            virtual ~CWriter() { }
+
+            /* 擴大到至少 capacity 個位元組, 已寫入的內容不變 */
+            virtual void Grow(size_t capacity) = 0;
+
+            char* Extend(size_t length)
+            {
+                if (_Size + length > _Capacity)
+                    Grow(_Size + length);
+                char* ptr = &_Data[_Size];
+                _Size += length;
+                return ptr;
+            }
+
+        public :
+            size_t size() const { return _Size; }
+
+            char& operator[](size_t index) { return _Data[index]; }
+
+            void resize(size_t size)
+            {
+                if (size > _Capacity)
+                    Grow(size);
+                _Size = size;
+            }
+
+            void append(const char* text, size_t length) { memcpy(Extend(length), text, length); }
+            void append(size_t count, char value)         { memset(Extend(count), value, count); }
+
+            CWriter& operator+=(char value)               { *Extend(1) = value; return *this; }
+            CWriter& operator+=(const char* text)         { append(text, strlen(text)); return *this; }
+            CWriter& operator+=(const std::string& text)  { append(text.data(), text.size()); return *this; }
+        };
+
+        /*
+         * 具名的分類, 以 '.' 分層, 例如 "db.pool" 的上層是 "db". 由 GetCategory 取得, 不會釋放, 可以保存起來重複使用.
+         * 有效等級取自己或最近的上層設定的等級, 都沒有設定時與 CManager 的等級相同, 設定改變時由設定的一方重新計算.
+         */
+        class CCategory
+        {
+        private :
+            CCategory                 (const CCategory& other) {               }
+            const CCategory& operator=(const CCategory& other) { return *this; }
+
+        protected :
+            std::atomic< int > _Level;  /* 有效等級, 沒有 CManager 時為 -1 */
+            const char*        _Name;
+
+            CCategory() : _Level(-1), _Name("") { }
+
+            virtual ~CCategory() { }
+
+        public :
+            /* 只讀取一次有效等級 */
+            bool IsEnabled(E_LOG_LEVEL level) const { return _Level.load(std::memory_order_relaxed) >= (int)level; }
+
+            const char* GetName() const { return _Name; }
+        };
+
         class CManager
         {
             friend std::shared_ptr< CManager >;
         private :
-            static CManager* _Instance;
+            static CManager*          _Instance;
+            static std::atomic< int > _Threshold;   /* 目前開啟的等級, 沒有 CManager 時為 -1 */
 
             CManager                 (const CManager& other) {               }
             const CManager& operator=(const CManager& other) { return *this; }
@@ -70,9 +367,14 @@ namespace kkboylin
 
             virtual ~CManager();
 
+            static void SetThreshold(E_LOG_LEVEL level);  /* 同時更新沒有自行設定等級的分類 */
+
         public :
             static CManager* GetInstance() { return _Instance; }
 
+            /* 不需經過虛擬函式就能判斷等級是否開啟 */
+            static bool IsEnabled(E_LOG_LEVEL level) { return _Threshold.load(std::memory_order_relaxed) >= (int)level; }
+
             virtual E_LOG_LEVEL GetLevel       () const = 0;
             virtual void        Process        () = 0;
             virtual void        Append         (const std::string& name, const Output& output) = 0;
@@ -83,6 +385,19 @@ namespace kkboylin
             virtual bool        EnableOption   (E_OPTIONS option) = 0;
             virtual bool        DisableOption  (E_OPTIONS option) = 0;
             virtual bool        IsEnabledOption(E_OPTIONS option) const = 0;
+            virtual bool        StartAsync     (const SAsyncOptions& options = SAsyncOptions()) = 0;
+            virtual void        StopAsync      () = 0;
+            virtual bool        IsAsync        () const = 0;
+            virtual char*       Reserve        (E_LOG_LEVEL level, const char* format, Renderer render, Encoder encode, uint32_t size) = 0;
+            virtual void        Commit         () = 0;
+            virtual SBudget     GetBudget      () const = 0;                /* 所有緩衝輸出共用的佇列上限 */
+            virtual void        SetBudget      (const SBudget& value) = 0;
+            virtual uint64_t    GetDropped     () const = 0;
+            virtual void        Fields         (E_LOG_LEVEL level, const char* msg, const SField* const* fields, uint32_t count) = 0;
+            virtual CWriter*    Begin          (E_LOG_LEVEL level, const CCategory* category = nullptr) = 0;  /* 開始一筆訊息並寫入前綴, nullptr 表示不需要輸出. 指定分類時依分類的等級判斷 */
+            virtual void        End            (CWriter* writer) = 0;
+            virtual SLogStats   GetStats       () = 0;
+            virtual void        SetStatsPeriod (uint32_t milliseconds) = 0; /* 每隔多久由 Process 輸出統計, 0 表示不輸出 */
         };
 
         typedef std::shared_ptr< CManager > Manager;
@@ -90,19 +405,59 @@ namespace kkboylin
         class CBufferOutput : public COutput
         {
         public :
-            virtual bool IsImmediately () const = 0;            
-            virtual void SetImmediately(bool value) = 0;
+            virtual bool       IsImmediately () const = 0;            
+            virtual void       SetImmediately(bool value) = 0;
+            virtual SBudget    GetBudget     () const = 0;
+            virtual void       SetBudget     (const SBudget& value) = 0;
+            virtual uint64_t   GetDropped    () const = 0;  /* 累計丟掉的訊息數量 */
+            virtual SSinkStats GetStats      () const = 0;  /* name 由 CManager::GetStats 填入 */
         };
 
         typedef std::shared_ptr< CBufferOutput > BufferOutput;
 
+        /* 呼叫 Output 時直接寫入固定大小的環狀記錄區, 滿了就覆蓋最舊的, 不需要 Process */
+        class CFlightRecorder : public COutput
+        {
+        public :
+            virtual bool Dump(const std::string& path) const = 0;  /* 寫出目前保留的訊息, 空字串表示 stderr */
+        };
+
+        typedef std::shared_ptr< CFlightRecorder > FlightRecorder;
+
         Manager Create(E_LOG_LEVEL level = ELL_INFO);
         BufferOutput CreateConsoleOutput(E_LOG_LEVEL level);
+        BufferOutput CreateConsoleOutput(E_LOG_LEVEL level, const SConsoleOptions& options);
         BufferOutput CreateDebugerOutput(E_LOG_LEVEL level);
+        BufferOutput CreateNullOutput   (E_LOG_LEVEL level);
         BufferOutput CreateFileOutput   (E_LOG_LEVEL level, const std::string& name, const std::string& directory = "./logs");
+        BufferOutput CreateFileOutput   (E_LOG_LEVEL level, const std::string& name, const std::string& directory, const SFileOptions& options);
+        BufferOutput CreateAsyncFileOutput (E_LOG_LEVEL level, const std::string& name, const std::string& directory = "./logs");
+        BufferOutput CreateMappedFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory = "./logs", uint64_t segment = 1024 * 1024 * 32);
+        /* 二進位檔案輸出, 副檔名為 .klog. 以 tools/logdecode 轉回文字或 JSON */
+        BufferOutput CreateBinaryFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory = "./logs");
+        BufferOutput CreateBinaryFileOutput(E_LOG_LEVEL level, const std::string& name, const std::string& directory, const SFileOptions& options);
+        /* 每筆訊息一行 JSON, 副檔名為 .jsonl. LogFields 的欄位會成為 JSON 的欄位 */
+        BufferOutput CreateJsonFileOutput  (E_LOG_LEVEL level, const std::string& name, const std::string& directory = "./logs");
+        BufferOutput CreateJsonFileOutput  (E_LOG_LEVEL level, const std::string& name, const std::string& directory, const SFileOptions& options);
+        BufferOutput CreateSyslogOutput    (E_LOG_LEVEL level, const SSyslogOptions& options);  /* 無法解析位址或平台不支援時傳回 nullptr */
+        /* 通常以 ELL_DEBUG 建立, CManager 也設為 ELL_DEBUG, 其他輸出用自己的等級過濾. 同時只有最後建立的一個處理當機 */
+        FlightRecorder CreateFlightRecorder(E_LOG_LEVEL level, const SFlightOptions& options = SFlightOptions());
+
+        CCategory* GetCategory       (const std::string& name);                     /* 第一次使用時建立, 之後傳回同一個 */
+        void       SetCategoryLevel  (const std::string& name, E_LOG_LEVEL level);  /* 包含沒有自行設定等級的下層分類. (E_LOG_LEVEL)-1 表示關閉 */
+        void       ResetCategoryLevel(const std::string& name);                     /* 改回使用上層的等級 */
+
+        Codec          CreateGzipCodec (int level = 6);    /* 沒有 zlib 時傳回 nullptr */
+        SCompressStats GetCompressStats();
 
         namespace
         {
+            /* 編譯期等級與執行期等級都開啟時才輸出 */
+            static inline bool IsEnabled_(E_LOG_LEVEL level)
+            {
+                return ((int)level <= KKLOG_LEVEL) && CManager::IsEnabled(level);
+            }
+
             static inline int GetFormatLength_(const char* fmt)
             {
                 const char* ptr = &fmt[1];
@@ -163,154 +518,1631 @@ namespace kkboylin
                 return -1;
             }
 
+            enum E_FORMAT_CATEGORY
+            {
+                EFC_NONE,
+                EFC_INTEGER,
+                EFC_FLOAT,
+                EFC_POINTER,
+                EFC_CSTRING,
+                EFC_STRING,
+                EFC_CUSTOM
+            };
+
             template< typename T >
-            static void ValueOutput_(std::string& output, const char*& fmt, const T& value)
+            struct SCategory_
             {
-                int count = GetFormatLength_(fmt);
-                if (count > 0)
+                enum
                 {
-                    char        buffer[1024 * 8];
-                    std::string format(fmt, count + 1);
-                    int         idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), value);
-                    if (idx > 0)
-                    {
-                        buffer[idx] = 0;
-                        output += buffer;
-                    }
-                    fmt += (count + 1);
+                    value = std::is_floating_point< T >::value                         ? EFC_FLOAT   :
+                            (std::is_integral< T >::value || std::is_enum< T >::value) ? EFC_INTEGER :
+                            std::is_pointer< T >::value                                ? EFC_POINTER :
+                            std::is_class< T >::value                                  ? EFC_CUSTOM  :
+                                                                                         EFC_NONE
+                };
+            };
+
+            template<> struct SCategory_< char* >       { enum { value = EFC_CSTRING }; };
+            template<> struct SCategory_< const char* > { enum { value = EFC_CSTRING }; };
+            template<> struct SCategory_< std::string > { enum { value = EFC_STRING  }; };
+
+            /* 可變參數的整數提升, 與直接交給 snprintf 時相同 */
+            template< typename T, bool E = std::is_enum< T >::value >
+            struct SPromote_
+            {
+                typedef decltype(+T()) type;
+            };
+
+            template< typename T >
+            struct SPromote_< T, true >
+            {
+                typedef typename SPromote_< typename std::underlying_type< T >::type >::type type;
+            };
+
+            /* 00 ~ 99, 每次除以 100 輸出兩位數字 */
+            static const char DIGIT_PAIRS_[] = "00010203040506070809"
+                                               "10111213141516171819"
+                                               "20212223242526272829"
+                                               "30313233343536373839"
+                                               "40414243444546474849"
+                                               "50515253545556575859"
+                                               "60616263646566676869"
+                                               "70717273747576777879"
+                                               "80818283848586878889"
+                                               "90919293949596979899";
+
+            /* 10^0 ~ 10^22 都能以 double 精確表示 */
+            static const double POWERS_[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                              1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+            /* 由 end 往前寫入十進位數字, 傳回第一個字元的位置 */
+            static inline char* DigitsOutput_(char* end, unsigned long long value)
+            {
+                while (value >= 100)
+                {
+                    unsigned index = (unsigned)(value % 100) * 2;
+                    value /= 100;
+                    *--end = DIGIT_PAIRS_[index + 1];
+                    *--end = DIGIT_PAIRS_[index];
+                }
+                if (value >= 10)
+                {
+                    unsigned index = (unsigned)value * 2;
+                    *--end = DIGIT_PAIRS_[index + 1];
+                    *--end = DIGIT_PAIRS_[index];
                 }
                 else
                 {
-                    fmt += strlen(fmt);
+                    *--end = (char)('0' + value);
                 }
+                return end;
             }
 
-            static void ValueOutput_(std::string& output, const char*& fmt, const std::string& value)
+            static inline char* RadixDigits_(char* end, unsigned long long value, unsigned shift, const char* digits)
             {
-                int count = GetFormatLength_(fmt);
-                if (count > 0)
+                unsigned mask = (1u << shift) - 1;
+                do
                 {
-                    if (count == 1)
+                    *--end = digits[value & mask];
+                    value >>= shift;
+                } while (value != 0);
+                return end;
+            }
+
+            /* 由 ptr 往後寫入剛好 count 位數字, 不足時前面補 '0'. value 必須小於 10^count */
+            static inline char* PaddedDigits_(char* ptr, unsigned long long value, int count)
+            {
+                if (count <= 0)
+                    return ptr;
+                char* end   = ptr + count;
+                char* first = DigitsOutput_(end, value);
+                while (first > ptr)
+                    *--first = '0';
+                return end;
+            }
+
+            template< typename O >
+            static void UnsignedOutput_(O& output, unsigned long long value)
+            {
+                char buffer[24];
+                char* ptr = DigitsOutput_(&buffer[sizeof(buffer)], value);
+                output.append(ptr, &buffer[sizeof(buffer)] - ptr);
+            }
+
+            template< typename O >
+            static void SignedOutput_(O& output, long long value)
+            {
+                if (value < 0)
+                {
+                    output += '-';
+                    UnsignedOutput_(output, 0ull - (unsigned long long)value);
+                }
+                else
+                {
+                    UnsignedOutput_(output, (unsigned long long)value);
+                }
+            }
+
+            template< typename O >
+            static void RadixOutput_(O& output, unsigned long long value, unsigned shift, const char* digits)
+            {
+                char  buffer[24];
+                char* ptr = RadixDigits_(&buffer[sizeof(buffer)], value, shift, digits);
+                output.append(ptr, &buffer[sizeof(buffer)] - ptr);
+            }
+
+            /* 不會截斷, 超過暫存區時直接寫入 output */
+            template< typename O, typename T >
+            static void SnprintfOutput_(O& output, const char* spec, T value)
+            {
+                char buffer[128];
+                int  length = snprintf(buffer, sizeof(buffer), spec, value);
+                if (length > 0)
+                {
+                    if (length < (int)sizeof(buffer))
                     {
-                        output += value;
+                        output.append(buffer, length);
                     }
                     else
                     {
-                        char        buffer[1024 * 8];
-                        std::string format(fmt, count + 1);
-                        int         idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), value.c_str());
-                        if (idx > 0)
-                        {
-                            buffer[idx] = 0;
-                            output += buffer;
-                        }
+                        size_t index = output.size();
+                        output.resize(index + length + 1);
+                        snprintf(&output[index], length + 1, spec, value);
+                        output.resize(index + length);
                     }
-                    fmt += (count + 1);
+                }
+            }
+
+            /* fmt 不一定以 0 結尾, 先複製出單一轉換再交給 snprintf */
+            template< typename O, typename T >
+            static void SpecOutput_(O& output, const char* fmt, int count, const T& value)
+            {
+                char spec[64];
+                if (count + 1 < (int)sizeof(spec))
+                {
+                    memcpy(spec, fmt, count + 1);
+                    spec[count + 1] = 0;
+                    SnprintfOutput_(output, spec, value);
                 }
                 else
                 {
-                    fmt += strlen(fmt);
+                    SnprintfOutput_(output, std::string(fmt, count + 1).c_str(), value);
                 }
             }
 
-            static void ValueOutput_(std::string& output, const char*& fmt, const char* value)
+            /* 執行期解析的單一轉換, 例如 "%-08.3f" */
+            struct SPrintSpec_
             {
-                int count = GetFormatLength_(fmt);
-                if (count > 0)
+                int  width;
+                int  precision;     /* 沒有指定時為 -1 */
+                int  shorts;        /* 'h' 的個數 */
+                char conversion;
+                char sign;          /* '+', ' ' 或 0 */
+                bool left;
+                bool zero;
+                bool alternate;
+            };
+
+            /* fmt[0] 為 '%', fmt[count] 為轉換字元. 有 '*' 或 'L' 時傳回 false, 交給 snprintf */
+            static bool ParseSpec_(SPrintSpec_& spec, const char* fmt, int count)
+            {
+                const char* ptr = &fmt[1];
+                const char* end = &fmt[count];
+                spec.width      = 0;
+                spec.precision  = -1;
+                spec.shorts     = 0;
+                spec.conversion = *end;
+                spec.sign       = 0;
+                spec.left       = false;
+                spec.zero       = false;
+                spec.alternate  = false;
+                for (;; ++ptr)
                 {
-                    if (count == 1)
+                    if (*ptr == '-')
+                        spec.left = true;
+                    else
+                    if (*ptr == '+')
+                        spec.sign = '+';
+                    else
+                    if (*ptr == ' ')
+                        spec.sign = (spec.sign == 0) ? ' ' : spec.sign;
+                    else
+                    if (*ptr == '#')
+                        spec.alternate = true;
+                    else
+                    if (*ptr == '0')
+                        spec.zero = true;
+                    else
+                        break;
+                }
+                for (; (*ptr >= '0') && (*ptr <= '9'); ++ptr)
+                {
+                    spec.width = spec.width * 10 + (*ptr - '0');
+                    if (spec.width > 4096)
+                        return false;
+                }
+                if (*ptr == '.')
+                {
+                    spec.precision = 0;
+                    for (++ptr; (*ptr >= '0') && (*ptr <= '9'); ++ptr)
                     {
-                        output += value;
+                        spec.precision = spec.precision * 10 + (*ptr - '0');
+                        if (spec.precision > 4096)
+                            return false;
                     }
-                    else
+                }
+                for (; ptr < end; ++ptr)
+                {
+                    switch (*ptr)
                     {
-                        char        buffer[1024 * 8];
-                        std::string format(fmt, count + 1);
-                        int         idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), value);
-                        if (idx > 0)
-                        {
-                            buffer[idx] = 0;
-                            output += buffer;
-                        }
+                        case 'h' :
+                            ++spec.shorts;
+                            break;
+
+                        case 'l' :
+                        case 'q' :
+                        case 'j' :
+                        case 'z' :
+                        case 't' :
+                            break;
+
+                        case 'I' :
+                            if( ((ptr[1] == '6') && (ptr[2] == '4')) ||
+                                ((ptr[1] == '3') && (ptr[2] == '2')) )
+                                ptr += 2;
+                            break;
+
+                        default:
+                            return false;
+                    }
+                }
+                return (ptr == end);
+            }
+
+            /* 依寬度補空白或 '0'. prefix 為正負號或 "0x", 補 '0' 時放在 prefix 之後 */
+            template< typename O >
+            static void PadOutput_(O& output, const SPrintSpec_& spec, bool zero,
+                                   const char* prefix, size_t count, const char* text, size_t length)
+            {
+                size_t pad = ((size_t)spec.width > count + length) ? (size_t)spec.width - count - length : 0;
+                if( (spec.left == false) &&
+                    (zero == false) )
+                    output.append(pad, ' ');
+                output.append(prefix, count);
+                if( (spec.left == false) &&
+                    (zero == true) )
+                    output.append(pad, '0');
+                output.append(text, length);
+                if (spec.left == true)
+                    output.append(pad, ' ');
+            }
+
+            /* %d %i %u %o %x %X. value 為絕對值 */
+            template< typename O >
+            static bool IntegerOutput_(O& output, const SPrintSpec_& spec, unsigned long long value, bool negative)
+            {
+                char   buffer[48];
+                char*  end = &buffer[sizeof(buffer)];
+                char*  ptr = end;
+                char   prefix[2];
+                size_t count = 0;
+                if (spec.precision > 32)
+                    return false;
+                if( (value != 0) ||
+                    (spec.precision != 0) )
+                {
+                    switch (spec.conversion)
+                    {
+                        case 'd' :
+                        case 'i' :
+                        case 'u' : ptr = DigitsOutput_(end, value);                          break;
+                        case 'o' : ptr = RadixDigits_ (end, value, 3, "01234567");           break;
+                        case 'x' : ptr = RadixDigits_ (end, value, 4, "0123456789abcdef");   break;
+                        case 'X' : ptr = RadixDigits_ (end, value, 4, "0123456789ABCDEF");   break;
+                        default  : return false;
                     }
-                    fmt += (count + 1);
                 }
+                while (end - ptr < spec.precision)
+                    *--ptr = '0';
+                if (negative == true)
+                    prefix[count++] = '-';
                 else
+                if( (spec.sign != 0) &&
+                    ((spec.conversion == 'd') || (spec.conversion == 'i')) )
+                    prefix[count++] = spec.sign;
+                if (spec.alternate == true)
                 {
-                    fmt += strlen(fmt);
+                    if( (spec.conversion == 'o') &&
+                        ((ptr == end) || (*ptr != '0')) )
+                        *--ptr = '0';
+                    else
+                    if( ((spec.conversion == 'x') || (spec.conversion == 'X')) &&
+                        (value != 0) )
+                    {
+                        prefix[count++] = '0';
+                        prefix[count++] = spec.conversion;
+                    }
                 }
+                PadOutput_(output, spec, (spec.zero == true) && (spec.precision < 0), prefix, count, ptr, end - ptr);
+                return true;
             }
 
-            static void LogOutput(E_LOG_LEVEL level, const char* format) // base function
+            /* value * 10^scale 四捨五入成整數. 乘法或除法只有一次捨入誤差,
+               結果離 .5 太近或超出 10^15 時無法確定正確的進位, 傳回 false */
+            static inline bool ScaleDigits_(double value, int scale, unsigned long long& digits)
             {
-                if (CManager::GetInstance()->GetLevel() >= level)
-                    CManager::GetInstance()->Printf(level, format);
+                if( (scale > 22) ||
+                    (scale < -22) )
+                    return false;
+                double product = (scale >= 0) ? value * POWERS_[scale] : value / POWERS_[-scale];
+                if ((product < 1e15) == false)
+                    return false;
+                unsigned long long whole    = (unsigned long long)product;
+                double             fraction = product - (double)whole;
+                double             margin   = product * 4.5e-16;
+                if( (fraction > 0.5 - margin) &&
+                    (fraction < 0.5 + margin) )
+                    return false;
+                digits = whole + ((fraction > 0.5) ? 1 : 0);
+                return true;
             }
 
-            static void LogOutput(E_LOG_LEVEL level, const std::string& format)
+            /* 取得 significant 位有效數字與十進位指數. value 為正數 */
+            static bool SignificantDigits_(double value, int significant, unsigned long long& digits, int& exponent)
             {
-                if (CManager::GetInstance()->GetLevel() >= level)
-                    CManager::GetInstance()->Printf(level, format.c_str());
+                if (significant > 15)
+                    return false;
+                if (value == 0)
+                {
+                    digits   = 0;
+                    exponent = 0;
+                    return true;
+                }
+                uint64_t bits;
+                memcpy(&bits, &value, sizeof(bits));
+                /* floor(二進位指數 * log10(2)), 最多差 1 */
+                int guess = ((int)((bits >> 52) & 0x7ff) - 1023) * 78913 >> 18;
+                for (int retry = 0; retry < 3; ++retry)
+                {
+                    if (ScaleDigits_(value, significant - 1 - guess, digits) == false)
+                        return false;
+                    if (digits >= (unsigned long long)POWERS_[significant])
+                        ++guess;
+                    else
+                    if (digits < (unsigned long long)POWERS_[significant - 1])
+                        --guess;
+                    else
+                    {
+                        exponent = guess;
+                        return true;
+                    }
+                }
+                return false;
             }
 
-            static void _LogOutput(E_LOG_LEVEL level, std::string& output, const char* format)
+            /* %f, 整數部分直接轉換, 小數部分乘上 10^precision. 傳回長度, 無法處理時傳回 -1 */
+            static int FixedDigits_(char* buffer, double value, int precision)
             {
-                output += format;
+                unsigned long long fraction;
+                if( (value >= 9007199254740992.0) ||
+                    (precision > 15) )
+                    return -1;
+                unsigned long long whole = (unsigned long long)value;
+                if (ScaleDigits_(value - (double)whole, precision, fraction) == false)
+                    return -1;
+                if (fraction >= (unsigned long long)POWERS_[precision])
+                {
+                    ++whole;
+                    fraction = 0;
+                }
+                char  digits[24];
+                char* first = DigitsOutput_(&digits[sizeof(digits)], whole);
+                char* ptr   = buffer;
+                memcpy(ptr, first, &digits[sizeof(digits)] - first);
+                ptr += &digits[sizeof(digits)] - first;
+                if (precision > 0)
+                {
+                    *ptr++ = '.';
+                    ptr = PaddedDigits_(ptr, fraction, precision);
+                }
+                return (int)(ptr - buffer);
             }
 
-            static void _LogOutput(E_LOG_LEVEL level, std::string& output, const std::string& format)
+            static char* ExponentOutput_(char* ptr, int exponent, char symbol)
             {
-                output += format;
+                *ptr++ = symbol;
+                *ptr++ = (exponent < 0) ? '-' : '+';
+                exponent = (exponent < 0) ? -exponent : exponent;
+                if (exponent >= 100)
+                    *ptr++ = (char)('0' + exponent / 100);
+                *ptr++ = DIGIT_PAIRS_[(exponent % 100) * 2];
+                *ptr++ = DIGIT_PAIRS_[(exponent % 100) * 2 + 1];
+                return ptr;
             }
 
-            template<typename T, typename... Targs>
-            static void _LogOutput(E_LOG_LEVEL level,
-                                   std::string& output,
-                                   const char* format,
-                                   T value, Targs... Fargs)
+            /* %e */
+            static int ScientificDigits_(char* buffer, double value, int precision, char symbol)
             {
-                if (CManager::GetInstance()->GetLevel() >= level)
+                unsigned long long digits;
+                int                exponent;
+                if (SignificantDigits_(value, precision + 1, digits, exponent) == false)
+                    return -1;
+                char text[16];
+                PaddedDigits_(text, digits, precision + 1);
+                char* ptr = buffer;
+                *ptr++ = text[0];
+                if (precision > 0)
                 {
-                    for (; *format != '\0'; format++)
-                    {
-                        if (*format == '%')
-                        {
-                            if (format[1] != '%')
-                            {
-                                ValueOutput_(output, format, value);
-                                _LogOutput(level, output, format, Fargs...);
-                                break;
-                            }
-                        }
-                        output += *format;
-                    }
+                    *ptr++ = '.';
+                    memcpy(ptr, &text[1], precision);
+                    ptr += precision;
                 }
+                return (int)(ExponentOutput_(ptr, exponent, symbol) - buffer);
             }
 
-            template<typename T, typename... Targs>
-            static void LogOutput(E_LOG_LEVEL level, const char* format, T value, Targs... Fargs)
+            /* %g, 去掉小數尾端的 '0' */
+            static int GeneralDigits_(char* buffer, double value, int precision, char symbol)
             {
-                if (CManager::GetInstance()->GetLevel() >= level)
+                unsigned long long digits;
+                int                exponent;
+                int                significant = (precision == 0) ? 1 : precision;
+                if (SignificantDigits_(value, significant, digits, exponent) == false)
+                    return -1;
+                char text[16];
+                PaddedDigits_(text, digits, significant);
+                while( (significant > 1) &&
+                       (text[significant - 1] == '0') )
+                    --significant;
+                char* ptr = buffer;
+                if( (exponent < -4) ||
+                    (exponent >= ((precision == 0) ? 1 : precision)) )
                 {
-                    std::string output;
-                    for (; *format != '\0'; format++)
+                    *ptr++ = text[0];
+                    if (significant > 1)
                     {
-                        if (*format == '%')
-                        {
-                            if (format[1] != '%')
-                            {
-                                ValueOutput_(output, format, value);
-                                _LogOutput(level, output, format, Fargs...);
-                                break;
-                            }
-                        }
-                        output += *format;
+                        *ptr++ = '.';
+                        memcpy(ptr, &text[1], significant - 1);
+                        ptr += significant - 1;
+                    }
+                    ptr = ExponentOutput_(ptr, exponent, symbol);
+                }
+                else
+                if (exponent < 0)
+                {
+                    *ptr++ = '0';
+                    *ptr++ = '.';
+                    for (int i = -1; i > exponent; --i)
+                        *ptr++ = '0';
+                    memcpy(ptr, text, significant);
+                    ptr += significant;
+                }
+                else
+                {
+                    for (int i = 0; i <= exponent; ++i)
+                        *ptr++ = (i < significant) ? text[i] : '0';
+                    if (significant > exponent + 1)
+                    {
+                        *ptr++ = '.';
+                        memcpy(ptr, &text[exponent + 1], significant - exponent - 1);
+                        ptr += significant - exponent - 1;
                     }
-                    CManager::GetInstance()->Printf( level, output.c_str() );
                 }
+                return (int)(ptr - buffer);
             }
-        }
-    };
-};
+
+            /* %f %e %g. 結果與 snprintf 相同; inf, nan, '#' 或無法確定進位時傳回 false */
+            template< typename O >
+            static bool FloatOutput_(O& output, const SPrintSpec_& spec, double value)
+            {
+                char     buffer[64];
+                int      length    = -1;
+                int      precision = (spec.precision < 0) ? 6 : spec.precision;
+                uint64_t bits;
+                if( ((value - value) != 0) ||
+                    (spec.alternate == true) )
+                    return false;
+                memcpy(&bits, &value, sizeof(bits));
+                switch (spec.conversion)
+                {
+                    case 'f' :
+                    case 'F' : length = FixedDigits_     (buffer, (value < 0) ? -value : value, precision);      break;
+                    case 'e' : length = ScientificDigits_(buffer, (value < 0) ? -value : value, precision, 'e'); break;
+                    case 'E' : length = ScientificDigits_(buffer, (value < 0) ? -value : value, precision, 'E'); break;
+                    case 'g' : length = GeneralDigits_   (buffer, (value < 0) ? -value : value, precision, 'e'); break;
+                    case 'G' : length = GeneralDigits_   (buffer, (value < 0) ? -value : value, precision, 'E'); break;
+                }
+                if (length < 0)
+                    return false;
+                char prefix = ((bits >> 63) != 0) ? '-' : spec.sign;
+                PadOutput_(output, spec, spec.zero, &prefix, (prefix != 0) ? 1 : 0, buffer, length);
+                return true;
+            }
+
+            /* 能還原成相同 double 的 %.15g, 不行時改用 %.17g. buffer 至少 32 個字元 */
+            static int RoundTripOutput_(char* buffer, size_t size, double value)
+            {
+                unsigned long long digits;
+                int                exponent;
+                double             magnitude = (value < 0) ? -value : value;
+                if( ((value - value) == 0) &&
+                    (SignificantDigits_(magnitude, 15, digits, exponent) == true) )
+                {
+                    /* digits 與 10^scale 都是精確值, 一次運算的結果就是最接近的 double */
+                    int    scale  = 14 - exponent;
+                    double result = (scale >= 0) ? (double)digits / POWERS_[scale] : (double)digits * POWERS_[-scale];
+                    if (result == magnitude)
+                    {
+                        uint64_t bits;
+                        memcpy(&bits, &value, sizeof(bits));
+                        buffer[0] = '-';
+                        return (int)((bits >> 63) + GeneralDigits_(&buffer[bits >> 63], magnitude, 15, 'e'));
+                    }
+                    return snprintf(buffer, size, "%.17g", value);
+                }
+                int length = snprintf(buffer, size, "%.15g", value);
+                if (strtod(buffer, nullptr) != value)
+                    length = snprintf(buffer, size, "%.17g", value);
+                return length;
+            }
+
+            /* 整數, 浮點數與指標自行轉換, 其他情況交給 snprintf */
+            template< typename O, typename T >
+            static void NumberOutput_(O& output, const char* fmt, int count, const T& value, std::integral_constant< int, EFC_INTEGER >)
+            {
+                typedef typename SPromote_< T >::type                  Promoted;
+                typedef typename std::make_signed< Promoted >::type   Signed;
+                typedef typename std::make_unsigned< Promoted >::type Unsigned;
+                SPrintSpec_ spec;
+                if (count == 1)
+                {
+                    /* 沒有旗標, 寬度與精度, 不需要解析 */
+                    switch (fmt[1])
+                    {
+                        case 'd' :
+                        case 'i' : SignedOutput_  (output, (long long)(Signed)value);            return;
+                        case 'u' : UnsignedOutput_(output, (unsigned long long)(Unsigned)value); return;
+                    }
+                }
+                if (ParseSpec_(spec, fmt, count) == true)
+                {
+                    if( (spec.conversion == 'd') ||
+                        (spec.conversion == 'i') )
+                    {
+                        long long number = (spec.shorts == 0) ? (long long)(Signed)value      :
+                                           (spec.shorts == 1) ? (long long)(short)value       :
+                                                                (long long)(signed char)value;
+                        if (IntegerOutput_(output, spec, (number < 0) ? 0ull - (unsigned long long)number : (unsigned long long)number, number < 0) == true)
+                            return;
+                    }
+                    else
+                    if (spec.conversion == 'c')
+                    {
+                        char character = (char)value;
+                        PadOutput_(output, spec, false, "", 0, &character, 1);
+                        return;
+                    }
+                    else
+                    {
+                        unsigned long long number = (spec.shorts == 0) ? (unsigned long long)(Unsigned)value      :
+                                                    (spec.shorts == 1) ? (unsigned long long)(unsigned short)value :
+                                                                         (unsigned long long)(unsigned char)value;
+                        if (IntegerOutput_(output, spec, number, false) == true)
+                            return;
+                    }
+                }
+                SpecOutput_(output, fmt, count, value);
+            }
+
+            template< typename O, typename T >
+            static void NumberOutput_(O& output, const char* fmt, int count, const T& value, std::integral_constant< int, EFC_FLOAT >)
+            {
+                SPrintSpec_ spec;
+                if( (sizeof(T) <= sizeof(double)) &&
+                    (ParseSpec_(spec, fmt, count) == true) &&
+                    (FloatOutput_(output, spec, (double)value) == true) )
+                    return;
+                SpecOutput_(output, fmt, count, value);
+            }
+
+            /* 空指標在各平台的輸出不同, 交給 snprintf */
+            template< typename O, typename T >
+            static void NumberOutput_(O& output, const char* fmt, int count, const T& value, std::integral_constant< int, EFC_POINTER >)
+            {
+#if !defined(_MSC_VER)
+                SPrintSpec_ spec;
+                if( (value != nullptr) &&
+                    (ParseSpec_(spec, fmt, count) == true) &&
+                    (spec.conversion == 'p') &&
+                    (spec.precision < 0) &&
+                    (spec.sign == 0) )
+                {
+                    char  buffer[24];
+                    char* ptr = RadixDigits_(&buffer[sizeof(buffer)], (unsigned long long)(uintptr_t)value, 4, "0123456789abcdef");
+                    PadOutput_(output, spec, false, "0x", 2, ptr, &buffer[sizeof(buffer)] - ptr);
+                    return;
+                }
+#endif
+                SpecOutput_(output, fmt, count, value);
+            }
+
+            template< typename O, typename T, int C >
+            static void NumberOutput_(O& output, const char* fmt, int count, const T& value, std::integral_constant< int, C >)
+            {
+                SpecOutput_(output, fmt, count, value);
+            }
+
+            template< typename O, typename T >
+            static void ValueOutput_(O& output, const char*& fmt, const T& value)
+            {
+                int count = GetFormatLength_(fmt);
+                if (count > 0)
+                {
+                    NumberOutput_(output, fmt, count, value, std::integral_constant< int, SCategory_< T >::value >());
+                    fmt += (count + 1);
+                }
+                else
+                {
+                    fmt += strlen(fmt);
+                }
+            }
+
+            template< typename O >
+            static void ValueOutput_(O& output, const char*& fmt, const std::string& value)
+            {
+                int count = GetFormatLength_(fmt);
+                if (count > 0)
+                {
+                    if (count == 1)
+                    {
+                        output += value;
+                    }
+                    else
+                    {
+                        SpecOutput_(output, fmt, count, value.c_str());
+                    }
+                    fmt += (count + 1);
+                }
+                else
+                {
+                    fmt += strlen(fmt);
+                }
+            }
+
+            /* 自訂型態的 ValueOutput_ 只接受 std::string, 先轉成字串再寫入 */
+            template< typename T >
+            static typename std::enable_if< SCategory_< T >::value == EFC_CUSTOM >::type
+            ValueOutput_(CWriter& output, const char*& fmt, const T& value)
+            {
+                std::string text;
+                ValueOutput_(text, fmt, value);
+                output += text;
+            }
+
+            template< typename O >
+            static void ValueOutput_(O& output, const char*& fmt, const char* value)
+            {
+                int count = GetFormatLength_(fmt);
+                if (count > 0)
+                {
+                    if (count == 1)
+                    {
+                        output += value;
+                    }
+                    else
+                    {
+                        SpecOutput_(output, fmt, count, value);
+                    }
+                    fmt += (count + 1);
+                }
+                else
+                {
+                    fmt += strlen(fmt);
+                }
+            }
+
+            static void LogOutput(E_LOG_LEVEL level, const char* format) // base function
+            {
+                if (IsEnabled_(level) == true)
+                    CManager::GetInstance()->Printf(level, format);
+            }
+
+            static void LogOutput(E_LOG_LEVEL level, const std::string& format)
+            {
+                if (IsEnabled_(level) == true)
+                    CManager::GetInstance()->Printf(level, format.c_str());
+            }
+
+            /* 輸出剩下的字串, "%%" 轉為 "%" */
+            template< typename O >
+            static void FormatOutput_(O& output, const char* format)
+            {
+                for (; *format != '\0'; format++)
+                {
+                    if( (*format == '%') &&
+                        (format[1] == '%') )
+                        ++format;
+                    output += *format;
+                }
+            }
+
+            template< typename O, typename T, typename... Targs >
+            static void FormatOutput_(O& output,
+                                      const char* format,
+                                      const T& value, const Targs&... Fargs)
+            {
+                for (; *format != '\0'; format++)
+                {
+                    if (*format == '%')
+                    {
+                        if (format[1] != '%')
+                        {
+                            ValueOutput_(output, format, value);
+                            FormatOutput_(output, format, Fargs...);
+                            return;
+                        }
+                        ++format;
+                    }
+                    output += *format;
+                }
+            }
+
+            template<typename T, typename... Targs>
+            static void LogOutput(E_LOG_LEVEL level, const char* format, T value, Targs... Fargs)
+            {
+                if (IsEnabled_(level) == true)
+                {
+                    CManager* manager = CManager::GetInstance();
+                    CWriter*  writer  = manager->Begin(level);
+                    if (writer != nullptr)
+                    {
+                        FormatOutput_(*writer, format, value, Fargs...);
+                        manager->End(writer);
+                    }
+                }
+            }
+
+            static inline bool IsEnabled_(const CCategory* category, E_LOG_LEVEL level)
+            {
+                return ((int)level <= KKLOG_LEVEL) && category->IsEnabled(level);
+            }
+
+            /* 分類的訊息, 例如 LogOutput(db, ELL_DEBUG, "query %s\n", sql). 依分類的等級判斷是否輸出 */
+            template< typename... Targs >
+            static void LogOutput(const CCategory* category, E_LOG_LEVEL level, const char* format, const Targs&... Fargs)
+            {
+                if (IsEnabled_(category, level) == true)
+                {
+                    CManager* manager = CManager::GetInstance();
+                    CWriter*  writer  = manager->Begin(level, category);
+                    if (writer != nullptr)
+                    {
+                        FormatOutput_(*writer, format, Fargs...);
+                        manager->End(writer);
+                    }
+                }
+            }
+
+            /* 每個呼叫點的狀態, 由 KKLOG_EVERY_N 等巨集放在 static 變數中, 初始值全為 0 */
+            struct SSite_
+            {
+                std::atomic< uint64_t > count;      /* 呼叫次數 */
+                std::atomic< int64_t >  next;       /* KKLOG_PER_SECOND: 配額排到的時間(奈秒) */
+                std::atomic< uint64_t > suppressed; /* KKLOG_PER_SECOND: 上一次輸出後略過的次數 */
+            };
+
+            /* 低精度的單調時間(奈秒), 精度約幾毫秒, 但比 steady_clock 快很多 */
+            static inline int64_t GetCoarseTime_()
+            {
+#if defined(CLOCK_MONOTONIC_COARSE)
+                timespec now;
+                clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+                return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+                return std::chrono::duration_cast< std::chrono::nanoseconds >(
+                         std::chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+            }
+
+            /* 第 1, n+1, 2n+1... 次才輸出, n 為 0 時與 1 相同. suppressed 為上一次輸出後略過的次數 */
+            static inline bool EveryN_(SSite_& site, uint64_t n, uint64_t& suppressed)
+            {
+                if (n == 0)
+                    n = 1;
+                uint64_t count = site.count.fetch_add(1, std::memory_order_relaxed);
+                if (count % n != 0)
+                    return false;
+                suppressed = (count > 0) ? n - 1 : 0;
+                return true;
+            }
+
+            /* 只輸出前 n 次, 之後只需要讀取一次 */
+            static inline bool FirstN_(SSite_& site, uint64_t n, uint64_t& suppressed)
+            {
+                if (site.count.load(std::memory_order_relaxed) >= n)
+                    return false;
+                suppressed = 0;
+                return site.count.fetch_add(1, std::memory_order_relaxed) < n;
+            }
+
+            /* 每秒最多 rate 次, 可以一次用完一秒的配額 (GCRA). 只有一個原子變數記錄配額排到的時間 */
+            static inline bool PerSecond_(SSite_& site, uint32_t rate, uint64_t& suppressed)
+            {
+                int64_t now      = GetCoarseTime_();
+                int64_t interval = 1000000000 / ((rate > 0) ? rate : 1);
+                int64_t next     = site.next.load(std::memory_order_relaxed);
+                do
+                {
+                    if (next - now > 1000000000 - interval)
+                    {
+                        site.suppressed.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                } while (site.next.compare_exchange_weak(next, ((next > now) ? next : now) + interval, std::memory_order_relaxed) == false);
+                suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+                return true;
+            }
+
+            /* 輸出通過限制的訊息, 略過的次數加在訊息最後, 換行之前 */
+            template< typename... Targs >
+            static void LogSite_(uint64_t suppressed, E_LOG_LEVEL level, const char* format, const Targs&... Fargs)
+            {
+                CManager* manager = CManager::GetInstance();
+                CWriter*  writer  = manager->Begin(level);
+                if (writer == nullptr)
+                    return;
+                FormatOutput_(*writer, format, Fargs...);
+                if (suppressed > 0)
+                {
+                    size_t size    = writer->size();
+                    bool   newline = (size > 0) && ((*writer)[size - 1] == '\n');
+                    char   buffer[48];
+                    if (newline == true)
+                        writer->resize(size - 1);
+                    writer->append(buffer, snprintf(buffer, sizeof(buffer), " (%llu suppressed)%s", (unsigned long long)suppressed, (newline == true) ? "\n" : ""));
+                }
+                manager->End(writer);
+            }
+
+            /* 二進位輸出: 每個位元組放 7 個位元, 最高位元表示後面還有 */
+            static inline void VarintOutput_(std::string& output, uint64_t value)
+            {
+                char buffer[10];
+                int  index = 0;
+                while (value >= 0x80)
+                {
+                    buffer[index++] = (char)(value | 0x80);
+                    value >>= 7;
+                }
+                buffer[index++] = (char)value;
+                output.append(buffer, index);
+            }
+
+            static inline void EncodeOutput_(std::string& output, long long value)
+            {
+                output += (char)EBT_SIGNED;
+                VarintOutput_(output, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+            }
+
+            static inline void EncodeOutput_(std::string& output, unsigned long long value)
+            {
+                output += (char)EBT_UNSIGNED;
+                VarintOutput_(output, value);
+            }
+
+            static inline void EncodeOutput_(std::string& output, double value)
+            {
+                uint64_t bits;
+                char     buffer[8];
+                memcpy(&bits, &value, sizeof(bits));
+                for (int i = 0; i < 8; ++i)
+                    buffer[i] = (char)(bits >> (i * 8));
+                output += (char)EBT_DOUBLE;
+                output.append(buffer, sizeof(buffer));
+            }
+
+            static inline void EncodeOutput_(std::string& output, const void* value)
+            {
+                output += (char)EBT_POINTER;
+                VarintOutput_(output, (uint64_t)(uintptr_t)value);
+            }
+
+            static inline void EncodeOutput_(std::string& output, const char* value, uint32_t length)
+            {
+                output += (char)EBT_STRING;
+                VarintOutput_(output, length);
+                output.append(value, length);
+            }
+
+            /* 延遲格式化: 呼叫端只複製參數, 由 Process() 負責轉成文字 */
+            template< typename T, typename Enable = void >
+            struct SCapture_
+            {
+                enum { value = false };
+            };
+
+            template< typename T >
+            struct SCapture_< T, typename std::enable_if< std::is_arithmetic< T >::value ||
+                                                          std::is_enum< T >::value ||
+                                                          std::is_pointer< T >::value >::type >
+            {
+                enum { value = true };
+                typedef T Value;
+                typedef typename std::conditional< std::is_floating_point< T >::value, double,
+                        typename std::conditional< std::is_pointer< T >::value, const void*,
+                        typename std::conditional< std::is_enum< T >::value || std::is_signed< T >::value, long long, unsigned long long >::type >::type >::type Encoded;
+
+                static uint32_t Size(const T& value) { return sizeof(T); }
+
+                static char* Store(char* data, const T& value)
+                {
+                    memcpy(data, &value, sizeof(T));
+                    return data + sizeof(T);
+                }
+
+                static const char* Load(const char* data, T& value)
+                {
+                    memcpy(&value, data, sizeof(T));
+                    return data + sizeof(T);
+                }
+
+                static const char* Encode(std::string& output, const char* data)
+                {
+                    T value;
+                    data = Load(data, value);
+                    EncodeOutput_(output, (Encoded)value);
+                    return data;
+                }
+            };
+
+            /* 字串直接複製到紀錄中, 以長度開頭並以 0 結尾 */
+            struct SCaptureString_
+            {
+                enum { value = true };
+                typedef const char* Value;
+
+                static uint32_t Size(const char* value, uint32_t length) { return sizeof(uint32_t) + length + 1; }
+
+                static char* Store(char* data, const char* value, uint32_t length)
+                {
+                    memcpy(data, &length, sizeof(length));
+                    memcpy(data + sizeof(length), value, length);
+                    data[sizeof(length) + length] = 0;
+                    return data + sizeof(length) + length + 1;
+                }
+
+                static const char* Load(const char* data, const char*& value)
+                {
+                    uint32_t length;
+                    memcpy(&length, data, sizeof(length));
+                    value = data + sizeof(length);
+                    return value + length + 1;
+                }
+
+                static const char* Encode(std::string& output, const char* data)
+                {
+                    uint32_t length;
+                    memcpy(&length, data, sizeof(length));
+                    EncodeOutput_(output, data + sizeof(length), length);
+                    return data + sizeof(length) + length + 1;
+                }
+            };
+
+            template<>
+            struct SCapture_< const char* > : public SCaptureString_
+            {
+                static uint32_t Size (const char* value)             { return SCaptureString_::Size(value, (value != nullptr) ? (uint32_t)strlen(value) : 0); }
+                static char*    Store(char* data, const char* value) { return SCaptureString_::Store(data, (value != nullptr) ? value : "", (value != nullptr) ? (uint32_t)strlen(value) : 0); }
+            };
+
+            template<>
+            struct SCapture_< char* > : public SCapture_< const char* >
+            {
+            };
+
+            template<>
+            struct SCapture_< std::string > : public SCaptureString_
+            {
+                static uint32_t Size (const std::string& value)             { return SCaptureString_::Size(value.c_str(), (uint32_t)value.size()); }
+                static char*    Store(char* data, const std::string& value) { return SCaptureString_::Store(data, value.c_str(), (uint32_t)value.size()); }
+            };
+
+            template< typename... Targs >
+            struct SCaptures_;
+
+            template<>
+            struct SCaptures_<>
+            {
+                enum { value = true };
+
+                static uint32_t Size  () { return 0; }
+                static void     Store (char* data) { }
+                static void     Encode(std::string& output, const char* data) { }
+
+                template< typename... Tvalues >
+                static void Render(std::string& output, const char* format, const char* data, const Tvalues&... values)
+                {
+                    FormatOutput_(output, format, values...);
+                }
+            };
+
+            template< typename T, typename... Targs >
+            struct SCaptures_< T, Targs... >
+            {
+                enum { value = SCapture_< T >::value && SCaptures_< Targs... >::value };
+
+                template< typename U, typename... Uargs >
+                static uint32_t Size(const U& value, const Uargs&... Fargs)
+                {
+                    return SCapture_< T >::Size(value) + SCaptures_< Targs... >::Size(Fargs...);
+                }
+
+                template< typename U, typename... Uargs >
+                static void Store(char* data, const U& value, const Uargs&... Fargs)
+                {
+                    SCaptures_< Targs... >::Store(SCapture_< T >::Store(data, value), Fargs...);
+                }
+
+                template< typename... Tvalues >
+                static void Render(std::string& output, const char* format, const char* data, const Tvalues&... values)
+                {
+                    typename SCapture_< T >::Value value;
+                    data = SCapture_< T >::Load(data, value);
+                    SCaptures_< Targs... >::Render(output, format, data, values..., value);
+                }
+
+                static void Encode(std::string& output, const char* data)
+                {
+                    SCaptures_< Targs... >::Encode(output, SCapture_< T >::Encode(output, data));
+                }
+            };
+
+            template< typename... Targs >
+            static void Render_(std::string& output, const char* format, const char* data)
+            {
+                SCaptures_< Targs... >::Render(output, format, data);
+            }
+
+            template< typename... Targs >
+            static void Encode_(std::string& output, const char* data)
+            {
+                SCaptures_< Targs... >::Encode(output, data);
+            }
+
+            template< typename... Targs >
+            static void Capture_(std::true_type, E_LOG_LEVEL level, const char* format, const Targs&... Fargs)
+            {
+                typedef SCaptures_< typename std::decay< Targs >::type... > Captures;
+                char* data = CManager::GetInstance()->Reserve(level,
+                                                              format,
+                                                              &Render_< typename std::decay< Targs >::type... >,
+                                                              &Encode_< typename std::decay< Targs >::type... >,
+                                                              Captures::Size(Fargs...));
+                if (data != nullptr)
+                {
+                    Captures::Store(data, Fargs...);
+                    CManager::GetInstance()->Commit();
+                }
+            }
+
+            template< typename... Targs >
+            static void Capture_(std::false_type, E_LOG_LEVEL level, const char* format, const Targs&... Fargs)
+            {
+                LogOutput(level, format, Fargs...);
+            }
+
+            /* 格式字串必須是常數字串, 轉成文字時才會讀取.
+               無法直接複製的參數型態(例如自訂結構)會改用 LogOutput 立即格式化. */
+            template< size_t N, typename... Targs >
+            static void LogDeferred(E_LOG_LEVEL level, const char (&format)[N], const Targs&... Fargs)
+            {
+                if (IsEnabled_(level) == true)
+                {
+                    typedef SCaptures_< typename std::decay< Targs >::type... > Captures;
+                    Capture_(std::integral_constant< bool, Captures::value >(), level, format, Fargs...);
+                }
+            }
+
+            /* 編譯期格式字串, 以 KKLOG_FORMAT("...") 產生.
+               格式字串在編譯期切成字串片段與轉換, 執行時不需要再掃描. */
+            struct SFormatString_
+            {
+            };
+
+            enum E_FORMAT_TOKEN
+            {
+                EFT_END,
+                EFT_PERCENT,
+                EFT_CONVERSION
+            };
+
+            enum E_FORMAT_LENGTH
+            {
+                EFL_NONE,
+                EFL_CHAR,       /* hh */
+                EFL_SHORT,      /* h */
+                EFL_LONG,       /* l */
+                EFL_LONGLONG,   /* ll, q, I64 */
+                EFL_SIZE,       /* z */
+                EFL_INTMAX,     /* j */
+                EFL_PTRDIFF,    /* t */
+                EFL_LONGDOUBLE  /* L */
+            };
+
+            static constexpr bool IsTokenStop_(char c)
+            {
+                return (c == 0) || (c == '%');
+            }
+
+            /* 一次檢查 8 個字元, 減少 constexpr 遞迴深度 */
+            static constexpr size_t FindToken_(const char* format, size_t pos)
+            {
+                return IsTokenStop_(format[pos])     ? pos     :
+                       IsTokenStop_(format[pos + 1]) ? pos + 1 :
+                       IsTokenStop_(format[pos + 2]) ? pos + 2 :
+                       IsTokenStop_(format[pos + 3]) ? pos + 3 :
+                       IsTokenStop_(format[pos + 4]) ? pos + 4 :
+                       IsTokenStop_(format[pos + 5]) ? pos + 5 :
+                       IsTokenStop_(format[pos + 6]) ? pos + 6 :
+                       IsTokenStop_(format[pos + 7]) ? pos + 7 :
+                       FindToken_(format, pos + 8);
+            }
+
+            static constexpr bool IsFormatFlag_(char c)
+            {
+                return (c == '-') || (c == '+') || (c == ' ') || (c == '#') || (c == '.') || (c == '*') ||
+                       ((c >= '0') && (c <= '9')) ||
+                       (c == 'h') || (c == 'l') || (c == 'L') || (c == 'q') ||
+                       (c == 'j') || (c == 'z') || (c == 't') || (c == 'I');
+            }
+
+            static constexpr size_t FindConversion_(const char* format, size_t pos)
+            {
+                return IsFormatFlag_(format[pos]) ? FindConversion_(format, pos + 1) : pos;
+            }
+
+            static constexpr bool IsConversion_(char c)
+            {
+                return (c == 'd') || (c == 'i') || (c == 'u') || (c == 'o') || (c == 'x') || (c == 'X') ||
+                       (c == 'f') || (c == 'F') || (c == 'e') || (c == 'E') || (c == 'g') || (c == 'G') ||
+                       (c == 'a') || (c == 'A') || (c == 'c') || (c == 's') || (c == 'p');
+            }
+
+            static constexpr bool HasStar_(const char* format, size_t pos, size_t end)
+            {
+                return (pos < end) && ((format[pos] == '*') || HasStar_(format, pos + 1, end));
+            }
+
+            /* end 為轉換字元的位置 */
+            static constexpr int GetLength_(const char* format, size_t end)
+            {
+                return (format[end - 1] == 'l') ? ((format[end - 2] == 'l') ? EFL_LONGLONG : EFL_LONG)  :
+                       (format[end - 1] == 'h') ? ((format[end - 2] == 'h') ? EFL_CHAR     : EFL_SHORT) :
+                       (format[end - 1] == 'q') ? EFL_LONGLONG :
+                       (format[end - 1] == 'z') ? EFL_SIZE     :
+                       (format[end - 1] == 'j') ? EFL_INTMAX   :
+                       (format[end - 1] == 't') ? EFL_PTRDIFF  :
+                       (format[end - 1] == 'L') ? EFL_LONGDOUBLE :
+                       ((format[end - 1] == '4') && (format[end - 2] == '6') && (format[end - 3] == 'I')) ? EFL_LONGLONG :
+                       EFL_NONE;
+            }
+
+            static constexpr bool IsAccepted_(int category, char conversion)
+            {
+                return (category == EFC_CUSTOM) ||
+                       ((category == EFC_INTEGER) && ((conversion == 'd') || (conversion == 'i') || (conversion == 'u') ||
+                                                      (conversion == 'o') || (conversion == 'x') || (conversion == 'X') ||
+                                                      (conversion == 'c'))) ||
+                       ((category == EFC_FLOAT)   && ((conversion == 'f') || (conversion == 'F') || (conversion == 'e') ||
+                                                      (conversion == 'E') || (conversion == 'g') || (conversion == 'G') ||
+                                                      (conversion == 'a') || (conversion == 'A'))) ||
+                       ((category == EFC_CSTRING) && ((conversion == 's') || (conversion == 'p'))) ||
+                       ((category == EFC_STRING)  && (conversion == 's')) ||
+                       ((category == EFC_POINTER) && (conversion == 'p'));
+            }
+
+            template< int L, bool S > struct SIntegral_                          { typedef typename std::conditional< S, int, unsigned int >::type                     type; };
+            template< bool S > struct SIntegral_< EFL_CHAR, S >                  { typedef typename std::conditional< S, signed char, unsigned char >::type            type; };
+            template< bool S > struct SIntegral_< EFL_SHORT, S >                 { typedef typename std::conditional< S, short, unsigned short >::type                 type; };
+            template< bool S > struct SIntegral_< EFL_LONG, S >                  { typedef typename std::conditional< S, long, unsigned long >::type                   type; };
+            template< bool S > struct SIntegral_< EFL_LONGLONG, S >              { typedef typename std::conditional< S, long long, unsigned long long >::type         type; };
+            template< bool S > struct SIntegral_< EFL_LONGDOUBLE, S >            { typedef typename std::conditional< S, long long, unsigned long long >::type         type; };
+            template< bool S > struct SIntegral_< EFL_SIZE, S >                  { typedef typename std::conditional< S, std::make_signed< size_t >::type, size_t >::type type; };
+            template< bool S > struct SIntegral_< EFL_INTMAX, S >                { typedef typename std::conditional< S, intmax_t, uintmax_t >::type                   type; };
+            template< bool S > struct SIntegral_< EFL_PTRDIFF, S >               { typedef typename std::conditional< S, ptrdiff_t, std::make_unsigned< ptrdiff_t >::type >::type type; };
+
+            template< size_t... I >
+            struct SIndices_
+            {
+            };
+
+            template< size_t N, size_t... I >
+            struct SMakeIndices_ : public SMakeIndices_< N - 1, N - 1, I... >
+            {
+            };
+
+            template< size_t... I >
+            struct SMakeIndices_< 0, I... >
+            {
+                typedef SIndices_< I... > type;
+            };
+
+            /* 由格式字串擷取出單一轉換, 例如 "%-8.3f" */
+            template< typename F, size_t B, typename I >
+            struct SSpec_;
+
+            template< typename F, size_t B, size_t... I >
+            struct SSpec_< F, B, SIndices_< I... > >
+            {
+                static constexpr char value[] = { F::Get()[B + I]..., 0 };
+            };
+
+            template< typename F, size_t B, size_t... I >
+            constexpr char SSpec_< F, B, SIndices_< I... > >::value[];
+
+            static const char* CString_(const char* value)        { return (value != nullptr) ? value : "(null)"; }
+            static const char* CString_(const std::string& value) { return value.c_str(); }
+
+            /* 單一轉換. Token 為 '%' 的位置, End 為轉換字元的位置 */
+            template< typename F, size_t Token, size_t End >
+            struct SConversion_
+            {
+                static constexpr char conversion = F::Get()[End];
+                static constexpr bool plain      = (End == Token + 1);
+                static constexpr int  length     = GetLength_(F::Get(), End);
+
+                static_assert(IsConversion_(conversion), "invalid conversion in format string");
+                static_assert(HasStar_(F::Get(), Token + 1, End) == false, "'*' width or precision is not supported by KKLOG_FORMAT");
+
+                typedef SSpec_< F, Token, typename SMakeIndices_< End - Token + 1 >::type > Spec;
+
+                template< typename O, typename T >
+                static void Apply(O& output, const T& value)
+                {
+                    typedef typename std::decay< T >::type Value;
+                    static_assert(IsAccepted_(SCategory_< Value >::value, conversion), "argument type does not match format string");
+                    Apply_(output, value, std::integral_constant< int, SCategory_< Value >::value >());
+                }
+
+                template< typename O, typename T >
+                static void Apply_(O& output, const T& value, std::integral_constant< int, EFC_INTEGER >)
+                {
+                    typedef typename SIntegral_< length, (conversion == 'd') || (conversion == 'i') >::type Integral;
+                    if (conversion == 'c')
+                    {
+                        if (plain == true)
+                            output += (char)value;
+                        else
+                            NumberOutput_(output, Spec::value, (int)(End - Token), (int)value, std::integral_constant< int, EFC_INTEGER >());
+                    }
+                    else
+                    if (plain == true)
+                    {
+                        switch (conversion)
+                        {
+                            case 'd' :
+                            case 'i' : SignedOutput_  (output, (long long)(Integral)value);                                        break;
+                            case 'u' : UnsignedOutput_(output, (unsigned long long)(Integral)value);                               break;
+                            case 'o' : RadixOutput_   (output, (unsigned long long)(Integral)value, 3, "01234567");                break;
+                            case 'x' : RadixOutput_   (output, (unsigned long long)(Integral)value, 4, "0123456789abcdef");        break;
+                            case 'X' : RadixOutput_   (output, (unsigned long long)(Integral)value, 4, "0123456789ABCDEF");        break;
+                        }
+                    }
+                    else
+                    {
+                        NumberOutput_(output, Spec::value, (int)(End - Token), (Integral)value, std::integral_constant< int, EFC_INTEGER >());
+                    }
+                }
+
+                template< typename O, typename T >
+                static void Apply_(O& output, const T& value, std::integral_constant< int, EFC_FLOAT >)
+                {
+                    if (length == EFL_LONGDOUBLE)
+                        SnprintfOutput_(output, Spec::value, (long double)value);
+                    else
+                        NumberOutput_(output, Spec::value, (int)(End - Token), (double)value, std::integral_constant< int, EFC_FLOAT >());
+                }
+
+                template< typename O, typename T >
+                static void Apply_(O& output, const T& value, std::integral_constant< int, EFC_POINTER >)
+                {
+                    NumberOutput_(output, Spec::value, (int)(End - Token), (const void*)value, std::integral_constant< int, EFC_POINTER >());
+                }
+
+                template< typename O >
+                static void Apply_(O& output, const char* value, std::integral_constant< int, EFC_CSTRING >)
+                {
+                    if (conversion == 'p')
+                        NumberOutput_(output, Spec::value, (int)(End - Token), (const void*)value, std::integral_constant< int, EFC_POINTER >());
+                    else
+                    if (plain == true)
+                        output += CString_(value);
+                    else
+                        SnprintfOutput_(output, Spec::value, CString_(value));
+                }
+
+                template< typename O >
+                static void Apply_(O& output, const std::string& value, std::integral_constant< int, EFC_STRING >)
+                {
+                    if (plain == true)
+                        output += value;
+                    else
+                        SnprintfOutput_(output, Spec::value, value.c_str());
+                }
+
+                template< typename O, typename T >
+                static void Apply_(O& output, const T& value, std::integral_constant< int, EFC_CUSTOM >)
+                {
+                    const char* format = F::Get() + Token;
+                    ValueOutput_(output, format, value);
+                }
+            };
+
+            template< typename F,
+                      size_t   Pos,
+                      size_t   Token = FindToken_(F::Get(), Pos),
+                      int      Kind  = (F::Get()[Token] == 0)       ? EFT_END     :
+                                       (F::Get()[Token + 1] == '%') ? EFT_PERCENT : EFT_CONVERSION >
+            struct SFormat_;
+
+            template< typename F, size_t Pos, size_t Token >
+            struct SFormat_< F, Pos, Token, EFT_END >
+            {
+                enum { count = 0 };
+
+                template< typename O >
+                static void Apply(O& output)
+                {
+                    output.append(F::Get() + Pos, Token - Pos);
+                }
+            };
+
+            template< typename F, size_t Pos, size_t Token >
+            struct SFormat_< F, Pos, Token, EFT_PERCENT >
+            {
+                typedef SFormat_< F, Token + 2 > Next;
+
+                enum { count = Next::count };
+
+                template< typename O, typename... Targs >
+                static void Apply(O& output, const Targs&... Fargs)
+                {
+                    output.append(F::Get() + Pos, Token - Pos + 1);
+                    Next::Apply(output, Fargs...);
+                }
+            };
+
+            template< typename F, size_t Pos, size_t Token >
+            struct SFormat_< F, Pos, Token, EFT_CONVERSION >
+            {
+                static constexpr size_t End = FindConversion_(F::Get(), Token + 1);
+
+                typedef SConversion_< F, Token, End >                               Conversion;
+                typedef SFormat_< F, (F::Get()[End] == 0) ? End : End + 1 > Next;
+
+                enum { count = 1 + Next::count };
+
+                template< typename O, typename T, typename... Targs >
+                static void Apply(O& output, const T& value, const Targs&... Fargs)
+                {
+                    output.append(F::Get() + Pos, Token - Pos);
+                    Conversion::Apply(output, value);
+                    Next::Apply(output, Fargs...);
+                }
+            };
+
+            template< typename F, typename... Targs >
+            static typename std::enable_if< std::is_base_of< SFormatString_, F >::value >::type
+            LogOutput(E_LOG_LEVEL level, const F& format, const Targs&... Fargs)
+            {
+                typedef SFormat_< F, 0 > Format;
+                static_assert(Format::count == sizeof...(Targs), "number of arguments does not match format string");
+                if (IsEnabled_(level) == true)
+                {
+                    CManager* manager = CManager::GetInstance();
+                    CWriter*  writer  = manager->Begin(level);
+                    if (writer != nullptr)
+                    {
+                        Format::Apply(*writer, Fargs...);
+                        manager->End(writer);
+                    }
+                }
+            }
+
+            /* 自訂型態的欄位, 由 ValueOutput_(CFields&, const T&) 展開 */
+            template< typename T >
+            static void FieldsOutput_(CFields& fields, const void* object);
+        }
+
+        /*
+         * 結構化欄位, 例如 LogFields(ELL_INFO, "login", {"user", id}, {"latency_us", latency}).
+         * 只保存參數的位址, 在 LogFields 返回前就會編碼完成.
+         */
+        struct SField
+        {
+            const char* key;
+            int         type;       /* E_BINARY_TYPE */
+            union
+            {
+                long long          integer;
+                unsigned long long natural;
+                double             real;
+                const void*        pointer;
+                const char*        text;
+            };
+            uint32_t    length;     /* EBT_STRING 的長度 */
+            void      (*emit)(CFields& fields, const void* object);
+
+            SField() : key(nullptr), type(0), natural(0), length(0), emit(nullptr) { }
+
+            SField(const char* key, bool value) : key(key), type(EBT_BOOLEAN), natural(value ? 1 : 0), length(0), emit(nullptr) { }
+
+            SField(const char* key, const std::string& value) : key(key), type(EBT_STRING), text(value.c_str()), length((uint32_t)value.size()), emit(nullptr) { }
+
+            template< typename T >
+            SField(const char* key, const T& value) : key(key), length(0), emit(nullptr)
+            {
+                typedef typename std::decay< T >::type Value;
+                Assign(value, std::integral_constant< int,
+                       (std::is_same< Value, char* >::value || std::is_same< Value, const char* >::value) ? EBT_STRING   :
+                       std::is_floating_point< Value >::value                                             ? EBT_DOUBLE   :
+                       (std::is_enum< Value >::value || std::is_signed< Value >::value)                  ? EBT_SIGNED   :
+                       std::is_integral< Value >::value                                                   ? EBT_UNSIGNED :
+                       std::is_pointer< Value >::value                                                    ? EBT_POINTER  : EBT_OBJECT >());
+            }
+
+        private :
+            void Assign(const char* value, std::integral_constant< int, EBT_STRING >)
+            {
+                type   = EBT_STRING;
+                text   = (value != nullptr) ? value : "";
+                length = (uint32_t)strlen(text);
+            }
+
+            template< typename T >
+            void Assign(const T& value, std::integral_constant< int, EBT_DOUBLE >)   { type = EBT_DOUBLE;   real    = (double)value;             }
+            template< typename T >
+            void Assign(const T& value, std::integral_constant< int, EBT_SIGNED >)   { type = EBT_SIGNED;   integer = (long long)value;          }
+            template< typename T >
+            void Assign(const T& value, std::integral_constant< int, EBT_UNSIGNED >) { type = EBT_UNSIGNED; natural = (unsigned long long)value; }
+            template< typename T >
+            void Assign(const T& value, std::integral_constant< int, EBT_POINTER >)  { type = EBT_POINTER;  pointer = (const void*)value;        }
+
+            template< typename T >
+            void Assign(const T& value, std::integral_constant< int, EBT_OBJECT >)
+            {
+                type    = EBT_OBJECT;
+                pointer = &value;
+                emit    = &FieldsOutput_< T >;
+            }
+        };
+
+        /* 把欄位編碼成二進位輸出的格式: 每個欄位是字串型態的名稱, 接著一個值 */
+        class CFields
+        {
+        private :
+            std::string& _Output;
+            std::string  _Prefix;   /* 自訂型態的欄位名稱前綴, 例如 "account." */
+
+            CFields                 (const CFields& other) : _Output(other._Output) { }
+            const CFields& operator=(const CFields& other) { return *this; }
+
+        public :
+            CFields(std::string& output) : _Output(output) { }
+
+            void Add(const SField& field);
+        };
+
+        namespace
+        {
+            /* 沒有提供 ValueOutput_(CFields&, const T&) 的型態, 以 "%s" 轉成文字後當成一個欄位 */
+            template< typename T >
+            static void ValueOutput_(CFields& fields, const T& value)
+            {
+                std::string output;
+                const char* format = "%s";
+                ValueOutput_(output, format, value);
+                fields.Add(SField("", output));
+            }
+
+            template< typename T >
+            static void FieldsOutput_(CFields& fields, const void* object)
+            {
+                ValueOutput_(fields, *(const T*)object);
+            }
+
+            /* 最多 8 個欄位, 更多的欄位可以直接呼叫 CManager::Fields */
+            static void LogFields(E_LOG_LEVEL level, const char* msg,
+                                  const SField& f1 = SField(), const SField& f2 = SField(),
+                                  const SField& f3 = SField(), const SField& f4 = SField(),
+                                  const SField& f5 = SField(), const SField& f6 = SField(),
+                                  const SField& f7 = SField(), const SField& f8 = SField())
+            {
+                if (IsEnabled_(level) == true)
+                {
+                    const SField* fields[] = { &f1, &f2, &f3, &f4, &f5, &f6, &f7, &f8 };
+                    uint32_t      count    = 0;
+                    while( (count < sizeof(fields) / sizeof(fields[0])) &&
+                           (fields[count]->key != nullptr) )
+                        ++count;
+                    CManager::GetInstance()->Fields(level, msg, fields, count);
+                }
+            }
+        }
+    };
+};
+
+/* 編譯期解析的格式字串, 例如 LogOutput(ELL_INFO, KKLOG_FORMAT("id : %d\n"), id) */
+#define KKLOG_FORMAT(format)                                                        \
+    ([]()                                                                           \
+    {                                                                               \
+        struct SFormat : public kkboylin::log::SFormatString_                       \
+        {                                                                           \
+            static constexpr const char* Get() { return format; }                   \
+        };                                                                          \
+        return SFormat();                                                           \
+    }())
+
+/* 只有等級開啟時才計算參數, 例如 KKLOG(ELL_INFO, "id : %d\n", GetId()) */
+#define KKLOG(level, ...)                                                           \
+    do                                                                              \
+    {                                                                               \
+        if (kkboylin::log::IsEnabled_(level) == true)                               \
+            kkboylin::log::LogOutput((level), __VA_ARGS__);                         \
+    } while (0)
+
+/* 每個呼叫點各自限制次數, 略過時不計算參數. 輸出時在訊息最後加上略過的次數 */
+#define KKLOG_SITE_(check, level, limit, ...)                                       \
+    do                                                                              \
+    {                                                                               \
+        static kkboylin::log::SSite_ kklogSite_;                                    \
+        uint64_t                     kklogSuppressed_;                              \
+        if( (kkboylin::log::IsEnabled_(level) == true) &&                           \
+            (kkboylin::log::check(kklogSite_, (limit), kklogSuppressed_) == true) ) \
+            kkboylin::log::LogSite_(kklogSuppressed_, (level), __VA_ARGS__);        \
+    } while (0)
+
+/* 第 1, n+1, 2n+1... 次才輸出, 例如 KKLOG_EVERY_N(ELL_WARNING, 1000, "retry %d\n", id). n 為 0 時與 1 相同, 每次都輸出 */
+#define KKLOG_EVERY_N(level, n, ...)      KKLOG_SITE_(EveryN_, level, n, __VA_ARGS__)
+/* 只輸出前 n 次 */
+#define KKLOG_FIRST_N(level, n, ...)      KKLOG_SITE_(FirstN_, level, n, __VA_ARGS__)
+/* 每秒最多 rate 次, rate 為 0 時與 1 相同 */
+#define KKLOG_PER_SECOND(level, rate, ...) KKLOG_SITE_(PerSecond_, level, rate, __VA_ARGS__)
+
+/* 分類的訊息, 例如 KKLOG_CATEGORY(db, ELL_DEBUG, "query %s\n", sql) */
+#define KKLOG_CATEGORY(category, level, ...)                                        \
+    do                                                                              \
+    {                                                                               \
+        if (kkboylin::log::IsEnabled_((category), (level)) == true)                 \
+            kkboylin::log::LogOutput((category), (level), __VA_ARGS__);             \
+    } while (0)
+
+#define KKLOG_DEFERRED(level, ...)                                                  \
+    do                                                                              \
+    {                                                                               \
+        if (kkboylin::log::IsEnabled_(level) == true)                               \
+            kkboylin::log::LogDeferred((level), __VA_ARGS__);                       \
+    } while (0)
+
+/* 低於 KKLOG_LEVEL 的等級在編譯期就移除, 參數也不會被編譯 */
+#if KKLOG_LEVEL >= 0
+    #define KKLOG_EMERGENCY(...) KKLOG(kkboylin::log::ELL_EMERGENCY, __VA_ARGS__)
+#else
+    #define KKLOG_EMERGENCY(...) ((void)0)
+#endif
+#if KKLOG_LEVEL >= 1
+    #define KKLOG_ALERT(...)     KKLOG(kkboylin::log::ELL_ALERT, __VA_ARGS__)
+#else
+    #define KKLOG_ALERT(...)     ((void)0)
+#endif
+#if KKLOG_LEVEL >= 2
+    #define KKLOG_CRITICAL(...)  KKLOG(kkboylin::log::ELL_CRITICAL, __VA_ARGS__)
+#else
+    #define KKLOG_CRITICAL(...)  ((void)0)
+#endif
+#if KKLOG_LEVEL >= 3
+    #define KKLOG_ERROR(...)     KKLOG(kkboylin::log::ELL_ERROR, __VA_ARGS__)
+#else
+    #define KKLOG_ERROR(...)     ((void)0)
+#endif
+#if KKLOG_LEVEL >= 4
+    #define KKLOG_WARNING(...)   KKLOG(kkboylin::log::ELL_WARNING, __VA_ARGS__)
+#else
+    #define KKLOG_WARNING(...)   ((void)0)
+#endif
+#if KKLOG_LEVEL >= 5
+    #define KKLOG_NOTICE(...)    KKLOG(kkboylin::log::ELL_NOTICE, __VA_ARGS__)
+#else
+    #define KKLOG_NOTICE(...)    ((void)0)
+#endif
+#if KKLOG_LEVEL >= 6
+    #define KKLOG_INFO(...)      KKLOG(kkboylin::log::ELL_INFO, __VA_ARGS__)
+#else
+    #define KKLOG_INFO(...)      ((void)0)
+#endif
+#if KKLOG_LEVEL >= 7
+    #define KKLOG_DEBUG(...)     KKLOG(kkboylin::log::ELL_DEBUG, __VA_ARGS__)
+#else
+    #define KKLOG_DEBUG(...)     ((void)0)
+#endif
 
 #endif // __LOG_H__
@@ -6,14 +6,8 @@
 
 using namespace kkboylin::log;
 
-static void onLog(const bool* terminate)
+static void onLog()
 {
-    do
-    {
-        CManager::GetInstance()->Process();
-        std::this_thread::sleep_for( std::chrono::seconds(1) );
-    } while (*terminate == false);
-
     LogOutput(ELL_NOTICE, "thread : %s\n", "end");
 }
 
@@ -42,32 +36,52 @@ static void ValueOutput_(std::string& output, const char*& fmt, const SAccount&
     }   
 }
 
+static void ValueOutput_(CFields& fields, const SAccount& value)
+{
+    fields.Add({ "loginname", value.loginname });
+    fields.Add({ "nickname",  value.nickname  });
+}
+
 int main(int argc, const char** argv)
 {
     Manager mgr = Create();
     mgr->Append( "console", CreateConsoleOutput(ELL_NOTICE) );
     mgr->Append( "debuger", CreateDebugerOutput(ELL_DEBUG) );
     mgr->Append( "log", CreateFileOutput(ELL_INFO, "Test", "./logs" ) );
+    mgr->Append( "json", CreateJsonFileOutput(ELL_INFO, "Test", "./logs" ) );
     mgr->EnableOption(EO_TIME);
     mgr->EnableOption(EO_DATE);
     mgr->EnableOption(EO_DAY);
     mgr->EnableOption(EO_THREAD);
     mgr->EnableOption(EO_LEVEL);
 
-    bool terminate = false;
-    std::thread t1(onLog, &terminate);
-    LogOutput(ELL_NOTICE, "test : %s\n", std::string("aaa") );
+    SAsyncOptions options;
+    options.interval = 100;
+    mgr->StartAsync(options);
+    mgr->SetStatsPeriod(500);
+
+    KKLOG_NOTICE("test : %s\n", std::string("aaa") );
+    KKLOG_DEBUG("not evaluated : %s\n", std::string("ccc") );
+    LogDeferred(ELL_NOTICE, "deferred : %s %d\n", std::string("bbb"), 1 );
 
     SAccount account;
     account.loginname = "tester";
     account.nickname  = "player1";
     LogOutput(ELL_NOTICE, "account : %s\n", account);
-    while(terminate != true)
-    {
-        std::this_thread::sleep_for( std::chrono::seconds(1) );
-        terminate = true;
-    }
+    LogFields(ELL_NOTICE, "login", { "account", account }, { "latency_us", 12.5 }, { "retry", false });
+
+    /* 只開啟 db 以下分類的 DEBUG */
+    CCategory* pool = GetCategory("db.pool");
+    SetCategoryLevel("db", ELL_DEBUG);
+    KKLOG_CATEGORY(pool, ELL_DEBUG, "connections : %d\n", 8);
+
+    /* 同一個呼叫點每 100 次輸出一次, 並附上略過的次數 */
+    for (int i = 0; i < 300; ++i)
+        KKLOG_EVERY_N(ELL_NOTICE, 100, "retry : %d\n", i);
+
+    std::thread t1(onLog);
     t1.join();
+    std::this_thread::sleep_for( std::chrono::seconds(1) );
     mgr.reset();
     return 0;
 }
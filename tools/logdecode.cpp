@@ -0,0 +1,797 @@
+/*
+ * 把 CreateBinaryFileOutput 產生的 .klog 檔轉回文字或 JSON.
+ *
+ *     g++ -O2 -std=c++11 -I../lib ../lib/Log.cpp logdecode.cpp -o logdecode -lpthread -lz
+ *
+ *     logdecode [-o date,time,ms,thread,level] [-j] file.klog ...
+ *
+ * -o 對應 E_OPTIONS (date, day, time, ms, us, ns, thread, level), 沒有指定時跟 CManager 一樣不加前綴.
+ * -j 每筆訊息輸出一行 JSON, 跟 CreateJsonFileOutput 的格式相同, 延遲格式化的訊息另外加上 format 與 args.
+ *
+ * 檔案格式: 連續的紀錄, 每筆以一個位元組的 E_BINARY_RECORD 開頭, 數字都是 varint.
+ *     EBR_HEADER  "KKLB" 版本(1 個位元組) 基準時間
+ *     EBR_FORMAT  編號 長度 格式字串
+ *     EBR_THREAD  編號 執行緒識別碼
+ *     EBR_MESSAGE 等級(1 個位元組) 時間差(zigzag) 執行緒編號 格式編號 長度 內容
+ *     EBR_FIELDS  等級(1 個位元組) 時間差(zigzag) 執行緒編號 長度 內容
+ * 格式編號為 0 時內容是文字, 否則是參數, 每個參數以一個位元組的 E_BINARY_TYPE 開頭.
+ * EBR_FIELDS 的內容是字串型態的訊息, 接著成對的欄位名稱與值.
+ * 同一個檔案中可以有多個檔頭 (重新開啟後接著寫入), 遇到檔頭時對照表重新開始.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Log.h"
+
+using namespace kkboylin::log;
+
+static const int VERSION = 1;
+
+static const char* LevelNames[ELL_COUNT] = { "[EMERGENCY] ",
+                                             "[ALERT    ] ",
+                                             "[CRITICAL ] ",
+                                             "[ERROR    ] ",
+                                             "[WARNING  ] ",
+                                             "[NOTICE   ] ",
+                                             "[INFO     ] ",
+                                             "[DEBUG    ] " };
+
+static const char* JsonLevels[ELL_COUNT] = { "EMERGENCY", "ALERT", "CRITICAL", "ERROR", "WARNING", "NOTICE", "INFO", "DEBUG" };
+
+struct SArgument
+{
+    E_BINARY_TYPE      type;
+    long long          integer;
+    unsigned long long natural;
+    double             real;
+    std::string        text;
+};
+
+class CReader
+{
+private :
+    const unsigned char* _Data;
+    const unsigned char* _End;
+
+public :
+    CReader(const char* data, size_t size) : _Data((const unsigned char*)data), _End((const unsigned char*)data + size) { }
+
+    bool IsEnd() const { return _Data >= _End; }
+
+    const char* GetPosition() const { return (const char*)_Data; }
+
+    bool Byte(unsigned char& value)
+    {
+        if (_Data >= _End)
+            return false;
+        value = *_Data++;
+        return true;
+    }
+
+    bool Varint(uint64_t& value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (_Data >= _End)
+                return false;
+            unsigned char byte = *_Data++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool Bytes(uint64_t size, const char*& value)
+    {
+        if ((uint64_t)(_End - _Data) < size)
+            return false;
+        value = (const char*)_Data;
+        _Data += size;
+        return true;
+    }
+};
+
+static int64_t Unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static bool DecodeArguments(const char* data, uint64_t size, std::vector< SArgument >& arguments)
+{
+    CReader reader(data, (size_t)size);
+    arguments.clear();
+    while (reader.IsEnd() == false)
+    {
+        unsigned char type;
+        uint64_t      value;
+        const char*   bytes;
+        SArgument     argument;
+        reader.Byte(type);
+        argument.type    = (E_BINARY_TYPE)type;
+        argument.integer = 0;
+        argument.natural = 0;
+        argument.real    = 0;
+        switch (type)
+        {
+        case EBT_SIGNED :
+            if (reader.Varint(value) == false)
+                return false;
+            argument.integer = Unzigzag(value);
+            argument.natural = (unsigned long long)argument.integer;
+            argument.real    = (double)argument.integer;
+            break;
+        case EBT_BOOLEAN :
+            if (reader.Byte(type) == false)
+                return false;
+            argument.natural = type;
+            argument.integer = type;
+            argument.real    = type;
+            break;
+        case EBT_UNSIGNED :
+        case EBT_POINTER :
+            if (reader.Varint(value) == false)
+                return false;
+            argument.natural = value;
+            argument.integer = (long long)value;
+            argument.real    = (double)value;
+            break;
+        case EBT_DOUBLE :
+            {
+                if (reader.Bytes(8, bytes) == false)
+                    return false;
+                uint64_t bits = 0;
+                for (int i = 0; i < 8; ++i)
+                    bits |= (uint64_t)(unsigned char)bytes[i] << (i * 8);
+                memcpy(&argument.real, &bits, sizeof(bits));
+                argument.integer = (long long)argument.real;
+                argument.natural = (unsigned long long)argument.integer;
+            }
+            break;
+        case EBT_STRING :
+            if( (reader.Varint(value) == false) ||
+                (reader.Bytes(value, bytes) == false) )
+                return false;
+            argument.text.assign(bytes, (size_t)value);
+            break;
+        default :
+            return false;
+        }
+        arguments.push_back(argument);
+    }
+    return true;
+}
+
+static void SpecOutput(std::string& output, const std::string& spec, const char* length, char conversion, const SArgument& argument)
+{
+    char        buffer[1024 * 8];
+    std::string format = spec + length + conversion;
+    int         idx    = -1;
+    switch (conversion)
+    {
+    case 'd' :
+    case 'i' :
+        if (strcmp(length, "ll") == 0)
+            idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), argument.integer);
+        else
+        if (strcmp(length, "l") == 0)
+            idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), (long)argument.integer);
+        else
+            idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), (int)argument.integer);
+        break;
+    case 'u' :
+    case 'o' :
+    case 'x' :
+    case 'X' :
+        if (strcmp(length, "ll") == 0)
+            idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), argument.natural);
+        else
+        if (strcmp(length, "l") == 0)
+            idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), (unsigned long)argument.natural);
+        else
+            idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), (unsigned int)argument.natural);
+        break;
+    case 'c' :
+        idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), (int)argument.integer);
+        break;
+    case 'p' :
+        idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), (void*)(uintptr_t)argument.natural);
+        break;
+    case 'n' :
+        break;
+    default :
+        if (strcmp(length, "L") == 0)
+            idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), (long double)argument.real);
+        else
+            idx = snprintf(buffer, sizeof(buffer) - 1, format.c_str(), argument.real);
+        break;
+    }
+    if (idx > 0)
+    {
+        if (idx >= (int)sizeof(buffer) - 1)
+            idx = (int)sizeof(buffer) - 1;
+        output.append(buffer, idx);
+    }
+}
+
+/* 跟 ValueOutput_ 相同, 但參數的型態在執行時才知道 */
+static void ArgumentOutput(std::string& output, const char*& fmt, const SArgument& argument)
+{
+    if (argument.type == EBT_STRING)
+    {
+        ValueOutput_(output, fmt, argument.text);
+        return;
+    }
+    int count = GetFormatLength_(fmt);
+    if (count <= 0)
+    {
+        fmt += strlen(fmt);
+        return;
+    }
+    char conversion = fmt[count];
+    if (conversion == 's')
+    {
+        /* 數字用字串格式輸出 */
+        char text[32];
+        if (argument.type == EBT_DOUBLE)
+            snprintf(text, sizeof(text), "%g", argument.real);
+        else
+        if (argument.type == EBT_SIGNED)
+            snprintf(text, sizeof(text), "%lld", argument.integer);
+        else
+            snprintf(text, sizeof(text), "%llu", argument.natural);
+        const char* spec = fmt;
+        ValueOutput_(output, spec, (const char*)text);
+        fmt += (count + 1);
+        return;
+    }
+
+    /* 長度修飾依解碼後的型態重新決定 */
+    std::string spec;
+    const char* length = "";
+    for (int i = 0; i < count; ++i)
+    {
+        switch (fmt[i])
+        {
+        case 'l' :
+            length = (*length == 'l') ? "ll" : "l";
+            break;
+        case 'q' :
+            length = "ll";
+            break;
+        case 'L' :
+            length = ((conversion == 'd') || (conversion == 'i') || (conversion == 'u') ||
+                      (conversion == 'o') || (conversion == 'x') || (conversion == 'X')) ? "ll" : "L";
+            break;
+        case 'I' :
+        case 'P' :
+        case 'R' :
+            break;
+        default :
+            spec += fmt[i];
+            break;
+        }
+    }
+    if( (strcmp(length, "l") == 0) &&
+        ((conversion == 'f') || (conversion == 'F') || (conversion == 'e') || (conversion == 'E') ||
+         (conversion == 'g') || (conversion == 'G') || (conversion == 'a') || (conversion == 'A')) )
+        length = "";
+    SpecOutput(output, spec, length, conversion, argument);
+    fmt += (count + 1);
+}
+
+/* 跟 FormatOutput_ 相同, 參數用完之後輸出剩下的字串 */
+static void Render(std::string& output, const char* format, const std::vector< SArgument >& arguments)
+{
+    size_t index = 0;
+    while (*format != '\0')
+    {
+        if (*format == '%')
+        {
+            if (format[1] == '%')
+            {
+                output += '%';
+                format += 2;
+                continue;
+            }
+            if (index < arguments.size())
+            {
+                ArgumentOutput(output, format, arguments[index++]);
+                continue;
+            }
+        }
+        output += *format++;
+    }
+}
+
+/* 能還原成相同數值的最短表示, 跟 CreateJsonFileOutput 相同 */
+static void DoubleOutput(std::string& output, double value)
+{
+    char buffer[32];
+    output.append(buffer, RoundTripOutput_(buffer, sizeof(buffer), value));
+}
+
+/* LogFields 的文字版面: 訊息 key=value key=value, 字串中有空白, '=' 或 '"' 時加上引號 */
+static void FieldOutput(std::string& output, const SArgument& argument)
+{
+    char buffer[32];
+    switch (argument.type)
+    {
+    case EBT_SIGNED :
+        snprintf(buffer, sizeof(buffer), "%lld", argument.integer);
+        output += buffer;
+        break;
+    case EBT_UNSIGNED :
+        snprintf(buffer, sizeof(buffer), "%llu", argument.natural);
+        output += buffer;
+        break;
+    case EBT_POINTER :
+        snprintf(buffer, sizeof(buffer), "0x%llx", argument.natural);
+        output += buffer;
+        break;
+    case EBT_DOUBLE :
+        DoubleOutput(output, argument.real);
+        break;
+    case EBT_BOOLEAN :
+        output += (argument.natural != 0) ? "true" : "false";
+        break;
+    default :
+        {
+            const std::string& text  = argument.text;
+            bool               quote = text.empty();
+            for (size_t i = 0; (i < text.size()) && (quote == false); ++i)
+                quote = ((unsigned char)text[i] <= ' ') || (text[i] == '=') || (text[i] == '"');
+            if (quote == false)
+            {
+                output += text;
+                break;
+            }
+            output += '"';
+            for (size_t i = 0; i < text.size(); ++i)
+            {
+                switch (text[i])
+                {
+                case '"'  : output += "\\\""; break;
+                case '\\' : output += "\\\\"; break;
+                case '\n' : output += "\\n";  break;
+                case '\t' : output += "\\t";  break;
+                default   : output += text[i]; break;
+                }
+            }
+            output += '"';
+        }
+        break;
+    }
+}
+
+class CDecoder
+{
+private :
+    typedef std::unordered_map< uint64_t, std::string > Formats;
+    typedef std::unordered_map< uint64_t, uint64_t >    Threads;
+
+    bool                     _Options[EO_COUNT];
+    bool                     _Json;
+    Formats                  _Formats;
+    Threads                  _Threads;
+    int64_t                  _Time;
+    std::vector< SArgument > _Arguments;
+    std::string              _Line;
+    std::string              _Text;
+
+    void Prefix   (E_LOG_LEVEL level, int64_t time, uint64_t thread);
+    void Json     (E_LOG_LEVEL level, int64_t time, uint64_t thread, const std::string* format, bool fields);
+    void JsonValue(const SArgument& argument);
+    void Escape   (const std::string& text);
+    bool Message  (CReader& reader, bool fields);
+
+public :
+    CDecoder(const bool* options, bool json) : _Json(json), _Time(0)
+    {
+        for (int i = 0; i < EO_COUNT; ++i)
+            _Options[i] = options[i];
+    }
+
+    bool Decode(const char* path, const char* data, size_t size);
+};
+
+/* 跟 CManagerImp::Prefix 相同的版面 */
+void CDecoder::Prefix(E_LOG_LEVEL level, int64_t time, uint64_t thread)
+{
+    char    buffer[128];
+    int64_t seconds = time / 1000000000;
+    time_t  now     = (time_t)seconds;
+    struct tm tm;
+#if defined(_MSC_VER)
+    localtime_s(&tm, &now);
+#else
+    localtime_r(&now, &tm);
+#endif
+    if (_Options[EO_DATE] == true)
+    {
+        snprintf(buffer, sizeof(buffer), "%04d-%02d-%02d ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+        _Line += buffer;
+    }
+    else
+    if (_Options[EO_DAY] == true)
+    {
+        snprintf(buffer, sizeof(buffer), "%02d ", tm.tm_mday);
+        _Line += buffer;
+    }
+    if (_Options[EO_TIME] == true)
+    {
+        snprintf(buffer, sizeof(buffer), "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+        _Line += buffer;
+        uint32_t fraction = (uint32_t)(time % 1000000000);
+        if (_Options[EO_NANOSECOND] == true)
+            snprintf(buffer, sizeof(buffer), ".%09u", fraction);
+        else
+        if (_Options[EO_MICROSECOND] == true)
+            snprintf(buffer, sizeof(buffer), ".%06u", fraction / 1000);
+        else
+        if (_Options[EO_MILLISECOND] == true)
+            snprintf(buffer, sizeof(buffer), ".%03u", fraction / 1000000);
+        else
+            buffer[0] = 0;
+        _Line += buffer;
+        _Line += ' ';
+    }
+    if (_Options[EO_THREAD] == true)
+    {
+        snprintf(buffer, sizeof(buffer), "0x%llx ", (unsigned long long)thread);
+        _Line += buffer;
+    }
+    if( (_Options[EO_LEVEL] == true) &&
+        (level >= 0) &&
+        (level < ELL_COUNT) )
+        _Line += LevelNames[level];
+}
+
+void CDecoder::Escape(const std::string& text)
+{
+    _Line += '"';
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        unsigned char c = (unsigned char)text[i];
+        switch (c)
+        {
+        case '"'  : _Line += "\\\""; break;
+        case '\\' : _Line += "\\\\"; break;
+        case '\n' : _Line += "\\n";  break;
+        case '\r' : _Line += "\\r";  break;
+        case '\t' : _Line += "\\t";  break;
+        default :
+            if (c < 0x20)
+            {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                _Line += buffer;
+            }
+            else
+            {
+                _Line += (char)c;
+            }
+            break;
+        }
+    }
+    _Line += '"';
+}
+
+void CDecoder::JsonValue(const SArgument& argument)
+{
+    char buffer[32];
+    switch (argument.type)
+    {
+    case EBT_SIGNED :
+        snprintf(buffer, sizeof(buffer), "%lld", argument.integer);
+        _Line += buffer;
+        break;
+    case EBT_UNSIGNED :
+        snprintf(buffer, sizeof(buffer), "%llu", argument.natural);
+        _Line += buffer;
+        break;
+    case EBT_DOUBLE :
+        if (argument.real - argument.real == 0)
+            DoubleOutput(_Line, argument.real);
+        else
+            _Line += "null";
+        break;
+    case EBT_POINTER :
+        snprintf(buffer, sizeof(buffer), "\"0x%llx\"", argument.natural);
+        _Line += buffer;
+        break;
+    case EBT_BOOLEAN :
+        _Line += (argument.natural != 0) ? "true" : "false";
+        break;
+    default :
+        Escape(argument.text);
+        break;
+    }
+}
+
+/* 一筆訊息一行, 跟 CreateJsonFileOutput 相同. 訊息結尾的換行不放進 "message" */
+void CDecoder::Json(E_LOG_LEVEL level, int64_t time, uint64_t thread, const std::string* format, bool fields)
+{
+    char      buffer[128];
+    time_t    now = (time_t)(time / 1000000000);
+    struct tm tm;
+#if defined(_MSC_VER)
+    gmtime_s(&tm, &now);
+#else
+    gmtime_r(&now, &tm);
+#endif
+    strftime(buffer, sizeof(buffer), "{\"time\":\"%Y-%m-%dT%H:%M:%S", &tm);
+    _Line += buffer;
+    snprintf(buffer, sizeof(buffer), ".%09uZ\",\"level\":", (uint32_t)(time % 1000000000));
+    _Line += buffer;
+    Escape( ((level >= 0) && (level < ELL_COUNT)) ? JsonLevels[level] : "UNKNOWN" );
+    snprintf(buffer, sizeof(buffer), ",\"thread\":\"0x%llx\"", (unsigned long long)thread);
+    _Line += buffer;
+    _Line += ",\"message\":";
+    if (fields == true)
+    {
+        /* 第一個參數是訊息, 之後是成對的名稱與值 */
+        Escape( (_Arguments.empty() == false) ? _Arguments[0].text : "" );
+        for (size_t i = 1; i + 1 < _Arguments.size(); i += 2)
+        {
+            _Line += ',';
+            Escape(_Arguments[i].text);
+            _Line += ':';
+            JsonValue(_Arguments[i + 1]);
+        }
+    }
+    else
+    {
+        std::string text = _Text;
+        if( (text.empty() == false) &&
+            (text[text.size() - 1] == '\n') )
+            text.resize(text.size() - 1);
+        Escape(text);
+    }
+    if (format != nullptr)
+    {
+        _Line += ",\"format\":";
+        Escape(*format);
+        _Line += ",\"args\":[";
+        for (size_t i = 0; i < _Arguments.size(); ++i)
+        {
+            if (i > 0)
+                _Line += ',';
+            JsonValue(_Arguments[i]);
+        }
+        _Line += ']';
+    }
+    _Line += "}\n";
+}
+
+bool CDecoder::Message(CReader& reader, bool fields)
+{
+    unsigned char level;
+    uint64_t      delta;
+    uint64_t      index;
+    uint64_t      format = 0;
+    uint64_t      size;
+    const char*   data;
+    if( (reader.Byte(level) == false) ||
+        (reader.Varint(delta) == false) ||
+        (reader.Varint(index) == false) ||
+        ((fields == false) && (reader.Varint(format) == false)) ||
+        (reader.Varint(size) == false) ||
+        (reader.Bytes(size, data) == false) )
+        return false;
+    _Time += Unzigzag(delta);
+
+    Threads::const_iterator thread = _Threads.find(index);
+    if (thread == _Threads.end())
+        return false;
+    const std::string* text = nullptr;
+    _Text.clear();
+    if (fields == true)
+    {
+        if (DecodeArguments(data, size, _Arguments) == false)
+            return false;
+        if (_Arguments.empty() == false)
+            _Text = _Arguments[0].text;
+        for (size_t i = 1; i + 1 < _Arguments.size(); i += 2)
+        {
+            _Text += ' ';
+            _Text += _Arguments[i].text;
+            _Text += '=';
+            FieldOutput(_Text, _Arguments[i + 1]);
+        }
+        _Text += '\n';
+    }
+    else
+    if (format == 0)
+    {
+        _Text.assign(data, (size_t)size);
+    }
+    else
+    {
+        Formats::const_iterator it = _Formats.find(format);
+        if( (it == _Formats.end()) ||
+            (DecodeArguments(data, size, _Arguments) == false) )
+            return false;
+        text = &(*it).second;
+        Render(_Text, text->c_str(), _Arguments);
+    }
+
+    _Line.clear();
+    if (_Json == true)
+    {
+        Json((E_LOG_LEVEL)level, _Time, (*thread).second, text, fields);
+    }
+    else
+    {
+        Prefix((E_LOG_LEVEL)level, _Time, (*thread).second);
+        _Line += _Text;
+    }
+    fwrite(_Line.data(), 1, _Line.size(), stdout);
+    return true;
+}
+
+bool CDecoder::Decode(const char* path, const char* data, size_t size)
+{
+    CReader reader(data, size);
+    bool    header = false;
+    while (reader.IsEnd() == false)
+    {
+        const char*   position = reader.GetPosition();
+        unsigned char record = 0;
+        uint64_t      id     = 0;
+        uint64_t      value  = 0;
+        const char*   bytes;
+        bool          valid = reader.Byte(record);
+        switch (record)
+        {
+        case EBR_HEADER :
+            {
+                unsigned char version = 0;
+                valid = (reader.Bytes(3, bytes) == true) &&
+                        (memcmp(bytes, "KLB", 3) == 0) &&
+                        (reader.Byte(version) == true) &&
+                        (version == VERSION) &&
+                        (reader.Varint(value) == true);
+                _Formats.clear();
+                _Threads.clear();
+                _Time  = (int64_t)value;
+                header = valid;
+            }
+            break;
+        case EBR_FORMAT :
+            valid = (header == true) &&
+                    (reader.Varint(id) == true) &&
+                    (reader.Varint(value) == true) &&
+                    (reader.Bytes(value, bytes) == true);
+            if (valid == true)
+                _Formats[id].assign(bytes, (size_t)value);
+            break;
+        case EBR_THREAD :
+            valid = (header == true) &&
+                    (reader.Varint(id) == true) &&
+                    (reader.Varint(value) == true);
+            if (valid == true)
+                _Threads[id] = value;
+            break;
+        case EBR_MESSAGE :
+        case EBR_FIELDS :
+            valid = (header == true) &&
+                    (Message(reader, record == EBR_FIELDS) == true);
+            break;
+        default :
+            valid = false;
+            break;
+        }
+        if (valid == false)
+        {
+            /* 通常是程式中斷時最後一筆沒有寫完 */
+            fprintf(stderr, "%s: invalid record at offset %llu\n", path, (unsigned long long)(position - data));
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool Load(const char* path, std::string& data)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+        return false;
+    char   buffer[1024 * 64];
+    size_t size;
+    data.clear();
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.append(buffer, size);
+    fclose(file);
+    return true;
+}
+
+static bool ParseOptions(const char* list, bool* options)
+{
+    static const struct
+    {
+        const char* name;
+        E_OPTIONS   option;
+    } names[] = { { "time",   EO_TIME        },
+                  { "date",   EO_DATE        },
+                  { "day",    EO_DAY         },
+                  { "thread", EO_THREAD      },
+                  { "level",  EO_LEVEL       },
+                  { "ms",     EO_MILLISECOND },
+                  { "us",     EO_MICROSECOND },
+                  { "ns",     EO_NANOSECOND  } };
+    std::string rest = list;
+    while (rest.empty() == false)
+    {
+        size_t      comma = rest.find(',');
+        std::string name  = rest.substr(0, comma);
+        rest = (comma == std::string::npos) ? "" : rest.substr(comma + 1);
+        size_t i = 0;
+        for (; i < sizeof(names) / sizeof(names[0]); ++i)
+        {
+            if (name == names[i].name)
+            {
+                options[names[i].option] = true;
+                break;
+            }
+        }
+        if (i == sizeof(names) / sizeof(names[0]))
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    bool                       options[EO_COUNT] = {};
+    bool                       json = false;
+    std::vector< const char* > files;
+    for (int i = 1; i < argc; ++i)
+    {
+        if( (strcmp(argv[i], "-o") == 0) &&
+            (i + 1 < argc) )
+        {
+            if (ParseOptions(argv[++i], options) == false)
+            {
+                fprintf(stderr, "unknown option in \"%s\"\n", argv[i]);
+                return 2;
+            }
+        }
+        else
+        if (strcmp(argv[i], "-j") == 0)
+        {
+            json = true;
+        }
+        else
+        {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty() == true)
+    {
+        fprintf(stderr, "usage: %s [-o date,day,time,ms,us,ns,thread,level] [-j] file.klog ...\n", argv[0]);
+        return 2;
+    }
+
+    int         result = 0;
+    std::string data;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        CDecoder decoder(options, json);
+        if (Load(files[i], data) == false)
+        {
+            fprintf(stderr, "%s: cannot open\n", files[i]);
+            result = 1;
+            continue;
+        }
+        if (decoder.Decode(files[i], data.data(), data.size()) == false)
+            result = 1;
+    }
+    return result;
+}